@@ -0,0 +1,185 @@
+#pragma once
+#include "Clock.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <algorithm>
+
+// Minimal microbenchmark harness. Each case is a function running its body `iterations` times;
+// the harness calibrates the iteration count to a minimum run time, repeats the measurement and
+// reports the median ns/op together with heap allocations and bytes per op over all repetitions
+// (counted by the replacement operator new below, so this header belongs to exactly one
+// translation unit).
+class Bench {
+ public:
+  typedef void (*Function)(long iterations);
+
+  struct Case {
+    std::string name;
+    Function function;
+  };
+
+  struct Result {
+    double nanosPerOp;
+    double allocationsPerOp;
+    double bytesPerOp;
+  };
+
+  static unsigned long allocations;
+  static unsigned long allocatedBytes;
+
+ private:
+  std::vector<Case> cases;
+  int repetitions;
+  long minTimeMicros;
+
+ public:
+  Bench() : repetitions(5), minTimeMicros(100000) {}
+
+  void add(const std::string &name, Function function) {
+    Case benchCase;
+    benchCase.name = name;
+    benchCase.function = function;
+    cases.push_back(benchCase);
+  }
+
+  template<class T>
+  static void doNotOptimize(const T &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+  }
+
+  // usage: webserv_bench [filter] [--repeat N] [--min-time-ms N] [--save file] [--compare file]
+  int main(int ac, char *av[]) {
+    std::string filter;
+    std::string savePath;
+    std::string comparePath;
+    for (int i = 1; i < ac; ++i) {
+      std::string arg(av[i]);
+      if (arg == "--repeat" && i + 1 < ac) {
+        repetitions = std::max(1, std::atoi(av[++i]));
+      } else if (arg == "--min-time-ms" && i + 1 < ac) {
+        minTimeMicros = std::atol(av[++i]) * 1000;
+      } else if (arg == "--save" && i + 1 < ac) {
+        savePath = av[++i];
+      } else if (arg == "--compare" && i + 1 < ac) {
+        comparePath = av[++i];
+      } else {
+        filter = arg;
+      }
+    }
+    std::map<std::string, double> baseline = load(comparePath);
+    std::FILE *save = savePath.empty() ? NULL : std::fopen(savePath.c_str(), "w");
+
+    std::printf("%-40s %12s %10s %10s%s\n", "benchmark", "ns/op", "allocs/op", "B/op",
+                baseline.empty() ? "" : "   vs baseline");
+    for (std::vector<Case>::const_iterator it = cases.begin(); it != cases.end(); ++it) {
+      if (!filter.empty() && it->name.find(filter) == std::string::npos) {
+        continue;
+      }
+      Result result = measure(*it);
+      std::printf("%-40s %12.1f %10.2f %10.1f", it->name.c_str(), result.nanosPerOp,
+                  result.allocationsPerOp, result.bytesPerOp);
+      std::map<std::string, double>::const_iterator base = baseline.find(it->name);
+      if (base != baseline.end() && base->second > 0) {
+        std::printf("   %+7.1f%%", (result.nanosPerOp / base->second - 1) * 100);
+      }
+      std::printf("\n");
+      if (save != NULL) {
+        std::fprintf(save, "%s\t%.1f\t%.2f\t%.1f\n", it->name.c_str(), result.nanosPerOp,
+                     result.allocationsPerOp, result.bytesPerOp);
+      }
+    }
+    if (save != NULL) {
+      std::fclose(save);
+    }
+    return 0;
+  }
+
+ private:
+  Result measure(const Case &benchCase) const {
+    // warm up, then grow the iteration count until one run takes minTimeMicros
+    long iterations = 1;
+    while (true) {
+      long long start = Clock::nowMicros();
+      benchCase.function(iterations);
+      long long elapsed = Clock::nowMicros() - start;
+      if (elapsed >= minTimeMicros || iterations >= (1L << 30)) {
+        break;
+      }
+      long factor = elapsed > 0 ? minTimeMicros / elapsed + 1 : 10;
+      iterations *= factor < 10 ? factor : 10;
+    }
+
+    // allocations are counted over all repetitions: a case that allocates once per run or caches
+    // lazily is averaged over every op rather than reported from the last run
+    std::vector<double> nanos;
+    nanos.reserve(repetitions);
+    unsigned long allocationsBefore = allocations;
+    unsigned long bytesBefore = allocatedBytes;
+    for (int i = 0; i < repetitions; ++i) {
+      struct timespec start;
+      struct timespec end;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      benchCase.function(iterations);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      double elapsed = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+      nanos.push_back(elapsed / iterations);
+    }
+    Result result;
+    double ops = (double) iterations * nanos.size();
+    result.allocationsPerOp = (double) (allocations - allocationsBefore) / ops;
+    result.bytesPerOp = (double) (allocatedBytes - bytesBefore) / ops;
+    std::sort(nanos.begin(), nanos.end());
+    result.nanosPerOp = nanos[nanos.size() / 2];
+    return result;
+  }
+
+  static std::map<std::string, double> load(const std::string &path) {
+    std::map<std::string, double> results;
+    if (path.empty()) {
+      return results;
+    }
+    std::ifstream file(path.c_str());
+    std::string name;
+    double nanos;
+    std::string rest;
+    while (file >> name >> nanos) {
+      results[name] = nanos;
+      std::getline(file, rest);
+    }
+    return results;
+  }
+};
+
+unsigned long Bench::allocations = 0;
+unsigned long Bench::allocatedBytes = 0;
+
+// out of line, so that the compiler does not pair the malloc and free inside them with new and delete
+// expressions it inlined them into (-Wmismatched-new-delete)
+__attribute__((noinline)) void *operator new(std::size_t size) throw(std::bad_alloc) {
+  ++Bench::allocations;
+  Bench::allocatedBytes += size;
+  void *memory = std::malloc(size ? size : 1);
+  if (memory == NULL) {
+    throw std::bad_alloc();
+  }
+  return memory;
+}
+
+__attribute__((noinline)) void *operator new[](std::size_t size) throw(std::bad_alloc) {
+  return operator new(size);
+}
+
+__attribute__((noinline)) void operator delete(void *memory) throw() {
+  std::free(memory);
+}
+
+__attribute__((noinline)) void operator delete[](void *memory) throw() {
+  operator delete(memory);
+}
@@ -0,0 +1,374 @@
+#include "Bench.h"
+#include "WebServer.h"
+#include "ConfigReader.h"
+#include "CgiHandler.h"
+#include "AccessLog.h"
+#include "Histogram.h"
+#include "Logger.h"
+#include "MemoryTransport.h"
+#include "RateLimiter.h"
+
+#include <sys/socket.h>
+#include <string>
+
+// Microbenchmarks for the per-request hot paths. Run from the repository root so that the sample
+// configuration is found:  ./_build/webserv_bench [filter] [--save base.tsv] [--compare base.tsv]
+
+namespace {
+
+const char *GET_REQUEST =
+    "GET /directory/index.html HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: webserv_bench/1.0\r\n"
+    "Accept: text/html,application/xhtml+xml\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+const char *POST_REQUEST =
+    "POST /cgi/pycgi.py HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 11\r\n"
+    "\r\n"
+    "hello=world";
+
+Location makeLocation() {
+  std::vector<std::string> methods;
+  methods.push_back("GET");
+  methods.push_back("POST");
+  std::vector<std::string> index;
+  index.push_back("index.html");
+  std::vector<std::string> cgiExt;
+  cgiExt.push_back(".py");
+  cgiExt.push_back(".bla");
+  std::map<HttpStatus, std::string> errorPages;
+  std::vector<std::pair<std::string, std::string> > redirect;
+  redirect.push_back(std::make_pair("old_index.html", "test_directory/index.html"));
+  return Location("/directory/", "./html/test_directory", methods, false, index, "", cgiExt,
+                  "python-cgi/venv/bin/python3.9", errorPages, redirect);
+}
+
+void parseGet(long iterations) {
+  Client client(-1);
+  for (long i = 0; i < iterations; ++i) {
+    client.clearInfo();
+    client.fullRequestBody = GET_REQUEST;
+    client.parseRequest();
+    Bench::doNotOptimize(client.path);
+  }
+}
+
+void parsePost(long iterations) {
+  Client client(-1);
+  for (long i = 0; i < iterations; ++i) {
+    client.clearInfo();
+    client.fullRequestBody = POST_REQUEST;
+    client.parseRequest();
+    Bench::doNotOptimize(client.body);
+  }
+}
+
+void clientConstruct(long iterations) {
+  for (long i = 0; i < iterations; ++i) {
+    Client client(-1);
+    Bench::doNotOptimize(client);
+  }
+}
+
+LocationRuntime makeRoute() {
+  std::string errorResponses[LocationRuntime::ERROR_SLOTS];
+  return LocationRuntime::compile(makeLocation(), errorResponses);
+}
+
+void locationMatches(long iterations) {
+  LocationRuntime location = makeRoute();
+  std::string hit("/directory/some/file.html");
+  std::string miss("/other/file.html");
+  for (long i = 0; i < iterations; ++i) {
+    Bench::doNotOptimize(location.matches(hit));
+    Bench::doNotOptimize(location.matches(miss));
+  }
+}
+
+void locationMapPath(long iterations) {
+  LocationRuntime location = makeRoute();
+  std::string path("/directory/some/file.html");
+  std::string mapped;
+  for (long i = 0; i < iterations; ++i) {
+    location.mapPath(path, mapped);
+    Bench::doNotOptimize(mapped);
+  }
+}
+
+void serializeHeaders(long iterations) {
+  WebServer server;
+  Client client(-1);
+  client.path = "/directory/index.html";
+  server.responseStatus = OK;
+  server.responseBody.assign(4096, 'x');
+  for (long i = 0; i < iterations; ++i) {
+    std::string headers = server.serializeHeaders(client);
+    Bench::doNotOptimize(headers);
+  }
+}
+
+void cgiEnv(long iterations) {
+  std::vector<std::string> constantEnv = CgiHandler::constantEnvironment("/usr/bin/python3", "localhost", 8080);
+  std::string body("hello=world");
+  std::vector<char *> env;
+  for (long i = 0; i < iterations; ++i) {
+    CgiHandler cgi(constantEnv, POST, body, "a=1&b=2", "./html/cgi/pycgi.py", "127.0.0.1");
+    cgi.fillEnvironment(env);
+    Bench::doNotOptimize(env);
+  }
+}
+
+// resident memory of a grown server, the pages fork() has to map into the child; only grows, so
+// the cases run from the smallest size up
+void growResident(std::size_t megabytes) {
+  static std::vector<char *> ballast;
+  while (ballast.size() < megabytes) {
+    char *block = new char[1 << 20];
+    memset(block, 1, 1 << 20);
+    ballast.push_back(block);
+  }
+}
+
+// one run of /bin/true through CgiHandler
+template <std::size_t MEGABYTES>
+void cgiSpawn(long iterations) {
+  growResident(MEGABYTES);
+  std::vector<std::string> constantEnv = CgiHandler::constantEnvironment("/bin/true", "localhost", 8080);
+  std::string body;
+  HttpStatus status;
+  for (long i = 0; i < iterations; ++i) {
+    CgiHandler cgi(constantEnv, GET, body, "", "/cgi/true", "127.0.0.1");
+    Bench::doNotOptimize(cgi.runScript("/cgi/true", "/bin/true", status));
+  }
+}
+
+// the same run the way the handler used to start it, for comparison
+template <std::size_t MEGABYTES>
+void cgiFork(long iterations) {
+  growResident(MEGABYTES);
+  char *args[] = {const_cast<char *>("/bin/true"), NULL};
+  char *env[] = {NULL};
+  for (long i = 0; i < iterations; ++i) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      execve(args[0], args, env);
+      _exit(127);
+    }
+    waitpid(pid, NULL, 0);
+  }
+}
+
+// limit_req checks over a million distinct IPv4 addresses, in a table with room for them (128m zone:
+// 2M slots of 40 bytes)
+void limitRequestMillionAddresses(long iterations) {
+  RateLimitConfig config;
+  config.rate = 10;
+  config.burst = 20;
+  config.zoneBytes = 128 << 20;
+  static RateLimiter limiter(config);
+  struct sockaddr_storage peer;
+  memset(&peer, 0, sizeof(peer));
+  peer.ss_family = AF_INET;
+  struct sockaddr_in &address = (struct sockaddr_in &) peer;
+  unsigned int state = 12345;
+  for (long i = 0; i < iterations; ++i) {
+    state = state * 1664525 + 1013904223;
+    address.sin_addr.s_addr = 0x0A000000 | ((state >> 8) % 1000000);
+    Bench::doNotOptimize(limiter.admitRequest(peer, i >> 10));
+  }
+}
+
+void limitRequestOneAddress(long iterations) {
+  RateLimitConfig config;
+  config.rate = 1000000;
+  config.burst = 1000000;
+  RateLimiter limiter(config);
+  struct sockaddr_storage peer;
+  memset(&peer, 0, sizeof(peer));
+  peer.ss_family = AF_INET6;
+  for (long i = 0; i < iterations; ++i) {
+    Bench::doNotOptimize(limiter.admitRequest(peer, i >> 10));
+  }
+}
+
+void configRead(long iterations) {
+  for (long i = 0; i < iterations; ++i) {
+    ConfigReader reader("test.conf");
+    reader.readConfig();
+    Bench::doNotOptimize(reader.getServers());
+  }
+}
+
+// generated once: 10,000 server blocks with 10 locations each, about 1.3M lines
+const char *largeConfig() {
+  static const char *path = NULL;
+  if (path == NULL) {
+    path = "/tmp/webserv_bench_10k.conf";
+    std::ofstream out(path);
+    for (int server = 0; server < 10000; ++server) {
+      out << "server {\n  port " << 10000 + server << "\n  host localhost\n  server_name vhost" << server
+          << "\n  limit_size 1000\n";
+      for (int location = 0; location < 10; ++location) {
+        out << "  location /l" << location << "/ {\n    root ./html\n    allow_method GET POST\n"
+               "    index index.html index.htm\n    autoIndex off\n    cgi_ext .py\n"
+               "    cgi_path python-cgi/venv/bin/python3.9\n    error_page 404 404.html\n  }\n";
+      }
+      out << "}\n";
+    }
+  }
+  return path;
+}
+
+void configRead10k(long iterations) {
+  const char *path = largeConfig();
+  for (long i = 0; i < iterations; ++i) {
+    ConfigReader reader(path);
+    reader.readConfig();
+    Bench::doNotOptimize(reader.getServers());
+  }
+}
+
+void accessLogLine(long iterations) {
+  AccessLogConfig config;
+  config.path = "/dev/null";
+  AccessLog accessLog(config);
+  struct sockaddr_storage address;
+  memset(&address, 0, sizeof(address));
+  address.ss_family = AF_INET;
+  std::string path("/directory/index.html");
+  std::string name("testsrv");
+  AccessLogEntry entry;
+  entry.remoteAddr = &address;
+  entry.method = GET;
+  entry.path = &path;
+  entry.status = 200;
+  entry.bytesSent = 4200;
+  entry.requestMicros = 420;
+  entry.serverName = &name;
+  for (long i = 0; i < iterations; ++i) {
+    accessLog.log(entry);
+  }
+}
+
+void histogramRecord(long iterations) {
+  Histogram histogram;
+  for (long i = 0; i < iterations; ++i) {
+    histogram.record((unsigned long long) (i & 0xfffff));
+  }
+  Bench::doNotOptimize(histogram.getTotal());
+}
+
+// full pipeline: one connection per iteration, served by the event loop of a WebServer that
+// parsed test.conf but listens nowhere
+WebServer &pipelineServer() {
+  static WebServer *server = NULL;
+  if (server == NULL) {
+    setenv("WEBSERV_LOG_LEVEL", "error", 0);
+    Logger::configureFromEnvironment();
+    char name[] = "webserv_bench";
+    char config[] = "test.conf";
+    char *args[] = {name, config, NULL};
+    server = new WebServer();
+    server->parseConfig(2, args);
+  }
+  return *server;
+}
+
+void serveInMemory(long iterations, const char *request) {
+  WebServer &server = pipelineServer();
+  Server &target = *server.getServers().front();
+  for (long i = 0; i < iterations; ++i) {
+    MemoryTransport *transport = new MemoryTransport(false);
+    transport->feed(request, strlen(request));
+    server.addConnection(new Client(-1, transport), target);
+    while (server.getConnectionCount() != 0) {
+      server.step(0);
+    }
+  }
+}
+
+// generateResponse alone for a static file, the body buffer reused as the event loop would not
+void handlerStaticGet(long iterations) {
+  WebServer &server = pipelineServer();
+  Server &target = *server.getServers().front();
+  Client client(-1);
+  client.method = GET;
+  client.path = "/directory/index.html";
+  for (long i = 0; i < iterations; ++i) {
+    server.generateResponse(client, target);
+    Bench::doNotOptimize(server.responseBody);
+    server.responseBody.clear();
+  }
+}
+
+void pipelineMemoryGet(long iterations) {
+  serveInMemory(iterations, GET_REQUEST);
+}
+
+void pipelineMemoryNotFound(long iterations) {
+  serveInMemory(iterations, "GET /missing.html HTTP/1.1\r\nHost: localhost:8080\r\n\r\n");
+}
+
+void pipelineSocketpairGet(long iterations) {
+  WebServer &server = pipelineServer();
+  Server &target = *server.getServers().front();
+  std::size_t requestLength = strlen(GET_REQUEST);
+  char response[65536];
+  for (long i = 0; i < iterations; ++i) {
+    int pair[2];
+    socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair);
+    send(pair[1], GET_REQUEST, requestLength, 0);
+    server.addConnection(new Client(pair[0]), target);
+    while (server.getConnectionCount() != 0) {
+      server.step(0);
+      while (recv(pair[1], response, sizeof(response), 0) > 0) {
+      }
+    }
+    close(pair[1]);
+  }
+}
+
+void disabledDebugLog(long iterations) {
+  Logger logger(Logger::INFO);
+  std::string path("/directory/index.html");
+  for (long i = 0; i < iterations; ++i) {
+    LOG_DEBUG(logger, "request " << path << " took " << i << " us");
+  }
+}
+
+}
+
+int main(int ac, char *av[]) {
+  Bench bench;
+  bench.add("client/construct", &clientConstruct);
+  bench.add("client/parseRequest_get", &parseGet);
+  bench.add("client/parseRequest_post", &parsePost);
+  bench.add("location/matches_x2", &locationMatches);
+  bench.add("location/mapPath", &locationMapPath);
+  bench.add("response/serializeHeaders", &serializeHeaders);
+  bench.add("cgi/getEnv", &cgiEnv);
+  bench.add("cgi/spawn_rss_10m", &cgiSpawn<10>);
+  bench.add("cgi/fork_rss_10m", &cgiFork<10>);
+  bench.add("cgi/spawn_rss_256m", &cgiSpawn<256>);
+  bench.add("cgi/fork_rss_256m", &cgiFork<256>);
+  bench.add("cgi/spawn_rss_2g", &cgiSpawn<2048>);
+  bench.add("cgi/fork_rss_2g", &cgiFork<2048>);
+  bench.add("limit/admit_request_1m_ips", &limitRequestMillionAddresses);
+  bench.add("limit/admit_request_one_ip", &limitRequestOneAddress);
+  bench.add("config/readConfig_test_conf", &configRead);
+  bench.add("config/readConfig_10k_servers", &configRead10k);
+  bench.add("log/access_log_line", &accessLogLine);
+  bench.add("log/debug_disabled", &disabledDebugLog);
+  bench.add("metrics/histogram_record", &histogramRecord);
+  bench.add("handler/static_get", &handlerStaticGet);
+  bench.add("pipeline/memory_get", &pipelineMemoryGet);
+  bench.add("pipeline/memory_404", &pipelineMemoryNotFound);
+  bench.add("pipeline/socketpair_get", &pipelineSocketpairGet);
+  return bench.main(ac, av);
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include "TrafficCapture.h"
+
+#include <fstream>
+#include <map>
+#include <vector>
+#include <string>
+#include <stdexcept>
+
+// One captured connection: the listening port it arrived on and its request bytes with their
+// arrival times relative to the start of the capture
+struct CapturedConnection {
+  struct Chunk {
+    int64_t micros;
+    std::string bytes;
+  };
+
+  uint32_t id;
+  int port;
+  int64_t openedAt;
+  int64_t closedAt; // -1 when the capture ended first
+  std::vector<Chunk> chunks;
+
+  CapturedConnection() : id(0), port(0), openedAt(0), closedAt(-1) {}
+};
+
+// Loads a capture file written by TrafficCapture. A file cut short (server killed before the last
+// flush) is read up to its last complete record.
+class CaptureReader {
+ public:
+  static std::vector<CapturedConnection> load(const std::string &path) {
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file) {
+      throw std::runtime_error("could not open capture " + path);
+    }
+    char magic[8];
+    if (!file.read(magic, sizeof(magic)) || memcmp(magic, CaptureRecord::MAGIC, sizeof(magic)) != 0) {
+      throw std::runtime_error("not a webserv capture: " + path);
+    }
+
+    std::vector<CapturedConnection> connections;
+    std::map<uint32_t, std::size_t> byId;
+    char header[CaptureRecord::HEADER_SIZE];
+    while (file.read(header, sizeof(header))) {
+      CaptureRecord record;
+      uint32_t length;
+      record.type = (uint8_t) header[0];
+      memcpy(&record.connection, header + 4, 4);
+      memcpy(&record.micros, header + 8, 8);
+      memcpy(&length, header + 16, 4);
+      record.payload.resize(length);
+      if (length != 0 && !file.read(&record.payload[0], length)) {
+        break;
+      }
+
+      if (record.type == CaptureRecord::OPEN) {
+        CapturedConnection connection;
+        uint16_t port = 0;
+        memcpy(&port, record.payload.data(), record.payload.length() < 2 ? record.payload.length() : 2);
+        connection.id = record.connection;
+        connection.port = port;
+        connection.openedAt = record.micros;
+        byId[record.connection] = connections.size();
+        connections.push_back(connection);
+        continue;
+      }
+      std::map<uint32_t, std::size_t>::iterator it = byId.find(record.connection);
+      if (it == byId.end()) {
+        continue;
+      }
+      CapturedConnection &connection = connections[it->second];
+      if (record.type == CaptureRecord::DATA) {
+        CapturedConnection::Chunk chunk;
+        chunk.micros = record.micros;
+        connection.chunks.push_back(chunk);
+        connection.chunks.back().bytes.swap(record.payload);
+      } else if (record.type == CaptureRecord::CLOSE) {
+        connection.closedAt = record.micros;
+      }
+    }
+    return connections;
+  }
+};
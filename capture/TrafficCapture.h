@@ -0,0 +1,122 @@
+#pragma once
+#include "BufferedLogFile.h"
+#include "Clock.h"
+
+#include <stdint.h>
+#include <unistd.h>
+#include <string>
+
+// `capture` settings of one server block
+struct CaptureConfig {
+  std::string path; // empty: capture off
+  unsigned long sampleEvery; // capture one connection out of N
+  unsigned long long maxBytes; // the file stops growing past this size
+  std::size_t bufferSize;
+  long flushMillis;
+
+  CaptureConfig() : sampleEvery(1), maxBytes(64ULL * 1024 * 1024), bufferSize(256 * 1024), flushMillis(1000) {}
+};
+
+// Capture file layout, host byte order:
+//   "WSCAP001" once at the start of the file, then records of
+//   uint8 type, uint8 pad[3], uint32 connection, int64 micros since capture start, uint32 length, payload
+// OPEN carries the uint16 listening port, DATA the bytes as read from the socket, CLOSE nothing.
+struct CaptureRecord {
+  static const char MAGIC[9];
+  static const std::size_t HEADER_SIZE = 20;
+
+  enum Type {
+    OPEN = 1, DATA = 2, CLOSE = 3
+  };
+
+  uint8_t type;
+  uint32_t connection;
+  int64_t micros;
+  std::string payload;
+
+  static void encodeHeader(char *out, uint8_t type, uint32_t connection, int64_t micros, uint32_t length) {
+    memset(out, 0, HEADER_SIZE);
+    out[0] = (char) type;
+    memcpy(out + 4, &connection, 4);
+    memcpy(out + 8, &micros, 8);
+    memcpy(out + 16, &length, 4);
+  }
+};
+
+// Records the raw request bytes of sampled connections with their arrival times, for replay with
+// webserv_replay. Only what the server read is kept; responses are regenerated on replay.
+class TrafficCapture {
+ private:
+  BufferedLogFile out;
+  unsigned long sampleEvery;
+  unsigned long counter;
+  uint32_t nextConnection;
+  unsigned long long written;
+  unsigned long long maxBytes;
+  long long startMicros;
+
+ public:
+  TrafficCapture(const CaptureConfig &config)
+      : out(truncated(config.path), config.bufferSize, config.flushMillis),
+        sampleEvery(config.sampleEvery ? config.sampleEvery : 1), counter(0), nextConnection(0), written(0), maxBytes(config.maxBytes), startMicros(Clock::nowMicros()) {
+    out.put(CaptureRecord::MAGIC, 8);
+    written = 8;
+  }
+
+  virtual ~TrafficCapture() {
+  }
+
+ private:
+  TrafficCapture(const TrafficCapture &capture);
+  TrafficCapture &operator=(const TrafficCapture &capture);
+
+ public:
+  BufferedLogFile &getFile() {
+    return out;
+  }
+
+  // decided once per connection at accept time; returns the connection id, 0 when not captured
+  uint32_t open(int port) {
+    if (++counter % sampleEvery != 0 || isFull()) {
+      return 0;
+    }
+    uint32_t connection = ++nextConnection;
+    uint16_t listenPort = (uint16_t) port;
+    append(CaptureRecord::OPEN, connection, (const char *) &listenPort, sizeof(listenPort));
+    return connection;
+  }
+
+  void data(uint32_t connection, const char *bytes, std::size_t length) {
+    if (!isFull()) {
+      append(CaptureRecord::DATA, connection, bytes, length);
+    }
+  }
+
+  void close(uint32_t connection) {
+    append(CaptureRecord::CLOSE, connection, NULL, 0);
+  }
+
+ private:
+  // a capture starts a new file: its timestamps are relative to this process
+  static const std::string &truncated(const std::string &path) {
+    ::truncate(path.c_str(), 0);
+    return path;
+  }
+
+  bool isFull() const {
+    return written >= maxBytes;
+  }
+
+  void append(uint8_t type, uint32_t connection, const char *payload, std::size_t length) {
+    char header[CaptureRecord::HEADER_SIZE];
+    CaptureRecord::encodeHeader(header, type, connection, Clock::nowMicros() - startMicros, (uint32_t) length);
+    out.reserve(length);
+    out.put(header, sizeof(header));
+    if (length != 0) {
+      out.put(payload, length);
+    }
+    written += sizeof(header) + length;
+  }
+};
+
+const char CaptureRecord::MAGIC[9] = "WSCAP001";
@@ -0,0 +1,377 @@
+#include "CaptureReader.h"
+#include "WebServer.h"
+#include "Clock.h"
+
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <csignal>
+#include <cstdio>
+#include <algorithm>
+
+// Replays a capture written by the `capture` directive.
+//
+//   webserv_replay capture.bin --config test.conf          in-process: parser and handlers only
+//   webserv_replay capture.bin --target 127.0.0.1:8080     over loopback against a running server
+//
+// --speed 1 keeps the original timing, 10 plays ten times faster and 0 (the default) sends
+// everything as fast as possible: connections are then played one after the other with at most
+// --concurrency of them waiting for a response. --repeat N plays the capture N times.
+
+namespace {
+
+struct ReplayOptions {
+  std::string capturePath;
+  std::string configPath;
+  std::string host;
+  int port;
+  double speed;
+  int repeat;
+  std::size_t concurrency;
+
+  ReplayOptions() : port(0), speed(0), repeat(1), concurrency(32) {}
+};
+
+struct ReplayEvent {
+  int64_t micros;
+  std::size_t connection;
+  long chunk; // -1: connection opens
+
+  bool operator<(const ReplayEvent &other) const {
+    return micros < other.micros || (micros == other.micros && chunk < other.chunk);
+  }
+};
+
+struct ReplayReport {
+  unsigned long connections;
+  unsigned long responses;
+  unsigned long errors;
+  unsigned long long bytesIn;
+  std::map<int, unsigned long> statuses;
+  std::vector<long long> latencies;
+
+  ReplayReport() : connections(0), responses(0), errors(0), bytesIn(0) {}
+};
+
+// without pacing each connection's bytes are sent back to back, in the order connections opened
+std::vector<ReplayEvent> timeline(const ReplayOptions &options, const std::vector<CapturedConnection> &connections) {
+  std::vector<ReplayEvent> events;
+  for (std::size_t i = 0; i < connections.size(); ++i) {
+    if (options.speed <= 0) {
+      ReplayEvent open = {connections[i].openedAt, i, -1};
+      events.push_back(open);
+      for (std::size_t j = 0; j < connections[i].chunks.size(); ++j) {
+        ReplayEvent data = {connections[i].openedAt, i, (long) j};
+        events.push_back(data);
+      }
+      continue;
+    }
+    ReplayEvent open = {connections[i].openedAt, i, -1};
+    events.push_back(open);
+    for (std::size_t j = 0; j < connections[i].chunks.size(); ++j) {
+      ReplayEvent data = {connections[i].chunks[j].micros, i, (long) j};
+      events.push_back(data);
+    }
+  }
+  std::stable_sort(events.begin(), events.end());
+  return events;
+}
+
+// microseconds to wait before an event recorded at `micros` is due, 0 when it is late already
+long long untilDue(const ReplayOptions &options, long long start, int64_t micros) {
+  if (options.speed <= 0) {
+    return 0;
+  }
+  long long due = start + (long long) (micros / options.speed);
+  long long now = Clock::nowMicros();
+  return due > now ? due - now : 0;
+}
+
+// in-process ------------------------------------------------------------------------------------
+
+Server *serverFor(WebServer &webServer, int port) {
+  const std::vector<Server *> &servers = webServer.getServers();
+  for (std::size_t i = 0; i < servers.size(); ++i) {
+    if (servers[i]->getPort() == port) {
+      return servers[i];
+    }
+  }
+  return servers.empty() ? NULL : servers.front();
+}
+
+void replayInProcess(const ReplayOptions &options, const std::vector<CapturedConnection> &connections,
+                     const std::vector<ReplayEvent> &events, WebServer &webServer, ReplayReport &report) {
+  std::vector<Client *> clients(connections.size(), (Client *) NULL);
+  std::vector<long long> firstByteAt(connections.size(), 0);
+  std::vector<char> buffer(WebServer::BUF_SIZE + 1);
+  long long start = Clock::nowMicros();
+
+  for (std::size_t i = 0; i < events.size(); ++i) {
+    const ReplayEvent &event = events[i];
+    long long wait = untilDue(options, start, event.micros);
+    if (wait > 0) {
+      usleep(wait);
+    }
+    if (event.chunk == -1) {
+      clients[event.connection] = new Client(-1);
+      ++report.connections;
+      continue;
+    }
+    Client *client = clients[event.connection];
+    if (client == NULL || client->getClientStatus() == CLOSED || client->getClientStatus() == WRITE) {
+      continue;
+    }
+    const std::string &bytes = connections[event.connection].chunks[event.chunk].bytes;
+    long long now = Clock::nowMicros();
+    if (firstByteAt[event.connection] == 0) {
+      firstByteAt[event.connection] = now;
+    }
+    if (bytes.length() + 1 > buffer.size()) {
+      buffer.resize(bytes.length() + 1);
+    }
+    try {
+      memcpy(&buffer[0], bytes.data(), bytes.length());
+      webServer.consumeRequestBytes(*client, &buffer[0], (long) bytes.length());
+      report.bytesIn += bytes.length();
+      if (client->getClientStatus() != WRITE) {
+        continue;
+      }
+      Server *server = serverFor(webServer, connections[event.connection].port);
+      webServer.generateResponse(*client, *server);
+      std::string headers = webServer.serializeHeaders(*client);
+      webServer.requestLocation = NULL;
+      ++report.responses;
+      ++report.statuses[webServer.responseStatus];
+      report.latencies.push_back(Clock::nowMicros() - firstByteAt[event.connection]);
+    } catch (const std::exception &e) {
+      ++report.errors;
+      client->closeClient();
+    }
+  }
+  for (std::size_t i = 0; i < clients.size(); ++i) {
+    delete clients[i];
+  }
+}
+
+// loopback --------------------------------------------------------------------------------------
+
+struct ReplaySocket {
+  int fd;
+  long long lastSentAt;
+  std::string head; // start of the response, until the status line is complete
+  bool counted;
+};
+
+void closeSocket(ReplaySocket &socket, ReplayReport &report) {
+  if (socket.fd == -1) {
+    return;
+  }
+  close(socket.fd);
+  socket.fd = -1;
+  if (socket.counted) {
+    report.latencies.push_back(Clock::nowMicros() - socket.lastSentAt);
+  }
+}
+
+std::size_t countOpen(const std::vector<ReplaySocket> &sockets) {
+  std::size_t open = 0;
+  for (std::size_t i = 0; i < sockets.size(); ++i) {
+    open += sockets[i].fd != -1;
+  }
+  return open;
+}
+
+// reads whatever is ready for up to `timeoutMicros`; returns false when no socket is open any more
+bool pumpResponses(std::vector<ReplaySocket> &sockets, long long timeoutMicros, ReplayReport &report) {
+  std::vector<struct pollfd> fds;
+  std::vector<std::size_t> owners;
+  for (std::size_t i = 0; i < sockets.size(); ++i) {
+    if (sockets[i].fd != -1) {
+      struct pollfd fd = {sockets[i].fd, POLLIN, 0};
+      fds.push_back(fd);
+      owners.push_back(i);
+    }
+  }
+  if (fds.empty()) {
+    if (timeoutMicros > 0) {
+      usleep(timeoutMicros);
+    }
+    return false;
+  }
+  int ready = poll(&fds[0], fds.size(), (int) ((timeoutMicros + 999) / 1000));
+  for (std::size_t i = 0; ready > 0 && i < fds.size(); ++i) {
+    if (fds[i].revents == 0) {
+      continue;
+    }
+    ReplaySocket &socket = sockets[owners[i]];
+    char buffer[65536];
+    ssize_t received = recv(socket.fd, buffer, sizeof(buffer), 0);
+    if (received <= 0) {
+      if (received < 0 && errno == EAGAIN) {
+        continue;
+      }
+      closeSocket(socket, report);
+      continue;
+    }
+    if (!socket.counted && socket.head.length() < 16) {
+      socket.head.append(buffer, std::min((std::size_t) received, 16 - socket.head.length()));
+      std::size_t space = socket.head.find(' ');
+      if (space != std::string::npos && socket.head.length() >= space + 4) {
+        ++report.responses;
+        ++report.statuses[std::atoi(socket.head.c_str() + space + 1)];
+        socket.counted = true;
+      }
+    }
+  }
+  return true;
+}
+
+void replayLoopback(const ReplayOptions &options, const std::vector<CapturedConnection> &connections,
+                    const std::vector<ReplayEvent> &events, ReplayReport &report) {
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(options.port);
+  if (inet_pton(AF_INET, options.host.c_str(), &address.sin_addr) != 1) {
+    throw std::runtime_error("bad IPv4 address: " + options.host);
+  }
+  ReplaySocket closed = {-1, 0, "", false};
+  std::vector<ReplaySocket> sockets(connections.size(), closed);
+  long long start = Clock::nowMicros();
+
+  for (std::size_t i = 0; i < events.size(); ++i) {
+    const ReplayEvent &event = events[i];
+    long long wait;
+    while ((wait = untilDue(options, start, event.micros)) > 0) {
+      pumpResponses(sockets, wait, report);
+    }
+    ReplaySocket &socket = sockets[event.connection];
+    if (event.chunk == -1) {
+      long long deadline = Clock::nowMicros() + 5000000;
+      while (options.speed <= 0 && countOpen(sockets) >= options.concurrency && Clock::nowMicros() < deadline) {
+        pumpResponses(sockets, 100000, report);
+      }
+      socket.fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      int yes = 1;
+      setsockopt(socket.fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+      if (connect(socket.fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+        ++report.errors;
+        close(socket.fd);
+        socket.fd = -1;
+      }
+      ++report.connections;
+      continue;
+    }
+    if (socket.fd == -1) {
+      continue;
+    }
+    const std::string &bytes = connections[event.connection].chunks[event.chunk].bytes;
+    if (send(socket.fd, bytes.data(), bytes.length(), MSG_NOSIGNAL) != (ssize_t) bytes.length()) {
+      ++report.errors;
+      closeSocket(socket, report);
+      continue;
+    }
+    report.bytesIn += bytes.length();
+    socket.lastSentAt = Clock::nowMicros();
+    pumpResponses(sockets, 0, report);
+  }
+
+  // the server closes each connection once it answered; give stragglers a few seconds
+  long long deadline = Clock::nowMicros() + 5000000;
+  while (Clock::nowMicros() < deadline && pumpResponses(sockets, 100000, report)) {
+  }
+  for (std::size_t i = 0; i < sockets.size(); ++i) {
+    if (sockets[i].fd != -1) {
+      ++report.errors;
+      closeSocket(sockets[i], report);
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------------------------
+
+void parse(ReplayOptions &options, int ac, char *av[]) {
+  for (int i = 1; i < ac; ++i) {
+    std::string arg(av[i]);
+    bool hasValue = i + 1 < ac;
+    if (arg == "--config" && hasValue) {
+      options.configPath = av[++i];
+    } else if (arg == "--target" && hasValue) {
+      std::string target(av[++i]);
+      std::size_t colon = target.rfind(':');
+      options.host = colon == std::string::npos ? "127.0.0.1" : target.substr(0, colon);
+      options.port = std::atoi(target.c_str() + (colon == std::string::npos ? 0 : colon + 1));
+    } else if (arg == "--speed" && hasValue) {
+      options.speed = std::atof(av[++i]);
+    } else if (arg == "--repeat" && hasValue) {
+      options.repeat = std::atoi(av[++i]);
+    } else if (arg == "--concurrency" && hasValue) {
+      options.concurrency = std::strtoul(av[++i], NULL, 10);
+    } else if (arg[0] != '-' && options.capturePath.empty()) {
+      options.capturePath = arg;
+    } else {
+      throw std::runtime_error("unknown option: " + arg);
+    }
+  }
+  if (options.capturePath.empty() || options.configPath.empty() == (options.port == 0)) {
+    throw std::runtime_error("need a capture file and one of --config or --target");
+  }
+}
+
+long long percentile(const std::vector<long long> &sorted, double fraction) {
+  return sorted.empty() ? 0 : sorted[(std::size_t) (fraction * (sorted.size() - 1) + 0.5)];
+}
+
+}
+
+int main(int ac, char *av[]) {
+  ReplayOptions options;
+  try {
+    parse(options, ac, av);
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "%s\nusage: webserv_replay <capture> (--config <file> | --target <host:port>) "
+                         "[--speed <factor>] [--repeat <n>] [--concurrency <n>]\n", e.what());
+    return 2;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  try {
+    std::vector<CapturedConnection> connections = CaptureReader::load(options.capturePath);
+    std::vector<ReplayEvent> events = timeline(options, connections);
+    ReplayReport report;
+    WebServer *webServer = NULL;
+    if (!options.configPath.empty()) {
+      Logger::configureFromEnvironment();
+      char *args[] = {av[0], const_cast<char *>(options.configPath.c_str()), NULL};
+      webServer = new WebServer();
+      webServer->parseConfig(2, args);
+    }
+
+    long long start = Clock::nowMicros();
+    for (int i = 0; i < options.repeat; ++i) {
+      if (webServer != NULL) {
+        replayInProcess(options, connections, events, *webServer, report);
+      } else {
+        replayLoopback(options, connections, events, report);
+      }
+    }
+    double seconds = (Clock::nowMicros() - start) / 1e6;
+    const char *mode = webServer != NULL ? "in-process" : "loopback";
+    delete webServer;
+
+    std::sort(report.latencies.begin(), report.latencies.end());
+    std::printf("%s replay of %s, %lu connections, %.3fs\n", mode, options.capturePath.c_str(), report.connections, seconds);
+    std::printf("  responses     %lu (%lu errors), %.1f req/s, %.2f MB/s of requests\n", report.responses,
+                report.errors, report.responses / seconds, report.bytesIn / seconds / 1e6);
+    std::printf("  latency us    p50 %lld  p90 %lld  p99 %lld  max %lld\n", percentile(report.latencies, 0.5),
+                percentile(report.latencies, 0.9), percentile(report.latencies, 0.99),
+                report.latencies.empty() ? 0 : report.latencies.back());
+    for (std::map<int, unsigned long>::const_iterator it = report.statuses.begin(); it != report.statuses.end();
+         ++it) {
+      std::printf("  status %d     %lu\n", it->first, it->second);
+    }
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "webserv_replay: %s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,126 @@
+#pragma once
+#include "HttpStatus.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+class Client;
+
+// Responses of GET requests to the CGI scripts of `cgi_cache` locations. Identical requests share
+// one run of the script: the first one runs it, the ones arriving meanwhile wait for its output,
+// and the output answers the following ones until its ttl is over.
+//
+//   lookup(key) -> answered | join(key, client) -> waits | runs the script ... finish(key) -> waiters
+class CgiCache {
+ public:
+  static const std::size_t MAX_ENTRIES = 1024;
+  static const std::size_t MAX_BYTES = 64 << 20;
+  static const std::size_t MAX_BODY = 1 << 20; // larger outputs are shared, not kept
+
+ private:
+  struct Entry {
+    HttpStatus status;
+    std::string body;
+    long long expiresAt;
+  };
+
+  std::map<std::string, Entry> entries;
+  std::size_t bytes;
+  std::map<std::string, std::vector<Client *> > running; // clients waiting for the run, by key
+
+ public:
+  CgiCache() : bytes(0) {}
+
+ private:
+  CgiCache(const CgiCache &cache);
+  CgiCache &operator=(const CgiCache &cache);
+
+ public:
+  // false when there is no response for the key younger than its ttl
+  bool lookup(const std::string &key, long long now, HttpStatus &status, std::string &body) {
+    std::map<std::string, Entry>::iterator it = entries.find(key);
+    if (it == entries.end()) {
+      return false;
+    }
+    if (it->second.expiresAt <= now) {
+      erase(it);
+      return false;
+    }
+    status = it->second.status;
+    body = it->second.body;
+    return true;
+  }
+
+  // true when the script already runs for the key: the client waits for its output; otherwise the
+  // caller runs it and calls finish()
+  bool join(const std::string &key, Client *client) {
+    std::map<std::string, std::vector<Client *> >::iterator it = running.find(key);
+    if (it == running.end()) {
+      running[key];
+      return false;
+    }
+    it->second.push_back(client);
+    return true;
+  }
+
+  // a waiting client that is gone
+  void leave(const std::string &key, Client *client) {
+    std::map<std::string, std::vector<Client *> >::iterator it = running.find(key);
+    if (it == running.end()) {
+      return;
+    }
+    std::vector<Client *> &waiting = it->second;
+    for (std::size_t i = 0; i < waiting.size(); ++i) {
+      if (waiting[i] == client) {
+        waiting.erase(waiting.begin() + i);
+        return;
+      }
+    }
+  }
+
+  // the run for the key is over: a 200 is kept for ttlMillis; returns the clients that waited for it
+  std::vector<Client *> finish(const std::string &key, HttpStatus status, const std::string &body, long long now,
+                               long ttlMillis) {
+    std::vector<Client *> waiting;
+    std::map<std::string, std::vector<Client *> >::iterator it = running.find(key);
+    if (it != running.end()) {
+      waiting.swap(it->second);
+      running.erase(it);
+    }
+    if (status == OK && ttlMillis > 0 && body.length() <= MAX_BODY && makeRoom(body.length(), now)) {
+      Entry &entry = entries[key];
+      bytes += body.length() - entry.body.length();
+      entry.status = status;
+      entry.body = body;
+      entry.expiresAt = now + ttlMillis;
+    }
+    return waiting;
+  }
+
+  std::size_t size() const {
+    return entries.size();
+  }
+
+ private:
+  // drops expired entries when the cache is full; false when that was not enough
+  bool makeRoom(std::size_t length, long long now) {
+    if (entries.size() < MAX_ENTRIES && bytes + length <= MAX_BYTES) {
+      return true;
+    }
+    std::map<std::string, Entry>::iterator it = entries.begin();
+    while (it != entries.end()) {
+      if (it->second.expiresAt <= now) {
+        erase(it++);
+      } else {
+        ++it;
+      }
+    }
+    return entries.size() < MAX_ENTRIES && bytes + length <= MAX_BYTES;
+  }
+
+  void erase(std::map<std::string, Entry>::iterator it) {
+    bytes -= it->second.body.length();
+    entries.erase(it);
+  }
+};
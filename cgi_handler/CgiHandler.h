@@ -4,12 +4,20 @@
 #include "FatalWebServException.h"
 #include "Logger.h"
 #include "Location.h"
+#include "HttpMethod.h"
 
 #include <unistd.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
 #include <sys/wait.h>
+#include <cerrno>
+#include <cstring>
 
-#include <map>
+#include <string>
+#include <vector>
 
 static std::string _toLiteral(int num) {
   std::stringstream ss;
@@ -26,11 +34,12 @@ static std::string extractQueryString(std::string &path) {
   return queryString;
 }
 
-static std::string findExtension(const std::string &path) {
-  size_t delimiter = path.find_last_of(".");
-  return path.substr(delimiter);
-}
-
+// Runs a CGI script with posix_spawn: the child shares the server's memory until it execs, so the
+// cost of a run does not grow with the size of the server the way copying its page tables in fork()
+// does. The body goes in and the output comes back through pipes.
+//
+// The variables that are the same for every run of a location are built once, see
+// constantEnvironment(); a run only adds the seven that depend on the request.
 class CgiHandler {
  public:
 
@@ -42,7 +51,7 @@ class CgiHandler {
   static const char *PATH_TRANSLATED;
   static const char *QUERY_STRING;
   static const char *REDIRECT_STATUS;
-  static const char *REMOTEaddr;
+  static const char *REMOTE_ADDR;
   static const char *REMOTE_IDENT;
   static const char *REMOTE_USER;
   static const char *REQUEST_URI;
@@ -59,153 +68,164 @@ class CgiHandler {
 
   static const int BUFFER_SIZE;
 
-  //for testing purposes
-  CgiHandler(char c) {
-    body = "";
-    std::string literalPort = "8080";
-    env[AUTH_TYPE] = "";
-    env[CONTENT_LENGTH] = "0";
-    env[CONTENT_TYPE] = "text/html";
-    env[GATEWAY_INTERFACE] = "CGI/1.1";
-    env[PATH_INFO] = "/Users/ilya/Desktop/a.out?var1=val1&var2=val2";
-    env[PATH_TRANSLATED] = "/Users/ilya/Desktop/a.out";
-    env[QUERY_STRING] = "";
-    env[REDIRECT_STATUS] = "200";
-    env[REMOTEaddr] = "8080";
-    env[REMOTE_IDENT] = "";
-    env[REMOTE_USER] = "";
-    env[REQUEST_URI] = "/Users/ilya/Desktop/a.out";
-    env[REQUEST_METHOD] = "GET";
-    env[SCRIPT_NAME] = "/Users/ilya/Desktop/a.out";
-    env[SCRIPT_FILENAME] = "/Users/ilya/Desktop/a.out";
-    env[SERVER_NAME] = "http://localhost";
-    env[SERVER_PORT] = "8080";
-    env[SERVER_PROTOCOL] = "HTTP/1.1";
-    env[SERVER_SOFTWARE] = "WebServ/42.0";
-    std::string path = "/Users/ilya/Desktop/a.out?var1=val1&var2=val2";
-    std::cerr << "pathQS: " << path << std::endl;
-    std::string queryString = extractQueryString(path);
-    std::cerr << "path: " << path << std::endl;
-    std::cerr << "QS: " << queryString << std::endl;
-    std::string extension = findExtension(path); //NEVER USED
-    std::cerr << "extension: " << extension << std::endl;
-  }
-
-
+ private:
+  static const int REQUEST_VARIABLES = 7;
 
-  CgiHandler(Client &client, Server &server,
-             const std::string &queryString, const std::string &path,
-             const std::string &interpretor) : body(client.body) {
-    env[REQUEST_URI] = path;
-    std::string literalPort = _toLiteral(server.getPort());
-    env[SERVER_PORT] = literalPort;
-    env[REMOTEaddr] = literalPort;
-    std::string literalBodySize = _toLiteral(body.size());
-    env[CONTENT_LENGTH] = literalBodySize;
-    env[AUTH_TYPE] = "";
-    env[REMOTE_IDENT] = "";
-    env[REMOTE_USER] = "";
-    env[CONTENT_TYPE] = "";
-    env[GATEWAY_INTERFACE] = "CGI/1.1";
-    env[PATH_INFO] = path;
-    env[PATH_TRANSLATED] = path;
-    env[QUERY_STRING] = queryString;
-    env[REDIRECT_STATUS] = "200"; //for php-cgi
-    env[REQUEST_METHOD] = "POST";
-    env[SCRIPT_NAME] = interpretor;
-    env[SCRIPT_FILENAME] = interpretor;
-    env[SERVER_NAME] = server.getServerName();
-    env[SERVER_PROTOCOL] = "HTTP/1.1";
-    env[SERVER_SOFTWARE] = "WebServ/42.0";
+ public:
+  // "NAME=value" of the variables that do not depend on the request, once per location
+  static std::vector<std::string> constantEnvironment(const std::string &interpretor, const std::string &serverName,
+                                                      int port) {
+    std::string literalPort = _toLiteral(port);
+    std::vector<std::string> env;
+    env.push_back(variable(AUTH_TYPE, ""));
+    env.push_back(variable(CONTENT_TYPE, ""));
+    env.push_back(variable(GATEWAY_INTERFACE, "CGI/1.1"));
+    env.push_back(variable(REDIRECT_STATUS, "200")); //for php-cgi
+    env.push_back(variable(REMOTE_IDENT, ""));
+    env.push_back(variable(REMOTE_USER, ""));
+    env.push_back(variable(SCRIPT_NAME, interpretor));
+    env.push_back(variable(SCRIPT_FILENAME, interpretor));
+    env.push_back(variable(SERVER_NAME, serverName));
+    env.push_back(variable(SERVER_PORT, literalPort));
+    env.push_back(variable(SERVER_PROTOCOL, "HTTP/1.1"));
+    env.push_back(variable(SERVER_SOFTWARE, "WebServ/42.0"));
+    return env;
+  }
 
+  CgiHandler(const std::vector<std::string> &constantEnv, HttpMethod method, const std::string &body,
+             const std::string &queryString, const std::string &path, const std::string &remoteAddress)
+      : constantEnv(constantEnv), body(body) {
+    requestEnv[0] = variable(REQUEST_METHOD, method == GET ? "GET" : "POST");
+    requestEnv[1] = variable(CONTENT_LENGTH, _toLiteral(body.size()));
+    requestEnv[2] = variable(QUERY_STRING, queryString);
+    requestEnv[3] = variable(REQUEST_URI, path);
+    requestEnv[4] = variable(PATH_INFO, path);
+    requestEnv[5] = variable(PATH_TRANSLATED, path);
+    requestEnv[6] = variable(REMOTE_ADDR, remoteAddress);
   }
   virtual ~CgiHandler() {}
 
+  // the script's output; responseStatus is BAD_REQUEST when the interpreter could not be started
   std::string runScript(const std::string &script, const std::string &interpreter, HttpStatus &responseStatus) {
     responseStatus = OK;
-
-    char **envVars;
-    try {
-      envVars = _getEnv();
+    std::vector<char *> envVars;
+    fillEnvironment(envVars);
+    char *args[3] = {const_cast<char *>(interpreter.c_str()), const_cast<char *>(script.c_str()), NULL};
+
+    int input[2];
+    int output[2];
+    if (pipe2(input, O_CLOEXEC) == -1) {
+      throw FatalWebServException("Could not create pipe in CgiHandler");
     }
-    catch (std::bad_alloc &e) {
-      LOGGER.error(e.what());
-      throw FatalWebServException("Could not allocate memory for env vars (char**) in CgiHandler"); //?
+    if (pipe2(output, O_CLOEXEC) == -1) {
+      close(input[0]);
+      close(input[1]);
+      throw FatalWebServException("Could not create pipe in CgiHandler");
     }
-    int input = dup(STDIN);
-    int output = dup(STDOUT);
-    FILE *fsInput = tmpfile();
-    FILE *fsOutput = tmpfile();
-    if (!fsInput || !fsOutput)
-      throw FatalWebServException("Could not create temporary file in CgiHandler");
-    int fdInput = fileno(fsInput);
-    int fdOutput = fileno(fsOutput);
-    write(fdInput, body.c_str(), body.size());
-    lseek(fdInput, 0, SEEK_SET);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, input[0], STDIN);
+    posix_spawn_file_actions_adddup2(&actions, output[1], STDOUT);
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 34)
+    // the server's sockets and files without O_CLOEXEC stay out of the script
+    posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+#endif
+    // the server ignores SIGPIPE, the script gets the default back
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attributes, &defaults);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGDEF);
+
+    pid_t pid;
+    int error = posix_spawn(&pid, interpreter.c_str(), &actions, &attributes, args, &envVars[0]);
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+    close(input[0]);
+    close(output[1]);
     std::string dynamicPage;
-    const char **args = new const char*[2];
-    args[0] = interpreter.c_str();
-    args[1] = script.c_str();;
-    args[2] = NULL;
-
-    pid_t pid = fork();
-    if (pid == -1)
-      throw FatalWebServException("Could not create process in CgiHandler");
-    else if (pid == 0) {
-      dup2(fdInput, STDIN);
-      dup2(fdOutput, STDOUT);
-      execve(interpreter.c_str(), const_cast<char*const*>(args), envVars);
-      LOGGER.error("Could not execute script in CgiHandler\n" + interpreter + '\n' + script);
+    if (error != 0) {
+      LOGGER.error("Could not execute script in CgiHandler\n" + interpreter + '\n' + script + '\n' + strerror(error));
       responseStatus = BAD_REQUEST;
-      exit(0);
     } else {
-      waitpid(-1, NULL, 0);
-      delete[] args;
-      lseek(fdOutput, 0, SEEK_SET);
-      char buf[BUFFER_SIZE];
-      for (int hasRead = 1; hasRead > 0;) {
-        bzero(buf, BUFFER_SIZE);
-        hasRead = read(fdOutput, buf, BUFFER_SIZE);
-        dynamicPage += buf;
+      exchange(input[1], output[0], dynamicPage);
+      while (waitpid(pid, NULL, 0) == -1 && errno == EINTR) {
       }
+    }
+    if (input[1] != -1) {
+      close(input[1]);
+    }
+    close(output[0]);
+    return dynamicPage;
+  }
 
-      dup2(STDIN, input);
-      dup2(STDOUT, output);
-      close(input);
-      close(output);
-      close(fdInput);
-      close(fdOutput);
-      fclose(fsInput);
-      fclose(fsOutput);
-
-      for (int i = 0; envVars[i]; ++i)
-        delete[] envVars[i];
-      delete[] envVars;
-      return dynamicPage;
+  // pointers into the prebuilt and the per-request variables, valid while the handler lives
+  void fillEnvironment(std::vector<char *> &envVars) const {
+    envVars.clear();
+    envVars.reserve(constantEnv.size() + REQUEST_VARIABLES + 1);
+    for (std::vector<std::string>::const_iterator it = constantEnv.begin(); it != constantEnv.end(); ++it) {
+      envVars.push_back(const_cast<char *>(it->c_str()));
+    }
+    for (int i = 0; i < REQUEST_VARIABLES; ++i) {
+      envVars.push_back(const_cast<char *>(requestEnv[i].c_str()));
     }
+    envVars.push_back(NULL);
   }
 
  private:
-  CgiHandler() {}
-  CgiHandler(const CgiHandler &c) {}
-  CgiHandler &operator=(CgiHandler const &src) {return *this;}
-
-  //heap allocation
-  char **_getEnv() const {
-    char **envVars = new char*[env.size() + 1];
-    envVars[env.size()] = NULL;
-    int i = 0;
-    for (std::map<std::string, std::string>::const_iterator it = env.begin();
-        it != env.end(); ++it, ++i) {
-      std::string keyValue = it->first + '=' + it->second;
-      envVars[i] = new char[keyValue.size() + 1];
-      strcpy(envVars[i], keyValue.c_str());
+  CgiHandler(const CgiHandler &c);
+  CgiHandler &operator=(CgiHandler const &src);
+
+  static std::string variable(const char *name, const std::string &value) {
+    return std::string(name) + '=' + value;
+  }
+
+  // writes the body to the script while reading its output, so that neither pipe fills up and
+  // blocks both sides; closes `in` once the body is through, reads `out` to the end
+  void exchange(int &in, int out, std::string &dynamicPage) {
+    std::size_t written = 0;
+    if (body.empty()) {
+      close(in);
+      in = -1;
+    } else {
+      fcntl(in, F_SETFL, O_NONBLOCK);
+    }
+    char buf[BUFFER_SIZE];
+    for (;;) {
+      struct pollfd fds[2] = {{out, POLLIN, 0}, {in, POLLOUT, 0}};
+      if (poll(fds, in == -1 ? 1 : 2, -1) == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return;
+      }
+      if (in != -1 && fds[1].revents != 0) {
+        ssize_t hasWritten = write(in, body.data() + written, body.size() - written);
+        if (hasWritten > 0) {
+          written += hasWritten;
+        }
+        bool failed = hasWritten < 0 && errno != EAGAIN && errno != EINTR;
+        if (failed || written == body.size()) {
+          close(in);
+          in = -1;
+        }
+      }
+      if (fds[0].revents != 0) {
+        ssize_t hasRead = read(out, buf, BUFFER_SIZE);
+        if (hasRead > 0) {
+          dynamicPage.append(buf, hasRead);
+        } else if (hasRead == 0 || errno != EINTR) {
+          return;
+        }
+      }
     }
-    return envVars;
   }
 
-  std::map<std::string, std::string> env;
-  std::string body;
+  const std::vector<std::string> &constantEnv;
+  std::string requestEnv[REQUEST_VARIABLES];
+  const std::string &body;
   Logger LOGGER;
 };
 
@@ -217,7 +237,7 @@ const char *CgiHandler::PATH_INFO = "PATH_INFO";
 const char *CgiHandler::PATH_TRANSLATED = "PATH_TRANSLATED";
 const char *CgiHandler::QUERY_STRING = "QUERY_STRING";
 const char *CgiHandler::REDIRECT_STATUS = "REDIRECT_STATUS";
-const char *CgiHandler::REMOTEaddr = "REMOTEaddr";
+const char *CgiHandler::REMOTE_ADDR = "REMOTE_ADDR";
 const char *CgiHandler::REMOTE_IDENT = "REMOTE_IDENT";
 const char *CgiHandler::REMOTE_USER = "REMOTE_USER";
 const char *CgiHandler::REQUEST_URI = "REQUEST_URI";
@@ -232,4 +252,4 @@ const char *CgiHandler::SERVER_SOFTWARE = "SERVER_SOFTWARE";
 const int CgiHandler::STDIN = 0;
 const int CgiHandler::STDOUT = 1;
 
-const int CgiHandler::BUFFER_SIZE = 1024;
+const int CgiHandler::BUFFER_SIZE = 16384;
@@ -1,7 +1,14 @@
 #pragma once
 #include "Logger.h"
+#include "RequestTiming.h"
+#include "SocketTransport.h"
 #include "ClientStatus.h"
 #include "HttpMethod.h"
+#include "FileTask.h"
+#include "UringConnection.h"
+#include "ProxyConnection.h"
+#include "RateLimiter.h"
+#include "Http2Connection.h"
 
 #include "PollException.h"
 #include "BadListenerFdException.h"
@@ -17,8 +24,9 @@
 #include <sys/select.h>
 #include <sys/fcntl.h>
 #include <unistd.h>
-#include <cstdlib>     /* atoi */
+#include <cstdlib>     /* strtol */
 #include <cstring>
+#include <strings.h>
 
 #include <vector>
 #include <iostream>
@@ -26,9 +34,10 @@
 class Client {
  public:
   int fd;
+  Transport *transport;
   std::string fullRequestBody;
   static Logger LOGGER;
-  int length; // 0 | >0
+  long length; // 0 | >0
   HttpMethod method;
   std::string path;
   std::string body;
@@ -48,6 +57,38 @@ class Client {
   std::string HEADER_PAIR_DELIMETER;
   std::size_t HEADER_PAIR_DELIMETER_LENGTH;
 
+  // access log data --------------------------------------------
+  struct sockaddr_storage remoteAddr;
+  RequestTiming timing;
+  long long upstreamMicros;
+  unsigned long bytesReceived;
+  unsigned long bytesSent;
+  unsigned captureId; // 0: connection not captured
+
+  // response in flight: written from responseOffset on as the transport accepts it
+  std::string responseHead;
+  std::string responseBody;
+  std::size_t responseOffset;
+  int responseFile; // sent after head and body when the transport sends files, owned; -1: none
+  off_t responseFileOffset;
+  std::size_t responseFileLeft;
+  const char *responsePreloaded; // head and body in one, in the blob of a `preload` location: sent instead
+  std::size_t responsePreloadedLength;
+  int responseStatus;
+  int locationScope;
+
+  // filesystem work of the request, reused by the next one; while a pool thread runs it the
+  // client is not polled and stays allocated even when closed
+  FileTask *fileTask;
+  bool fileTaskRunning;
+  UringConnection *uring; // set when the io_uring backend serves the connection
+  ProxyConnection *proxy; // set while the request is passed to an upstream server
+  std::string cgiKey;     // the shared CGI run the request makes or waits for, see CgiCache
+  RateLimiter *connectionLimiter; // counted the connection under limit_conn, released when it closes
+  bool bodyRefused;               // answered before the body it announced was read
+  Http2Connection *http2;         // the connection speaks HTTP/2 (MULTIPLEXED), its streams are clients too
+  bool http2Stream;               // the client serves a stream of an HTTP/2 connection, in process
+
  public:
   void clearInfo() {
     length = 0;
@@ -59,20 +100,46 @@ class Client {
   }
 
  public:
-  Client(int fd) : fd(fd), length(0), method(UNKNOWN_METHOD), clientStatus(READ), containsRequestEnd(false),
-                   REQUEST_END_LENGTH(4), REQUEST_END("\r\n\r\n"), REQUEST_END_CONST_CHAR("\r\n\r\n"),
-                   HEADER_DELIMETER("\r\n"), HEADER_DELIMETER_LENGTH(2),
-                   HEADER_PAIR_DELIMETER(": "), HEADER_PAIR_DELIMETER_LENGTH(2) {
+  // the client owns its transport; without one it reads and writes the socket `fd`
+  Client(int fd, Transport *transport = NULL)
+      : fd(fd), transport(transport != NULL ? transport : new SocketTransport(fd)), length(0),
+        method(UNKNOWN_METHOD), clientStatus(READ), containsRequestEnd(false),
+        REQUEST_END_LENGTH(4), REQUEST_END("\r\n\r\n"), REQUEST_END_CONST_CHAR("\r\n\r\n"),
+        HEADER_DELIMETER("\r\n"), HEADER_DELIMETER_LENGTH(2),
+        HEADER_PAIR_DELIMETER(": "), HEADER_PAIR_DELIMETER_LENGTH(2),
+        upstreamMicros(-1), bytesReceived(0), bytesSent(0), captureId(0),
+        responseOffset(0), responseFile(-1), responseFileOffset(0), responseFileLeft(0), responsePreloaded(NULL),
+        responsePreloadedLength(0), responseStatus(0),
+        locationScope(-1), fileTask(NULL), fileTaskRunning(false), uring(NULL),
+        proxy(NULL), connectionLimiter(NULL), bodyRefused(false), http2(NULL), http2Stream(false) {
+    memset(&remoteAddr, 0, sizeof(remoteAddr));
   }
 
   virtual ~Client() {
+    if (responseFile != -1) {
+      close(responseFile);
+    }
+    delete fileTask;
+    delete proxy;
+    delete uring;
+    delete http2;
+    delete transport;
   }
 
+ private:
+  Client(const Client &client);
+  Client &operator=(const Client &client);
+
  public:
   int getFd() const {
     return fd;
   }
 
+  // the pool or the kernel still works for this client: it has to stay allocated
+  bool isBusy() const {
+    return fileTaskRunning || (uring != NULL && uring->isBusy());
+  }
+
   bool isContainsRequestEnd() {
     return containsRequestEnd;
   }
@@ -98,6 +165,23 @@ class Client {
     }
   }
 
+  // value of the first request header with that name in any case, empty when there is none
+  std::string getHeader(const std::string &name) const {
+    std::size_t headEnd = fullRequestBody.find(REQUEST_END);
+    std::size_t line = fullRequestBody.find(HEADER_DELIMETER);
+    while (line != std::string::npos && line < headEnd) {
+      std::size_t start = line + HEADER_DELIMETER_LENGTH;
+      std::size_t end = fullRequestBody.find(HEADER_DELIMETER, start);
+      if (end != std::string::npos && end - start > name.length() && fullRequestBody[start + name.length()] == ':'
+          && strncasecmp(fullRequestBody.data() + start, name.data(), name.length()) == 0) {
+        std::size_t value = fullRequestBody.find_first_not_of(' ', start + name.length() + 1);
+        return value < end ? fullRequestBody.substr(value, end - value) : "";
+      }
+      line = end;
+    }
+    return "";
+  }
+
   HttpMethod extractMethod(const std::string &line) {
     if ("GET" == line) {
       return GET;
@@ -112,7 +196,7 @@ class Client {
   }
 
   void closeClient() {
-    close(fd);
+    transport->close();
     clientStatus = CLOSED;
   }
 
@@ -158,10 +242,14 @@ class Client {
     size_t pos;
     for (int i = 0; i < lines.size(); ++i) {
       if ((pos = lines[i].find("Content-Length", 0)) != std::string::npos) {
-        length = std::atoi(lines[i].substr(pos + 16, lines[i].length()).c_str());
+        length = std::strtol(lines[i].substr(pos + 16, lines[i].length()).c_str(), NULL, 10);
       }
     }
 
+    if (length < 0) {
+      return closeClient();
+    }
+
     if (length == 0 || length == body.length()) {
       clientStatus = WRITE;
       return;
@@ -182,4 +270,4 @@ class Client {
   }
 };
 
-Logger Client::LOGGER(Logger::DEBUG);
+Logger Client::LOGGER(Logger::INFO);
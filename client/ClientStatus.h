@@ -1,5 +1,5 @@
 #pragma once
 
 enum ClientStatus {
-  READ, WAITING_BODY, WRITE, CLOSED
+  READ, WAITING_BODY, WRITE, WAITING_FILE, SENDING, PROXYING, MULTIPLEXED, CLOSED
 };
@@ -0,0 +1,49 @@
+#pragma once
+#include "Clock.h"
+
+// Monotonic timestamps (us) of one request's phases. `accepted` and `lastByteSent` are always
+// taken since $request_time and the latency histograms need them; the other marks are only taken
+// when `detailed` is set (phase variables in the access log, or the request is sampled for tracing),
+// so untraced requests pay a single branch per phase. `accepted` is when accept(2) returned the
+// connection: the time it waited in the listen queue before is not measured.
+struct RequestTiming {
+  enum Phase {
+    ACCEPTED,
+    FIRST_BYTE,
+    HEADERS_PARSED,
+    HANDLER_START,
+    HANDLER_END,
+    FIRST_BYTE_SENT,
+    LAST_BYTE_SENT,
+    PHASE_COUNT
+  };
+
+  long long marks[PHASE_COUNT];
+  bool detailed;
+  bool sampled;
+
+  RequestTiming() : detailed(false), sampled(false) {
+    for (int i = 0; i < PHASE_COUNT; ++i) {
+      marks[i] = 0;
+    }
+    marks[ACCEPTED] = Clock::nowMicros();
+  }
+
+  void mark(Phase phase) {
+    if (detailed && marks[phase] == 0) {
+      marks[phase] = Clock::nowMicros();
+    }
+  }
+
+  void markAlways(Phase phase) {
+    marks[phase] = Clock::nowMicros();
+  }
+
+  // duration between two marks, -1 if either was not taken
+  long long between(Phase from, Phase to) const {
+    if (marks[from] == 0 || marks[to] == 0) {
+      return -1;
+    }
+    return marks[to] - marks[from];
+  }
+};
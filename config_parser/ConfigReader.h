@@ -7,30 +7,14 @@
 #include <iostream>
 #include "Server.h"
 #include "HttpStatus.h"
+#include "StatusPage.h"
+#include "ConfigTokenizer.h"
+#include "AdmissionControl.h"
+#include <cctype>
 #include <cstring>
 #include <algorithm>
-
-struct Srv {
-  int port;
-  std::string hostName;
-  std::string serverName;
-  std::string errorPage;
-  int maxBodySize;
-  std::vector<Location> locations;
-};
-
-struct Loc {
-  std::string url;
-  std::string root;
-  std::vector<std::string> allowMethod;
-  bool autoIndex;
-  std::vector<std::string> index;
-  std::string uploadPath;
-  std::vector<std::string> cgiExt;
-  std::string cgiPath;
-  std::map<HttpStatus, std::string> errorPage;
-  std::vector<std::pair<std::string, std::string> > redirect;
-};
+#include <set>
+#include <cstdlib>
 
 class ConfigReader {
  public:
@@ -51,48 +35,10 @@ class ConfigReader {
   }
 
   void readConfig() {
-
-    std::ifstream fileStream(this->path.c_str());
-
-    if (fileStream.fail()) {
-      throw std::runtime_error("Error reading config file. Exiting...");
-    }
-
-    std::string str;
-    std::vector<std::string> data;
-
-    while (std::getline(fileStream, str)) {
-      if (removeSymbols(str)) {
-        data.push_back(str);
-      }
-    }
-    fileStream.close();
-    setConfig(data);
-  }
-
-  bool removeSymbols(std::string &str) {
-
-    while (str[0] == ' ' || str[0] == '\t')
-      str.erase(0, 1);
-    while (str[str.length() - 1] == ' ' || str[str.length() - 1] == '\t') // remove tabs and spaces before and after
-      str.erase((str.length() - 1), 1);
-
-    size_t doubleSpace = str.find('\t'); // remove tabs and double spaces inside string
-    doubleSpace = str.find('\t');
-    while (doubleSpace != std::string::npos) {
-      str.replace(doubleSpace, 1, " ");
-      doubleSpace = str.find('\t');
-    }
-
-    doubleSpace = str.find("  ");
-    while (doubleSpace != std::string::npos) {
-      str.erase(doubleSpace, 1);
-      doubleSpace = str.find("  ");
-    }
-
-    if (str.length() == 0 || str[0] == '#' || str[0] == '\n')
-      return false;
-    return true;
+    ConfigTokenizer tokenizer;
+    const std::vector<ConfigToken> &tokens = tokenizer.tokenize(this->path);
+    std::size_t pos = 0;
+    parseMain(tokens, pos);
   }
 
   void printData() {
@@ -103,11 +49,16 @@ class ConfigReader {
       int k = 1;
       std::cout << "Server #" << i << " config:" << std::endl;
       Server tmp = *it;
-      std::cout << "Port: " << tmp.getPort() << std::endl;
+      for (std::vector<Listener>::const_iterator lst = tmp.listeners.begin(); lst != tmp.listeners.end(); ++lst) {
+        std::cout << "Listen: " << lst->key() << (lst->ssl ? " (ssl)" : "")
+                  << (tmp.http2.enabled ? " (http2)" : "") << std::endl;
+      }
       std::cout << "Hostname: " << tmp.getHostName() << std::endl;
       std::cout << "Server Name: " << tmp.getServerName() << std::endl;
       std::cout << "Error page: " << tmp.getErrorPage() << std::endl;
-      std::cout << "Size limit: " << tmp.getBodySize() << std::endl << std::endl;
+      std::cout << "Size limit: " << tmp.getBodySize() << std::endl;
+      std::cout << "Access log: " << (tmp.getAccessLog().path.empty() ? "NONE" : tmp.getAccessLog().path)
+                << (tmp.getAccessLog().json ? " (json)" : "") << std::endl << std::endl;
 
       std::vector<Location> loc = it->getLocations();
       std::vector<Location>::iterator lit = loc.begin();
@@ -153,6 +104,19 @@ class ConfigReader {
         }
         std::cout << std::endl;
         std::cout << "CGI path: " << (ltmp.getCgiPath().length() > 0 ? ltmp.getCgiPath() : "NONE") << std::endl;
+        if (ltmp.maxBodySize >= 0) {
+          std::cout << "Size limit: " << ltmp.maxBodySize << std::endl;
+        }
+        if (ltmp.cgiCacheMillis >= 0) {
+          std::cout << "CGI cache: " << ltmp.cgiCacheMillis << " ms" << std::endl;
+        }
+        if (ltmp.preload) {
+          std::cout << "Preload: on" << std::endl;
+        }
+        if (!ltmp.proxyPass.empty()) {
+          std::cout << "Proxy pass: http://" << ltmp.proxyPass << ltmp.proxyUri << " ("
+                    << ltmp.upstream.servers.size() << " servers)" << std::endl;
+        }
         std::cout << "Error page: ";
         if (ltmp.getErrorPage().size() > 0) {
           std::map<HttpStatus, std::string> tmp = ltmp.getErrorPage();
@@ -190,209 +154,762 @@ class ConfigReader {
       it++;
 
     }
+    std::string maxConnections = admission.maxConnections == 0 ? "NONE" : Logger::toString(admission.maxConnections);
+    std::cout << "Max connections: " << maxConnections << ", shed target: " << admission.targetMillis << " ms, shed interval: " << admission.intervalMillis
+              << " ms" << std::endl << std::endl;
   }
 
   const std::vector<Server> &getServers() const {
     return servers;
   }
 
+  const AdmissionConfig &getAdmission() const {
+    return admission;
+  }
+
  private:
-  std::vector<std::string> strSplit(const std::string &text) {
-    std::vector<std::string> res;
-    size_t start = 0;
-    size_t end = 0;
-    while ((end = text.find(' ', start)) != std::string::npos) {
-      res.push_back(text.substr(start, end - start));
-      start = end + 1;
-    }
-    res.push_back(text.substr(start));
-    return res;
-  }
-
-  void addServerData(Srv &srv, std::string &str) {
-    std::vector<std::string> spl = strSplit(str);
-    if (spl.front().compare("port") == 0) {
-      int n = spl.back().length();
-      char ch[n + 1];
-      strcpy(ch, spl.back().c_str());
-      srv.port = atoi(ch);
-    } else if (spl.front().compare("limit_size") == 0) {
-      int n = spl.back().length();
-      char ch[n + 1];
-      strcpy(ch, spl.back().c_str());
-      srv.maxBodySize = atoi(ch);
-    } else if (spl.front().compare("host") == 0) {
-      srv.hostName = spl.back();
-    } else if (spl.front().compare("server_name") == 0) {
-      srv.serverName = spl.back();
-    } else if (spl.front().compare("error_page") == 0) {
-      srv.errorPage = spl.back();
+  // a directive: its name token followed by its arguments
+  typedef std::vector<const ConfigToken *> Directive;
+
+  // a proxy_pass target, looked up once all upstream blocks are known
+  struct ProxyTarget {
+    std::size_t server;
+    std::size_t location;
+    const ConfigToken *token;
+  };
+
+  // main context: server and upstream blocks, the process-wide limits
+  void parseMain(const std::vector<ConfigToken> &tokens, std::size_t &pos) {
+    std::set<std::string> addresses;
+    Directive directive;
+    // growing the vector would copy every Server with its locations
+    servers.reserve(count(tokens, "server"));
+    while (pos < tokens.size()) {
+      const ConfigToken &token = tokens[pos];
+      if (token.type == ConfigToken::END) {
+        ++pos;
+      } else if (token.type == ConfigToken::WORD && token.is("server")) {
+        ++pos;
+        expectOpen(tokens, pos, token);
+        parseServer(tokens, pos, token);
+        const std::vector<Listener> &listeners = servers.back().listeners;
+        for (std::vector<Listener>::const_iterator it = listeners.begin(); it != listeners.end(); ++it) {
+          if (!addresses.insert(it->key()).second) {
+            throw ConfigTokenizer::error(token, "duplicate listen " + it->key());
+          }
+        }
+      } else if (token.type == ConfigToken::WORD && token.is("upstream")) {
+        ++pos;
+        parseUpstream(tokens, pos, token);
+      } else if (token.type == ConfigToken::WORD) {
+        readDirective(tokens, pos, directive);
+        addMainData(directive);
+      } else {
+        throw ConfigTokenizer::error(token, "unexpected '" + token.text() + "', expected a server or upstream block");
+      }
+    }
+    if (this->servers.size() == 0) {
+      throw std::runtime_error("Config file error: no server data found. Exiting...");
+    }
+    resolveProxyTargets();
+  }
+
+  void addMainData(const Directive &directive) {
+    const std::string &name = directive[0]->text();
+    if (name == "max_connections") {
+      expectArguments(directive, 1, 1);
+      admission.maxConnections = parseNumber(*directive[1], 0, 10000000);
+    } else if (name == "shed_target") {
+      expectArguments(directive, 1, 1);
+      admission.targetMillis = parseDelay(*directive[1], 0);
+    } else if (name == "shed_interval") {
+      expectArguments(directive, 1, 1);
+      admission.intervalMillis = parseDelay(*directive[1], 1);
     } else {
-      throw std::runtime_error("Config file error: wrong server option. Exiting...");
+      throw ConfigTokenizer::error(*directive[0], "unknown option '" + name + "', expected a server or upstream block");
+    }
+  }
+
+  // <n>ms or <n>s, a plain number is taken as milliseconds
+  static long parseDelay(const ConfigToken &token, long min) {
+    std::string text = token.text();
+    long unit = 1;
+    if (text.length() > 2 && text.substr(text.length() - 2) == "ms") {
+      text = text.substr(0, text.length() - 2);
+    } else if (text.length() > 1 && text[text.length() - 1] == 's') {
+      text = text.substr(0, text.length() - 1);
+      unit = 1000;
     }
+    return parseNumber(token, text, min, 3600000 / unit) * unit;
   }
 
-  void addLocationData(Loc &loc, std::string &str) {
-    std::vector<std::string> spl = strSplit(str);
-    if (spl.front().compare("location") == 0) {
-      if (spl[1] == "{") {
-        loc.url = "NONE";
+  // upstream <name> { server <host>[:<port>] [max_fails=<n>] [fail_timeout=<n>[ms|s]]; least_conn; keepalive <n> }
+  void parseUpstream(const std::vector<ConfigToken> &tokens, std::size_t &pos, const ConfigToken &block) {
+    if (pos == tokens.size() || tokens[pos].type != ConfigToken::WORD) {
+      throw ConfigTokenizer::error(block, "upstream expects a name");
+    }
+    const ConfigToken &name = tokens[pos++];
+    if (upstreams.count(name.text()) != 0) {
+      throw ConfigTokenizer::error(name, "duplicate upstream '" + name.text() + "'");
+    }
+    expectOpen(tokens, pos, block);
+    UpstreamConfig &upstream = upstreams[name.text()];
+    upstream.name = name.text();
+    upstream.hostHeader = name.text();
+    Directive directive;
+    while (true) {
+      if (pos == tokens.size()) {
+        throw ConfigTokenizer::error(block, "unexpected end of file, '}' of this block expected");
+      }
+      const ConfigToken &token = tokens[pos];
+      if (token.type == ConfigToken::END) {
+        ++pos;
+      } else if (token.type == ConfigToken::CLOSE) {
+        ++pos;
+        break;
+      } else if (token.type == ConfigToken::OPEN) {
+        throw ConfigTokenizer::error(token, "unexpected '{'");
       } else {
-        loc.url = spl[1];
-      }
-    } else if (spl.front().compare("root") == 0) {
-      loc.root = spl.back();
-    } else if (spl.front().compare("allow_method") == 0) {
-      while (spl.size() != 1) {
-        if (spl.back() != "GET" && spl.back() != "POST" && spl.back() != "DELETE") {
-          throw std::runtime_error("Config file error: wrong location option. Exiting...");
+        readDirective(tokens, pos, directive);
+        addUpstreamData(upstream, directive);
+      }
+    }
+    if (upstream.servers.empty()) {
+      throw ConfigTokenizer::error(block, "upstream '" + upstream.name + "' without servers");
+    }
+  }
+
+  void addUpstreamData(UpstreamConfig &upstream, const Directive &directive) {
+    const std::string name = directive[0]->text();
+    if (name == "server") {
+      expectArguments(directive, 1, 3);
+      UpstreamServerConfig server;
+      parseAddress(*directive[1], directive[1]->text(), server);
+      for (std::size_t i = 2; i < directive.size(); ++i) {
+        const std::string option = directive[i]->text();
+        if (option.compare(0, 10, "max_fails=") == 0) {
+          server.maxFails = parseNumber(*directive[i], option.substr(10), 0, 1000);
+        } else if (option.compare(0, 13, "fail_timeout=") == 0) {
+          server.failTimeoutMillis = parseMillis(option.substr(13));
+        } else {
+          throw ConfigTokenizer::error(*directive[i], "unknown server option '" + option + "'");
         }
-//        loc.allowMethod.push_back(extractMethodFromStr(spl.back())); // add check for allowed
-        loc.allowMethod.push_back(spl.back()); // add check for allowed
-        spl.pop_back();
-      }
-    } else if (spl.front().compare("autoIndex") == 0) {
-      spl.back() == "on" ? loc.autoIndex = true : loc.autoIndex = false;
-    } else if (spl.front().compare("index") == 0) {
-      while (spl.size() != 1) {
-        loc.index.push_back(spl.back());
-        spl.pop_back();
-      }
-    } else if (spl.front().compare("cgi_ext") == 0) {
-      while (spl.size() != 1) {
-        loc.cgiExt.push_back(spl.back());
-        spl.pop_back();
-      }
-    } else if (spl.front().compare("redirect") == 0) {
-      if (spl.size() != 3){
-        throw std::runtime_error("Config file error: Wrong redirect options. Exiting...");
-      }
-      loc.redirect.push_back(std::make_pair(spl[1], spl[2]));
-    } else if (spl.front().compare("cgi_path") == 0) {
-      loc.cgiPath = spl.back();
-    } else if (spl.front().compare("error_page") == 0) {
-      if (spl[1] == "400") {
-        loc.errorPage.insert(std::make_pair(BAD_REQUEST, spl[2]));
-      } else if (spl[1] == "404") {
-        loc.errorPage.insert(std::make_pair(NOT_FOUND, spl[2]));
-      } else if (spl[1] == "405") {
-          loc.errorPage.insert(std::make_pair(NOT_ALLOWED, spl[2]));
-      } else if (spl[1] == "500") {
-        loc.errorPage.insert(std::make_pair(INTERNAL_SERVER_ERROR, spl[2]));
-      } else {
-        throw std::runtime_error("Config file error: Non-existing status to match error page. Exiting...");
       }
+      upstream.servers.push_back(server);
+    } else if (name == "least_conn") {
+      expectArguments(directive, 0, 0);
+      upstream.leastConn = true;
+    } else if (name == "keepalive") {
+      expectArguments(directive, 1, 1);
+      upstream.keepalive = parseNumber(*directive[1], 0, 100000);
     } else {
-      throw std::runtime_error("Config file error: wrong location option. Exiting...");
+      throw ConfigTokenizer::error(*directive[0], "unknown upstream option '" + name + "'");
     }
   }
 
-  void addServer(int count, std::vector<std::string> data) {
-
-    bool loc_bracket = false;
-    std::vector<std::string>::iterator it = data.begin() + 1;
-    int i = 0;
-    Srv srv;
-    srv.maxBodySize = 10000000;
+  // <host>[:<port>], resolved now: a name that does not resolve is a configuration error
+  static void parseAddress(const ConfigToken &token, const std::string &address, UpstreamServerConfig &server) {
+    std::size_t colon = address.rfind(':');
+    server.host = address.substr(0, colon);
+    if (colon != std::string::npos) {
+      server.port = parseNumber(token, address.substr(colon + 1), 1, 65535);
+    }
+    if (server.host.empty() || !server.resolve()) {
+      throw ConfigTokenizer::error(token, "host not found in '" + address + "'");
+    }
+  }
 
-    while (i < count - 1) {
-      if (!loc_bracket && (*it).find("location") == std::string::npos && *it != "}") {
-        addServerData(srv, *it);
-      } else if ((*it).find("location") != std::string::npos) {
-        loc_bracket = true;
-        Loc loc;
-        loc.autoIndex = false;
+  // proxy_pass names an upstream block, or is the address of a single server
+  void resolveProxyTargets() {
+    for (std::vector<ProxyTarget>::const_iterator it = proxyTargets.begin(); it != proxyTargets.end(); ++it) {
+      Location &loc = servers[it->server].locations[it->location];
+      std::map<std::string, UpstreamConfig>::const_iterator upstream = upstreams.find(loc.proxyPass);
+      if (upstream != upstreams.end()) {
+        loc.upstream = upstream->second;
+        continue;
+      }
+      UpstreamServerConfig server;
+      parseAddress(*it->token, loc.proxyPass, server);
+      server.maxFails = 0; // nothing to fail over to
+      loc.upstream.name = loc.proxyPass;
+      loc.upstream.hostHeader = server.authority();
+      loc.upstream.servers.push_back(server);
+    }
+    proxyTargets.clear();
+  }
 
-        addLocationData(loc, *it);
-        it++;
+  void parseServer(const std::vector<ConfigToken> &tokens, std::size_t &pos, const ConfigToken &block) {
+    // built in place: a Server holds its locations, copying it per block would cost as much again
+    servers.push_back(Server(0, "", "", "", 10000000));
+    Server &srv = servers.back();
+    srv.locations.clear();
+    portListeners.clear();
+    Directive directive;
+    while (true) {
+      if (pos == tokens.size()) {
+        throw ConfigTokenizer::error(block, "unexpected end of file, '}' of this block expected");
+      }
+      const ConfigToken &token = tokens[pos];
+      if (token.type == ConfigToken::END) {
+        ++pos;
+      } else if (token.type == ConfigToken::CLOSE) {
+        ++pos;
+        break;
+      } else if (token.type == ConfigToken::OPEN) {
+        throw ConfigTokenizer::error(token, "unexpected '{'");
+      } else if (token.is("location")) {
+        ++pos;
+        parseLocation(tokens, pos, token, srv);
+      } else {
+        readDirective(tokens, pos, directive);
+        addServerData(srv, directive);
+      }
+    }
+    if (srv.listeners.empty()) {
+      throw ConfigTokenizer::error(block, "server block without port or listen");
+    }
+    // `port` binds the address of `host`, wherever that comes in the block
+    for (std::size_t i = 0; i < portListeners.size(); ++i) {
+      Listener &listener = srv.listeners[portListeners[i].first];
+      listener.host = srv.hostName;
+      if (!listener.resolve()) {
+        throw ConfigTokenizer::error(*portListeners[i].second, "host not found in '" + srv.hostName + "'");
+      }
+    }
+    srv.port = srv.listeners.front().port;
+    for (std::vector<Listener>::const_iterator it = srv.listeners.begin(); it != srv.listeners.end(); ++it) {
+      srv.tls.enabled |= it->ssl;
+    }
+    if (srv.tls.enabled && (srv.tls.certificate.empty() || srv.tls.certificateKey.empty())) {
+      throw ConfigTokenizer::error(block, "ssl server without ssl_certificate and ssl_certificate_key");
+    }
+    if (srv.locations.empty()) {
+      srv.locations.push_back(Location(1));
+    }
+  }
 
-        while ((*it).find("}") == std::string::npos) {
-          addLocationData(loc, *it);
-          i++;
-          it++;
+  void parseLocation(const std::vector<ConfigToken> &tokens, std::size_t &pos, const ConfigToken &block, Server &srv) {
+    if (srv.locations.empty()) {
+      srv.locations.reserve(countLocations(tokens, pos));
+    }
+    srv.locations.push_back(Location());
+    Location &loc = srv.locations.back();
+    loc.autoIndex = false;
+    loc.stubStatus = StatusPage::OFF;
+    loc.url = "NONE";
+    if (pos < tokens.size() && tokens[pos].type == ConfigToken::WORD) {
+      loc.url = tokens[pos++].text();
+    }
+    expectOpen(tokens, pos, block);
+    Directive directive;
+    while (true) {
+      if (pos == tokens.size()) {
+        throw ConfigTokenizer::error(block, "unexpected end of file, '}' of this block expected");
+      }
+      const ConfigToken &token = tokens[pos];
+      if (token.type == ConfigToken::END) {
+        ++pos;
+      } else if (token.type == ConfigToken::CLOSE) {
+        ++pos;
+        break;
+      } else if (token.type == ConfigToken::OPEN) {
+        throw ConfigTokenizer::error(token, "unexpected '{'");
+      } else {
+        readDirective(tokens, pos, directive);
+        addLocationData(loc, directive);
+        if (directive[0]->is("proxy_pass")) {
+          ProxyTarget target = {servers.size() - 1, srv.locations.size() - 1, directive[1]};
+          proxyTargets.push_back(target);
         }
+      }
+    }
+  }
 
-        loc_bracket = false;
-        srv.locations.push_back(Location(loc.url, loc.root, loc.allowMethod, loc.autoIndex,
-                                         loc.index, loc.uploadPath, loc.cgiExt, loc.cgiPath,
-                                         loc.errorPage, loc.redirect));
-        loc.allowMethod.clear();
-        loc.index.clear();
-        loc.cgiExt.clear();
-        i++;
+  static std::size_t count(const std::vector<ConfigToken> &tokens, const char *word) {
+    std::size_t found = 0;
+    for (std::vector<ConfigToken>::const_iterator it = tokens.begin(); it != tokens.end(); ++it) {
+      found += it->type == ConfigToken::WORD && it->text() == word;
+    }
+    return found;
+  }
+
+  // locations of the server block being parsed, `pos` being just after the first one's keyword
+  static std::size_t countLocations(const std::vector<ConfigToken> &tokens, std::size_t pos) {
+    std::size_t found = 1;
+    int depth = 0;
+    for (; pos < tokens.size() && depth >= 0; ++pos) {
+      if (tokens[pos].type == ConfigToken::OPEN) {
+        ++depth;
+      } else if (tokens[pos].type == ConfigToken::CLOSE) {
+        --depth;
+      } else if (depth == 0 && tokens[pos].type == ConfigToken::WORD && tokens[pos].is("location")) {
+        ++found;
       }
+    }
+    return found;
+  }
 
-      if ((*it == "}" && i == count - 2) || it == data.end() - 1) {
-        break;
+  static void expectOpen(const std::vector<ConfigToken> &tokens, std::size_t &pos, const ConfigToken &block) {
+    if (pos == tokens.size() || tokens[pos].type != ConfigToken::OPEN) {
+      throw ConfigTokenizer::error(pos == tokens.size() ? block : tokens[pos], "'{' expected after " + block.text());
+    }
+    ++pos;
+  }
+
+  // words up to the end of the line, a ';' or the '}' closing the block
+  static void readDirective(const std::vector<ConfigToken> &tokens, std::size_t &pos, Directive &directive) {
+    directive.clear();
+    while (pos < tokens.size() && tokens[pos].type == ConfigToken::WORD) {
+      directive.push_back(&tokens[pos++]);
+    }
+    if (pos < tokens.size() && tokens[pos].type == ConfigToken::OPEN) {
+      throw ConfigTokenizer::error(tokens[pos], "unexpected '{' after " + directive[0]->text());
+    }
+  }
+
+  static void expectArguments(const Directive &directive, std::size_t min, std::size_t max) {
+    std::size_t count = directive.size() - 1;
+    if (count < min || count > max) {
+      throw ConfigTokenizer::error(*directive[0], directive[0]->text() + " expects "
+          + (min == max ? Logger::toString(min) : Logger::toString(min) + " or more") + " argument"
+          + (max == 1 ? "" : "s"));
+    }
+  }
+
+  static int parseNumber(const ConfigToken &token, long min, long max) {
+    return parseNumber(token, token.text(), min, max);
+  }
+
+  // `text` is the token's text or part of it
+  static int parseNumber(const ConfigToken &token, const std::string &text, long min, long max) {
+    char *end;
+    long value = std::strtol(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0' || value < min || value > max) {
+      throw ConfigTokenizer::error(token, "'" + text + "' is not a number between " + Logger::toString(min)
+          + " and " + Logger::toString(max));
+    }
+    return (int) value;
+  }
+
+  void addServerData(Server &srv, const Directive &directive) {
+    const std::string name = directive[0]->text();
+    if (name == "port") {
+      expectArguments(directive, 1, 2);
+      Listener listener;
+      listener.port = parseNumber(*directive[1], 1, 65535);
+      if (directive.size() == 3 && !directive[2]->is("ssl")) {
+        throw ConfigTokenizer::error(*directive[2], "unknown port option '" + directive[2]->text() + "'");
       }
-      i++;
-      it++;
+      listener.ssl = directive.size() == 3;
+      portListeners.push_back(std::make_pair(srv.listeners.size(), directive[1]));
+      srv.listeners.push_back(listener);
+    } else if (name == "listen") {
+      srv.listeners.push_back(parseListen(directive));
+    } else if (name.compare(0, 4, "ssl_") == 0) {
+      addTlsData(srv.tls, directive);
+    } else if (name == "http2") {
+      expectArguments(directive, 1, 1);
+      if (!directive[1]->is("on") && !directive[1]->is("off")) {
+        throw ConfigTokenizer::error(*directive[1], "http2 expects on|off");
+      }
+      srv.http2.enabled = directive[1]->is("on");
+    } else if (name == "http2_max_streams") {
+      expectArguments(directive, 1, 1);
+      srv.http2.maxStreams = parseNumber(*directive[1], 1, 1000);
+    } else if (name == "limit_size") {
+      expectArguments(directive, 1, 1);
+      srv.maxBodySize = parseNumber(*directive[1], 0, 2147483647L);
+    } else if (name == "host") {
+      expectArguments(directive, 1, 1);
+      srv.hostName = directive[1]->text();
+    } else if (name == "server_name") {
+      expectArguments(directive, 1, 1);
+      srv.serverName = directive[1]->text();
+    } else if (name == "error_page") {
+      expectArguments(directive, 1, 1);
+      srv.errorPage = directive[1]->text();
+    } else if (name == "access_log") {
+      addAccessLogData(srv.accessLog, directive);
+    } else if (name == "trace_log") {
+      addTraceLogData(srv.traceLog, directive);
+    } else if (name == "capture") {
+      addCaptureData(srv.capture, directive);
+    } else if (name == "limit_req") {
+      addLimitReqData(srv.limits, directive);
+    } else if (name == "limit_conn") {
+      expectArguments(directive, 1, 1);
+      srv.limits.connections = parseNumber(*directive[1], 1, 1000000);
+    } else if (name == "limit_zone") {
+      expectArguments(directive, 1, 1);
+      srv.limits.zoneBytes = parseSize(directive[1]->text());
+      if (srv.limits.zoneBytes < 64 * 1024 || srv.limits.zoneBytes > 1024UL * 1024 * 1024) {
+        throw ConfigTokenizer::error(*directive[1], "limit_zone expects a size between 64k and 1024m");
+      }
+    } else if (name == "log_format") {
+      expectArguments(directive, 1, 1000);
+      std::string format = directive[1]->text();
+      for (std::size_t i = 2; i < directive.size(); ++i) {
+        format += " " + directive[i]->text();
+      }
+      srv.accessLog.format = format;
+    } else {
+      throw ConfigTokenizer::error(*directive[0], "unknown server option '" + name + "'");
     }
-    this->servers.push_back(Server(srv.port, srv.hostName, srv.serverName,
-                                   srv.errorPage, srv.maxBodySize, srv.locations));
-  }
-
-  void setConfig(std::vector<std::string> data) {
-
-    while (data.size() > 0) {
-      bool srv_bracket = false;
-      bool loc_bracket = false;
-      int count = 0;
-      std::vector<std::string>::iterator it = data.begin();
-
-      while (it != data.end()) {
-        std::string str = *it;
-
-        if (str.find("server {") != std::string::npos) {
-          srv_bracket = true;
-          count++;
-        } else if (str.find("location") != std::string::npos) {
-          loc_bracket = true;
-          count++;
-        } else if (str[0] == '}' && loc_bracket && srv_bracket) {
-          loc_bracket = false;
-          count++;
-        } else if (srv_bracket && !loc_bracket && str[0] != '}') {
-          count++;
-        } else if (srv_bracket && loc_bracket) {
-          count++;
-        } else if (str[0] == '}' && !loc_bracket && srv_bracket) {
-          srv_bracket = false;
-          count++;
+  }
+
+  // limit_req rate=<n>r/s|r/m [burst=<n>]
+  void addLimitReqData(RateLimitConfig &limits, const Directive &directive) {
+    expectArguments(directive, 1, 2);
+    limits.rate = 0;
+    limits.burst = 0;
+    for (std::size_t i = 1; i < directive.size(); ++i) {
+      const std::string option = directive[i]->text();
+      if (option.compare(0, 5, "rate=") == 0 && option.length() > 8) {
+        std::string unit = option.substr(option.length() - 3);
+        if (unit != "r/s" && unit != "r/m") {
+          throw ConfigTokenizer::error(*directive[i], "limit_req expects rate=<n>r/s or rate=<n>r/m");
         }
+        limits.rate = parseNumber(*directive[i], option.substr(5, option.length() - 8), 1, 1000000);
+        limits.periodMillis = unit == "r/s" ? 1000 : 60000;
+      } else if (option.compare(0, 6, "burst=") == 0) {
+        limits.burst = parseNumber(*directive[i], option.substr(6), 0, 1000000);
+      } else {
+        throw ConfigTokenizer::error(*directive[i], "unknown limit_req option '" + option + "'");
+      }
+    }
+    if (limits.rate == 0) {
+      throw ConfigTokenizer::error(*directive[0], "limit_req expects rate=<n>r/s or rate=<n>r/m");
+    }
+  }
 
-        if (!loc_bracket && !srv_bracket) {
-          break;
+  // ssl_certificate <path>; ssl_certificate_key <path>; ssl_session_cache <sessions>|off;
+  // ssl_session_timeout <n>[ms|s]; ssl_session_tickets on|off; ssl_ktls on|off
+  void addTlsData(TlsConfig &tls, const Directive &directive) {
+    expectArguments(directive, 1, 1);
+    const std::string name = directive[0]->text();
+    const ConfigToken &value = *directive[1];
+    if (name == "ssl_certificate") {
+      tls.certificate = value.text();
+    } else if (name == "ssl_certificate_key") {
+      tls.certificateKey = value.text();
+    } else if (name == "ssl_session_cache") {
+      tls.sessionCache = value.is("off") ? 0 : parseNumber(value, 1, 10000000);
+    } else if (name == "ssl_session_timeout") {
+      tls.sessionTimeout = parseMillis(value.text()) / 1000;
+      if (tls.sessionTimeout <= 0) {
+        throw ConfigTokenizer::error(value, "ssl_session_timeout expects a duration of a second or more");
+      }
+    } else if (name == "ssl_session_tickets" || name == "ssl_ktls") {
+      if (!value.is("on") && !value.is("off")) {
+        throw ConfigTokenizer::error(value, name + " expects on|off");
+      }
+      (name == "ssl_ktls" ? tls.ktls : tls.sessionTickets) = value.is("on");
+    } else {
+      throw ConfigTokenizer::error(*directive[0], "unknown server option '" + name + "'");
+    }
+  }
+
+  // access_log <path|off> [json] [buffer=<bytes>[k|m]] [flush=<n>[ms|s]]
+  void addAccessLogData(AccessLogConfig &accessLog, const Directive &directive) {
+    expectArguments(directive, 1, 4);
+    accessLog.path = directive[1]->text() == "off" ? "" : directive[1]->text();
+    for (std::size_t i = 2; i < directive.size(); ++i) {
+      const std::string option = directive[i]->text();
+      if (option == "json") {
+        accessLog.json = true;
+      } else if (option.compare(0, 7, "buffer=") == 0) {
+        accessLog.bufferSize = parseSize(option.substr(7));
+      } else if (option.compare(0, 6, "flush=") == 0) {
+        accessLog.flushMillis = parseMillis(option.substr(6));
+      } else {
+        throw ConfigTokenizer::error(*directive[i], "unknown access_log option '" + option + "'");
+      }
+    }
+  }
+
+  // trace_log <path|off> [sample=<one in N requests>] [buffer=<bytes>[k|m]] [flush=<n>[ms|s]]
+  void addTraceLogData(TraceLogConfig &traceLog, const Directive &directive) {
+    expectArguments(directive, 1, 4);
+    traceLog.path = directive[1]->text() == "off" ? "" : directive[1]->text();
+    for (std::size_t i = 2; i < directive.size(); ++i) {
+      const std::string option = directive[i]->text();
+      if (option.compare(0, 7, "sample=") == 0) {
+        traceLog.sampleEvery = std::strtoul(option.substr(7).c_str(), NULL, 10);
+      } else if (option.compare(0, 7, "buffer=") == 0) {
+        traceLog.bufferSize = parseSize(option.substr(7));
+      } else if (option.compare(0, 6, "flush=") == 0) {
+        traceLog.flushMillis = parseMillis(option.substr(6));
+      } else {
+        throw ConfigTokenizer::error(*directive[i], "unknown trace_log option '" + option + "'");
+      }
+    }
+  }
+
+  // capture <path|off> [sample=<one in N connections>] [max_size=<bytes>[k|m]] [buffer=<bytes>[k|m]] [flush=<n>[ms|s]]
+  void addCaptureData(CaptureConfig &capture, const Directive &directive) {
+    expectArguments(directive, 1, 5);
+    capture.path = directive[1]->text() == "off" ? "" : directive[1]->text();
+    for (std::size_t i = 2; i < directive.size(); ++i) {
+      const std::string option = directive[i]->text();
+      if (option.compare(0, 7, "sample=") == 0) {
+        capture.sampleEvery = std::strtoul(option.substr(7).c_str(), NULL, 10);
+      } else if (option.compare(0, 9, "max_size=") == 0) {
+        capture.maxBytes = parseSize(option.substr(9));
+      } else if (option.compare(0, 7, "buffer=") == 0) {
+        capture.bufferSize = parseSize(option.substr(7));
+      } else if (option.compare(0, 6, "flush=") == 0) {
+        capture.flushMillis = parseMillis(option.substr(6));
+      } else {
+        throw ConfigTokenizer::error(*directive[i], "unknown capture option '" + option + "'");
+      }
+    }
+  }
+
+  // listen [<address>:]<port> [ssl] [backlog=<n>] [deferred[=<seconds>]] [fastopen=<n>] [nodelay]
+  //        [rcvbuf=<size>] [sndbuf=<size>] [ipv6only=on|off]
+  // listen unix:<path> [ssl] [backlog=<n>] [mode=<octal>] [cleanup=on|off] [rcvbuf=<size>] [sndbuf=<size>]
+  static Listener parseListen(const Directive &directive) {
+    expectArguments(directive, 1, 9);
+    const ConfigToken &token = *directive[1];
+    const std::string address = token.text();
+    if (address.compare(0, 5, "unix:") == 0) {
+      return parseUnixListen(directive);
+    }
+    std::size_t colon = address.rfind(':');
+    Listener listener;
+    if (address[0] == '[') {
+      std::size_t close = address.find(']');
+      if (close == std::string::npos || close + 1 != colon) {
+        throw ConfigTokenizer::error(token, "listen expects [<IPv6 address>]:<port>");
+      }
+      listener.host = address.substr(1, close - 1);
+    } else if (colon != std::string::npos) {
+      listener.host = address.substr(0, colon);
+    }
+    listener.port = parseNumber(token, colon == std::string::npos ? address : address.substr(colon + 1), 1, 65535);
+    if (!listener.resolve()) {
+      throw ConfigTokenizer::error(token, "host not found in '" + address + "'");
+    }
+    for (std::size_t i = 2; i < directive.size(); ++i) {
+      const ConfigToken &option = *directive[i];
+      const std::string text = option.text();
+      std::size_t equals = text.find('=');
+      const std::string value = equals == std::string::npos ? "" : text.substr(equals + 1);
+      if (text == "ssl") {
+        listener.ssl = true;
+      } else if (text == "nodelay") {
+        listener.noDelay = true;
+      } else if (text == "deferred") {
+        listener.deferAcceptSeconds = 1;
+      } else if (text.compare(0, 9, "deferred=") == 0) {
+        listener.deferAcceptSeconds = parseNumber(option, value, 1, 3600);
+      } else if (text.compare(0, 8, "backlog=") == 0) {
+        listener.backlog = parseNumber(option, value, 1, 65535);
+      } else if (text.compare(0, 9, "fastopen=") == 0) {
+        listener.fastOpenQueue = parseNumber(option, value, 1, 65535);
+      } else if (text.compare(0, 7, "rcvbuf=") == 0 || text.compare(0, 7, "sndbuf=") == 0) {
+        parseBufferSize(listener, option);
+      } else if ((text == "ipv6only=on" || text == "ipv6only=off") && listener.address.ss_family == AF_INET6) {
+        listener.ipv6Only = value == "on";
+      } else if (text.compare(0, 9, "ipv6only=") == 0) {
+        throw ConfigTokenizer::error(option, "ipv6only expects on|off, on an IPv6 address");
+      } else {
+        throw ConfigTokenizer::error(option, "unknown listen option '" + text + "'");
+      }
+    }
+    return listener;
+  }
+
+  // the TCP options have no meaning on a Unix domain socket and are refused rather than ignored
+  static Listener parseUnixListen(const Directive &directive) {
+    const ConfigToken &token = *directive[1];
+    Listener listener;
+    listener.path = token.text().substr(5);
+    if (listener.path.empty()) {
+      throw ConfigTokenizer::error(token, "listen expects unix:<path>");
+    }
+    if (!listener.resolve()) {
+      throw ConfigTokenizer::error(token, "socket path too long in '" + token.text() + "'");
+    }
+    for (std::size_t i = 2; i < directive.size(); ++i) {
+      const ConfigToken &option = *directive[i];
+      const std::string text = option.text();
+      if (text == "ssl") {
+        listener.ssl = true;
+      } else if (text.compare(0, 8, "backlog=") == 0) {
+        listener.backlog = parseNumber(option, text.substr(8), 1, 65535);
+      } else if (text.compare(0, 5, "mode=") == 0) {
+        const std::string value = text.substr(5);
+        char *end = NULL;
+        long mode = std::strtol(value.c_str(), &end, 8);
+        if (value.empty() || *end != '\0' || mode < 0 || mode > 0777) {
+          throw ConfigTokenizer::error(option, "mode expects octal permissions, e.g. mode=0660");
         }
-        it++;
+        listener.mode = (int) mode;
+      } else if (text == "cleanup=on" || text == "cleanup=off") {
+        listener.cleanup = text == "cleanup=on";
+      } else if (text.compare(0, 7, "rcvbuf=") == 0 || text.compare(0, 7, "sndbuf=") == 0) {
+        parseBufferSize(listener, option);
+      } else {
+        throw ConfigTokenizer::error(option, "unknown option '" + text + "' for a unix socket");
       }
+    }
+    return listener;
+  }
 
-      addServer(count, data);
-      data.erase(data.begin(), data.begin() + count);
+  static void parseBufferSize(Listener &listener, const ConfigToken &option) {
+    const std::string value = option.text().substr(7);
+    std::size_t size = parseSize(value);
+    if (size == 0 || size > 2147483647UL) {
+      throw ConfigTokenizer::error(option, "'" + value + "' is not a buffer size");
     }
+    (option.text()[0] == 'r' ? listener.receiveBuffer : listener.sendBuffer) = (int) size;
+  }
 
-    if (this->servers.size() == 0) {
-      throw std::runtime_error("Config file error: no server data found. Exiting...");
+  static std::size_t parseSize(const std::string &value) {
+    std::size_t size = std::strtoul(value.c_str(), NULL, 10);
+    char unit = value.empty() ? 0 : value[value.length() - 1];
+    if (unit == 'k' || unit == 'K') {
+      size *= 1024;
+    } else if (unit == 'm' || unit == 'M') {
+      size *= 1024 * 1024;
+    }
+    return size;
+  }
+
+  static long parseMillis(const std::string &value) {
+    long amount = std::strtol(value.c_str(), NULL, 10);
+    if (value.length() > 2 && value.substr(value.length() - 2) == "ms") {
+      return amount;
     }
-    if (checkPorts() != 0) {
-      throw std::runtime_error("Config file error: Duplicate ports found. Exiting...");
+    return amount * 1000;
+  }
+
+  // proxy_pass http://<upstream|host[:port]>[/uri]
+  static void addProxyPassData(Location &loc, const Directive &directive) {
+    expectArguments(directive, 1, 1);
+    const std::string target = directive[1]->text();
+    if (target.compare(0, 7, "http://") != 0 || target.length() == 7) {
+      throw ConfigTokenizer::error(*directive[1], "proxy_pass expects http://<upstream or host[:port]>[/uri]");
     }
+    std::size_t slash = target.find('/', 7);
+    loc.proxyPass = target.substr(7, slash == std::string::npos ? std::string::npos : slash - 7);
+    loc.hasProxyUri = slash != std::string::npos;
+    loc.proxyUri = loc.hasProxyUri ? target.substr(slash) : "";
   }
 
-  int checkPorts()
-  {
-    std::vector<Server>::iterator it = servers.begin();
-    std::vector<int> ports;
-    while (it != servers.end()) {
-      if (std::find(ports.begin(), ports.end(), it->getPort()) != ports.end())
-        return 1;
-      ports.push_back(it->getPort());
-      it++;
+  void addLocationData(Location &loc, const Directive &directive) {
+    const std::string name = directive[0]->text();
+    if (name == "root") {
+      expectArguments(directive, 1, 1);
+      loc.root = directive[1]->text();
+    } else if (name == "allow_method") {
+      for (std::size_t i = directive.size() - 1; i > 0; --i) {
+        const std::string method = directive[i]->text();
+        if (method != "GET" && method != "POST" && method != "DELETE") {
+          throw ConfigTokenizer::error(*directive[i], "unknown method '" + method + "'");
+        }
+        loc.allowedMethods.insert(Location::extractMethodFromStr(method));
+      }
+    } else if (name == "autoIndex") {
+      expectArguments(directive, 1, 1);
+      loc.autoIndex = directive[1]->text() == "on";
+    } else if (name == "index") {
+      expectArguments(directive, 1, 1000);
+      // kept last to first: Location tries them from the back
+      for (std::size_t i = directive.size() - 1; i > 0; --i) {
+        loc.index.push_back(directive[i]->text());
+      }
+    } else if (name == "cgi_ext") {
+      expectArguments(directive, 1, 1000);
+      for (std::size_t i = directive.size() - 1; i > 0; --i) {
+        loc.cgiExt.push_back(directive[i]->text());
+      }
+    } else if (name == "redirect") {
+      expectArguments(directive, 2, 2);
+      loc.redirect.push_back(std::make_pair(directive[1]->text(), directive[2]->text()));
+    } else if (name == "cgi_path") {
+      expectArguments(directive, 1, 1);
+      loc.cgiPath = directive[1]->text();
+    } else if (name == "limit_size") {
+      expectArguments(directive, 1, 1);
+      loc.maxBodySize = parseNumber(*directive[1], 0, 2147483647L);
+    } else if (name == "cgi_cache") {
+      expectArguments(directive, 1, 1);
+      const std::string ttl = directive[1]->text();
+      if (directive[1]->is("off")) {
+        loc.cgiCacheMillis = -1;
+      } else if (!ttl.empty() && isdigit((unsigned char) ttl[0])) {
+        loc.cgiCacheMillis = parseMillis(ttl);
+      } else {
+        throw ConfigTokenizer::error(*directive[1], "cgi_cache expects a ttl like 1s or 500ms, or off");
+      }
+    } else if (name == "cgi_cache_vary") {
+      expectArguments(directive, 1, 1000);
+      for (std::size_t i = 1; i < directive.size(); ++i) {
+        loc.cgiCacheVary.push_back(directive[i]->text());
+      }
+    } else if (name == "stub_status") {
+      expectArguments(directive, 0, 1);
+      const std::string mode = directive.size() == 1 ? "on" : directive[1]->text();
+      if (mode == "prometheus") {
+        loc.stubStatus = StatusPage::PROMETHEUS;
+      } else if (mode == "on") {
+        loc.stubStatus = StatusPage::STUB;
+      } else if (mode == "off") {
+        loc.stubStatus = StatusPage::OFF;
+      } else {
+        throw ConfigTokenizer::error(*directive[1], "stub_status expects on|off|prometheus");
+      }
+    } else if (name == "preload") {
+      expectArguments(directive, 1, 1);
+      if (!directive[1]->is("on") && !directive[1]->is("off")) {
+        throw ConfigTokenizer::error(*directive[1], "preload expects on|off");
+      }
+      loc.preload = directive[1]->is("on");
+    } else if (name == "aio") {
+      expectArguments(directive, 1, 1);
+      if (directive[1]->is("threads")) {
+        loc.aioThreads = true;
+      } else if (directive[1]->is("off")) {
+        loc.aioThreads = false;
+      } else {
+        throw ConfigTokenizer::error(*directive[1], "aio expects threads|off");
+      }
+    } else if (name == "proxy_pass") {
+      addProxyPassData(loc, directive);
+    } else if (name == "proxy_connect_timeout" || name == "proxy_read_timeout") {
+      expectArguments(directive, 1, 1);
+      long millis = parseMillis(directive[1]->text());
+      if (millis <= 0) {
+        throw ConfigTokenizer::error(*directive[1], name + " expects a duration like 5s or 500ms");
+      }
+      (name == "proxy_connect_timeout" ? loc.proxyConnectTimeoutMillis : loc.proxyReadTimeoutMillis) = millis;
+    } else if (name == "error_page") {
+      expectArguments(directive, 2, 2);
+      const std::string code = directive[1]->text();
+      if (code == "400") {
+        loc.errorPage.insert(std::make_pair(BAD_REQUEST, directive[2]->text()));
+      } else if (code == "404") {
+        loc.errorPage.insert(std::make_pair(NOT_FOUND, directive[2]->text()));
+      } else if (code == "405") {
+        loc.errorPage.insert(std::make_pair(NOT_ALLOWED, directive[2]->text()));
+      } else if (code == "500") {
+        loc.errorPage.insert(std::make_pair(INTERNAL_SERVER_ERROR, directive[2]->text()));
+      } else {
+        throw ConfigTokenizer::error(*directive[1], "no error page for status " + code);
+      }
+    } else {
+      throw ConfigTokenizer::error(*directive[0], "unknown location option '" + name + "'");
     }
-    return 0;
   }
 
  private:
   std::string path;
   std::vector<Server> servers;
+  std::map<std::string, UpstreamConfig> upstreams;
+  std::vector<ProxyTarget> proxyTargets;
+  AdmissionConfig admission;
+  // listeners of the `port` directives of the server block being read, with their token
+  std::vector<std::pair<std::size_t, const ConfigToken *> > portListeners;
 };
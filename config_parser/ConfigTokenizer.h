@@ -0,0 +1,209 @@
+#pragma once
+#include "Logger.h"
+
+#include <glob.h>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+// One token of a configuration file, with the position it was read at for error messages. Its text
+// stays in the tokenizer's copy of the file: tokens are plain values, cheap to store by the million.
+struct ConfigToken {
+  enum Type {
+    WORD, OPEN, CLOSE, END // END: newline or ';', the end of a directive
+  };
+
+  Type type;
+  const char *data;
+  std::size_t length;
+  const std::string *file;
+  int line;
+  int column;
+
+  std::string text() const {
+    return std::string(data, length);
+  }
+
+  bool is(const char *word) const {
+    return strncmp(data, word, length) == 0 && word[length] == '\0';
+  }
+
+  std::string where() const {
+    return *file + ":" + Logger::toString(line) + ":" + Logger::toString(column);
+  }
+};
+
+// Splits configuration files into tokens in one pass. `include <path|glob>` directives are resolved
+// here, relative to the directory of the file containing them, and their tokens spliced in place, so
+// that the parser sees a single stream wherever the include appeared.
+//
+//   server {                    # comment up to the end of the line
+//     log_format '$status "$request_uri"'   quotes keep spaces and '#'
+//     include servers/*.conf
+//   }
+class ConfigTokenizer {
+ public:
+  static const int MAX_INCLUDE_DEPTH = 16;
+
+ private:
+  std::vector<ConfigToken> tokens;
+  std::vector<std::string *> files;    // owned: names tokens point to
+  std::vector<std::string *> contents; // owned: text tokens point into
+
+ public:
+  ConfigTokenizer() {}
+
+  virtual ~ConfigTokenizer() {
+    for (std::vector<std::string *>::iterator it = files.begin(); it != files.end(); ++it) {
+      delete *it;
+    }
+    for (std::vector<std::string *>::iterator it = contents.begin(); it != contents.end(); ++it) {
+      delete *it;
+    }
+  }
+
+ private:
+  ConfigTokenizer(const ConfigTokenizer &tokenizer);
+  ConfigTokenizer &operator=(const ConfigTokenizer &tokenizer);
+
+ public:
+  const std::vector<ConfigToken> &tokenize(const std::string &path) {
+    readFile(path, NULL, 0);
+    return tokens;
+  }
+
+  static std::runtime_error error(const ConfigToken &at, const std::string &message) {
+    return std::runtime_error("Config file error: " + at.where() + ": " + message + ". Exiting...");
+  }
+
+ private:
+  void readFile(const std::string &path, const ConfigToken *includedAt, int depth) {
+    std::ifstream stream(path.c_str(), std::ios::binary);
+    if (stream.fail()) {
+      if (includedAt != NULL) {
+        throw error(*includedAt, "could not read included file " + path);
+      }
+      throw std::runtime_error("Error reading config file. Exiting...");
+    }
+    stream.seekg(0, std::ios::end);
+    std::streamoff size = stream.tellg();
+    stream.seekg(0, std::ios::beg);
+    files.push_back(new std::string(path));
+    contents.push_back(new std::string(size > 0 ? (std::size_t) size : 0, '\0'));
+    std::string &content = *contents.back();
+    if (size > 0 && !stream.read(&content[0], size)) {
+      throw std::runtime_error("Error reading config file " + path + ". Exiting...");
+    }
+    // about one token per 7 bytes in typical files: spares most of the regrowth of a large vector
+    tokens.reserve(tokens.size() + content.length() / 7);
+    scan(content, files.back(), depth);
+  }
+
+  void scan(const std::string &text, const std::string *file, int depth) {
+    std::size_t length = text.length();
+    std::size_t statementStart = tokens.size();
+    int line = 1;
+    std::size_t lineStart = 0;
+    std::size_t i = 0;
+    while (i < length) {
+      char c = text[i];
+      int column = (int) (i - lineStart) + 1;
+      if (c == '\n' || c == ';') {
+        endStatement(file, line, column, statementStart, depth);
+        statementStart = tokens.size();
+        if (c == '\n') {
+          ++line;
+          lineStart = i + 1;
+        }
+        ++i;
+      } else if (c == ' ' || c == '\t' || c == '\r') {
+        ++i;
+      } else if (c == '#') {
+        while (i < length && text[i] != '\n') {
+          ++i;
+        }
+      } else if (c == '{' || c == '}') {
+        push(c == '{' ? ConfigToken::OPEN : ConfigToken::CLOSE, text.data() + i, 1, file, line, column);
+        statementStart = tokens.size();
+        ++i;
+      } else if (c == '"' || c == '\'') {
+        std::size_t close = text.find(c, i + 1);
+        std::size_t newline = text.find('\n', i + 1);
+        if (close == std::string::npos || (newline != std::string::npos && newline < close)) {
+          ConfigToken at = {ConfigToken::WORD, "", 0, file, line, column};
+          throw error(at, "unterminated quoted string");
+        }
+        push(ConfigToken::WORD, text.data() + i + 1, close - i - 1, file, line, column);
+        i = close + 1;
+      } else {
+        std::size_t end = i;
+        while (end < length && !isDelimiter(text[end])) {
+          ++end;
+        }
+        push(ConfigToken::WORD, text.data() + i, end - i, file, line, column);
+        i = end;
+      }
+    }
+    endStatement(file, line, (int) (length - lineStart) + 1, statementStart, depth);
+  }
+
+  static bool isDelimiter(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == ';' || c == '{' || c == '}' || c == '"'
+        || c == '\'';
+  }
+
+  void push(ConfigToken::Type type, const char *data, std::size_t length, const std::string *file, int line,
+            int column) {
+    ConfigToken token = {type, data, length, file, line, column};
+    tokens.push_back(token);
+  }
+
+  // closes the statement begun at `statementStart`; an include is replaced by the included tokens
+  void endStatement(const std::string *file, int line, int column, std::size_t statementStart, int depth) {
+    if (statementStart == tokens.size()) {
+      return;
+    }
+    if (tokens[statementStart].type == ConfigToken::WORD && tokens[statementStart].is("include")) {
+      ConfigToken include = tokens[statementStart];
+      if (tokens.size() - statementStart != 2 || tokens.back().type != ConfigToken::WORD) {
+        throw error(include, "include expects one path");
+      }
+      if (depth >= MAX_INCLUDE_DEPTH) {
+        throw error(include, "includes nested too deeply");
+      }
+      std::string pattern = relativeTo(*file, tokens.back().text());
+      tokens.resize(statementStart);
+      includeFiles(include, pattern, depth + 1);
+      return;
+    }
+    push(ConfigToken::END, "", 0, file, line, column);
+  }
+
+  void includeFiles(const ConfigToken &include, const std::string &pattern, int depth) {
+    glob_t matches;
+    int result = glob(pattern.c_str(), 0, NULL, &matches);
+    if (result == GLOB_NOMATCH && pattern.find_first_of("*?[") != std::string::npos) {
+      globfree(&matches);
+      return; // a pattern matching nothing includes nothing, as in nginx
+    }
+    if (result != 0) {
+      globfree(&matches);
+      throw error(include, "could not read included file " + pattern);
+    }
+    std::vector<std::string> paths(matches.gl_pathv, matches.gl_pathv + matches.gl_pathc);
+    globfree(&matches);
+    for (std::vector<std::string>::iterator it = paths.begin(); it != paths.end(); ++it) {
+      readFile(*it, &include, depth);
+    }
+  }
+
+  static std::string relativeTo(const std::string &file, const std::string &path) {
+    std::size_t slash = file.find_last_of('/');
+    if (path.empty() || path[0] == '/' || slash == std::string::npos) {
+      return path;
+    }
+    return file.substr(0, slash + 1) + path;
+  }
+};
@@ -1,6 +1,7 @@
 #pragma once
 #include "Logger.h"
 #include "HttpStatus.h"
+#include "UpstreamConfig.h"
 
 #include <string>
 #include <vector>
@@ -21,12 +22,33 @@ class Location {
   std::string cgiPath;
   std::map<HttpStatus, std::string> errorPage;
   std::vector<std::pair<std::string, std::string> > redirect;
+  int stubStatus;   // StatusPage::OFF | STUB | PROMETHEUS
+  int metricsScope; // latency histogram id, assigned when the server starts
+  bool aioThreads;  // `aio threads`: file operations run on the file worker pool
+  std::string proxyPass;   // `proxy_pass` target without scheme and uri, empty: files are served
+  UpstreamConfig upstream; // its servers, resolved once the whole file is read
+  std::string proxyUri;    // replaces the location's url in the proxied path when hasProxyUri
+  bool hasProxyUri;
+  long proxyConnectTimeoutMillis;
+  long proxyReadTimeoutMillis;
+  long cgiCacheMillis;                  // `cgi_cache`: ttl of the shared script outputs, -1: each GET runs it
+  std::vector<std::string> cgiCacheVary; // request headers that are part of the cache key
+  long maxBodySize;                     // `limit_size` of the location, -1: the server's
+  bool preload;                         // `preload on`: the files are read into memory when the config loads
 
  public:
-  Location(void) {
+  static const long DEFAULT_PROXY_TIMEOUT = 60000;
+
+  Location(void)
+      : stubStatus(0), metricsScope(-1), aioThreads(false), hasProxyUri(false),
+        proxyConnectTimeoutMillis(DEFAULT_PROXY_TIMEOUT), proxyReadTimeoutMillis(DEFAULT_PROXY_TIMEOUT),
+        cgiCacheMillis(-1), maxBodySize(-1), preload(false) {
   }
 
-  Location(int def) {
+  Location(int def)
+      : stubStatus(0), metricsScope(-1), aioThreads(false), hasProxyUri(false),
+        proxyConnectTimeoutMillis(DEFAULT_PROXY_TIMEOUT), proxyReadTimeoutMillis(DEFAULT_PROXY_TIMEOUT),
+        cgiCacheMillis(-1), maxBodySize(-1), preload(false) {
     this->url = "/";
     this->allowedMethods.insert(GET);
     this->allowedMethods.insert(POST);
@@ -48,7 +70,10 @@ class Location {
            const std::vector<std::pair<std::string, std::string> > &redirect)
       : url(url), root(root), allowedMethods(vectorToSet(allowedMethodsVector)),
         autoIndex(autoIndex), index(index), uploadPath(uploadPath),
-        cgiExt(cgiExt), cgiPath(cgiPath), errorPage(errorPage), redirect(redirect) {
+        cgiExt(cgiExt), cgiPath(cgiPath), errorPage(errorPage), redirect(redirect),
+        stubStatus(0), metricsScope(-1), aioThreads(false), hasProxyUri(false),
+        proxyConnectTimeoutMillis(DEFAULT_PROXY_TIMEOUT), proxyReadTimeoutMillis(DEFAULT_PROXY_TIMEOUT),
+        cgiCacheMillis(-1), maxBodySize(-1), preload(false) {
   }
 
   ~Location() {
@@ -60,39 +85,6 @@ class Location {
   //Location(Location const &other){};
   //Location &operator=(Location const &other){};
 
-  std::string substitutePath(const std::string &path) const {
-    std::string name = path.substr(path.find_last_of('/') + 1);
-    bool isRedir = false;
-    for (std::vector<std::pair<std::string, std::string> >::const_iterator it = redirect.begin();
-          it != redirect.end() && !name.empty(); ++it) {
-      if (name == it->first){
-        name = it->second;
-        isRedir = true;
-        break;
-      }
-    }
-    if (path.find(url) != std::string::npos) {
-      if (!isRedir)
-        return root + path.substr(url.length() - 1);
-      else
-        return root + path.substr(url.length() - 1).substr(0, path.find_last_of('/')) + '/' + name;
-    }
-    throw RuntimeWebServException("Bad path string provided: " + path + ". Not matches with url: " + url);
-  }
-
-  std::string getFullCgiPath(const std::string &path) const {
-    return root + '/' + path;
-  }
-
-  bool isMethodAllowed(HttpMethod method) const {
-    return allowedMethods.find(method) != allowedMethods.end();
-  }
-
-  bool matches(const std::string &path) const {
-    return (path.length() == 1 && url.length() == 1 && path == url) ||
-        (path.substr(1).rfind(url.substr(1), 0) == 0);
-  }
-
   std::string getUrl() const {
     return this->url;
   }
@@ -145,18 +137,6 @@ class Location {
     return methodsVector;
   }
 
-  std::string getFirstExistingIndex(const std::string &path) const {
-    for (std::vector<std::string>::const_reverse_iterator it = index.rbegin(); it != index.rend(); ++it) {
-      std::ifstream f((path + *it).c_str());
-      if (!f.fail())
-        return *it;
-    }
-    std::map<HttpStatus, std::string>::const_iterator it = errorPage.find(NOT_FOUND);
-    if (it == errorPage.end())
-      return "";
-    return it->second; //
-  }
-
   std::vector<std::string> getMethodsVector() const {
     return setToVector(this->allowedMethods);
   }
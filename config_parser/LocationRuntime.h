@@ -0,0 +1,179 @@
+#pragma once
+#include "Location.h"
+#include "HttpMethod.h"
+#include "HttpStatus.h"
+#include "UpstreamConfig.h"
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+class UpstreamPool;
+class PreloadedSite;
+
+// What request handling needs of a Location, compiled once when the configuration is loaded: plain
+// values and flat arrays, looked up without building temporary strings. Location stays the parsed
+// form of the config file.
+struct LocationRuntime {
+  static const int ERROR_SLOTS = 4;
+
+  std::string url;
+  std::string root;
+  unsigned methods;                       // bit 1 << HttpMethod per allowed method
+  bool autoIndex;
+  std::vector<std::string> indexNames;    // in the order they are tried
+  std::vector<std::pair<std::string, std::string> > redirects; // file name -> replacement
+  std::vector<std::string> cgiExtensions; // ".py", compared against the end of the path
+  std::string cgiInterpreter;             // root + '/' + cgi_path
+  bool hasCgi;
+  std::vector<std::string> cgiEnvironment; // "NAME=value" the same for every run, set by the event loop
+  std::string errorResponses[ERROR_SLOTS]; // complete responses for 400, 404, 405 and 500
+  int stubStatus;
+  int metricsScope;
+  bool aioThreads;                        // file operations go to the worker pool when it runs
+  UpstreamConfig upstream;                // no servers: not proxied
+  std::string proxyUri;
+  bool hasProxyUri;
+  long proxyConnectTimeoutMillis;
+  long proxyReadTimeoutMillis;
+  UpstreamPool *proxyPool;                // bound by the event loop, NULL until then
+  long cgiCacheMillis;                    // -1: no cgi_cache
+  std::vector<std::string> cgiCacheVary;
+  long maxBodySize;                       // bytes of a request body, limit_size of the location or the server
+  const PreloadedSite *preload;           // `preload on`, owned by the Server; NULL: files come from the disk
+
+  LocationRuntime()
+      : methods(0), autoIndex(false), hasCgi(false), stubStatus(0), metricsScope(-1), aioThreads(false),
+        hasProxyUri(false), proxyConnectTimeoutMillis(0), proxyReadTimeoutMillis(0), proxyPool(NULL),
+        cgiCacheMillis(-1), maxBodySize(-1), preload(NULL) {}
+
+  // error responses are given by the caller: they need the status lines and the error page files
+  static LocationRuntime compile(const Location &location, const std::string errorResponses[ERROR_SLOTS]) {
+    LocationRuntime runtime;
+    runtime.url = location.url;
+    runtime.root = location.root;
+    for (std::set<HttpMethod>::const_iterator it = location.allowedMethods.begin();
+         it != location.allowedMethods.end(); ++it) {
+      runtime.methods |= 1u << *it;
+    }
+    runtime.autoIndex = location.autoIndex;
+    // the config reader keeps index names last to first
+    runtime.indexNames.assign(location.index.rbegin(), location.index.rend());
+    runtime.redirects = location.redirect;
+    runtime.cgiExtensions = location.cgiExt;
+    runtime.cgiInterpreter = location.root + '/' + location.cgiPath;
+    runtime.hasCgi = !location.cgiPath.empty() && !location.cgiExt.empty();
+    for (int i = 0; i < ERROR_SLOTS; ++i) {
+      runtime.errorResponses[i] = errorResponses[i];
+    }
+    runtime.stubStatus = location.stubStatus;
+    runtime.metricsScope = location.metricsScope;
+    runtime.aioThreads = location.aioThreads;
+    runtime.upstream = location.upstream;
+    runtime.proxyUri = location.proxyUri;
+    runtime.hasProxyUri = location.hasProxyUri;
+    runtime.proxyConnectTimeoutMillis = location.proxyConnectTimeoutMillis;
+    runtime.proxyReadTimeoutMillis = location.proxyReadTimeoutMillis;
+    runtime.cgiCacheMillis = location.cgiCacheMillis;
+    runtime.cgiCacheVary = location.cgiCacheVary;
+    runtime.maxBodySize = location.maxBodySize;
+    return runtime;
+  }
+
+  static int errorSlot(HttpStatus status) {
+    switch (status) {
+      case BAD_REQUEST:
+        return 0;
+      case NOT_FOUND:
+        return 1;
+      case NOT_ALLOWED:
+        return 2;
+      case INTERNAL_SERVER_ERROR:
+        return 3;
+      default:
+        return -1;
+    }
+  }
+
+  static HttpStatus slotStatus(int slot) {
+    static const HttpStatus statuses[ERROR_SLOTS] = {BAD_REQUEST, NOT_FOUND, NOT_ALLOWED, INTERNAL_SERVER_ERROR};
+    return statuses[slot];
+  }
+
+  bool allows(HttpMethod method) const {
+    return (methods & (1u << method)) != 0;
+  }
+
+  bool isProxy() const {
+    return !upstream.servers.empty();
+  }
+
+  // the path sent upstream: as requested, or with the location's url replaced by the uri of proxy_pass
+  std::string proxiedPath(const std::string &path) const {
+    if (!hasProxyUri) {
+      return path;
+    }
+    return proxyUri + path.substr(url.length() < path.length() ? url.length() : path.length());
+  }
+
+  bool isRoot() const {
+    return url.length() == 1 && url[0] == '/';
+  }
+
+  // the path without its first character starts with the url without its first character
+  bool matches(const std::string &path) const {
+    return !url.empty() && !path.empty() && path.length() >= url.length()
+        && path.compare(1, url.length() - 1, url, 1, url.length() - 1) == 0;
+  }
+
+  // the file a request path maps to, written to `out`, which keeps its capacity from one request to
+  // the next: root + path after the url, with the file name replaced when a redirect matches it.
+  // False when the path is not under this location.
+  bool mapPath(const std::string &path, std::string &out) const {
+    if (path.find(url) == std::string::npos) {
+      return false;
+    }
+    std::size_t lastSlash = path.find_last_of('/');
+    std::size_t nameStart = lastSlash + 1;
+    const std::string *redirect = NULL;
+    if (nameStart < path.length()) {
+      for (std::vector<std::pair<std::string, std::string> >::const_iterator it = redirects.begin();
+           it != redirects.end(); ++it) {
+        if (path.compare(nameStart, std::string::npos, it->first) == 0) {
+          redirect = &it->second;
+          break;
+        }
+      }
+    }
+    out.assign(root);
+    if (redirect == NULL) {
+      out.append(path, url.length() - 1, std::string::npos);
+    } else {
+      out.append(path, url.length() - 1, lastSlash);
+      out += '/';
+      out += *redirect;
+    }
+    return true;
+  }
+
+  bool isCgiScript(const std::string &path) const {
+    std::size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos) {
+      return false;
+    }
+    std::size_t length = path.length() - dot;
+    for (std::vector<std::string>::const_iterator it = cgiExtensions.begin(); it != cgiExtensions.end(); ++it) {
+      if (it->length() == length && memcmp(it->data(), path.data() + dot, length) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // empty for statuses without a prebuilt response
+  const std::string &errorResponse(HttpStatus status) const {
+    static const std::string none;
+    int slot = errorSlot(status);
+    return slot < 0 ? none : errorResponses[slot];
+  }
+};
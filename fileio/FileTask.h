@@ -0,0 +1,290 @@
+#pragma once
+#include "LocationRuntime.h"
+#include "HttpStatus.h"
+#include "CgiHandler.h"
+#include "Clock.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+class Client;
+
+// The filesystem part of a GET, POST or DELETE, self-contained so that it can run on a
+// FileWorkerPool thread while the event loop serves other connections: the loop fills in the
+// inputs, run() makes the blocking calls and sets the results, the loop builds the response.
+// A GET or POST of a CGI script runs the script, on the pool too.
+struct FileTask {
+  enum Operation {
+    READ,  // GET: the file, an index file, the autoindex listing of a directory or a CGI script's output
+    WRITE, // POST: upload, or the body given to a CGI script
+    REMOVE // DELETE
+  };
+
+  // inputs, set on the event loop; the pointers stay valid until the loop took the task back
+  Operation operation;
+  std::string path;               // file the request maps to
+  std::string queryString;        // split off the path, for a CGI script
+  const LocationRuntime *route;
+  const std::string *requestPath; // autoindex links
+  const std::string *requestBody; // WRITE
+  std::string serverAddress;      // "http://host:port", autoindex links
+  std::string remoteAddress;      // the client's, REMOTE_ADDR of a CGI script
+  std::size_t maxFileSize;
+  bool keepOpen; // READ: a regular file is left open for the caller to send, not read
+
+  // results
+  HttpStatus status;
+  std::string body;
+  long long cgiMicros; // wall time of the CGI script, -1 when none ran
+  int file;    // READ with keepOpen: the open file, owned by whoever takes it
+  std::size_t fileSize;
+
+  // owner and completion list of the pool
+  Client *client;
+  FileTask *next;
+
+ private:
+  // WEBSERV_FILE_DELAY=<path prefix>:<ms>, a slow disk under that prefix for latency tests
+  static std::string delayPrefix;
+  static long delayMillis;
+
+ public:
+  FileTask()
+      : operation(READ), route(NULL), requestPath(NULL), requestBody(NULL), maxFileSize(0), keepOpen(false),
+        status(OK), cgiMicros(-1), file(-1), fileSize(0), client(NULL), next(NULL) {}
+
+ private:
+  FileTask(const FileTask &task);
+  FileTask &operator=(const FileTask &task);
+
+ public:
+  static void configureFromEnvironment() {
+    const char *delay = getenv("WEBSERV_FILE_DELAY");
+    const char *colon = delay != NULL ? strrchr(delay, ':') : NULL;
+    if (colon != NULL) {
+      delayPrefix.assign(delay, colon - delay);
+      delayMillis = atol(colon + 1);
+    }
+  }
+
+  void run() {
+    body.clear();
+    cgiMicros = -1;
+    file = -1;
+    fileSize = 0;
+    if (delayMillis > 0 && path.compare(0, delayPrefix.length(), delayPrefix) == 0) {
+      struct timespec pause = {delayMillis / 1000, (delayMillis % 1000) * 1000000};
+      nanosleep(&pause, NULL);
+    }
+    if (operation == READ) {
+      read();
+    } else if (operation == WRITE) {
+      write();
+    } else {
+      remove();
+    }
+  }
+
+ private:
+  void read() {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat fileStat;
+    if (fd == -1 || fstat(fd, &fileStat) == -1) {
+      if (fd != -1) {
+        close(fd);
+      }
+      status = NOT_FOUND;
+      return;
+    }
+    if ((std::size_t) fileStat.st_size > maxFileSize) {
+      close(fd);
+      status = BAD_REQUEST;
+      return;
+    }
+    if (!S_ISDIR(fileStat.st_mode) && route->hasCgi && route->isCgiScript(path)) {
+      close(fd);
+      runScript();
+      return;
+    }
+    if (!S_ISDIR(fileStat.st_mode)) {
+      finishRead(fd, fileStat);
+      return;
+    }
+    close(fd);
+    if (route->autoIndex) {
+      listDirectory();
+      status = OK;
+      return;
+    }
+    // the index names are appended as they are, like the directory path was requested
+    std::size_t directoryLength = path.length();
+    for (std::vector<std::string>::const_iterator name = route->indexNames.begin();
+         name != route->indexNames.end(); ++name) {
+      path.resize(directoryLength);
+      path += *name;
+      fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd == -1) {
+        continue;
+      }
+      if (fstat(fd, &fileStat) != 0 || S_ISDIR(fileStat.st_mode)) {
+        close(fd);
+        status = INTERNAL_SERVER_ERROR;
+        return;
+      }
+      finishRead(fd, fileStat);
+      return;
+    }
+    body.clear();
+    status = NOT_FOUND;
+  }
+
+  void finishRead(int fd, const struct stat &fileStat) {
+    if (keepOpen) {
+      file = fd;
+      fileSize = (std::size_t) fileStat.st_size;
+      status = OK;
+      return;
+    }
+    bool complete = readWhole(fd, (std::size_t) fileStat.st_size);
+    close(fd);
+    status = complete ? OK : INTERNAL_SERVER_ERROR;
+  }
+
+  // reads a whole regular file into body, reusing its capacity
+  bool readWhole(int fd, std::size_t size) {
+    body.resize(size);
+    std::size_t done = 0;
+    while (done < size) {
+      ssize_t got = ::read(fd, &body[done], size - done);
+      if (got < 0 && errno == EINTR) {
+        continue;
+      }
+      if (got <= 0) {
+        break;
+      }
+      done += got;
+    }
+    body.resize(done);
+    return done == size;
+  }
+
+  void listDirectory() {
+    DIR *dir = opendir(path.c_str());
+    if (dir == NULL) {
+      return;
+    }
+    bool slash = !requestPath->empty() && (*requestPath)[requestPath->length() - 1] == '/';
+    body = "<!doctype html><html lang=\"en\"><head><meta charset=\"UTF-8\"><title>";
+    body += path;
+    body += "</title></head><body>";
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+      if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+        continue;
+      }
+      body += "<li><a href=\"";
+      body += serverAddress;
+      body += *requestPath;
+      if (!slash) {
+        body += '/';
+      }
+      body += ent->d_name;
+      body += "\">";
+      body += ent->d_name;
+      body += "</a></li>\n";
+    }
+    closedir(dir);
+    body += "</body></html>";
+  }
+
+  static bool isDirectory(const std::string &path) {
+    struct stat pathStat;
+    return stat(path.c_str(), &pathStat) == 0 && S_ISDIR(pathStat.st_mode);
+  }
+
+  void write() {
+    if (access(path.c_str(), R_OK) != 0) {
+      if (!isDirectory(path.substr(0, path.rfind('/')))) {
+        status = NOT_FOUND;
+        return;
+      }
+      writeWhole();
+      return;
+    }
+    if (isDirectory(path)) {
+      status = NOT_FOUND;
+    } else if (!route->hasCgi) {
+      status = BAD_REQUEST;
+    } else if (route->isCgiScript(path)) {
+      runScript();
+    } else {
+      writeWhole();
+    }
+  }
+
+  void writeWhole() {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    std::size_t done = 0;
+    while (fd != -1 && done < requestBody->length()) {
+      ssize_t written = ::write(fd, requestBody->data() + done, requestBody->length() - done);
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+      if (written <= 0) {
+        break;
+      }
+      done += written;
+    }
+    if (fd == -1 || close(fd) == -1 || done != requestBody->length()) {
+      status = INTERNAL_SERVER_ERROR;
+      return;
+    }
+    status = CREATED;
+    body = "<html>\n"
+           "  <body>\n"
+           "    <h1>File Created.</h1>\n"
+           "  </body>\n"
+           "</html>";
+  }
+
+  void runScript() {
+    static const std::string noBody;
+    CgiHandler cgi(route->cgiEnvironment, operation == READ ? GET : POST, operation == READ ? noBody : *requestBody,
+                   queryString, path, remoteAddress);
+    long long start = Clock::nowMicros();
+    try {
+      body = cgi.runScript(path, route->cgiInterpreter, status);
+    } catch (const std::exception &e) {
+      body.clear();
+      status = BAD_REQUEST;
+    }
+    cgiMicros = Clock::nowMicros() - start;
+  }
+
+  void remove() {
+    if (access(path.c_str(), R_OK) != 0 || ::remove(path.c_str()) != 0) {
+      status = NOT_FOUND;
+      return;
+    }
+    status = OK;
+    body = "HTTP/1.1 200 OK\n"
+           "<html>\n"
+           "  <body>\n"
+           "    <h1>File deleted.</h1>\n"
+           "  </body>\n"
+           "</html>";
+  }
+};
+
+std::string FileTask::delayPrefix;
+long FileTask::delayMillis = 0;
@@ -0,0 +1,185 @@
+#pragma once
+#include "FileTask.h"
+
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <cstdlib>
+#include <vector>
+
+// A fixed set of threads running FileTasks off the event loop. Submission goes through a bounded
+// queue under a mutex; finished tasks are pushed onto a lock-free list and announced on an eventfd
+// that the loop polls next to its sockets, so a slow disk only delays the requests that touch it.
+//
+//   loop:    submit(task) ... poll(eventFd) ... takeCompleted() -> build the responses
+//   workers: queue -> task->run() -> completed list -> eventfd
+class FileWorkerPool {
+ public:
+  static const int DEFAULT_THREADS = 4;
+  static const int MAX_THREADS = 64;
+  static const std::size_t QUEUE_PER_THREAD = 64;
+
+ private:
+  std::vector<pthread_t> threads;
+  pthread_mutex_t mutex;
+  pthread_cond_t queued;
+  std::vector<FileTask *> queue; // ring of submitted tasks not picked up yet
+  std::size_t queueHead;
+  std::size_t queueLength;
+  bool stopping;
+  FileTask *completed; // pushed by the workers, taken whole by the loop
+  int eventFd;
+
+ public:
+  FileWorkerPool() : queueHead(0), queueLength(0), stopping(false), completed(NULL), eventFd(-1) {
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&queued, NULL);
+  }
+
+  virtual ~FileWorkerPool() {
+    stop();
+    pthread_cond_destroy(&queued);
+    pthread_mutex_destroy(&mutex);
+  }
+
+ private:
+  FileWorkerPool(const FileWorkerPool &pool);
+  FileWorkerPool &operator=(const FileWorkerPool &pool);
+
+ public:
+  // WEBSERV_FILE_THREADS, 0 keeps the filesystem calls on the event loop
+  static int threadsFromEnvironment() {
+    const char *value = getenv("WEBSERV_FILE_THREADS");
+    if (value == NULL || *value == '\0') {
+      return DEFAULT_THREADS;
+    }
+    int count = atoi(value);
+    return count < 0 ? 0 : count > MAX_THREADS ? MAX_THREADS : count;
+  }
+
+  // false when not a single worker could be started: the caller runs the tasks itself
+  bool start(int count) {
+    if (count <= 0 || !threads.empty()) {
+      return !threads.empty();
+    }
+    eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eventFd == -1) {
+      return false;
+    }
+    queue.assign(count * QUEUE_PER_THREAD, NULL);
+    for (int i = 0; i < count; ++i) {
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, &FileWorkerPool::workerRoutine, this) != 0) {
+        break;
+      }
+      threads.push_back(thread);
+    }
+    if (threads.empty()) {
+      close(eventFd);
+      eventFd = -1;
+    }
+    return !threads.empty();
+  }
+
+  // lets the workers finish the queued tasks, then joins them
+  void stop() {
+    if (threads.empty()) {
+      return;
+    }
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_broadcast(&queued);
+    pthread_mutex_unlock(&mutex);
+    for (std::vector<pthread_t>::iterator it = threads.begin(); it != threads.end(); ++it) {
+      pthread_join(*it, NULL);
+    }
+    threads.clear();
+    close(eventFd);
+    eventFd = -1;
+  }
+
+  bool isRunning() const {
+    return !threads.empty();
+  }
+
+  int getEventFd() const {
+    return eventFd;
+  }
+
+  std::size_t getThreadCount() const {
+    return threads.size();
+  }
+
+  // false when the queue is full: the caller runs the task itself rather than waiting
+  bool submit(FileTask *task) {
+    pthread_mutex_lock(&mutex);
+    bool accepted = queueLength < queue.size();
+    if (accepted) {
+      queue[(queueHead + queueLength) % queue.size()] = task;
+      ++queueLength;
+      pthread_cond_signal(&queued);
+    }
+    pthread_mutex_unlock(&mutex);
+    return accepted;
+  }
+
+  // the tasks finished since the last call, oldest first, linked through `next`
+  FileTask *takeCompleted() {
+    uint64_t count;
+    // reset the eventfd before taking the list: a task pushed after this read signals it again
+    if (read(eventFd, &count, sizeof(count)) == -1) {
+      // EAGAIN: nothing announced, the list may still hold tasks of an earlier announcement
+    }
+    FileTask *task = __atomic_exchange_n(&completed, (FileTask *) NULL, __ATOMIC_ACQUIRE);
+    FileTask *ordered = NULL;
+    while (task != NULL) {
+      FileTask *next = task->next;
+      task->next = ordered;
+      ordered = task;
+      task = next;
+    }
+    return ordered;
+  }
+
+ private:
+  static void *workerRoutine(void *arg) {
+    FileWorkerPool *pool = static_cast<FileWorkerPool *>(arg);
+    FileTask *task;
+    while ((task = pool->take()) != NULL) {
+      task->run();
+      pool->complete(task);
+    }
+    return NULL;
+  }
+
+  // blocks until a task is queued; NULL once stopping and the queue is empty
+  FileTask *take() {
+    pthread_mutex_lock(&mutex);
+    while (queueLength == 0 && !stopping) {
+      pthread_cond_wait(&queued, &mutex);
+    }
+    FileTask *task = NULL;
+    if (queueLength != 0) {
+      task = queue[queueHead];
+      queueHead = (queueHead + 1) % queue.size();
+      --queueLength;
+    }
+    pthread_mutex_unlock(&mutex);
+    return task;
+  }
+
+  void complete(FileTask *task) {
+    FileTask *head = __atomic_load_n(&completed, __ATOMIC_RELAXED);
+    do {
+      task->next = head;
+    } while (!__atomic_compare_exchange_n(&completed, &head, task, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    // only the push onto an empty list signals: a non-empty one was announced and not taken yet
+    if (head == NULL) {
+      uint64_t one = 1;
+      if (write(eventFd, &one, sizeof(one)) == -1) {
+        // the counter cannot overflow at one write per announcement
+      }
+    }
+  }
+};
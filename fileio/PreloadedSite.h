@@ -0,0 +1,393 @@
+#pragma once
+#include "LocationRuntime.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// The files of a `preload` location, read once when the configuration is loaded: every response is
+// built ahead, status line, Content-Length, Content-Type and ETag followed by the file, in one
+// read-only mapping, and found through a perfect hash of the path. Serving one is a lookup and a
+// write of a range of the mapping. For sites that do not change while the server runs: a file
+// changed on disk is served as it was, one added is served from the disk like in any other location.
+//
+//   blob:  [path][200 head][file][304 head]  [path][200 head][file][304 head] ...
+//   index: bucket = hash % buckets, slot = hash(seeds[bucket]) % slots -> file
+class PreloadedSite {
+ public:
+  struct File {
+    std::size_t path;       // offsets into the blob and lengths
+    std::size_t pathLength;
+    std::size_t response;   // 200 head and the file
+    std::size_t responseLength;
+    std::size_t notModified;
+    std::size_t notModifiedLength;
+    std::size_t etag;       // within the 304 head
+    std::size_t etagLength;
+  };
+
+ private:
+  static const uint32_t EMPTY = 0xffffffffu;
+  static const uint32_t MAX_SEED = 1u << 24;
+
+  // a file found under the root, before it is packed
+  struct Pending {
+    std::string path;       // as requested, "/css/site.css"; "/css/" for an index file
+    std::string file;
+    std::size_t size;
+    time_t modified;
+    std::size_t alias;      // of an index file: the entry it shares the response of, `index` itself otherwise
+  };
+
+  char *blob;
+  std::size_t blobSize;
+  std::vector<File> files;
+  std::vector<uint32_t> seeds; // per bucket
+  std::vector<uint32_t> slots; // file index or EMPTY
+  std::size_t bytes;           // of the files themselves
+
+ public:
+  PreloadedSite() : blob(NULL), blobSize(0), bytes(0) {}
+
+  virtual ~PreloadedSite() {
+    if (blob != NULL) {
+      munmap(blob, blobSize);
+    }
+  }
+
+ private:
+  PreloadedSite(const PreloadedSite &site);
+  PreloadedSite &operator=(const PreloadedSite &site);
+
+ public:
+  // walks the root of the location; files over maxFileSize and CGI scripts stay on the disk.
+  // Throws std::runtime_error when the root cannot be read.
+  static PreloadedSite *load(const LocationRuntime &route, const std::map<std::string, std::string> &mime,
+                             std::size_t maxFileSize) {
+    std::vector<Pending> found;
+    walk(route, route.root, "/", maxFileSize, found);
+    std::sort(found.begin(), found.end(), byPath);
+    addIndexes(route, found);
+    PreloadedSite *site = new PreloadedSite();
+    try {
+      site->pack(found, mime);
+      site->index();
+    } catch (...) {
+      delete site;
+      throw;
+    }
+    return site;
+  }
+
+  // the path is the request path under the location's root, without the query string
+  const File *find(const char *path, std::size_t length) const {
+    if (files.empty()) {
+      return NULL;
+    }
+    uint64_t hash = hashOf(path, length);
+    uint32_t seed = seeds[mix(hash) % seeds.size()];
+    uint32_t index = slots[mix(hash + (seed + 1) * GOLDEN) % slots.size()];
+    if (index == EMPTY) {
+      return NULL;
+    }
+    const File &file = files[index];
+    if (file.pathLength != length || memcmp(blob + file.path, path, length) != 0) {
+      return NULL;
+    }
+    return &file;
+  }
+
+  const char *data(std::size_t offset) const {
+    return blob + offset;
+  }
+
+  // If-None-Match names the file's ETag, or is `*`
+  bool isNotModified(const File &file, const std::string &ifNoneMatch) const {
+    if (ifNoneMatch.empty()) {
+      return false;
+    }
+    return ifNoneMatch == "*" || ifNoneMatch.find(std::string(blob + file.etag, file.etagLength)) != std::string::npos;
+  }
+
+  std::size_t fileCount() const {
+    return files.size();
+  }
+
+  std::size_t fileBytes() const {
+    return bytes;
+  }
+
+  std::size_t mappedBytes() const {
+    return blobSize;
+  }
+
+ private:
+  static const uint64_t GOLDEN = 0x9e3779b97f4a7c15ULL;
+
+  static bool byPath(const Pending &a, const Pending &b) {
+    return a.path < b.path;
+  }
+
+  // FNV-1a over the path, once per lookup; the bucket and the slot are mixed from it
+  static uint64_t hashOf(const char *path, std::size_t length) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (std::size_t i = 0; i < length; ++i) {
+      hash ^= (unsigned char) path[i];
+      hash *= 0x100000001b3ULL;
+    }
+    return hash;
+  }
+
+  static uint64_t mix(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+  }
+
+  // symbolic links to files are followed, like open() does when serving; to directories they are not,
+  // so that a link cannot make the walk go round
+  static void walk(const LocationRuntime &route, const std::string &directory, const std::string &path,
+                   std::size_t maxFileSize, std::vector<Pending> &found) {
+    DIR *dir = opendir(directory.c_str());
+    if (dir == NULL) {
+      throw std::runtime_error("preload " + directory + ": " + strerror(errno));
+    }
+    std::vector<std::string> subdirectories;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      std::string name(entry->d_name);
+      if (name == "." || name == "..") {
+        continue;
+      }
+      // d_type saves a stat of the directories; file systems that leave it unknown get one
+      unsigned char type = entry->d_type;
+      struct stat target;
+      if (type == DT_UNKNOWN) {
+        if (fstatat(dirfd(dir), entry->d_name, &target, AT_SYMLINK_NOFOLLOW) != 0) {
+          continue;
+        }
+        type = S_ISDIR(target.st_mode) ? DT_DIR : S_ISLNK(target.st_mode) ? DT_LNK : DT_REG;
+      }
+      if (type == DT_DIR) {
+        subdirectories.push_back(name);
+        continue;
+      }
+      if ((type != DT_REG && type != DT_LNK) || fstatat(dirfd(dir), entry->d_name, &target, 0) != 0) {
+        continue;
+      }
+      std::string file = directory + (directory[directory.length() - 1] == '/' ? "" : "/") + name;
+      if (S_ISREG(target.st_mode) && (std::size_t) target.st_size <= maxFileSize
+          && !(route.hasCgi && route.isCgiScript(name))) {
+        Pending pending = {path + name, file, (std::size_t) target.st_size, target.st_mtime, found.size()};
+        found.push_back(pending);
+      }
+    }
+    closedir(dir);
+    for (std::vector<std::string>::iterator it = subdirectories.begin(); it != subdirectories.end(); ++it) {
+      walk(route, directory + (directory[directory.length() - 1] == '/' ? "" : "/") + *it, path + *it + "/",
+           maxFileSize, found);
+    }
+  }
+
+  // "/docs/" answers with the first index file of the directory, as the location does from the disk
+  static void addIndexes(const LocationRuntime &route, std::vector<Pending> &found) {
+    std::map<std::string, std::size_t> byPath;
+    for (std::size_t i = 0; i < found.size(); ++i) {
+      found[i].alias = i;
+      byPath[found[i].path] = i;
+    }
+    std::size_t count = found.size();
+    for (std::size_t i = 0; i < count; ++i) {
+      std::string directory = found[i].path.substr(0, found[i].path.rfind('/') + 1);
+      if (byPath.count(directory) != 0) {
+        continue;
+      }
+      for (std::vector<std::string>::const_iterator name = route.indexNames.begin();
+           name != route.indexNames.end(); ++name) {
+        std::map<std::string, std::size_t>::iterator index = byPath.find(directory + *name);
+        if (index != byPath.end()) {
+          Pending alias = found[index->second];
+          alias.path = directory;
+          alias.alias = index->second;
+          byPath[directory] = found.size();
+          found.push_back(alias);
+          break;
+        }
+      }
+    }
+  }
+
+  static std::string contentType(const std::string &path, const std::map<std::string, std::string> &mime) {
+    std::size_t dot = path.find_last_of('.');
+    std::map<std::string, std::string>::const_iterator it = mime.end();
+    if (dot != std::string::npos && dot > path.rfind('/')) {
+      it = mime.find(path.substr(dot));
+    }
+    if (it == mime.end()) {
+      it = mime.find(".html");
+    }
+    return it != mime.end() ? it->second : "text/html";
+  }
+
+  // the heads of all files first, for the size of the mapping, then the mapping filled and sealed
+  void pack(const std::vector<Pending> &found, const std::map<std::string, std::string> &mime) {
+    std::vector<std::string> heads(found.size());
+    std::vector<std::string> notModifiedHeads(found.size());
+    std::vector<std::string> etags(found.size());
+    std::size_t total = 0;
+    for (std::size_t i = 0; i < found.size(); ++i) {
+      const Pending &file = found[i];
+      total += file.path.length();
+      if (file.alias != i) {
+        continue;
+      }
+      std::ostringstream etag;
+      etag << '"' << std::hex << (long) file.modified << '-' << file.size << '"';
+      etags[i] = etag.str();
+      std::ostringstream head;
+      head << "HTTP/1.1 200 OK\r\nContent-Length: " << file.size << "\r\nContent-Type: "
+           << contentType(file.path, mime) << "\r\nETag: " << etags[i] << "\r\nConnection: close\r\n\r\n";
+      heads[i] = head.str();
+      notModifiedHeads[i] = "HTTP/1.1 304 Not Modified\r\nETag: " + etags[i] + "\r\nConnection: close\r\n\r\n";
+      total += heads[i].length() + file.size + notModifiedHeads[i].length();
+    }
+    if (total == 0) {
+      return;
+    }
+    void *mapping = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+      throw std::runtime_error(std::string("preload: mmap: ") + strerror(errno));
+    }
+    blob = (char *) mapping;
+    blobSize = total;
+    madvise(blob, blobSize, MADV_HUGEPAGE);
+    files.resize(found.size());
+    std::size_t offset = 0;
+    for (std::size_t i = 0; i < found.size(); ++i) {
+      const Pending &file = found[i];
+      File &packed = files[i];
+      packed.path = append(offset, file.path.data(), file.path.length());
+      packed.pathLength = file.path.length();
+      if (file.alias != i) {
+        continue;
+      }
+      packed.response = append(offset, heads[i].data(), heads[i].length());
+      readFile(file, offset);
+      packed.responseLength = heads[i].length() + file.size;
+      packed.notModified = append(offset, notModifiedHeads[i].data(), notModifiedHeads[i].length());
+      packed.notModifiedLength = notModifiedHeads[i].length();
+      packed.etag = packed.notModified + notModifiedHeads[i].find('"');
+      packed.etagLength = etags[i].length();
+      bytes += file.size;
+    }
+    // aliases come after the files they share the response of
+    for (std::size_t i = 0; i < found.size(); ++i) {
+      if (found[i].alias != i) {
+        std::size_t path = files[i].path;
+        files[i] = files[found[i].alias];
+        files[i].path = path;
+        files[i].pathLength = found[i].path.length();
+      }
+    }
+    mprotect(blob, blobSize, PROT_READ);
+  }
+
+  std::size_t append(std::size_t &offset, const char *data, std::size_t length) {
+    memcpy(blob + offset, data, length);
+    offset += length;
+    return offset - length;
+  }
+
+  void readFile(const Pending &file, std::size_t &offset) {
+    int fd = open(file.file.c_str(), O_RDONLY | O_CLOEXEC);
+    std::size_t done = 0;
+    while (fd != -1 && done < file.size) {
+      ssize_t bytesRead = read(fd, blob + offset + done, file.size - done);
+      if (bytesRead < 0 && errno == EINTR) {
+        continue;
+      }
+      if (bytesRead <= 0) {
+        break;
+      }
+      done += bytesRead;
+    }
+    if (fd != -1) {
+      close(fd);
+    }
+    if (done != file.size) {
+      throw std::runtime_error("preload " + file.file + ": could not be read whole");
+    }
+    offset += file.size;
+  }
+
+  // hash and displace: the buckets, largest first, each get the first seed that puts all their paths
+  // in free slots. With a fifth of the slots left free a seed is found after a few tries.
+  void index() {
+    if (files.empty()) {
+      return;
+    }
+    std::size_t count = files.size();
+    std::size_t bucketCount = count / 3 + 1;
+    seeds.assign(bucketCount, 0);
+    slots.assign(count + count / 4 + 1, EMPTY);
+    std::vector<uint64_t> hashes(count);
+    std::vector<std::vector<uint32_t> > buckets(bucketCount);
+    for (std::size_t i = 0; i < count; ++i) {
+      hashes[i] = hashOf(blob + files[i].path, files[i].pathLength);
+      buckets[mix(hashes[i]) % bucketCount].push_back((uint32_t) i);
+    }
+    std::vector<std::pair<std::size_t, std::size_t> > order; // size, bucket
+    for (std::size_t i = 0; i < bucketCount; ++i) {
+      if (!buckets[i].empty()) {
+        order.push_back(std::make_pair(buckets[i].size(), i));
+      }
+    }
+    std::sort(order.rbegin(), order.rend());
+    std::vector<std::size_t> taken;
+    for (std::size_t i = 0; i < order.size(); ++i) {
+      const std::vector<uint32_t> &bucket = buckets[order[i].second];
+      uint32_t seed = 0;
+      while (!place(bucket, hashes, seed, taken)) {
+        if (++seed == MAX_SEED) {
+          throw std::runtime_error("preload: no perfect hash for the paths");
+        }
+      }
+      seeds[order[i].second] = seed;
+    }
+  }
+
+  bool place(const std::vector<uint32_t> &bucket, const std::vector<uint64_t> &hashes, uint32_t seed,
+             std::vector<std::size_t> &taken) {
+    taken.clear();
+    for (std::size_t i = 0; i < bucket.size(); ++i) {
+      std::size_t slot = mix(hashes[bucket[i]] + (seed + 1) * GOLDEN) % slots.size();
+      if (slots[slot] != EMPTY || std::find(taken.begin(), taken.end(), slot) != taken.end()) {
+        return false;
+      }
+      taken.push_back(slot);
+    }
+    for (std::size_t i = 0; i < bucket.size(); ++i) {
+      slots[taken[i]] = bucket[i];
+    }
+    return true;
+  }
+};
+
+const uint32_t PreloadedSite::EMPTY;
+const uint32_t PreloadedSite::MAX_SEED;
+const uint64_t PreloadedSite::GOLDEN;
@@ -0,0 +1,298 @@
+#pragma once
+#include "HpackHuffman.h"
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <utility>
+
+typedef std::vector<std::pair<std::string, std::string> > HpackHeaders;
+
+// Header table of HPACK (RFC 7541): the 61 static entries, then the dynamic ones, newest first.
+// An entry costs its name and value plus 32 bytes; adding one evicts the oldest until it fits.
+class HpackTable {
+ public:
+  static const std::size_t STATIC_ENTRIES = 61;
+  static const std::size_t ENTRY_OVERHEAD = 32;
+  static const std::size_t DEFAULT_SIZE = 4096;
+
+ private:
+  static const char *const STATIC_TABLE[STATIC_ENTRIES][2];
+
+  std::deque<std::pair<std::string, std::string> > entries;
+  std::size_t size;
+  std::size_t maxSize;
+
+ public:
+  HpackTable() : size(0), maxSize(DEFAULT_SIZE) {}
+
+  std::size_t getMaxSize() const {
+    return maxSize;
+  }
+
+  void setMaxSize(std::size_t max) {
+    maxSize = max;
+    evict(0);
+  }
+
+  // entry `index`, 1-based over both tables; false when there is none
+  bool get(std::size_t index, std::string &name, std::string &value) const {
+    if (index >= 1 && index <= STATIC_ENTRIES) {
+      name = STATIC_TABLE[index - 1][0];
+      value = STATIC_TABLE[index - 1][1];
+      return true;
+    }
+    if (index > STATIC_ENTRIES && index - STATIC_ENTRIES <= entries.size()) {
+      name = entries[index - STATIC_ENTRIES - 1].first;
+      value = entries[index - STATIC_ENTRIES - 1].second;
+      return true;
+    }
+    return false;
+  }
+
+  // index of the entry with that name and value, 0 when there is none; `nameIndex` is that of the
+  // first entry with the name, 0 when there is none either
+  std::size_t find(const std::string &name, const std::string &value, std::size_t &nameIndex) const {
+    nameIndex = 0;
+    for (std::size_t i = 0; i < STATIC_ENTRIES; ++i) {
+      if (name == STATIC_TABLE[i][0]) {
+        if (value == STATIC_TABLE[i][1]) {
+          return i + 1;
+        }
+        nameIndex = nameIndex == 0 ? i + 1 : nameIndex;
+      }
+    }
+    for (std::size_t i = 0; i < entries.size(); ++i) {
+      if (entries[i].first == name) {
+        if (entries[i].second == value) {
+          return STATIC_ENTRIES + i + 1;
+        }
+        nameIndex = nameIndex == 0 ? STATIC_ENTRIES + i + 1 : nameIndex;
+      }
+    }
+    return 0;
+  }
+
+  void add(const std::string &name, const std::string &value) {
+    std::size_t entrySize = name.length() + value.length() + ENTRY_OVERHEAD;
+    evict(entrySize);
+    if (entrySize <= maxSize) {
+      entries.push_front(std::make_pair(name, value));
+      size += entrySize;
+    }
+  }
+
+ private:
+  // oldest entries out until `room` more bytes fit; all of them when it does not fit at all
+  void evict(std::size_t room) {
+    while (!entries.empty() && size + room > maxSize) {
+      size -= entries.back().first.length() + entries.back().second.length() + ENTRY_OVERHEAD;
+      entries.pop_back();
+    }
+  }
+};
+
+const char *const HpackTable::STATIC_TABLE[HpackTable::STATIC_ENTRIES][2] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"}, {":path", "/index.html"},
+    {":scheme", "http"}, {":scheme", "https"}, {":status", "200"}, {":status", "204"}, {":status", "206"},
+    {":status", "304"}, {":status", "400"}, {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""},
+    {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""}, {"authorization", ""},
+    {"cache-control", ""}, {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""},
+    {"content-length", ""}, {"content-location", ""}, {"content-range", ""}, {"content-type", ""},
+    {"cookie", ""}, {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""},
+    {"if-match", ""}, {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+    {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""}, {"location", ""}, {"max-forwards", ""},
+    {"proxy-authenticate", ""}, {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""},
+    {"retry-after", ""}, {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""}, {"www-authenticate", ""}};
+
+// Decoder of the header blocks of one connection. Its table follows the peer's encoder, so every
+// block has to be decoded, in order, even those of streams that are refused.
+class HpackDecoder {
+  HpackTable table;
+  std::size_t maxTableSize; // what our SETTINGS_HEADER_TABLE_SIZE allows the peer
+  std::size_t maxListSize;  // decoded names and values plus 32 bytes each, SETTINGS_MAX_HEADER_LIST_SIZE
+
+ public:
+  HpackDecoder(std::size_t maxListSize)
+      : maxTableSize(HpackTable::DEFAULT_SIZE), maxListSize(maxListSize) {}
+
+  // false on a compression error, which leaves the table out of step with the peer's: the connection
+  // cannot go on
+  bool decode(const std::string &block, HpackHeaders &headers) {
+    const unsigned char *data = (const unsigned char *) block.data();
+    std::size_t length = block.length();
+    std::size_t pos = 0;
+    std::size_t listSize = 0;
+    bool fieldSeen = false;
+    while (pos < length) {
+      unsigned char first = data[pos];
+      std::string name;
+      std::string value;
+      unsigned long long index;
+      if (first & 0x80) { // indexed field
+        if (!readInteger(data, length, pos, 7, index) || !table.get((std::size_t) index, name, value)) {
+          return false;
+        }
+      } else if ((first & 0xe0) == 0x20) { // dynamic table size update, before the fields only
+        if (fieldSeen || !readInteger(data, length, pos, 5, index) || index > maxTableSize) {
+          return false;
+        }
+        table.setMaxSize((std::size_t) index);
+        continue;
+      } else { // literal: with incremental indexing (01), without (0000) or never indexed (0001)
+        bool indexing = (first & 0xc0) == 0x40;
+        if (!readInteger(data, length, pos, indexing ? 6 : 4, index)) {
+          return false;
+        }
+        if (index != 0 && !table.get((std::size_t) index, name, value)) {
+          return false;
+        }
+        if ((index == 0 && !readString(data, length, pos, name)) || !readString(data, length, pos, value)) {
+          return false;
+        }
+        if (indexing) {
+          table.add(name, value);
+        }
+      }
+      fieldSeen = true;
+      listSize += name.length() + value.length() + HpackTable::ENTRY_OVERHEAD;
+      if (listSize > maxListSize) {
+        return false;
+      }
+      headers.push_back(std::make_pair(name, value));
+    }
+    return true;
+  }
+
+ private:
+  // an integer with an N-bit prefix; false when it runs past the block or over 2^32
+  static bool readInteger(const unsigned char *data, std::size_t length, std::size_t &pos, int prefixBits,
+                          unsigned long long &value) {
+    unsigned mask = (1U << prefixBits) - 1;
+    value = data[pos++] & mask;
+    if (value < mask) {
+      return true;
+    }
+    int shift = 0;
+    while (pos < length) {
+      unsigned char byte = data[pos++];
+      value += (unsigned long long) (byte & 0x7f) << shift;
+      if (value > 0xffffffffULL) {
+        return false;
+      }
+      if ((byte & 0x80) == 0) {
+        return true;
+      }
+      shift += 7;
+      if (shift > 28) {
+        return false;
+      }
+    }
+    return false;
+  }
+
+  static bool readString(const unsigned char *data, std::size_t length, std::size_t &pos, std::string &out) {
+    if (pos >= length) {
+      return false;
+    }
+    bool huffman = (data[pos] & 0x80) != 0;
+    unsigned long long stringLength;
+    if (!readInteger(data, length, pos, 7, stringLength) || stringLength > length - pos) {
+      return false;
+    }
+    const unsigned char *start = data + pos;
+    pos += (std::size_t) stringLength;
+    out.clear();
+    if (huffman) {
+      return HpackHuffman::decode(start, (std::size_t) stringLength, out);
+    }
+    out.assign((const char *) start, (std::size_t) stringLength);
+    return true;
+  }
+};
+
+// Encoder of the header blocks one side sends. A field found in the table goes out as its index;
+// the others are literals, Huffman-coded when that is shorter, and added to the table unless their
+// values rarely repeat (lengths, dates, paths) or must not be kept (cookies, credentials).
+class HpackEncoder {
+  HpackTable table;
+  std::size_t pendingSize; // table size the peer allowed, announced at the start of the next block
+  bool sizeChanged;
+
+ public:
+  HpackEncoder() : pendingSize(HpackTable::DEFAULT_SIZE), sizeChanged(false) {}
+
+  // the peer's SETTINGS_HEADER_TABLE_SIZE; the table does not grow past the default
+  void setMaxSize(std::size_t max) {
+    pendingSize = max < HpackTable::DEFAULT_SIZE ? max : HpackTable::DEFAULT_SIZE;
+    sizeChanged = pendingSize != table.getMaxSize();
+  }
+
+  void encode(const HpackHeaders &headers, std::string &out) {
+    if (sizeChanged) {
+      table.setMaxSize(pendingSize);
+      writeInteger(out, 0x20, 5, pendingSize);
+      sizeChanged = false;
+    }
+    for (HpackHeaders::const_iterator it = headers.begin(); it != headers.end(); ++it) {
+      std::size_t nameIndex;
+      std::size_t index = table.find(it->first, it->second, nameIndex);
+      if (index != 0) {
+        writeInteger(out, 0x80, 7, index);
+        continue;
+      }
+      bool sensitive = isSensitive(it->first);
+      bool indexing = !sensitive && !changesOften(it->first);
+      if (indexing) {
+        writeInteger(out, 0x40, 6, nameIndex);
+      } else {
+        writeInteger(out, sensitive ? 0x10 : 0x00, 4, nameIndex);
+      }
+      if (nameIndex == 0) {
+        writeString(out, it->first);
+      }
+      writeString(out, it->second);
+      if (indexing) {
+        table.add(it->first, it->second);
+      }
+    }
+  }
+
+ private:
+  static bool isSensitive(const std::string &name) {
+    return name == "authorization" || name == "proxy-authorization" || name == "cookie" || name == "set-cookie";
+  }
+
+  static bool changesOften(const std::string &name) {
+    return name == "content-length" || name == "date" || name == "last-modified" || name == "etag"
+        || name == ":path" || name == "location" || name == "content-range";
+  }
+
+  static void writeInteger(std::string &out, unsigned char pattern, int prefixBits, std::size_t value) {
+    std::size_t mask = (1U << prefixBits) - 1;
+    if (value < mask) {
+      out += (char) (pattern | value);
+      return;
+    }
+    out += (char) (pattern | mask);
+    value -= mask;
+    while (value >= 0x80) {
+      out += (char) (0x80 | (value & 0x7f));
+      value >>= 7;
+    }
+    out += (char) value;
+  }
+
+  static void writeString(std::string &out, const std::string &text) {
+    std::size_t huffmanLength = HpackHuffman::encodedLength(text);
+    if (huffmanLength < text.length()) {
+      writeInteger(out, 0x80, 7, huffmanLength);
+      HpackHuffman::encode(text, out);
+    } else {
+      writeInteger(out, 0x00, 7, text.length());
+      out += text;
+    }
+  }
+};
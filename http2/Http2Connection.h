@@ -0,0 +1,964 @@
+#pragma once
+#include "Hpack.h"
+#include "Http2Frame.h"
+#include "Transport.h"
+
+#include <sys/types.h>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <deque>
+#include <map>
+#include <string>
+
+// `http2 on|off` and `http2_max_streams <n>` of a server block
+struct Http2Config {
+  static const int DEFAULT_MAX_STREAMS = 128;
+
+  bool enabled;
+  int maxStreams; // open streams of a connection, SETTINGS_MAX_CONCURRENT_STREAMS
+
+  Http2Config() : enabled(false), maxStreams(DEFAULT_MAX_STREAMS) {}
+};
+
+class Http2StreamTransport;
+
+// Server side of one HTTP/2 connection (RFC 9113), from the connection preface on. It owns no socket:
+// the event loop feeds it what the client's transport read with receive(), writes out what output()
+// holds and tells it with sent().
+//
+// A stream whose request is complete (END_STREAM) is ready: the loop takes it with takeReady() and
+// serves it as a client of its own, on an Http2StreamTransport. That client reads the request as
+// HTTP/1.1 and writes its response as HTTP/1.1, as any other client does, so every handler and
+// Location works unchanged; the connection turns the response into HEADERS, through HPACK, and DATA
+// frames. Response bodies are kept by their stream until the flow control windows let them out;
+// produce() frames them in the order of their priority (RFC 9218): the lowest urgency first, then
+// non-incremental streams one after the other, then incremental ones taking turns.
+class Http2Connection {
+ public:
+  static const long long RECEIVE_WINDOW = 1048576;  // of the connection and of every stream
+  static const std::size_t MAX_HEADER_LIST = 65536;  // decoded, and the encoded block across CONTINUATIONs
+  static const std::size_t OUTPUT_LIMIT = 65536;     // framed ahead of what the socket took
+  static const std::size_t RESPONSE_HEAD_LIMIT = 65536;
+  static const int DEFAULT_URGENCY = 3;
+  static const std::size_t PREFACE_DECISION = 4;
+
+ private:
+  enum ChunkState {
+    CHUNK_SIZE, // the size line
+    CHUNK_DATA,
+    CHUNK_END,  // CRLF after the data
+    CHUNKS_DONE // trailers and anything after them are dropped
+  };
+
+  struct Stream {
+    // request
+    HpackHeaders headers;
+    std::string body;
+    unsigned long long bodyLength; // what came; past maxBodySize the stream is answered 413
+    bool requestEnded;
+    std::string request;           // HTTP/1.1 head and body once ready, read by the stream's client
+    std::size_t requestOffset;
+    long long receiveWindow;
+    // response
+    std::string response;          // HTTP/1.1 bytes from the client not framed yet
+    bool headersSent;
+    bool chunked;
+    ChunkState chunkState;
+    long long chunkLeft;
+    std::string data;              // body bytes waiting for DATA frames
+    std::size_t dataOffset;
+    bool responseEnded;            // the stream's client closed its transport
+    bool finished;                 // END_STREAM or RST_STREAM went out, or RST_STREAM came in
+    long long sendWindow;
+    int urgency;
+    bool incremental;
+    unsigned long long turn;       // when it last sent, incremental streams take turns by it
+    Http2StreamTransport *transport;
+
+    Stream()
+        : bodyLength(0), requestEnded(false), requestOffset(0), receiveWindow(RECEIVE_WINDOW), headersSent(false),
+          chunked(false), chunkState(CHUNK_SIZE), chunkLeft(0), dataOffset(0), responseEnded(false),
+          finished(false), sendWindow(Http2Frame::DEFAULT_WINDOW), urgency(DEFAULT_URGENCY), incremental(false),
+          turn(0), transport(NULL) {}
+  };
+
+  int maxStreams;
+  std::size_t maxBodySize; // the largest limit_size of the server's locations
+  HpackDecoder decoder;
+  HpackEncoder encoder;
+  std::string input;
+  bool prefaceDone;
+  bool settingsSeen;
+  std::string output;
+  std::size_t outputOffset;
+  std::map<unsigned, Stream> streams; // open ones, and finished ones whose client is still attached
+  std::size_t openStreams;
+  std::deque<unsigned> ready;
+  unsigned lastStreamId;
+  unsigned headerStream; // the HEADERS whose CONTINUATION frames are expected, 0: none
+  std::string headerBlock;
+  bool headerEndStream;
+  bool headerNewStream;  // the block opens a stream, rather than ending one or being for a closed one
+  long long sendWindow;
+  long long receiveWindow;
+  long long peerInitialWindow;
+  std::size_t peerMaxFrame;
+  unsigned long long turns;
+  bool goAwaySent;
+  bool goAwayReceived;
+  bool failed; // a connection error went out with GOAWAY, the input is ignored from then on
+
+ public:
+  Http2Connection(const Http2Config &config, std::size_t maxBodySize)
+      : maxStreams(config.maxStreams), maxBodySize(maxBodySize), decoder(MAX_HEADER_LIST), prefaceDone(false),
+        settingsSeen(false), outputOffset(0), openStreams(0), lastStreamId(0), headerStream(0),
+        headerEndStream(false), headerNewStream(false), sendWindow(Http2Frame::DEFAULT_WINDOW),
+        receiveWindow(RECEIVE_WINDOW), peerInitialWindow(Http2Frame::DEFAULT_WINDOW),
+        peerMaxFrame(Http2Frame::DEFAULT_MAX_FRAME), turns(0), goAwaySent(false), goAwayReceived(false),
+        failed(false) {
+    std::string settings;
+    Http2Frame::appendSetting(settings, Http2Frame::MAX_CONCURRENT_STREAMS, (unsigned) maxStreams);
+    Http2Frame::appendSetting(settings, Http2Frame::INITIAL_WINDOW_SIZE, (unsigned) RECEIVE_WINDOW);
+    Http2Frame::appendSetting(settings, Http2Frame::MAX_HEADER_LIST_SIZE, (unsigned) MAX_HEADER_LIST);
+    Http2Frame::appendSetting(settings, Http2Frame::ENABLE_PUSH, 0);
+    Http2Frame::appendSetting(settings, Http2Frame::NO_RFC7540_PRIORITIES, 1);
+    Http2Frame::append(output, Http2Frame::SETTINGS, 0, 0, settings.data(), settings.length());
+    Http2Frame::appendWindowUpdate(output, 0, (unsigned) (RECEIVE_WINDOW - Http2Frame::DEFAULT_WINDOW));
+  }
+
+  ~Http2Connection();
+
+ private:
+  Http2Connection(const Http2Connection &connection);
+  Http2Connection &operator=(const Http2Connection &connection);
+
+ public:
+  // the client's connection starts with HTTP/2's preface, or with as much of it as `length` bytes hold;
+  // PREFACE_DECISION bytes ("PRI ") tell it from any HTTP/1 request
+  static bool startsWithPreface(const char *data, std::size_t length) {
+    std::size_t compared = length < Http2Frame::PREFACE_LENGTH ? length : Http2Frame::PREFACE_LENGTH;
+    return compared >= PREFACE_DECISION && memcmp(data, Http2Frame::PREFACE, compared) == 0;
+  }
+
+  // bytes of the connection as they come, the preface included
+  void receive(const char *data, std::size_t length) {
+    if (failed) {
+      return;
+    }
+    input.append(data, length);
+    std::size_t pos = 0;
+    if (!prefaceDone) {
+      std::size_t compared = input.length() < Http2Frame::PREFACE_LENGTH ? input.length() : Http2Frame::PREFACE_LENGTH;
+      if (memcmp(input.data(), Http2Frame::PREFACE, compared) != 0) {
+        fail(Http2Frame::PROTOCOL_ERROR);
+        return;
+      }
+      if (compared < Http2Frame::PREFACE_LENGTH) {
+        return;
+      }
+      prefaceDone = true;
+      pos = Http2Frame::PREFACE_LENGTH;
+    }
+    while (!failed && input.length() - pos >= Http2Frame::HEADER_LENGTH) {
+      const unsigned char *header = (const unsigned char *) input.data() + pos;
+      Http2Frame frame = Http2Frame::parse(header);
+      if (frame.length > Http2Frame::DEFAULT_MAX_FRAME) {
+        fail(Http2Frame::FRAME_SIZE_ERROR);
+        break;
+      }
+      if (input.length() - pos - Http2Frame::HEADER_LENGTH < frame.length) {
+        break;
+      }
+      handleFrame(frame, header + Http2Frame::HEADER_LENGTH);
+      pos += Http2Frame::HEADER_LENGTH + frame.length;
+    }
+    if (failed) {
+      input.clear();
+    } else {
+      input.erase(0, pos);
+    }
+  }
+
+  // a stream whose request is complete, to be served; false when there is none
+  bool takeReady(unsigned &id) {
+    while (!ready.empty()) {
+      id = ready.front();
+      ready.pop_front();
+      std::map<unsigned, Stream>::iterator it = streams.find(id);
+      if (it != streams.end() && !it->second.finished) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // frames the response bodies the windows let out, until OUTPUT_LIMIT bytes wait for the socket
+  void produce() {
+    while (!failed && output.length() - outputOffset < OUTPUT_LIMIT) {
+      std::map<unsigned, Stream>::iterator next = nextToSend();
+      if (next == streams.end()) {
+        return;
+      }
+      Stream &stream = next->second;
+      std::size_t length = stream.data.length() - stream.dataOffset;
+      length = length < peerMaxFrame ? length : peerMaxFrame;
+      length = (long long) length < sendWindow ? length : (std::size_t) sendWindow;
+      length = (long long) length < stream.sendWindow ? length : (std::size_t) stream.sendWindow;
+      bool last = stream.responseEnded && stream.dataOffset + length == stream.data.length();
+      Http2Frame::append(output, Http2Frame::DATA, last ? Http2Frame::END_STREAM : 0, next->first,
+                         stream.data.data() + stream.dataOffset, length);
+      sendWindow -= length;
+      stream.sendWindow -= length;
+      stream.dataOffset += length;
+      stream.turn = ++turns;
+      if (stream.dataOffset == stream.data.length()) {
+        stream.data.clear();
+        stream.dataOffset = 0;
+      }
+      if (last) {
+        finish(next);
+      }
+    }
+  }
+
+  bool hasOutput() const {
+    return outputOffset < output.length();
+  }
+
+  const char *outputData() const {
+    return output.data() + outputOffset;
+  }
+
+  std::size_t outputLength() const {
+    return output.length() - outputOffset;
+  }
+
+  void sent(std::size_t length) {
+    outputOffset += length;
+    if (outputOffset == output.length()) {
+      output.clear();
+      outputOffset = 0;
+    } else if (outputOffset >= OUTPUT_LIMIT) {
+      output.erase(0, outputOffset);
+      outputOffset = 0;
+    }
+  }
+
+  // graceful shutdown: the streams started so far are served, no new ones are taken
+  void goAway() {
+    if (!goAwaySent && !failed) {
+      appendGoAway(Http2Frame::NO_ERROR);
+      goAwaySent = true;
+    }
+  }
+
+  // nothing left to do on the connection: it failed, or its streams are done after a GOAWAY either
+  // way, and the last frames went out
+  bool isDone() const {
+    return (failed || ((goAwaySent || goAwayReceived) && openStreams == 0)) && !hasOutput();
+  }
+
+  // the side of a stream's client ----------------------------------------------------------------------
+
+  void attach(unsigned id, Http2StreamTransport *transport) {
+    std::map<unsigned, Stream>::iterator it = streams.find(id);
+    if (it != streams.end()) {
+      it->second.transport = transport;
+    }
+  }
+
+  // the client of the stream is gone; the stream stays until its response is out
+  void detach(unsigned id) {
+    std::map<unsigned, Stream>::iterator it = streams.find(id);
+    if (it == streams.end()) {
+      return;
+    }
+    if (!it->second.responseEnded) {
+      endResponse(id);
+    }
+    it->second.transport = NULL;
+    if (it->second.finished) {
+      streams.erase(it);
+    }
+  }
+
+  ssize_t readRequest(unsigned id, char *buf, std::size_t length) {
+    std::map<unsigned, Stream>::iterator it = streams.find(id);
+    if (it == streams.end() || it->second.finished) {
+      return 0; // reset: the client closes
+    }
+    Stream &stream = it->second;
+    std::size_t available = stream.request.length() - stream.requestOffset;
+    if (available == 0) {
+      errno = EAGAIN;
+      return -1;
+    }
+    length = length < available ? length : available;
+    memcpy(buf, stream.request.data() + stream.requestOffset, length);
+    stream.requestOffset += length;
+    if (stream.requestOffset == stream.request.length()) {
+      std::string().swap(stream.request);
+      stream.requestOffset = 0;
+    }
+    return (ssize_t) length;
+  }
+
+  bool isRequestReadable(unsigned id) const {
+    std::map<unsigned, Stream>::const_iterator it = streams.find(id);
+    return it == streams.end() || it->second.finished || it->second.requestOffset < it->second.request.length();
+  }
+
+  // the response of the stream's client as HTTP/1.1; all of it is taken and kept until it can be sent
+  ssize_t writeResponse(unsigned id, const char *buf, std::size_t length) {
+    std::map<unsigned, Stream>::iterator it = streams.find(id);
+    if (it == streams.end() || it->second.finished || it->second.responseEnded) {
+      errno = EPIPE;
+      return -1;
+    }
+    it->second.response.append(buf, length);
+    convertResponse(it);
+    return (ssize_t) length;
+  }
+
+  // a response that did not even have its head complete is a failed stream
+  void endResponse(unsigned id) {
+    std::map<unsigned, Stream>::iterator it = streams.find(id);
+    if (it == streams.end() || it->second.finished || it->second.responseEnded) {
+      return;
+    }
+    it->second.responseEnded = true;
+    if (!it->second.headersSent) {
+      resetStream(it, Http2Frame::INTERNAL_ERROR);
+    }
+  }
+
+ private:
+  // frames -------------------------------------------------------------------------------------------
+
+  void handleFrame(const Http2Frame &frame, const unsigned char *payload) {
+    if (headerStream != 0 && (frame.type != Http2Frame::CONTINUATION || frame.streamId != headerStream)) {
+      fail(Http2Frame::PROTOCOL_ERROR);
+      return;
+    }
+    if (!settingsSeen && frame.type != Http2Frame::SETTINGS) {
+      fail(Http2Frame::PROTOCOL_ERROR); // the client's preface ends with its SETTINGS
+      return;
+    }
+    switch (frame.type) {
+      case Http2Frame::DATA:
+        onData(frame, payload);
+        break;
+      case Http2Frame::HEADERS:
+        onHeaders(frame, payload);
+        break;
+      case Http2Frame::PRIORITY:
+        if (frame.streamId == 0 || frame.length != 5) {
+          fail(frame.streamId == 0 ? Http2Frame::PROTOCOL_ERROR : Http2Frame::FRAME_SIZE_ERROR);
+        }
+        break;
+      case Http2Frame::RST_STREAM:
+        onReset(frame, payload);
+        break;
+      case Http2Frame::SETTINGS:
+        onSettings(frame, payload);
+        break;
+      case Http2Frame::PING:
+        if (frame.streamId != 0 || frame.length != 8) {
+          fail(frame.streamId != 0 ? Http2Frame::PROTOCOL_ERROR : Http2Frame::FRAME_SIZE_ERROR);
+        } else if (!(frame.flags & Http2Frame::ACK)) {
+          Http2Frame::append(output, Http2Frame::PING, Http2Frame::ACK, 0, (const char *) payload, 8);
+        }
+        break;
+      case Http2Frame::GOAWAY:
+        if (frame.streamId != 0 || frame.length < 8) {
+          fail(Http2Frame::PROTOCOL_ERROR);
+        }
+        goAwayReceived = true;
+        break;
+      case Http2Frame::WINDOW_UPDATE:
+        onWindowUpdate(frame, payload);
+        break;
+      case Http2Frame::CONTINUATION:
+        if (headerStream == 0) {
+          fail(Http2Frame::PROTOCOL_ERROR);
+          return;
+        }
+        if (headerBlock.length() + frame.length > MAX_HEADER_LIST) {
+          fail(Http2Frame::ENHANCE_YOUR_CALM); // a CONTINUATION flood is not buffered
+          return;
+        }
+        headerBlock.append((const char *) payload, frame.length);
+        if (frame.flags & Http2Frame::END_HEADERS) {
+          finishHeaders();
+        }
+        break;
+      case Http2Frame::PRIORITY_UPDATE:
+        onPriorityUpdate(frame, payload);
+        break;
+      case Http2Frame::PUSH_PROMISE:
+        fail(Http2Frame::PROTOCOL_ERROR); // clients do not push
+        break;
+      default:
+        break; // unknown types are ignored
+    }
+  }
+
+  // the payload without its padding; false on a connection error
+  bool unpad(const Http2Frame &frame, const unsigned char *&payload, std::size_t &length) {
+    length = frame.length;
+    if (!(frame.flags & Http2Frame::PADDED)) {
+      return true;
+    }
+    if (length == 0 || payload[0] >= length) {
+      fail(Http2Frame::PROTOCOL_ERROR);
+      return false;
+    }
+    length -= 1 + payload[0];
+    ++payload;
+    return true;
+  }
+
+  void onHeaders(const Http2Frame &frame, const unsigned char *payload) {
+    std::size_t length;
+    if (frame.streamId == 0 || (frame.streamId & 1) == 0 || !unpad(frame, payload, length)) {
+      fail(Http2Frame::PROTOCOL_ERROR);
+      return;
+    }
+    if (frame.flags & Http2Frame::PRIORITY_FLAG) {
+      if (length < 5) {
+        fail(Http2Frame::PROTOCOL_ERROR);
+        return;
+      }
+      payload += 5;
+      length -= 5;
+    }
+    // a closed stream's block is decoded all the same, for the table, e.g. trailers crossing our reset
+    headerNewStream = frame.streamId > lastStreamId;
+    if (headerNewStream) {
+      lastStreamId = frame.streamId;
+    }
+    if (length > MAX_HEADER_LIST) {
+      fail(Http2Frame::ENHANCE_YOUR_CALM);
+      return;
+    }
+    headerStream = frame.streamId;
+    headerBlock.assign((const char *) payload, length);
+    headerEndStream = (frame.flags & Http2Frame::END_STREAM) != 0;
+    if (frame.flags & Http2Frame::END_HEADERS) {
+      finishHeaders();
+    }
+  }
+
+  // a whole header block: a new request, or trailers of one whose body came
+  void finishHeaders() {
+    unsigned id = headerStream;
+    headerStream = 0;
+    HpackHeaders headers;
+    bool decoded = decoder.decode(headerBlock, headers);
+    headerBlock.clear();
+    if (!decoded) {
+      fail(Http2Frame::COMPRESSION_ERROR);
+      return;
+    }
+    std::map<unsigned, Stream>::iterator it = streams.find(id);
+    if (it != streams.end()) {
+      if (it->second.finished) {
+        return;
+      }
+      if (it->second.requestEnded || !headerEndStream) {
+        resetStream(it, Http2Frame::PROTOCOL_ERROR);
+      } else {
+        endRequest(it); // trailers are not passed on
+      }
+      return;
+    }
+    if (!headerNewStream || goAwaySent) {
+      return; // after a GOAWAY: above its last stream id, the client retries it elsewhere
+    }
+    if (openStreams >= (std::size_t) maxStreams) {
+      Http2Frame::appendReset(output, id, Http2Frame::REFUSED_STREAM);
+      return;
+    }
+    it = streams.insert(std::make_pair(id, Stream())).first;
+    ++openStreams;
+    it->second.headers.swap(headers);
+    it->second.sendWindow = peerInitialWindow;
+    for (HpackHeaders::const_iterator header = it->second.headers.begin(); header != it->second.headers.end();
+         ++header) {
+      if (header->first == "priority") {
+        parsePriority(header->second, it->second);
+      }
+    }
+    if (headerEndStream) {
+      endRequest(it);
+    }
+  }
+
+  void onData(const Http2Frame &frame, const unsigned char *payload) {
+    if (frame.streamId == 0) {
+      fail(Http2Frame::PROTOCOL_ERROR);
+      return;
+    }
+    if ((long long) frame.length > receiveWindow) {
+      fail(Http2Frame::FLOW_CONTROL_ERROR);
+      return;
+    }
+    // padding counts against the windows too; the connection's is given back right away
+    receiveWindow -= frame.length;
+    if (receiveWindow < RECEIVE_WINDOW / 2) {
+      Http2Frame::appendWindowUpdate(output, 0, (unsigned) (RECEIVE_WINDOW - receiveWindow));
+      receiveWindow = RECEIVE_WINDOW;
+    }
+    std::map<unsigned, Stream>::iterator it = streams.find(frame.streamId);
+    if (it == streams.end() || it->second.finished) {
+      if (frame.streamId > lastStreamId) {
+        fail(Http2Frame::PROTOCOL_ERROR); // idle stream
+      }
+      return;
+    }
+    Stream &stream = it->second;
+    std::size_t length;
+    if (!unpad(frame, payload, length)) {
+      return;
+    }
+    if (stream.requestEnded) {
+      resetStream(it, Http2Frame::STREAM_CLOSED);
+      return;
+    }
+    if ((long long) frame.length > stream.receiveWindow) {
+      resetStream(it, Http2Frame::FLOW_CONTROL_ERROR);
+      return;
+    }
+    stream.receiveWindow -= frame.length;
+    stream.bodyLength += length;
+    if (stream.bodyLength > maxBodySize) {
+      refuseBody(it);
+      return;
+    }
+    stream.body.append((const char *) payload, length);
+    if (frame.flags & Http2Frame::END_STREAM) {
+      endRequest(it);
+    } else if (stream.receiveWindow < RECEIVE_WINDOW / 2) {
+      Http2Frame::appendWindowUpdate(output, frame.streamId, (unsigned) (RECEIVE_WINDOW - stream.receiveWindow));
+      stream.receiveWindow = RECEIVE_WINDOW;
+    }
+  }
+
+  void onReset(const Http2Frame &frame, const unsigned char *payload) {
+    (void) payload;
+    if (frame.streamId == 0 || frame.length != 4) {
+      fail(frame.streamId == 0 ? Http2Frame::PROTOCOL_ERROR : Http2Frame::FRAME_SIZE_ERROR);
+      return;
+    }
+    std::map<unsigned, Stream>::iterator it = streams.find(frame.streamId);
+    if (it != streams.end() && !it->second.finished) {
+      finish(it);
+    }
+  }
+
+  void onSettings(const Http2Frame &frame, const unsigned char *payload) {
+    if (frame.streamId != 0) {
+      fail(Http2Frame::PROTOCOL_ERROR);
+      return;
+    }
+    if (frame.flags & Http2Frame::ACK) {
+      if (frame.length != 0) {
+        fail(Http2Frame::FRAME_SIZE_ERROR);
+      }
+      return;
+    }
+    if (frame.length % 6 != 0) {
+      fail(Http2Frame::FRAME_SIZE_ERROR);
+      return;
+    }
+    for (std::size_t pos = 0; pos < frame.length; pos += 6) {
+      unsigned setting = ((unsigned) payload[pos] << 8) | payload[pos + 1];
+      unsigned value = Http2Frame::read32(payload + pos + 2);
+      if (setting == Http2Frame::HEADER_TABLE_SIZE) {
+        encoder.setMaxSize(value);
+      } else if (setting == Http2Frame::ENABLE_PUSH && value > 1) {
+        fail(Http2Frame::PROTOCOL_ERROR);
+        return;
+      } else if (setting == Http2Frame::INITIAL_WINDOW_SIZE) {
+        if (value > Http2Frame::MAX_WINDOW) {
+          fail(Http2Frame::FLOW_CONTROL_ERROR);
+          return;
+        }
+        // applies to the open streams as well, by the difference
+        long long delta = (long long) value - peerInitialWindow;
+        peerInitialWindow = value;
+        for (std::map<unsigned, Stream>::iterator it = streams.begin(); it != streams.end(); ++it) {
+          it->second.sendWindow += delta;
+          if (it->second.sendWindow > Http2Frame::MAX_WINDOW) {
+            fail(Http2Frame::FLOW_CONTROL_ERROR);
+            return;
+          }
+        }
+      } else if (setting == Http2Frame::MAX_FRAME_SIZE) {
+        if (value < Http2Frame::DEFAULT_MAX_FRAME || value > Http2Frame::LARGEST_MAX_FRAME) {
+          fail(Http2Frame::PROTOCOL_ERROR);
+          return;
+        }
+        peerMaxFrame = value;
+      }
+    }
+    settingsSeen = true;
+    Http2Frame::appendHeader(output, 0, Http2Frame::SETTINGS, Http2Frame::ACK, 0);
+  }
+
+  void onWindowUpdate(const Http2Frame &frame, const unsigned char *payload) {
+    if (frame.length != 4) {
+      fail(Http2Frame::FRAME_SIZE_ERROR);
+      return;
+    }
+    long long increment = Http2Frame::read32(payload) & 0x7fffffff;
+    if (frame.streamId == 0) {
+      sendWindow += increment;
+      if (increment == 0 || sendWindow > Http2Frame::MAX_WINDOW) {
+        fail(increment == 0 ? Http2Frame::PROTOCOL_ERROR : Http2Frame::FLOW_CONTROL_ERROR);
+      }
+      return;
+    }
+    std::map<unsigned, Stream>::iterator it = streams.find(frame.streamId);
+    if (it == streams.end() || it->second.finished) {
+      return;
+    }
+    it->second.sendWindow += increment;
+    if (increment == 0 || it->second.sendWindow > Http2Frame::MAX_WINDOW) {
+      resetStream(it, increment == 0 ? Http2Frame::PROTOCOL_ERROR : Http2Frame::FLOW_CONTROL_ERROR);
+    }
+  }
+
+  // PRIORITY_UPDATE: the priority of a stream changed after its request
+  void onPriorityUpdate(const Http2Frame &frame, const unsigned char *payload) {
+    if (frame.streamId != 0 || frame.length < 4) {
+      fail(Http2Frame::PROTOCOL_ERROR);
+      return;
+    }
+    std::map<unsigned, Stream>::iterator it = streams.find(Http2Frame::read32(payload) & 0x7fffffff);
+    if (it != streams.end()) {
+      parsePriority(std::string((const char *) payload + 4, frame.length - 4), it->second);
+    }
+  }
+
+  // `u=<0-7>` and `i` of a priority field value, the rest is ignored
+  static void parsePriority(const std::string &value, Stream &stream) {
+    std::size_t start = 0;
+    while (start < value.length()) {
+      std::size_t end = value.find(',', start);
+      end = end == std::string::npos ? value.length() : end;
+      std::size_t first = value.find_first_not_of(' ', start);
+      std::string item = first < end ? value.substr(first, end - first) : "";
+      item = item.substr(0, item.find_last_not_of(' ') + 1);
+      if (item.length() == 3 && item.compare(0, 2, "u=") == 0 && item[2] >= '0' && item[2] <= '7') {
+        stream.urgency = item[2] - '0';
+      } else if (item == "i" || item == "i=?1") {
+        stream.incremental = true;
+      } else if (item == "i=?0") {
+        stream.incremental = false;
+      }
+      start = end + 1;
+    }
+  }
+
+  // requests -----------------------------------------------------------------------------------------
+
+  void endRequest(std::map<unsigned, Stream>::iterator it) {
+    Stream &stream = it->second;
+    stream.requestEnded = true;
+    if (!buildRequest(stream)) {
+      resetStream(it, Http2Frame::PROTOCOL_ERROR);
+      return;
+    }
+    ready.push_back(it->first);
+  }
+
+  // the request as HTTP/1.1, with its body's length; false when it is malformed (RFC 9113, 8.2)
+  bool buildRequest(Stream &stream) {
+    std::string method;
+    std::string path;
+    std::string scheme;
+    std::string authority;
+    std::string fields;
+    std::string cookies;
+    bool regularSeen = false;
+    for (HpackHeaders::const_iterator it = stream.headers.begin(); it != stream.headers.end(); ++it) {
+      const std::string &name = it->first;
+      const std::string &value = it->second;
+      if (name.empty() || name.find_first_of("ABCDEFGHIJKLMNOPQRSTUVWXYZ\r\n: ", 1) != std::string::npos
+          || value.find_first_of("\r\n", 0) != std::string::npos || value.find('\0') != std::string::npos) {
+        return false;
+      }
+      if (name[0] == ':') {
+        std::string *pseudo = name == ":method" ? &method : name == ":path" ? &path : name == ":scheme" ? &scheme
+            : name == ":authority" ? &authority : NULL;
+        if (regularSeen || pseudo == NULL || !pseudo->empty()) {
+          return false;
+        }
+        *pseudo = value;
+      } else if (name == "connection" || name == "keep-alive" || name == "proxy-connection"
+          || name == "transfer-encoding" || name == "upgrade" || (name == "te" && value != "trailers")) {
+        return false;
+      } else {
+        regularSeen = true;
+        if (name == "cookie") {
+          cookies += (cookies.empty() ? "" : "; ") + value;
+        } else if (!(name == "host" && !authority.empty()) && name != "content-length" && name != "expect"
+            && name != "te") {
+          fields += name + ": " + value + "\r\n";
+        }
+      }
+    }
+    if (method.empty() || scheme.empty() || path.empty()) {
+      return false; // CONNECT too, it is not served
+    }
+    std::string &request = stream.request;
+    request = method + " " + path + " HTTP/1.1\r\n";
+    if (!authority.empty()) {
+      request += "Host: " + authority + "\r\n";
+    }
+    request += fields;
+    if (!cookies.empty()) {
+      request += "cookie: " + cookies + "\r\n";
+    }
+    if (stream.bodyLength > 0) {
+      char length[32];
+      snprintf(length, sizeof(length), "%llu", stream.bodyLength);
+      request += std::string("Content-Length: ") + length + "\r\n";
+    }
+    request += "\r\n";
+    request += stream.body;
+    std::string().swap(stream.body);
+    HpackHeaders().swap(stream.headers);
+    return true;
+  }
+
+  // responses ----------------------------------------------------------------------------------------
+
+  // a body over every limit of the server: the 413 is the whole response, and RST_STREAM with NO_ERROR
+  // tells the client to stop sending the rest (RFC 9113, 8.1)
+  void refuseBody(std::map<unsigned, Stream>::iterator it) {
+    HpackHeaders fields;
+    fields.push_back(std::make_pair(":status", "413"));
+    fields.push_back(std::make_pair("content-length", "0"));
+    std::string block;
+    encoder.encode(fields, block);
+    Http2Frame::appendHeaders(output, it->first, block, true, peerMaxFrame);
+    resetStream(it, Http2Frame::NO_ERROR);
+  }
+
+  // the head of the response becomes a HEADERS frame as soon as it is complete, so that header blocks
+  // go out in the order the encoder's table saw them; the body waits in `data`
+  void convertResponse(std::map<unsigned, Stream>::iterator it) {
+    Stream &stream = it->second;
+    while (!stream.headersSent) {
+      std::size_t end = stream.response.find("\r\n\r\n");
+      if (end == std::string::npos) {
+        if (stream.response.length() > RESPONSE_HEAD_LIMIT) {
+          resetStream(it, Http2Frame::INTERNAL_ERROR);
+        }
+        return;
+      }
+      int status = stream.response.compare(0, 5, "HTTP/") == 0 && stream.response.length() > 12
+          ? atoi(stream.response.c_str() + 9) : 0;
+      if (status < 100 || status > 999) {
+        resetStream(it, Http2Frame::INTERNAL_ERROR);
+        return;
+      }
+      if (status < 200) {
+        stream.response.erase(0, end + 4); // 100 Continue and the like have no place here
+        continue;
+      }
+      HpackHeaders fields;
+      fields.push_back(std::make_pair(":status", stream.response.substr(9, 3)));
+      std::size_t line = stream.response.find("\r\n") + 2;
+      while (line < end + 2) {
+        std::size_t lineEnd = stream.response.find("\r\n", line);
+        std::size_t colon = stream.response.find(':', line);
+        if (colon < lineEnd) {
+          std::string name = stream.response.substr(line, colon - line);
+          for (std::size_t i = 0; i < name.length(); ++i) {
+            name[i] = (char) tolower(name[i]);
+          }
+          std::size_t valueStart = stream.response.find_first_not_of(' ', colon + 1);
+          std::string value = valueStart < lineEnd ? stream.response.substr(valueStart, lineEnd - valueStart) : "";
+          value = value.substr(0, value.find_last_not_of(' ') + 1);
+          if (name == "transfer-encoding") {
+            stream.chunked = strcasestr(value.c_str(), "chunked") != NULL;
+          } else if (name != "connection" && name != "keep-alive" && name != "proxy-connection" && name != "upgrade") {
+            fields.push_back(std::make_pair(name, value));
+          }
+        }
+        line = lineEnd + 2;
+      }
+      std::string block;
+      encoder.encode(fields, block);
+      Http2Frame::appendHeaders(output, it->first, block, false, peerMaxFrame);
+      stream.headersSent = true;
+      stream.response.erase(0, end + 4);
+    }
+    if (stream.chunked) {
+      decodeChunks(stream);
+    } else {
+      stream.data.append(stream.response);
+      stream.response.clear();
+    }
+  }
+
+  // chunked bodies come from upstream servers; HTTP/2 frames the data itself
+  static void decodeChunks(Stream &stream) {
+    std::string &raw = stream.response;
+    std::size_t pos = 0;
+    while (pos < raw.length()) {
+      if (stream.chunkState == CHUNK_SIZE) {
+        std::size_t lineEnd = raw.find("\r\n", pos);
+        if (lineEnd == std::string::npos) {
+          break;
+        }
+        stream.chunkLeft = strtoll(raw.c_str() + pos, NULL, 16);
+        stream.chunkState = stream.chunkLeft > 0 ? CHUNK_DATA : CHUNKS_DONE;
+        pos = lineEnd + 2;
+      } else if (stream.chunkState == CHUNK_DATA) {
+        std::size_t length = raw.length() - pos;
+        length = (long long) length < stream.chunkLeft ? length : (std::size_t) stream.chunkLeft;
+        stream.data.append(raw, pos, length);
+        stream.chunkLeft -= length;
+        pos += length;
+        stream.chunkState = stream.chunkLeft == 0 ? CHUNK_END : CHUNK_DATA;
+      } else if (stream.chunkState == CHUNK_END) {
+        if (raw.length() - pos < 2) {
+          break;
+        }
+        pos += 2;
+        stream.chunkState = CHUNK_SIZE;
+      } else {
+        pos = raw.length();
+      }
+    }
+    raw.erase(0, pos);
+  }
+
+  // the stream to frame next: the lowest urgency; then the lowest id of the non-incremental streams,
+  // or the incremental one that waited longest
+  std::map<unsigned, Stream>::iterator nextToSend() {
+    std::map<unsigned, Stream>::iterator best = streams.end();
+    for (std::map<unsigned, Stream>::iterator it = streams.begin(); it != streams.end(); ++it) {
+      const Stream &stream = it->second;
+      bool hasData = stream.dataOffset < stream.data.length();
+      if (!stream.headersSent || stream.finished || (!hasData && !stream.responseEnded)
+          || (hasData && (sendWindow <= 0 || stream.sendWindow <= 0))) {
+        continue;
+      }
+      if (best == streams.end() || stream.urgency < best->second.urgency) {
+        best = it;
+      } else if (stream.urgency == best->second.urgency && best->second.incremental
+          && (!stream.incremental || stream.turn < best->second.turn)) {
+        best = it;
+      }
+    }
+    return best;
+  }
+
+  // connection and stream state -----------------------------------------------------------------------
+
+  void resetStream(std::map<unsigned, Stream>::iterator it, Http2Frame::Error error) {
+    Http2Frame::appendReset(output, it->first, error);
+    finish(it);
+  }
+
+  // nothing more goes out on the stream; its record goes once its client is gone too
+  void finish(std::map<unsigned, Stream>::iterator it) {
+    Stream &stream = it->second;
+    stream.finished = true;
+    --openStreams;
+    std::string().swap(stream.request);
+    stream.requestOffset = 0;
+    std::string().swap(stream.response);
+    std::string().swap(stream.data);
+    stream.dataOffset = 0;
+    if (stream.transport == NULL) {
+      streams.erase(it);
+    }
+  }
+
+  void fail(Http2Frame::Error error) {
+    if (!failed) {
+      appendGoAway(error);
+      failed = true;
+    }
+  }
+
+  void appendGoAway(Http2Frame::Error error) {
+    Http2Frame::appendHeader(output, 8, Http2Frame::GOAWAY, 0, 0);
+    Http2Frame::append32(output, lastStreamId);
+    Http2Frame::append32(output, error);
+  }
+};
+
+// The byte stream of one HTTP/2 stream for the client serving it, in process: read gives the request
+// as HTTP/1.1 and write takes the response, which the connection frames. Once the connection is gone
+// reads end and writes fail, so the client closes.
+class Http2StreamTransport : public Transport {
+ private:
+  Http2Connection *connection;
+  unsigned id;
+  bool closed;
+
+ public:
+  Http2StreamTransport(Http2Connection &connection, unsigned id) : connection(&connection), id(id), closed(false) {
+    connection.attach(id, this);
+  }
+
+  virtual ~Http2StreamTransport() {
+    close();
+    if (connection != NULL) {
+      connection->detach(id);
+    }
+  }
+
+ private:
+  Http2StreamTransport(const Http2StreamTransport &transport);
+  Http2StreamTransport &operator=(const Http2StreamTransport &transport);
+
+ public:
+  virtual ssize_t read(char *buf, size_t length) {
+    return connection != NULL ? connection->readRequest(id, buf, length) : 0;
+  }
+
+  virtual ssize_t write(const char *buf, size_t length) {
+    if (connection == NULL || closed) {
+      errno = EPIPE;
+      return -1;
+    }
+    return connection->writeResponse(id, buf, length);
+  }
+
+  // the response is complete
+  virtual void close() {
+    if (!closed && connection != NULL) {
+      connection->endResponse(id);
+    }
+    closed = true;
+  }
+
+  virtual bool isReadable() const {
+    return connection == NULL || connection->isRequestReadable(id);
+  }
+
+  // the connection went away before the stream's client
+  void release() {
+    connection = NULL;
+  }
+};
+
+inline Http2Connection::~Http2Connection() {
+  for (std::map<unsigned, Stream>::iterator it = streams.begin(); it != streams.end(); ++it) {
+    if (it->second.transport != NULL) {
+      it->second.transport->release();
+    }
+  }
+}
@@ -0,0 +1,130 @@
+#pragma once
+#include <string>
+#include <cstring>
+
+// Framing layer of HTTP/2 (RFC 9113): a 9-byte header, then the payload. Shared by the server's
+// connections and the load generator's client.
+struct Http2Frame {
+  enum Type {
+    DATA = 0x0,
+    HEADERS = 0x1,
+    PRIORITY = 0x2, // the RFC 7540 scheme, parsed and ignored
+    RST_STREAM = 0x3,
+    SETTINGS = 0x4,
+    PUSH_PROMISE = 0x5,
+    PING = 0x6,
+    GOAWAY = 0x7,
+    WINDOW_UPDATE = 0x8,
+    CONTINUATION = 0x9,
+    PRIORITY_UPDATE = 0x10 // RFC 9218
+  };
+  enum Flag {
+    END_STREAM = 0x1,
+    ACK = 0x1,
+    END_HEADERS = 0x4,
+    PADDED = 0x8,
+    PRIORITY_FLAG = 0x20
+  };
+  enum Error {
+    NO_ERROR = 0x0,
+    PROTOCOL_ERROR = 0x1,
+    INTERNAL_ERROR = 0x2,
+    FLOW_CONTROL_ERROR = 0x3,
+    STREAM_CLOSED = 0x5,
+    FRAME_SIZE_ERROR = 0x6,
+    REFUSED_STREAM = 0x7,
+    CANCEL = 0x8,
+    COMPRESSION_ERROR = 0x9,
+    ENHANCE_YOUR_CALM = 0xb
+  };
+  enum Setting {
+    HEADER_TABLE_SIZE = 0x1,
+    ENABLE_PUSH = 0x2,
+    MAX_CONCURRENT_STREAMS = 0x3,
+    INITIAL_WINDOW_SIZE = 0x4,
+    MAX_FRAME_SIZE = 0x5,
+    MAX_HEADER_LIST_SIZE = 0x6,
+    NO_RFC7540_PRIORITIES = 0x9
+  };
+
+  static const std::size_t HEADER_LENGTH = 9;
+  static const std::size_t PREFACE_LENGTH = 24;
+  static const std::size_t DEFAULT_MAX_FRAME = 16384;
+  static const std::size_t LARGEST_MAX_FRAME = 16777215;
+  static const long long DEFAULT_WINDOW = 65535;
+  static const long long MAX_WINDOW = 2147483647;
+  static const char PREFACE[];
+
+  std::size_t length;
+  unsigned char type;
+  unsigned char flags;
+  unsigned streamId;
+
+  // header at `data`, which has HEADER_LENGTH bytes
+  static Http2Frame parse(const unsigned char *data) {
+    Http2Frame frame;
+    frame.length = ((std::size_t) data[0] << 16) | ((std::size_t) data[1] << 8) | data[2];
+    frame.type = data[3];
+    frame.flags = data[4];
+    frame.streamId = read32(data + 5) & 0x7fffffff;
+    return frame;
+  }
+
+  static unsigned read32(const unsigned char *data) {
+    return ((unsigned) data[0] << 24) | ((unsigned) data[1] << 16) | ((unsigned) data[2] << 8) | data[3];
+  }
+
+  static void append32(std::string &out, unsigned value) {
+    out += (char) (value >> 24);
+    out += (char) (value >> 16);
+    out += (char) (value >> 8);
+    out += (char) value;
+  }
+
+  static void appendHeader(std::string &out, std::size_t length, Type type, unsigned char flags, unsigned streamId) {
+    out += (char) (length >> 16);
+    out += (char) (length >> 8);
+    out += (char) length;
+    out += (char) type;
+    out += (char) flags;
+    append32(out, streamId & 0x7fffffff);
+  }
+
+  static void append(std::string &out, Type type, unsigned char flags, unsigned streamId, const char *payload,
+                     std::size_t length) {
+    appendHeader(out, length, type, flags, streamId);
+    out.append(payload, length);
+  }
+
+  static void appendSetting(std::string &payload, Setting setting, unsigned value) {
+    payload += (char) (setting >> 8);
+    payload += (char) setting;
+    append32(payload, value);
+  }
+
+  static void appendWindowUpdate(std::string &out, unsigned streamId, unsigned increment) {
+    appendHeader(out, 4, WINDOW_UPDATE, 0, streamId);
+    append32(out, increment);
+  }
+
+  static void appendReset(std::string &out, unsigned streamId, Error error) {
+    appendHeader(out, 4, RST_STREAM, 0, streamId);
+    append32(out, error);
+  }
+
+  // a header block as HEADERS and the CONTINUATION frames it needs at `maxFrame` bytes each
+  static void appendHeaders(std::string &out, unsigned streamId, const std::string &block, bool endStream,
+                            std::size_t maxFrame) {
+    std::size_t offset = 0;
+    do {
+      std::size_t length = block.length() - offset < maxFrame ? block.length() - offset : maxFrame;
+      bool last = offset + length == block.length();
+      unsigned char flags = (unsigned char) ((last ? END_HEADERS : 0) | (offset == 0 && endStream ? END_STREAM : 0));
+      appendHeader(out, length, offset == 0 ? HEADERS : CONTINUATION, flags, streamId);
+      out.append(block, offset, length);
+      offset += length;
+    } while (offset < block.length());
+  }
+};
+
+const char Http2Frame::PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
@@ -0,0 +1,81 @@
+#pragma once
+#include <cstddef>
+
+// max_connections, shed_target and shed_interval of the main context
+struct AdmissionConfig {
+  std::size_t maxConnections; // 0: not limited
+  long targetMillis;          // 0: no queue delay check
+  long intervalMillis;
+
+  AdmissionConfig() : maxConnections(0), targetMillis(0), intervalMillis(100) {}
+};
+
+// Load shedding of the whole process, so that the connections it takes stay fast when more arrive
+// than it can serve:
+//
+//   max_connections <n>;       open connections; one more is answered 503 on accept
+//   shed_target <n>[ms|s];     queue delay target, 0 (default) turns the queue check off
+//   shed_interval <n>[ms|s];   the delay a request may queue while the loop keeps up (100ms)
+//
+// The queue delay of a request is the time from the accept of its connection to the start of its
+// handler. As with CoDel, a loop that keeps up empties its queue now and then, so the smallest delay
+// of an interval is small; when even the smallest one stayed over the target for a whole interval
+// the loop is overloaded. Then a request that queued for longer than the target is answered 503
+// instead of handled, otherwise only one that queued for longer than the interval is. An interval
+// that shed a request counts as overloaded too: the loop serves its clients in no particular order,
+// and shedding the stale ones makes its turns short enough for the smallest delay to look fine while
+// the queue is still there. The stale work goes first, and what is served was not waiting long.
+class AdmissionControl {
+  std::size_t maxConnections; // 0: not limited
+  long long targetMicros;     // 0: no queue delay check
+  long long intervalMicros;
+  long long intervalEnd;
+  long long minDelay; // smallest queue delay of the current interval, -1 before the first
+  bool shed;          // a request of the current interval was shed
+  bool overloaded;    // the last interval had a standing queue or shed requests
+
+ public:
+  AdmissionControl()
+      : maxConnections(0), targetMicros(0), intervalMicros(100000), intervalEnd(0), minDelay(-1), shed(false),
+        overloaded(false) {}
+
+  // at startup and on every reload; the current interval runs to its end with the old length
+  void configure(const AdmissionConfig &config) {
+    maxConnections = config.maxConnections;
+    targetMicros = config.targetMillis * 1000LL;
+    intervalMicros = config.intervalMillis * 1000LL;
+  }
+
+  // false when one more connection goes over max_connections
+  bool admitConnection(std::size_t openConnections) const {
+    return maxConnections == 0 || openConnections < maxConnections;
+  }
+
+  bool checksQueueDelay() const {
+    return targetMicros > 0;
+  }
+
+  // the handler of a request that waited `delay` since its accept is about to start; false when the
+  // request is to be shed instead
+  bool admitQueued(long long delay, long long now) {
+    advance(now);
+    if (minDelay == -1 || delay < minDelay) {
+      minDelay = delay;
+    }
+    bool admitted = delay <= (overloaded ? targetMicros : intervalMicros);
+    shed = shed || !admitted;
+    return admitted;
+  }
+
+ private:
+  void advance(long long now) {
+    if (now < intervalEnd) {
+      return;
+    }
+    // an interval without any request in between was no overload: the queue was empty
+    overloaded = (minDelay > targetMicros || shed) && now < intervalEnd + intervalMicros;
+    minDelay = -1;
+    shed = false;
+    intervalEnd = now + intervalMicros;
+  }
+};
@@ -0,0 +1,208 @@
+#pragma once
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+// limit_req, limit_conn and limit_zone of a server block
+struct RateLimitConfig {
+  static const std::size_t DEFAULT_ZONE_BYTES = 10 * 1024 * 1024;
+
+  long rate;             // requests per periodMillis, 0: requests are not limited
+  long periodMillis;     // 1000 for r/s, 60000 for r/m
+  long burst;            // requests over the rate that are still let through
+  long connections;      // open connections per address, 0: not limited
+  std::size_t zoneBytes; // size of the address table
+
+  RateLimitConfig() : rate(0), periodMillis(1000), burst(0), connections(0), zoneBytes(DEFAULT_ZONE_BYTES) {}
+
+  bool isEnabled() const {
+    return rate > 0 || connections > 0;
+  }
+};
+
+// Token buckets and connection counts by client address (IPv4 or IPv6) in a fixed-size, open
+// addressing table: a check hashes the address and looks at no more than PROBES neighbouring slots,
+// so it costs the same with a million addresses as with ten. When they are all taken by other
+// addresses the one seen least recently without open connections makes room; when every one of
+// them has connections open the address is let through unlimited.
+//
+// The bucket is nginx's leaky bucket: `excess` drains at the rate, every request adds one, and a
+// request that would take it over the burst is rejected without counting.
+class RateLimiter {
+ public:
+  static const std::size_t PROBES = 8;
+  static const long long UNIT = 1000000; // one request in `excess`
+
+  struct Slot {
+    unsigned char address[16]; // IPv4 as v4-mapped IPv6
+    long long excess;
+    long long lastMillis;
+    int connections;
+    int used;
+  };
+
+ private:
+  std::vector<Slot> slots;
+  std::size_t mask;
+  unsigned long long seed; // per process, so that nobody can pick addresses that collide
+  long long drainPerMilli;
+  long long burst;
+  long connectionLimit;
+
+ public:
+  explicit RateLimiter(const RateLimitConfig &config)
+      : mask(0), seed(0), drainPerMilli(0), burst(0), connectionLimit(0) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    seed = mix(((unsigned long long) now.tv_nsec << 20) ^ (unsigned long long) now.tv_sec ^ getpid());
+    configure(config);
+  }
+
+ private:
+  RateLimiter(const RateLimiter &limiter);
+  RateLimiter &operator=(const RateLimiter &limiter);
+
+ public:
+  // a new zone size empties the table: the addresses and their counts start over
+  void configure(const RateLimitConfig &config) {
+    drainPerMilli = config.rate * UNIT / config.periodMillis;
+    if (config.rate > 0 && drainPerMilli == 0) {
+      drainPerMilli = 1;
+    }
+    burst = config.burst * UNIT;
+    connectionLimit = config.connections;
+    std::size_t count = PROBES;
+    while (count * 2 * sizeof(Slot) <= config.zoneBytes) {
+      count *= 2;
+    }
+    if (count != slots.size()) {
+      Slot empty;
+      memset(&empty, 0, sizeof(empty));
+      slots.assign(count, empty);
+      mask = count - 1;
+    }
+  }
+
+  // counts an accepted connection; false when the address has limit_conn connections open already
+  bool admitConnection(const struct sockaddr_storage &peer, long long now) {
+    if (connectionLimit == 0) {
+      return true;
+    }
+    Slot *slot = find(peer, now, true);
+    if (slot == NULL) {
+      return true;
+    }
+    if (slot->connections >= connectionLimit) {
+      return false;
+    }
+    ++slot->connections; // lastMillis is the bucket's: it drains from the last request on
+    return true;
+  }
+
+  // a connection admitConnection() counted is closed
+  void releaseConnection(const struct sockaddr_storage &peer) {
+    if (connectionLimit == 0) {
+      return;
+    }
+    Slot *slot = find(peer, 0, false);
+    if (slot != NULL && slot->connections > 0) {
+      --slot->connections;
+    }
+  }
+
+  // false when the request goes over the rate and the burst of the address
+  bool admitRequest(const struct sockaddr_storage &peer, long long now) {
+    if (drainPerMilli == 0) {
+      return true;
+    }
+    Slot *slot = find(peer, now, true);
+    if (slot == NULL) {
+      return true;
+    }
+    long long elapsed = now - slot->lastMillis;
+    long long excess = slot->excess - drainPerMilli * (elapsed > 0 ? elapsed : 0);
+    excess = (excess < 0 ? 0 : excess) + UNIT;
+    if (excess > burst + UNIT) {
+      return false;
+    }
+    slot->excess = excess;
+    slot->lastMillis = now;
+    return true;
+  }
+
+  bool limitsConnections() const {
+    return connectionLimit > 0;
+  }
+
+  std::size_t capacity() const {
+    return slots.size();
+  }
+
+ private:
+  static void keyOf(const struct sockaddr_storage &peer, unsigned char key[16]) {
+    memset(key, 0, 16);
+    if (peer.ss_family == AF_INET6) {
+      memcpy(key, &((const struct sockaddr_in6 &) peer).sin6_addr, 16);
+    } else if (peer.ss_family == AF_INET) {
+      key[10] = 0xFF;
+      key[11] = 0xFF;
+      memcpy(key + 12, &((const struct sockaddr_in &) peer).sin_addr, 4);
+    }
+  }
+
+  // murmur3's 64 bit finalizer
+  static unsigned long long mix(unsigned long long h) {
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+  std::size_t indexOf(const unsigned char key[16]) const {
+    unsigned long long high;
+    unsigned long long low;
+    memcpy(&high, key, 8);
+    memcpy(&low, key + 8, 8);
+    return (std::size_t) (mix(mix(high ^ seed) ^ low) & mask);
+  }
+
+  // the slot of the address; with `create` a free or evicted one is taken for it, NULL when none can be
+  Slot *find(const struct sockaddr_storage &peer, long long now, bool create) {
+    unsigned char key[16];
+    keyOf(peer, key);
+    std::size_t start = indexOf(key);
+    Slot *free = NULL;
+    Slot *stalest = NULL;
+    for (std::size_t i = 0; i < PROBES; ++i) {
+      Slot &slot = slots[(start + i) & mask];
+      if (!slot.used) {
+        free = &slot; // slots are never emptied: the address is not further on
+        break;
+      }
+      if (memcmp(slot.address, key, 16) == 0) {
+        return &slot;
+      }
+      if (slot.connections == 0 && (stalest == NULL || slot.lastMillis < stalest->lastMillis)) {
+        stalest = &slot;
+      }
+    }
+    if (!create) {
+      return NULL;
+    }
+    Slot *slot = free != NULL ? free : stalest;
+    if (slot != NULL) {
+      memcpy(slot->address, key, 16);
+      slot->excess = 0;
+      slot->lastMillis = now;
+      slot->connections = 0;
+      slot->used = 1;
+    }
+    return slot;
+  }
+};
@@ -0,0 +1,548 @@
+#pragma once
+#include "LoadOptions.h"
+#include "RequestMix.h"
+#include "Clock.h"
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <csignal>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+// One client connection driven by the generator's epoll loop
+struct LoadConnection {
+  enum State {
+    FREE, CONNECTING, HANDSHAKING, SENDING, READING
+  };
+
+  int fd;
+  SSL *ssl; // with --tls
+  State state;
+  bool slow;
+  const std::string *request;
+  std::size_t sent;
+  std::string head;
+  bool headersDone;
+  long long contentLength; // -1: until the server closes
+  long long bodyRead;
+  bool serverCloses;
+  int status;
+  long long intendedAt; // when the request should have been sent (schedule time in open loop)
+  long long startedAt;
+  long long resumeReadAt; // slow readers: next time reading is allowed, 0 when not paused
+
+  LoadConnection() : fd(-1), ssl(NULL), state(FREE), slow(false), request(NULL), sent(0), headersDone(false),
+                     contentLength(-1), bodyRead(0), serverCloses(false), status(0), intendedAt(0), startedAt(0),
+                     resumeReadAt(0) {}
+};
+
+struct LoadReport {
+  double seconds;
+  unsigned long completed;
+  unsigned long pages; // page scenario: pages loaded whole, `latencies` are theirs
+  unsigned long connects;
+  unsigned long long bytesReceived;
+  std::map<int, unsigned long> statuses;
+  std::map<std::string, unsigned long> errors;
+  std::vector<long long> latencies; // us, measured from the intended send time
+  std::vector<long long> successLatencies; // the 2xx ones among them, apart from fast rejections
+  long long expectedIntervalMicros; // closed loop: mean per-connection interval used for correction
+  unsigned long signalsSent;
+  unsigned long tlsHandshakes;
+  unsigned long tlsResumed;
+
+  LoadReport()
+      : seconds(0), completed(0), pages(0), connects(0), bytesReceived(0), expectedIntervalMicros(0), signalsSent(0),
+        tlsHandshakes(0), tlsResumed(0) {}
+};
+
+// Epoll-based HTTP/1.1 load generator.
+//
+// Closed loop (rate 0): every connection sends its next request as soon as the previous response
+// is complete. Open loop (rate > 0): requests are scheduled at fixed intervals regardless of how the
+// server keeps up; a request waiting for a free connection still counts its latency from its
+// scheduled time, which avoids coordinated omission (a stalled server cannot hide the queueing it
+// causes by slowing the generator down).
+//
+// With --tls every new connection makes a TLS handshake first, a full one unless --tls-resume hands
+// it the session of a connection before: with --close the request rate is the handshake rate.
+class LoadGenerator {
+ public:
+  static const std::size_t READ_CHUNK = 65536;
+  static const int SLOW_TICK_MILLIS = 10;
+
+ private:
+  const LoadOptions &options;
+  RequestMix mix;
+  std::vector<LoadConnection> connections;
+  std::deque<long long> backlog; // intended send times of scheduled requests without a connection
+  int epollFd;
+  struct sockaddr_storage address;
+  socklen_t addressLength;
+  long long measureStart;
+  long long measureEnd;
+  LoadReport report;
+  char *readBuffer;
+  SSL_CTX *tlsContext;
+  SSL_SESSION *tlsSession; // resumed by new connections with --tls-resume
+
+ public:
+  LoadGenerator(const LoadOptions &options)
+      : options(options), mix(options), connections(options.connections), epollFd(-1), measureStart(0),
+        measureEnd(0), readBuffer(new char[READ_CHUNK]), tlsContext(NULL), tlsSession(NULL) {
+    addressLength = options.target(address);
+    int slowConnections = options.scenario == "slow" ? (int) (options.connections * options.slowFraction) : 0;
+    for (int i = 0; i < slowConnections; ++i) {
+      connections[i].slow = true;
+    }
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == -1) {
+      throw std::runtime_error("epoll_create1 failed");
+    }
+    if (options.tls) {
+      tlsContext = SSL_CTX_new(TLS_client_method());
+      if (tlsContext == NULL) {
+        throw std::runtime_error("SSL_CTX_new failed");
+      }
+      SSL_CTX_set_verify(tlsContext, SSL_VERIFY_NONE, NULL);
+      SSL_CTX_set_session_cache_mode(tlsContext, SSL_SESS_CACHE_OFF);
+    }
+  }
+
+  virtual ~LoadGenerator() {
+    for (std::size_t i = 0; i < connections.size(); ++i) {
+      drop(connections[i]);
+    }
+    close(epollFd);
+    delete[] readBuffer;
+    SSL_SESSION_free(tlsSession);
+    SSL_CTX_free(tlsContext);
+  }
+
+ private:
+  LoadGenerator(const LoadGenerator &generator);
+  LoadGenerator &operator=(const LoadGenerator &generator);
+
+ public:
+  const LoadReport &run() {
+    long long start = Clock::nowMicros();
+    measureStart = start + (long long) (options.warmupSeconds * 1e6);
+    measureEnd = measureStart + (long long) (options.durationSeconds * 1e6);
+    double interval = options.rate > 0 ? 1e6 / options.rate : 0;
+    long long scheduled = 0;
+    long long nextSignal = options.signalPid != 0 ? measureStart : 0;
+    std::vector<struct epoll_event> events(connections.size());
+
+    long long now = start;
+    while (now < measureEnd) {
+      // open loop: queue every request whose time has come
+      if (interval > 0) {
+        while (start + (long long) (scheduled * interval) <= now) {
+          backlog.push_back(start + (long long) (scheduled * interval));
+          ++scheduled;
+        }
+      }
+      dispatch(now);
+      // e.g. SIGHUP: the server reloads its configuration while under load
+      if (nextSignal != 0 && now >= nextSignal) {
+        if (kill(options.signalPid, options.signal) == 0) {
+          ++report.signalsSent;
+        } else {
+          ++report.errors["signal"];
+        }
+        nextSignal += options.signalEveryMillis * 1000;
+      }
+
+      long long nextEvent = interval > 0 ? start + (long long) (scheduled * interval) : 0;
+      if (nextSignal != 0 && (nextEvent == 0 || nextSignal < nextEvent)) {
+        nextEvent = nextSignal;
+      }
+      int timeout = nextTimeout(now, nextEvent);
+      int ready = epoll_wait(epollFd, &events[0], (int) events.size(), timeout);
+      now = Clock::nowMicros();
+      for (int i = 0; i < ready; ++i) {
+        handle(connections[events[i].data.u32], events[i].events, now);
+      }
+      resumeSlowReaders(now);
+      expire(now);
+    }
+
+    report.seconds = options.durationSeconds;
+    if (interval <= 0 && report.completed != 0) {
+      report.expectedIntervalMicros = (long long) (options.durationSeconds * 1e6 * connections.size() / report.completed);
+    }
+    return report;
+  }
+
+ private:
+  // hands queued (open loop) or immediate (closed loop) requests to free connections
+  void dispatch(long long now) {
+    for (std::size_t i = 0; i < connections.size(); ++i) {
+      LoadConnection &connection = connections[i];
+      if (connection.state != LoadConnection::FREE) {
+        continue;
+      }
+      long long intendedAt;
+      if (options.rate > 0) {
+        if (backlog.empty()) {
+          return;
+        }
+        intendedAt = backlog.front();
+        backlog.pop_front();
+      } else {
+        intendedAt = now;
+      }
+      start(connection, (unsigned) i, intendedAt, now);
+    }
+  }
+
+  void start(LoadConnection &connection, unsigned index, long long intendedAt, long long now) {
+    connection.request = &mix.next();
+    connection.sent = 0;
+    connection.head.clear();
+    connection.headersDone = false;
+    connection.contentLength = -1;
+    connection.bodyRead = 0;
+    connection.serverCloses = false;
+    connection.status = 0;
+    connection.intendedAt = intendedAt;
+    connection.startedAt = now;
+    connection.resumeReadAt = 0;
+
+    if (connection.fd != -1) {
+      connection.state = LoadConnection::SENDING;
+      watch(connection, index, EPOLLOUT, EPOLL_CTL_MOD);
+      return;
+    }
+    connection.fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (connection.fd == -1) {
+      fail(connection, "socket");
+      return;
+    }
+    int yes = 1;
+    if (address.ss_family != AF_UNIX) {
+      setsockopt(connection.fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    }
+    if (connection.slow) {
+      int small = 4096;
+      setsockopt(connection.fd, SOL_SOCKET, SO_RCVBUF, &small, sizeof(small));
+    }
+    if (now >= measureStart) {
+      ++report.connects;
+    }
+    if (connect(connection.fd, (struct sockaddr *) &address, addressLength) == -1 && errno != EINPROGRESS) {
+      fail(connection, "connect");
+      return;
+    }
+    connection.state = LoadConnection::CONNECTING;
+    watch(connection, index, EPOLLOUT, EPOLL_CTL_ADD);
+  }
+
+  void watch(LoadConnection &connection, unsigned index, unsigned events, int operation) {
+    struct epoll_event event;
+    event.events = events;
+    event.data.u32 = index;
+    epoll_ctl(epollFd, operation, connection.fd, &event);
+  }
+
+  unsigned indexOf(const LoadConnection &connection) const {
+    return (unsigned) (&connection - &connections[0]);
+  }
+
+  void handle(LoadConnection &connection, unsigned events, long long now) {
+    if (connection.state == LoadConnection::CONNECTING) {
+      int error = 0;
+      socklen_t length = sizeof(error);
+      getsockopt(connection.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+      if (error != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+        fail(connection, error == ECONNREFUSED ? "connect refused" : "connect");
+        return;
+      }
+      connection.state = LoadConnection::SENDING;
+      if (options.tls && !startTls(connection)) {
+        return;
+      }
+    }
+    if (connection.state == LoadConnection::HANDSHAKING) {
+      handshake(connection, now);
+      return;
+    }
+    if (connection.state == LoadConnection::SENDING) {
+      sendRequest(connection);
+      return;
+    }
+    if (connection.state == LoadConnection::READING && connection.resumeReadAt == 0) {
+      readResponse(connection, now);
+    }
+  }
+
+  bool startTls(LoadConnection &connection) {
+    connection.ssl = SSL_new(tlsContext);
+    if (connection.ssl == NULL || SSL_set_fd(connection.ssl, connection.fd) != 1) {
+      fail(connection, "tls setup");
+      return false;
+    }
+    if (tlsSession != NULL) {
+      SSL_set_session(connection.ssl, tlsSession);
+    }
+    SSL_set_connect_state(connection.ssl);
+    connection.state = LoadConnection::HANDSHAKING;
+    return true;
+  }
+
+  void handshake(LoadConnection &connection, long long now) {
+    ERR_clear_error();
+    int result = SSL_do_handshake(connection.ssl);
+    if (result != 1) {
+      int error = SSL_get_error(connection.ssl, result);
+      if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+        watch(connection, indexOf(connection), error == SSL_ERROR_WANT_READ ? EPOLLIN : EPOLLOUT, EPOLL_CTL_MOD);
+      } else {
+        fail(connection, "tls handshake");
+      }
+      return;
+    }
+    if (now >= measureStart) {
+      ++report.tlsHandshakes;
+      report.tlsResumed += SSL_session_reused(connection.ssl) == 1;
+    }
+    connection.state = LoadConnection::SENDING;
+    sendRequest(connection);
+  }
+
+  // send(2) and recv(2), or their TLS counterparts; -1 with EAGAIN when the connection is not ready
+  ssize_t transmit(LoadConnection &connection, const char *data, std::size_t length) {
+    if (connection.ssl == NULL) {
+      return send(connection.fd, data, length, MSG_NOSIGNAL);
+    }
+    ERR_clear_error();
+    int written = SSL_write(connection.ssl, data, (int) length);
+    return written > 0 ? written : tlsFailure(connection, written);
+  }
+
+  ssize_t receive(LoadConnection &connection, char *data, std::size_t length) {
+    if (connection.ssl == NULL) {
+      return recv(connection.fd, data, length, 0);
+    }
+    ERR_clear_error();
+    int got = SSL_read(connection.ssl, data, (int) length);
+    return got > 0 ? got : tlsFailure(connection, got);
+  }
+
+  static ssize_t tlsFailure(LoadConnection &connection, int result) {
+    int error = SSL_get_error(connection.ssl, result);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+      errno = EAGAIN;
+      return -1;
+    }
+    if (error == SSL_ERROR_ZERO_RETURN) {
+      return 0;
+    }
+    // OpenSSL 3 reports a close without close_notify as an error: for a response that ends with the
+    // connection that is its end
+    unsigned long reason = ERR_peek_error();
+    if (error == SSL_ERROR_SSL && ERR_GET_REASON(reason) == SSL_R_UNEXPECTED_EOF_WHILE_READING) {
+      return 0;
+    }
+    errno = EPROTO;
+    return -1;
+  }
+
+  void sendRequest(LoadConnection &connection) {
+    const std::string &request = *connection.request;
+    while (connection.sent < request.length()) {
+      ssize_t written = transmit(connection, request.data() + connection.sent, request.length() - connection.sent);
+      if (written < 0 && errno == EAGAIN) {
+        return;
+      }
+      if (written <= 0) {
+        fail(connection, "send");
+        return;
+      }
+      connection.sent += written;
+    }
+    connection.state = LoadConnection::READING;
+    watch(connection, indexOf(connection), EPOLLIN, EPOLL_CTL_MOD);
+  }
+
+  // a TLS record is decrypted whole: the rest of it is read on, epoll would not report it
+  void readResponse(LoadConnection &connection, long long now) {
+    do {
+      if (!readChunk(connection, now)) {
+        return;
+      }
+    } while (!connection.slow && connection.ssl != NULL && SSL_pending(connection.ssl) > 0);
+  }
+
+  // false once the connection is done with or paused
+  bool readChunk(LoadConnection &connection, long long now) {
+    std::size_t budget = connection.slow ? slowChunk() : READ_CHUNK;
+    ssize_t received = receive(connection, readBuffer, budget);
+    if (received < 0 && errno == EAGAIN) {
+      return false;
+    }
+    if (received < 0) {
+      fail(connection, "recv");
+      return false;
+    }
+    if (received == 0) {
+      if (connection.headersDone && connection.contentLength == -1) {
+        complete(connection, now, true);
+      } else {
+        fail(connection, "closed before response end");
+      }
+      return false;
+    }
+    report.bytesReceived += received;
+    consume(connection, readBuffer, (std::size_t) received);
+    if (connection.headersDone && connection.contentLength != -1 && connection.bodyRead >= connection.contentLength) {
+      complete(connection, now, connection.serverCloses || !options.keepAlive);
+      return false;
+    }
+    if (connection.slow) {
+      connection.resumeReadAt = now + SLOW_TICK_MILLIS * 1000;
+      watch(connection, indexOf(connection), 0, EPOLL_CTL_MOD);
+      return false;
+    }
+    return true;
+  }
+
+  std::size_t slowChunk() const {
+    long chunk = options.slowBytesPerSecond * SLOW_TICK_MILLIS / 1000;
+    return chunk > 0 ? (std::size_t) chunk : 1;
+  }
+
+  void consume(LoadConnection &connection, const char *data, std::size_t length) {
+    if (connection.headersDone) {
+      connection.bodyRead += length;
+      return;
+    }
+    connection.head.append(data, length);
+    std::size_t end = connection.head.find("\r\n\r\n");
+    if (end == std::string::npos) {
+      return;
+    }
+    connection.headersDone = true;
+    connection.bodyRead = (long long) (connection.head.length() - end - 4);
+    std::string headers = connection.head.substr(0, end + 2);
+    std::size_t space = headers.find(' ');
+    connection.status = space != std::string::npos ? std::atoi(headers.c_str() + space + 1) : 0;
+    for (std::size_t i = 0; i < headers.length(); ++i) {
+      headers[i] = (char) tolower(headers[i]);
+    }
+    std::size_t position = headers.find("\r\ncontent-length:");
+    if (position != std::string::npos) {
+      connection.contentLength = std::atol(headers.c_str() + position + 17);
+    }
+    connection.serverCloses = headers.find("\r\nconnection: close") != std::string::npos;
+    connection.head.clear();
+  }
+
+  void complete(LoadConnection &connection, long long now, bool closeConnection) {
+    if (connection.intendedAt >= measureStart && now <= measureEnd) {
+      ++report.completed;
+      ++report.statuses[connection.status];
+      report.latencies.push_back(now - connection.intendedAt);
+      if (connection.status >= 200 && connection.status < 300) {
+        report.successLatencies.push_back(now - connection.intendedAt);
+      }
+    }
+    if (closeConnection) {
+      keepSession(connection);
+      drop(connection);
+    } else {
+      watch(connection, indexOf(connection), 0, EPOLL_CTL_MOD);
+    }
+    connection.state = LoadConnection::FREE;
+  }
+
+  void fail(LoadConnection &connection, const char *reason) {
+    if (Clock::nowMicros() >= measureStart) {
+      ++report.errors[reason];
+    }
+    drop(connection);
+    connection.state = LoadConnection::FREE;
+  }
+
+  // the session of a connection that ended well, for the next one to resume
+  void keepSession(LoadConnection &connection) {
+    if (connection.ssl == NULL || !options.tlsResume) {
+      return;
+    }
+    SSL_SESSION *session = SSL_get1_session(connection.ssl);
+    if (session != NULL && SSL_SESSION_is_resumable(session)) {
+      SSL_SESSION_free(tlsSession);
+      tlsSession = session;
+    } else {
+      SSL_SESSION_free(session);
+    }
+  }
+
+  void drop(LoadConnection &connection) {
+    if (connection.ssl != NULL) {
+      // no close_notify exchange: the server closes after its response anyway
+      SSL_set_shutdown(connection.ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+      SSL_free(connection.ssl);
+      connection.ssl = NULL;
+    }
+    if (connection.fd != -1) {
+      close(connection.fd); // also removes it from the epoll set
+      connection.fd = -1;
+    }
+  }
+
+  void resumeSlowReaders(long long now) {
+    for (std::size_t i = 0; i < connections.size(); ++i) {
+      LoadConnection &connection = connections[i];
+      if (connection.state == LoadConnection::READING && connection.resumeReadAt != 0
+          && connection.resumeReadAt <= now) {
+        connection.resumeReadAt = 0;
+        watch(connection, (unsigned) i, EPOLLIN, EPOLL_CTL_MOD);
+        if (connection.ssl != NULL && SSL_pending(connection.ssl) > 0) {
+          readResponse(connection, now);
+        }
+      }
+    }
+  }
+
+  void expire(long long now) {
+    long long limit = options.timeoutMillis * 1000LL;
+    for (std::size_t i = 0; i < connections.size(); ++i) {
+      LoadConnection &connection = connections[i];
+      if (connection.state != LoadConnection::FREE && now - connection.startedAt > limit) {
+        fail(connection, "timeout");
+      }
+    }
+  }
+
+  // milliseconds until the next scheduled arrival, slow-reader tick or timeout scan
+  int nextTimeout(long long now, long long nextArrival) const {
+    long long wake = now + 10000;
+    if (nextArrival != 0 && nextArrival < wake) {
+      wake = nextArrival;
+    }
+    for (std::size_t i = 0; i < connections.size(); ++i) {
+      if (connections[i].resumeReadAt != 0 && connections[i].resumeReadAt < wake) {
+        wake = connections[i].resumeReadAt;
+      }
+    }
+    if (wake < now) {
+      return 0;
+    }
+    return (int) ((wake - now + 999) / 1000);
+  }
+};
@@ -0,0 +1,182 @@
+#pragma once
+#include <string>
+#include <cstdlib>
+#include <stdexcept>
+#include <csignal>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Command line of webserv_loadgen
+struct LoadOptions {
+  std::string host;
+  int port;
+  std::string unixPath; // connect to a Unix domain socket instead of host and port
+  int connections;
+  double durationSeconds;
+  double warmupSeconds;
+  double rate;          // requests per second over all connections, 0: closed loop
+  bool keepAlive;
+  bool tls;             // connections are TLS, each one with its handshake
+  bool tlsResume;       // new connections resume the session of the last one
+  bool http2;           // the page scenario loads over one HTTP/2 connection
+  std::string scenario; // static | post | cgi | cgi-get | slow | mixed | page
+  std::string docRoot;  // scanned for the static GET mix, served at /
+  std::string postPath;
+  std::size_t postBytes;
+  std::string cgiPath;
+  std::size_t assets;   // files of a page in the `page` scenario
+  double slowFraction;  // share of connections reading slowly in the `slow` scenario
+  long slowBytesPerSecond;
+  long timeoutMillis;
+  unsigned seed;
+  bool json;
+  pid_t signalPid;      // signalled periodically during the measured run, 0: never
+  int signal;
+  long signalEveryMillis;
+
+  LoadOptions()
+      : host("127.0.0.1"), port(8080), connections(16), durationSeconds(10), warmupSeconds(1), rate(0),
+        keepAlive(true), tls(false), tlsResume(false), http2(false), scenario("static"), docRoot("html"),
+        postPath("/loadgen_upload.txt"), postBytes(4096), cgiPath("/cgi/pycgi.py"), assets(50), slowFraction(0.25),
+        slowBytesPerSecond(16384), timeoutMillis(5000), seed(42), json(false), signalPid(0), signal(SIGHUP),
+        signalEveryMillis(1000) {}
+
+  static const char *usage() {
+    return "usage: webserv_loadgen [options]\n"
+           "  --host ADDR            server address (127.0.0.1)\n"
+           "  --port N               server port (8080)\n"
+           "  --unix PATH            connect to the Unix domain socket PATH instead\n"
+           "  -c, --connections N    concurrent connections (16)\n"
+           "  -d, --duration SEC     measured run time (10)\n"
+           "  --warmup SEC           unmeasured warm-up before the run (1)\n"
+           "  -R, --rate N           fixed arrival rate in req/s, 0 for closed loop (0)\n"
+           "  --close                one request per connection instead of keep-alive\n"
+           "  --tls                  connect with TLS, the certificate is not verified\n"
+           "  --tls-resume           TLS, resuming the session of an earlier connection\n"
+           "  --h2                   page scenario over HTTP/2, prior knowledge or ALPN with --tls\n"
+           "  -s, --scenario NAME    static | post | cgi | cgi-get | slow | mixed | page (static)\n"
+           "  --root DIR             document root scanned for the static mix (html)\n"
+           "  --post-path PATH       target of POST uploads (/loadgen_upload.txt)\n"
+           "  --post-bytes N         upload size (4096)\n"
+           "  --cgi-path PATH        CGI script requested by the cgi scenarios (/cgi/pycgi.py)\n"
+           "  --assets N             files of a page, the first ones of the document root (50)\n"
+           "  --slow-fraction F      share of slow-reader connections (0.25)\n"
+           "  --slow-rate BYTES      read rate of a slow reader per second (16384)\n"
+           "  --timeout MS           per-request timeout (5000)\n"
+           "  --seed N               request mix seed (42)\n"
+           "  --json                 print the report as one JSON object\n"
+           "  --signal-pid PID       send a signal to PID during the run, e.g. to reload the server\n"
+           "  --signal NAME          HUP | USR1 | USR2 or a number (HUP)\n"
+           "  --signal-every MS      interval between two signals (1000)\n";
+  }
+
+  void parse(int ac, char *av[]) {
+    for (int i = 1; i < ac; ++i) {
+      std::string arg(av[i]);
+      bool hasValue = i + 1 < ac;
+      if (arg == "--close") {
+        keepAlive = false;
+      } else if (arg == "--tls") {
+        tls = true;
+      } else if (arg == "--tls-resume") {
+        tls = true;
+        tlsResume = true;
+      } else if (arg == "--h2") {
+        http2 = true;
+      } else if (arg == "--json") {
+        json = true;
+      } else if (!hasValue) {
+        throw std::runtime_error("missing value or unknown option: " + arg);
+      } else if (arg == "--host") {
+        host = av[++i];
+      } else if (arg == "--port") {
+        port = std::atoi(av[++i]);
+      } else if (arg == "--unix") {
+        unixPath = av[++i];
+      } else if (arg == "-c" || arg == "--connections") {
+        connections = std::atoi(av[++i]);
+      } else if (arg == "-d" || arg == "--duration") {
+        durationSeconds = std::atof(av[++i]);
+      } else if (arg == "--warmup") {
+        warmupSeconds = std::atof(av[++i]);
+      } else if (arg == "-R" || arg == "--rate") {
+        rate = std::atof(av[++i]);
+      } else if (arg == "-s" || arg == "--scenario") {
+        scenario = av[++i];
+      } else if (arg == "--root") {
+        docRoot = av[++i];
+      } else if (arg == "--post-path") {
+        postPath = av[++i];
+      } else if (arg == "--post-bytes") {
+        postBytes = std::strtoul(av[++i], NULL, 10);
+      } else if (arg == "--cgi-path") {
+        cgiPath = av[++i];
+      } else if (arg == "--assets") {
+        assets = std::strtoul(av[++i], NULL, 10);
+      } else if (arg == "--slow-fraction") {
+        slowFraction = std::atof(av[++i]);
+      } else if (arg == "--slow-rate") {
+        slowBytesPerSecond = std::atol(av[++i]);
+      } else if (arg == "--timeout") {
+        timeoutMillis = std::atol(av[++i]);
+      } else if (arg == "--seed") {
+        seed = (unsigned) std::strtoul(av[++i], NULL, 10);
+      } else if (arg == "--signal-pid") {
+        signalPid = (pid_t) std::atol(av[++i]);
+      } else if (arg == "--signal") {
+        signal = parseSignal(av[++i]);
+      } else if (arg == "--signal-every") {
+        signalEveryMillis = std::atol(av[++i]);
+      } else {
+        throw std::runtime_error("unknown option: " + arg);
+      }
+    }
+    if (connections < 1 || durationSeconds <= 0 || slowBytesPerSecond < 1 || assets < 1) {
+      throw std::runtime_error("connections, duration, slow rate and assets must be positive");
+    }
+    if (signalPid != 0 && signalEveryMillis < 1) {
+      throw std::runtime_error("signal interval must be positive");
+    }
+  }
+
+  // the server's address, the length connect() takes
+  socklen_t target(struct sockaddr_storage &address) const {
+    memset(&address, 0, sizeof(address));
+    if (!unixPath.empty()) {
+      struct sockaddr_un &local = (struct sockaddr_un &) address;
+      if (unixPath.length() >= sizeof(local.sun_path)) {
+        throw std::runtime_error("socket path too long: " + unixPath);
+      }
+      local.sun_family = AF_UNIX;
+      memcpy(local.sun_path, unixPath.c_str(), unixPath.length() + 1);
+      return sizeof(struct sockaddr_un);
+    }
+    struct sockaddr_in &ipv4 = (struct sockaddr_in &) address;
+    ipv4.sin_family = AF_INET;
+    ipv4.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &ipv4.sin_addr) != 1) {
+      throw std::runtime_error("bad IPv4 address: " + host);
+    }
+    return sizeof(struct sockaddr_in);
+  }
+
+ private:
+  static int parseSignal(const std::string &name) {
+    if (name == "HUP" || name == "SIGHUP") {
+      return SIGHUP;
+    } else if (name == "USR1" || name == "SIGUSR1") {
+      return SIGUSR1;
+    } else if (name == "USR2" || name == "SIGUSR2") {
+      return SIGUSR2;
+    }
+    int number = std::atoi(name.c_str());
+    if (number <= 0) {
+      throw std::runtime_error("unknown signal: " + name);
+    }
+    return number;
+  }
+};
@@ -0,0 +1,624 @@
+#pragma once
+#include "LoadOptions.h"
+#include "LoadGenerator.h"
+#include "RequestMix.h"
+#include "Hpack.h"
+#include "Http2Frame.h"
+#include "Clock.h"
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+// One connection of a page load, plain or TLS, non-blocking
+struct PageConnection {
+  int fd;
+  SSL *ssl;
+  bool connecting;
+  bool handshaking;
+  bool wantWrite;   // TLS: the handshake or a read waits for the socket to take data
+  std::string out;  // not yet sent
+  std::size_t sent;
+
+  PageConnection() : fd(-1), ssl(NULL), connecting(false), handshaking(false), wantWrite(false), sent(0) {}
+};
+
+// `-s page`: loads a page of `--assets` files, one after the other, for the whole run, the way a
+// browser does it. Over HTTP/1.1 the files are fetched on up to `-c` connections at a time, a
+// request per connection while the server closes after each response (browsers open six); with
+// --h2 all of them are streams of one connection, sent at once. The latency is that of the whole
+// page, from the first connect to the last byte of the last file, and every page opens its
+// connections anew so that both sides pay for their handshakes.
+class PageLoad {
+ public:
+  static const std::size_t READ_CHUNK = 65536;
+  static const unsigned RECEIVE_WINDOW = 16777216;
+  static const std::size_t MAX_HEADER_LIST = 65536;
+
+ private:
+  // one file of the page on an HTTP/1.1 connection
+  struct Fetch {
+    PageConnection connection;
+    std::size_t path; // index in `paths`, paths.size() when idle
+    std::string head;
+    bool headersDone;
+    long long contentLength;
+    long long bodyRead;
+    bool serverCloses;
+    int status;
+
+    Fetch() : path(0), headersDone(false), contentLength(-1), bodyRead(0), serverCloses(false), status(0) {}
+  };
+
+  // a file of the page on the HTTP/2 connection
+  struct Stream {
+    std::size_t path;
+    std::string block; // header block until END_HEADERS
+    int status;
+    bool done;
+
+    Stream() : path(0), status(0), done(false) {}
+  };
+
+  const LoadOptions &options;
+  std::vector<std::string> paths;
+  struct sockaddr_storage address;
+  socklen_t addressLength;
+  SSL_CTX *tlsContext;
+  char *readBuffer;
+  LoadReport report;
+  LoadReport current; // of the page being loaded
+
+ public:
+  PageLoad(const LoadOptions &options)
+      : options(options), tlsContext(NULL), readBuffer(new char[READ_CHUNK]) {
+    RequestMix::scan(options.docRoot, "/", paths);
+    std::sort(paths.begin(), paths.end());
+    if (paths.empty()) {
+      delete[] readBuffer;
+      throw std::runtime_error("no files found under " + options.docRoot);
+    }
+    if (paths.size() > options.assets) {
+      paths.resize(options.assets);
+    }
+    try {
+      addressLength = options.target(address);
+    } catch (const std::exception &) {
+      delete[] readBuffer;
+      throw;
+    }
+    if (options.tls) {
+      tlsContext = SSL_CTX_new(TLS_client_method());
+      if (tlsContext == NULL) {
+        delete[] readBuffer;
+        throw std::runtime_error("SSL_CTX_new failed");
+      }
+      SSL_CTX_set_verify(tlsContext, SSL_VERIFY_NONE, NULL);
+      SSL_CTX_set_session_cache_mode(tlsContext, SSL_SESS_CACHE_OFF);
+      static const unsigned char H2[] = "\x02h2";
+      static const unsigned char HTTP1[] = "\x08http/1.1";
+      if (options.http2) {
+        SSL_CTX_set_alpn_protos(tlsContext, H2, sizeof(H2) - 1);
+      } else {
+        SSL_CTX_set_alpn_protos(tlsContext, HTTP1, sizeof(HTTP1) - 1);
+      }
+    }
+  }
+
+  virtual ~PageLoad() {
+    delete[] readBuffer;
+    SSL_CTX_free(tlsContext);
+  }
+
+ private:
+  PageLoad(const PageLoad &load);
+  PageLoad &operator=(const PageLoad &load);
+
+ public:
+  // pages count from the end of the warm-up, those that end after the run do not count at all
+  const LoadReport &run() {
+    long long start = Clock::nowMicros();
+    long long measureStart = start + (long long) (options.warmupSeconds * 1e6);
+    long long measureEnd = measureStart + (long long) (options.durationSeconds * 1e6);
+    for (long long now = start; now < measureEnd; now = Clock::nowMicros()) {
+      current = LoadReport();
+      const char *error = options.http2 ? loadHttp2(now) : loadHttp1(now);
+      long long end = Clock::nowMicros();
+      if (now < measureStart || end > measureEnd) {
+        continue;
+      }
+      report.completed += current.completed;
+      report.connects += current.connects;
+      report.bytesReceived += current.bytesReceived;
+      report.tlsHandshakes += current.tlsHandshakes;
+      for (std::map<int, unsigned long>::const_iterator it = current.statuses.begin(); it != current.statuses.end();
+           ++it) {
+        report.statuses[it->first] += it->second;
+      }
+      if (error != NULL) {
+        ++report.errors[error];
+        continue;
+      }
+      ++report.pages;
+      report.latencies.push_back(end - now);
+      report.successLatencies.push_back(end - now);
+    }
+    report.seconds = options.durationSeconds;
+    return report;
+  }
+
+ private:
+  // HTTP/1.1
+
+  // NULL when every file of the page came, else what went wrong
+  const char *loadHttp1(long long startedAt) {
+    std::size_t width = std::min(paths.size(), (std::size_t) options.connections);
+    std::vector<Fetch> fetches(width);
+    std::size_t next = 0;
+    std::size_t done = 0;
+    const char *error = NULL;
+    std::vector<struct pollfd> pollFds(width);
+    for (std::size_t i = 0; i < width; ++i) {
+      fetches[i].path = paths.size();
+    }
+    while (done < paths.size() && error == NULL) {
+      for (std::size_t i = 0; i < width && next < paths.size(); ++i) {
+        if (fetches[i].path == paths.size()) {
+          error = startFetch(fetches[i], next++);
+        }
+      }
+      for (std::size_t i = 0; i < width; ++i) {
+        pollFds[i].fd = fetches[i].path == paths.size() ? -1 : fetches[i].connection.fd;
+        pollFds[i].events = (short) (wantsWrite(fetches[i].connection) ? POLLOUT : POLLIN);
+        pollFds[i].revents = 0;
+      }
+      if (error == NULL && !waitFor(pollFds, startedAt)) {
+        error = "timeout";
+      }
+      for (std::size_t i = 0; i < width && error == NULL; ++i) {
+        if (pollFds[i].revents != 0) {
+          bool finished = false;
+          error = advanceFetch(fetches[i], pollFds[i].revents, finished);
+          done += finished;
+        }
+      }
+    }
+    for (std::size_t i = 0; i < width; ++i) {
+      drop(fetches[i].connection);
+    }
+    return error;
+  }
+
+  const char *startFetch(Fetch &fetch, std::size_t path) {
+    fetch.path = path;
+    fetch.head.clear();
+    fetch.headersDone = false;
+    fetch.contentLength = -1;
+    fetch.bodyRead = 0;
+    fetch.serverCloses = false;
+    fetch.status = 0;
+    std::stringstream ss;
+    ss << "GET " << paths[path] << " HTTP/1.1\r\n"
+       << "Host: " << options.host << ":" << options.port << "\r\n"
+       << "User-Agent: webserv_loadgen\r\n"
+       << "Connection: " << (options.keepAlive ? "keep-alive" : "close") << "\r\n\r\n";
+    fetch.connection.out = ss.str();
+    fetch.connection.sent = 0;
+    if (fetch.connection.fd != -1) {
+      return NULL;
+    }
+    return open(fetch.connection);
+  }
+
+  const char *advanceFetch(Fetch &fetch, short revents, bool &finished) {
+    PageConnection &connection = fetch.connection;
+    const char *error = advanceConnection(connection, revents);
+    if (error != NULL || connection.connecting || connection.handshaking) {
+      return error;
+    }
+    if (!flush(connection)) {
+      return "send";
+    }
+    if (!(revents & (POLLIN | POLLHUP | POLLERR))) {
+      return NULL;
+    }
+    do {
+      ssize_t received = receive(connection, readBuffer, READ_CHUNK);
+      if (received < 0 && errno == EAGAIN) {
+        return NULL;
+      }
+      if (received < 0) {
+        return "recv";
+      }
+      if (received == 0) {
+        if (!fetch.headersDone || fetch.contentLength != -1) {
+          return "closed before response end";
+        }
+        drop(connection);
+        return completeFetch(fetch, finished);
+      }
+      current.bytesReceived += received;
+      consume(fetch, readBuffer, (std::size_t) received);
+    } while (!responseDone(fetch) && connection.ssl != NULL && SSL_pending(connection.ssl) > 0);
+    if (!responseDone(fetch)) {
+      return NULL;
+    }
+    if (fetch.serverCloses || !options.keepAlive) {
+      drop(connection);
+    }
+    return completeFetch(fetch, finished);
+  }
+
+  static bool responseDone(const Fetch &fetch) {
+    return fetch.headersDone && fetch.contentLength != -1 && fetch.bodyRead >= fetch.contentLength;
+  }
+
+  const char *completeFetch(Fetch &fetch, bool &finished) {
+    ++current.completed;
+    ++current.statuses[fetch.status];
+    fetch.path = paths.size();
+    finished = true;
+    return NULL;
+  }
+
+  void consume(Fetch &fetch, const char *data, std::size_t length) {
+    if (fetch.headersDone) {
+      fetch.bodyRead += length;
+      return;
+    }
+    fetch.head.append(data, length);
+    std::size_t end = fetch.head.find("\r\n\r\n");
+    if (end == std::string::npos) {
+      return;
+    }
+    fetch.headersDone = true;
+    fetch.bodyRead = (long long) (fetch.head.length() - end - 4);
+    std::string headers = fetch.head.substr(0, end + 2);
+    std::size_t space = headers.find(' ');
+    fetch.status = space != std::string::npos ? std::atoi(headers.c_str() + space + 1) : 0;
+    for (std::size_t i = 0; i < headers.length(); ++i) {
+      headers[i] = (char) tolower(headers[i]);
+    }
+    std::size_t position = headers.find("\r\ncontent-length:");
+    if (position != std::string::npos) {
+      fetch.contentLength = std::atol(headers.c_str() + position + 17);
+    }
+    fetch.serverCloses = headers.find("\r\nconnection: close") != std::string::npos;
+    fetch.head.clear();
+  }
+
+  // HTTP/2
+
+  const char *loadHttp2(long long startedAt) {
+    PageConnection connection;
+    const char *error = open(connection);
+    HpackEncoder encoder;
+    HpackDecoder decoder(MAX_HEADER_LIST);
+    std::map<unsigned, Stream> streams;
+    std::string input;
+    std::size_t done = 0;
+    bool requested = false;
+    while (error == NULL && done < paths.size()) {
+      if (!requested && !connection.connecting && !connection.handshaking) {
+        error = requestAll(connection, encoder, streams);
+        requested = true;
+        continue;
+      }
+      std::vector<struct pollfd> pollFds(1);
+      pollFds[0].fd = connection.fd;
+      pollFds[0].events = (short) (wantsWrite(connection) ? POLLOUT : POLLIN);
+      pollFds[0].revents = 0;
+      if (!waitFor(pollFds, startedAt)) {
+        error = "timeout";
+        break;
+      }
+      error = advanceConnection(connection, pollFds[0].revents);
+      if (error != NULL || connection.connecting || connection.handshaking || !requested) {
+        continue;
+      }
+      if (!flush(connection)) {
+        error = "send";
+        break;
+      }
+      error = readFrames(connection, input, decoder, streams, done);
+    }
+    drop(connection);
+    return error;
+  }
+
+  const char *requestAll(PageConnection &connection, HpackEncoder &encoder, std::map<unsigned, Stream> &streams) {
+    if (connection.ssl != NULL) {
+      const unsigned char *protocol = NULL;
+      unsigned length = 0;
+      SSL_get0_alpn_selected(connection.ssl, &protocol, &length);
+      if (length != 2 || memcmp(protocol, "h2", 2) != 0) {
+        return "no h2 from alpn";
+      }
+    }
+    std::string &out = connection.out;
+    out.assign(Http2Frame::PREFACE, Http2Frame::PREFACE_LENGTH);
+    std::string settings;
+    Http2Frame::appendSetting(settings, Http2Frame::ENABLE_PUSH, 0);
+    Http2Frame::appendSetting(settings, Http2Frame::INITIAL_WINDOW_SIZE, RECEIVE_WINDOW);
+    Http2Frame::append(out, Http2Frame::SETTINGS, 0, 0, settings.data(), settings.length());
+    Http2Frame::appendWindowUpdate(out, 0, RECEIVE_WINDOW - (unsigned) Http2Frame::DEFAULT_WINDOW);
+    std::stringstream authority;
+    authority << options.host << ":" << options.port;
+    for (std::size_t i = 0; i < paths.size(); ++i) {
+      unsigned id = (unsigned) (2 * i + 1);
+      HpackHeaders headers;
+      headers.push_back(std::make_pair(std::string(":method"), std::string("GET")));
+      headers.push_back(std::make_pair(std::string(":scheme"), std::string(options.tls ? "https" : "http")));
+      headers.push_back(std::make_pair(std::string(":authority"), authority.str()));
+      headers.push_back(std::make_pair(std::string(":path"), paths[i]));
+      headers.push_back(std::make_pair(std::string("user-agent"), std::string("webserv_loadgen")));
+      std::string block;
+      encoder.encode(headers, block);
+      Http2Frame::appendHeaders(out, id, block, true, Http2Frame::DEFAULT_MAX_FRAME);
+      streams[id].path = i;
+    }
+    connection.sent = 0;
+    return flush(connection) ? NULL : "send";
+  }
+
+  const char *readFrames(PageConnection &connection, std::string &input, HpackDecoder &decoder,
+                         std::map<unsigned, Stream> &streams, std::size_t &done) {
+    for (;;) {
+      ssize_t received = receive(connection, readBuffer, READ_CHUNK);
+      if (received < 0 && errno == EAGAIN) {
+        break;
+      }
+      if (received <= 0) {
+        return received == 0 ? "closed before response end" : "recv";
+      }
+      current.bytesReceived += received;
+      input.append(readBuffer, (std::size_t) received);
+    }
+    std::size_t offset = 0;
+    while (input.length() - offset >= Http2Frame::HEADER_LENGTH) {
+      Http2Frame frame = Http2Frame::parse((const unsigned char *) input.data() + offset);
+      if (input.length() - offset - Http2Frame::HEADER_LENGTH < frame.length) {
+        break;
+      }
+      std::string payload = input.substr(offset + Http2Frame::HEADER_LENGTH, frame.length);
+      offset += Http2Frame::HEADER_LENGTH + frame.length;
+      const char *error = handleFrame(connection, frame, payload, decoder, streams, done);
+      if (error != NULL) {
+        return error;
+      }
+    }
+    input.erase(0, offset);
+    return flush(connection) ? NULL : "send";
+  }
+
+  const char *handleFrame(PageConnection &connection, const Http2Frame &frame, const std::string &payload,
+                          HpackDecoder &decoder, std::map<unsigned, Stream> &streams, std::size_t &done) {
+    std::map<unsigned, Stream>::iterator stream = streams.find(frame.streamId);
+    switch (frame.type) {
+      case Http2Frame::SETTINGS:
+        if (!(frame.flags & Http2Frame::ACK)) {
+          Http2Frame::appendHeader(connection.out, 0, Http2Frame::SETTINGS, Http2Frame::ACK, 0);
+        }
+        return NULL;
+      case Http2Frame::PING:
+        if (!(frame.flags & Http2Frame::ACK)) {
+          Http2Frame::append(connection.out, Http2Frame::PING, Http2Frame::ACK, 0, payload.data(), payload.length());
+        }
+        return NULL;
+      case Http2Frame::GOAWAY:
+        return "goaway";
+      case Http2Frame::RST_STREAM:
+        return "stream reset";
+      case Http2Frame::HEADERS:
+      case Http2Frame::CONTINUATION:
+        if (stream == streams.end()) {
+          return "unknown stream";
+        }
+        stream->second.block += frame.type == Http2Frame::HEADERS ? headerBlock(frame, payload) : payload;
+        if (frame.flags & Http2Frame::END_HEADERS) {
+          HpackHeaders headers;
+          if (!decoder.decode(stream->second.block, headers)) {
+            return "hpack";
+          }
+          stream->second.block.clear();
+          for (std::size_t i = 0; i < headers.size(); ++i) {
+            if (headers[i].first == ":status") {
+              stream->second.status = std::atoi(headers[i].second.c_str());
+            }
+          }
+        }
+        break;
+      case Http2Frame::DATA:
+        if (stream == streams.end()) {
+          return "unknown stream";
+        }
+        // hand the window back at once, the page is not the thing measured by flow control
+        if (frame.length != 0) {
+          Http2Frame::appendWindowUpdate(connection.out, 0, (unsigned) frame.length);
+          Http2Frame::appendWindowUpdate(connection.out, frame.streamId, (unsigned) frame.length);
+        }
+        break;
+      default:
+        return NULL;
+    }
+    if ((frame.flags & Http2Frame::END_STREAM) && !stream->second.done) {
+      stream->second.done = true;
+      ++done;
+      ++current.completed;
+      ++current.statuses[stream->second.status];
+    }
+    return NULL;
+  }
+
+  // a HEADERS payload without its padding and RFC 7540 priority
+  static std::string headerBlock(const Http2Frame &frame, const std::string &payload) {
+    std::size_t start = 0;
+    std::size_t padding = 0;
+    if ((frame.flags & Http2Frame::PADDED) && !payload.empty()) {
+      padding = (unsigned char) payload[0];
+      start = 1;
+    }
+    if (frame.flags & Http2Frame::PRIORITY_FLAG) {
+      start += 5;
+    }
+    if (start + padding > payload.length()) {
+      return std::string();
+    }
+    return payload.substr(start, payload.length() - start - padding);
+  }
+
+  // connections
+
+  const char *open(PageConnection &connection) {
+    connection.fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (connection.fd == -1) {
+      return "socket";
+    }
+    int yes = 1;
+    if (address.ss_family != AF_UNIX) {
+      setsockopt(connection.fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    }
+    ++current.connects;
+    if (connect(connection.fd, (struct sockaddr *) &address, addressLength) == -1 && errno != EINPROGRESS) {
+      return "connect";
+    }
+    connection.connecting = true;
+    return NULL;
+  }
+
+  // the connect and the TLS handshake, as far as the socket lets them go
+  const char *advanceConnection(PageConnection &connection, short revents) {
+    if (connection.connecting) {
+      int error = 0;
+      socklen_t length = sizeof(error);
+      getsockopt(connection.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+      if (error != 0 || (revents & (POLLERR | POLLHUP))) {
+        return error == ECONNREFUSED ? "connect refused" : "connect";
+      }
+      connection.connecting = false;
+      if (options.tls) {
+        connection.ssl = SSL_new(tlsContext);
+        if (connection.ssl == NULL || SSL_set_fd(connection.ssl, connection.fd) != 1) {
+          return "tls setup";
+        }
+        SSL_set_connect_state(connection.ssl);
+        connection.handshaking = true;
+      }
+    }
+    if (connection.handshaking) {
+      ERR_clear_error();
+      int result = SSL_do_handshake(connection.ssl);
+      if (result != 1) {
+        int error = SSL_get_error(connection.ssl, result);
+        if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+          return "tls handshake";
+        }
+        connection.wantWrite = error == SSL_ERROR_WANT_WRITE;
+        return NULL;
+      }
+      connection.handshaking = false;
+      connection.wantWrite = false;
+      ++current.tlsHandshakes;
+    }
+    return NULL;
+  }
+
+  static bool wantsWrite(const PageConnection &connection) {
+    return connection.connecting || connection.wantWrite || connection.sent < connection.out.length();
+  }
+
+  // false when the connection failed
+  bool flush(PageConnection &connection) {
+    while (connection.sent < connection.out.length()) {
+      ssize_t written;
+      if (connection.ssl == NULL) {
+        written = send(connection.fd, connection.out.data() + connection.sent,
+                       connection.out.length() - connection.sent, MSG_NOSIGNAL);
+      } else {
+        ERR_clear_error();
+        int result = SSL_write(connection.ssl, connection.out.data() + connection.sent,
+                               (int) (connection.out.length() - connection.sent));
+        written = result > 0 ? result : tlsFailure(connection, result);
+      }
+      if (written < 0 && errno == EAGAIN) {
+        return true;
+      }
+      if (written <= 0) {
+        return false;
+      }
+      connection.sent += written;
+    }
+    connection.out.clear();
+    connection.sent = 0;
+    return true;
+  }
+
+  ssize_t receive(PageConnection &connection, char *data, std::size_t length) {
+    if (connection.ssl == NULL) {
+      return recv(connection.fd, data, length, 0);
+    }
+    ERR_clear_error();
+    int got = SSL_read(connection.ssl, data, (int) length);
+    connection.wantWrite = false;
+    return got > 0 ? got : tlsFailure(connection, got);
+  }
+
+  static ssize_t tlsFailure(PageConnection &connection, int result) {
+    int error = SSL_get_error(connection.ssl, result);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+      connection.wantWrite = error == SSL_ERROR_WANT_WRITE;
+      errno = EAGAIN;
+      return -1;
+    }
+    if (error == SSL_ERROR_ZERO_RETURN) {
+      return 0;
+    }
+    unsigned long reason = ERR_peek_error();
+    if (error == SSL_ERROR_SSL && ERR_GET_REASON(reason) == SSL_R_UNEXPECTED_EOF_WHILE_READING) {
+      return 0;
+    }
+    errno = EPROTO;
+    return -1;
+  }
+
+  static void drop(PageConnection &connection) {
+    if (connection.ssl != NULL) {
+      SSL_set_shutdown(connection.ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+      SSL_free(connection.ssl);
+      connection.ssl = NULL;
+    }
+    if (connection.fd != -1) {
+      close(connection.fd);
+      connection.fd = -1;
+    }
+    connection.connecting = false;
+    connection.handshaking = false;
+    connection.wantWrite = false;
+    connection.out.clear();
+    connection.sent = 0;
+  }
+
+  // false once the page ran past the request timeout
+  bool waitFor(std::vector<struct pollfd> &pollFds, long long startedAt) {
+    long long left = options.timeoutMillis * 1000LL - (Clock::nowMicros() - startedAt);
+    if (left <= 0) {
+      return false;
+    }
+    return poll(&pollFds[0], pollFds.size(), (int) ((left + 999) / 1000)) != 0;
+  }
+};
@@ -0,0 +1,100 @@
+#pragma once
+#include "LoadOptions.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+
+// Prebuilt raw requests of a scenario; connections pick from them with a seeded generator so two
+// runs with the same options send the same sequence.
+class RequestMix {
+ private:
+  std::vector<std::string> requests;
+  unsigned state;
+
+ public:
+  RequestMix(const LoadOptions &options) : state(options.seed ? options.seed : 1) {
+    const std::string &scenario = options.scenario;
+    if (scenario == "static" || scenario == "slow" || scenario == "mixed") {
+      std::vector<std::string> paths;
+      scan(options.docRoot, "/", paths);
+      std::sort(paths.begin(), paths.end());
+      if (paths.empty()) {
+        throw std::runtime_error("no files found under " + options.docRoot);
+      }
+      for (std::size_t i = 0; i < paths.size(); ++i) {
+        requests.push_back(build(options, "GET", paths[i], ""));
+      }
+    }
+    if (scenario == "post" || scenario == "mixed") {
+      requests.push_back(build(options, "POST", options.postPath, std::string(options.postBytes, 'p')));
+    }
+    if (scenario == "cgi" || scenario == "mixed") {
+      requests.push_back(build(options, "POST", options.cgiPath, "loadgen"));
+    }
+    if (scenario == "cgi-get") {
+      requests.push_back(build(options, "GET", options.cgiPath, ""));
+    }
+    if (requests.empty()) {
+      throw std::runtime_error("unknown scenario: " + scenario);
+    }
+  }
+
+  std::size_t size() const {
+    return requests.size();
+  }
+
+  const std::string &next() {
+    // xorshift32: cheap and deterministic
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return requests[state % requests.size()];
+  }
+
+ private:
+  static std::string build(const LoadOptions &options, const char *method, const std::string &path,
+                           const std::string &body) {
+    std::stringstream ss;
+    ss << method << " " << path << " HTTP/1.1\r\n"
+       << "Host: " << options.host << ":" << options.port << "\r\n"
+       << "User-Agent: webserv_loadgen\r\n"
+       << "Connection: " << (options.keepAlive ? "keep-alive" : "close") << "\r\n";
+    if (!body.empty()) {
+      ss << "Content-Length: " << body.length() << "\r\n";
+    }
+    ss << "\r\n" << body;
+    return ss.str();
+  }
+
+ public:
+  // the files under `directory`, as the URLs they are served at below `url`
+  static void scan(const std::string &directory, const std::string &url, std::vector<std::string> &paths) {
+    DIR *dir = opendir(directory.c_str());
+    if (dir == NULL) {
+      return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      std::string name(entry->d_name);
+      if (name == "." || name == "..") {
+        continue;
+      }
+      std::string filePath = directory + "/" + name;
+      struct stat fileStat;
+      if (stat(filePath.c_str(), &fileStat) != 0) {
+        continue;
+      }
+      if (S_ISDIR(fileStat.st_mode)) {
+        scan(filePath, url + name + "/", paths);
+      } else if (S_ISREG(fileStat.st_mode)) {
+        paths.push_back(url + name);
+      }
+    }
+    closedir(dir);
+  }
+};
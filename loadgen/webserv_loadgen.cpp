@@ -0,0 +1,185 @@
+#include "LoadGenerator.h"
+#include "PageLoad.h"
+
+#include <cstdio>
+#include <signal.h>
+
+// End-to-end load generator. Start the server first, e.g.
+//   ./_build/webserv test.conf &
+//   ./_build/webserv_loadgen --port 8080 -c 32 -d 10 -s static
+// and run from the repository root so that the static mix finds `html/`. The page scenario compares
+// HTTP/1.1 and HTTP/2 on a page of many small files:
+//   ./_build/webserv_loadgen -s page --root www --assets 50 -c 6
+//   ./_build/webserv_loadgen -s page --root www --assets 50 --h2
+
+namespace {
+
+long long percentile(const std::vector<long long> &sorted, double fraction) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  std::size_t rank = (std::size_t) (fraction * (sorted.size() - 1) + 0.5);
+  return sorted[rank];
+}
+
+// HdrHistogram-style correction for closed-loop runs: a response that took longer than the
+// expected interval hid the requests that would have been sent meanwhile, so add them back with
+// linearly decreasing latencies.
+std::vector<long long> corrected(const std::vector<long long> &latencies, long long expectedInterval) {
+  static const long long MAX_BACKFILL = 10000;
+  std::vector<long long> result(latencies);
+  if (expectedInterval <= 0) {
+    return result;
+  }
+  for (std::size_t i = 0; i < latencies.size(); ++i) {
+    long long missing = latencies[i] - expectedInterval;
+    for (long long count = 0; missing >= expectedInterval && count < MAX_BACKFILL; ++count) {
+      result.push_back(missing);
+      missing -= expectedInterval;
+    }
+  }
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+struct Summary {
+  long long p50;
+  long long p90;
+  long long p99;
+  long long p999;
+  long long max;
+  double mean;
+
+  Summary(const std::vector<long long> &sorted)
+      : p50(percentile(sorted, 0.5)), p90(percentile(sorted, 0.9)), p99(percentile(sorted, 0.99)),
+        p999(percentile(sorted, 0.999)), max(sorted.empty() ? 0 : sorted.back()), mean(0) {
+    for (std::size_t i = 0; i < sorted.size(); ++i) {
+      mean += sorted[i];
+    }
+    mean = sorted.empty() ? 0 : mean / sorted.size();
+  }
+};
+
+void printText(const LoadOptions &options, const LoadReport &report, const Summary &latency,
+               const Summary *closedLoop, const Summary &success) {
+  unsigned long errors = 0;
+  for (std::map<std::string, unsigned long>::const_iterator it = report.errors.begin(); it != report.errors.end();
+       ++it) {
+    errors += it->second;
+  }
+  int connections = options.scenario == "page" && options.http2 ? 1 : options.connections;
+  std::printf("scenario %s, %d connections, %s, %s, %.1fs\n", options.scenario.c_str(), connections,
+              options.keepAlive ? "keep-alive" : "close",
+              options.rate > 0 ? "open loop" : "closed loop", report.seconds);
+  if (options.rate > 0) {
+    std::printf("  target rate   %.0f req/s\n", options.rate);
+  }
+  if (options.scenario == "page") {
+    std::printf("  pages         %lu of %lu files over %s, %.1f pages/s\n", report.pages,
+                report.pages != 0 ? report.completed / report.pages : 0UL, options.http2 ? "h2" : "http/1.1",
+                report.pages / report.seconds);
+  }
+  std::printf("  requests      %lu (%lu connects, %lu errors)\n", report.completed, report.connects, errors);
+  std::printf("  throughput    %.1f req/s, %.2f MB/s\n", report.completed / report.seconds,
+              report.bytesReceived / report.seconds / 1e6);
+  if (options.tls) {
+    std::printf("  tls           %lu handshakes (%lu resumed), %.1f/s\n", report.tlsHandshakes, report.tlsResumed,
+                report.tlsHandshakes / report.seconds);
+  }
+  if (options.signalPid != 0) {
+    std::printf("  signals       %lu sent to %ld\n", report.signalsSent, (long) options.signalPid);
+  }
+  std::printf("  %-13s p50 %lld  p90 %lld  p99 %lld  p99.9 %lld  max %lld  mean %.0f\n",
+              options.scenario == "page" ? "page load us" : "latency us", latency.p50, latency.p90, latency.p99,
+              latency.p999, latency.max, latency.mean);
+  if (closedLoop != NULL) {
+    std::printf("  corrected us  p50 %lld  p90 %lld  p99 %lld  p99.9 %lld  max %lld  mean %.0f  (interval %lld us)\n",
+                closedLoop->p50, closedLoop->p90, closedLoop->p99, closedLoop->p999, closedLoop->max,
+                closedLoop->mean, report.expectedIntervalMicros);
+  }
+  if (report.successLatencies.size() != report.latencies.size()) {
+    std::printf("  2xx us        p50 %lld  p90 %lld  p99 %lld  p99.9 %lld  max %lld  mean %.0f\n", success.p50,
+                success.p90, success.p99, success.p999, success.max, success.mean);
+  }
+  for (std::map<int, unsigned long>::const_iterator it = report.statuses.begin(); it != report.statuses.end(); ++it) {
+    std::printf("  status %d     %lu\n", it->first, it->second);
+  }
+  for (std::map<std::string, unsigned long>::const_iterator it = report.errors.begin(); it != report.errors.end();
+       ++it) {
+    std::printf("  error %-20s %lu\n", it->first.c_str(), it->second);
+  }
+}
+
+void printSummaryJson(const char *name, const Summary &summary) {
+  std::printf("\"%s\":{\"p50\":%lld,\"p90\":%lld,\"p99\":%lld,\"p999\":%lld,\"max\":%lld,\"mean\":%.1f}", name,
+              summary.p50, summary.p90, summary.p99, summary.p999, summary.max, summary.mean);
+}
+
+void printJson(const LoadOptions &options, const LoadReport &report, const Summary &latency,
+               const Summary *closedLoop, const Summary &success) {
+  std::printf("{\"scenario\":\"%s\",\"connections\":%d,\"keepalive\":%s,\"rate\":%.1f,\"seconds\":%.3f,"
+              "\"requests\":%lu,\"connects\":%lu,\"rps\":%.1f,\"bytes_per_sec\":%.1f,\"signals\":%lu,"
+              "\"tls_handshakes\":%lu,\"tls_resumed\":%lu,\"http2\":%s,\"pages\":%lu,",
+              options.scenario.c_str(), options.connections, options.keepAlive ? "true" : "false", options.rate,
+              report.seconds, report.completed, report.connects, report.completed / report.seconds,
+              report.bytesReceived / report.seconds, report.signalsSent, report.tlsHandshakes, report.tlsResumed,
+              options.http2 ? "true" : "false", report.pages);
+  printSummaryJson("latency_us", latency);
+  if (closedLoop != NULL) {
+    std::printf(",");
+    printSummaryJson("corrected_latency_us", *closedLoop);
+  }
+  std::printf(",");
+  printSummaryJson("success_latency_us", success);
+  std::printf(",\"statuses\":{");
+  for (std::map<int, unsigned long>::const_iterator it = report.statuses.begin(); it != report.statuses.end(); ++it) {
+    std::printf("%s\"%d\":%lu", it == report.statuses.begin() ? "" : ",", it->first, it->second);
+  }
+  std::printf("},\"errors\":{");
+  for (std::map<std::string, unsigned long>::const_iterator it = report.errors.begin(); it != report.errors.end();
+       ++it) {
+    std::printf("%s\"%s\":%lu", it == report.errors.begin() ? "" : ",", it->first.c_str(), it->second);
+  }
+  std::printf("}}\n");
+}
+
+}
+
+int main(int ac, char *av[]) {
+  LoadOptions options;
+  try {
+    options.parse(ac, av);
+  } catch (std::exception &e) {
+    std::fprintf(stderr, "%s\n%s", e.what(), LoadOptions::usage());
+    return 2;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  try {
+    LoadReport report;
+    if (options.scenario == "page") {
+      PageLoad load(options);
+      report = load.run();
+    } else {
+      LoadGenerator generator(options);
+      report = generator.run();
+    }
+    std::sort(report.latencies.begin(), report.latencies.end());
+    Summary latency(report.latencies);
+    std::sort(report.successLatencies.begin(), report.successLatencies.end());
+    Summary success(report.successLatencies);
+    Summary *closedLoop = NULL;
+    if (options.rate <= 0 && options.scenario != "page") {
+      closedLoop = new Summary(corrected(report.latencies, report.expectedIntervalMicros));
+    }
+    if (options.json) {
+      printJson(options, report, latency, closedLoop, success);
+    } else {
+      printText(options, report, latency, closedLoop, success);
+    }
+    delete closedLoop;
+  } catch (std::exception &e) {
+    std::fprintf(stderr, "webserv_loadgen: %s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,248 @@
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// Counts the system calls of a running process, all of its threads, for a while. Next to a load
+// generator at a fixed rate it gives system calls per request:
+//   ./_build/webserv_loadgen -c 8 -d 5 -R 2000 &
+//   ./_build/webserv_syscount $(pgrep -x webserv) -d 4 -n 8000
+// -n is the number of requests served meanwhile, it adds a per request column. Tracing slows the
+// process down, measure throughput without it.
+
+namespace {
+
+struct SyscountOptions {
+  pid_t pid;
+  int seconds;
+  unsigned long requests;
+
+  SyscountOptions() : pid(0), seconds(5), requests(0) {}
+};
+
+struct SyscallName {
+  long number;
+  const char *name;
+};
+
+#define SYSCALL_NAME(call) {__NR_##call, #call}
+
+const SyscallName SYSCALL_NAMES[] = {
+    SYSCALL_NAME(read), SYSCALL_NAME(write), SYSCALL_NAME(readv), SYSCALL_NAME(writev), SYSCALL_NAME(pread64),
+    SYSCALL_NAME(openat), SYSCALL_NAME(close), SYSCALL_NAME(fstat), SYSCALL_NAME(newfstatat), SYSCALL_NAME(statx),
+    SYSCALL_NAME(lseek), SYSCALL_NAME(getdents64), SYSCALL_NAME(faccessat), SYSCALL_NAME(unlinkat),
+    SYSCALL_NAME(ppoll), SYSCALL_NAME(epoll_pwait), SYSCALL_NAME(accept), SYSCALL_NAME(accept4),
+    SYSCALL_NAME(recvfrom), SYSCALL_NAME(sendto), SYSCALL_NAME(recvmsg), SYSCALL_NAME(sendmsg),
+    SYSCALL_NAME(shutdown), SYSCALL_NAME(getpeername), SYSCALL_NAME(getsockname), SYSCALL_NAME(setsockopt),
+    SYSCALL_NAME(fcntl), SYSCALL_NAME(splice), SYSCALL_NAME(pipe2), SYSCALL_NAME(eventfd2), SYSCALL_NAME(futex),
+    SYSCALL_NAME(nanosleep), SYSCALL_NAME(clock_nanosleep), SYSCALL_NAME(clock_gettime), SYSCALL_NAME(gettimeofday),
+    SYSCALL_NAME(mmap), SYSCALL_NAME(munmap), SYSCALL_NAME(mremap), SYSCALL_NAME(brk), SYSCALL_NAME(madvise),
+    SYSCALL_NAME(rt_sigaction), SYSCALL_NAME(rt_sigprocmask), SYSCALL_NAME(rt_sigreturn), SYSCALL_NAME(wait4),
+    SYSCALL_NAME(restart_syscall), SYSCALL_NAME(clone), SYSCALL_NAME(execve), SYSCALL_NAME(io_uring_enter),
+    SYSCALL_NAME(io_uring_register),
+#ifdef __NR_poll
+    SYSCALL_NAME(poll), SYSCALL_NAME(open), SYSCALL_NAME(stat), SYSCALL_NAME(access), SYSCALL_NAME(pipe),
+#endif
+};
+
+#undef SYSCALL_NAME
+
+std::string syscallName(long number) {
+  for (std::size_t i = 0; i < sizeof(SYSCALL_NAMES) / sizeof(SYSCALL_NAMES[0]); ++i) {
+    if (SYSCALL_NAMES[i].number == number) {
+      return SYSCALL_NAMES[i].name;
+    }
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "syscall_%ld", number);
+  return name;
+}
+
+void usage() {
+  fprintf(stderr, "usage: webserv_syscount PID [-d seconds] [-n requests]\n");
+  exit(2);
+}
+
+SyscountOptions parseOptions(int argc, char **argv) {
+  SyscountOptions options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if ((arg == "-d" || arg == "-n") && i + 1 < argc) {
+      long value = atol(argv[++i]);
+      if (value <= 0) {
+        usage();
+      }
+      if (arg == "-d") {
+        options.seconds = (int) value;
+      } else {
+        options.requests = (unsigned long) value;
+      }
+    } else if (options.pid == 0 && atol(arg.c_str()) > 0) {
+      options.pid = (pid_t) atol(arg.c_str());
+    } else {
+      usage();
+    }
+  }
+  if (options.pid == 0) {
+    usage();
+  }
+  return options;
+}
+
+volatile sig_atomic_t timeIsUp = 0;
+
+void onAlarm(int) {
+  timeIsUp = 1;
+}
+
+std::vector<pid_t> threadsOf(pid_t pid) {
+  std::vector<pid_t> threads;
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/task", (int) pid);
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    return threads;
+  }
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    if (ent->d_name[0] != '.') {
+      threads.push_back((pid_t) atol(ent->d_name));
+    }
+  }
+  closedir(dir);
+  return threads;
+}
+
+class SyscallCounter {
+  std::set<pid_t> traced;
+  std::map<long, unsigned long> counts;
+  unsigned long total;
+
+ public:
+  SyscallCounter() : total(0) {}
+
+  // seizes every thread; threads the process starts later are followed through PTRACE_O_TRACECLONE
+  bool attach(pid_t pid) {
+    std::vector<pid_t> threads = threadsOf(pid);
+    for (std::size_t i = 0; i < threads.size(); ++i) {
+      long options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE;
+      if (ptrace(PTRACE_SEIZE, threads[i], NULL, (void *) options) != 0) {
+        fprintf(stderr, "webserv_syscount: cannot trace thread %d: %s\n", (int) threads[i], strerror(errno));
+        continue;
+      }
+      ptrace(PTRACE_INTERRUPT, threads[i], NULL, NULL);
+      traced.insert(threads[i]);
+    }
+    return !traced.empty();
+  }
+
+  // counts until SIGALRM, then lets every thread go
+  void run() {
+    bool interrupted = false;
+    while (!traced.empty()) {
+      if (timeIsUp && !interrupted) {
+        interruptAll();
+        interrupted = true;
+      }
+      int status;
+      pid_t tid = waitpid(-1, &status, __WALL);
+      if (tid == -1 && errno == EINTR) {
+        continue;
+      }
+      if (tid == -1) {
+        break;
+      }
+      if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        traced.erase(tid);
+        continue;
+      }
+      traced.insert(tid);
+      handleStop(tid, status);
+    }
+  }
+
+  void print(const SyscountOptions &options) const {
+    std::vector<std::pair<unsigned long, long> > sorted;
+    for (std::map<long, unsigned long>::const_iterator it = counts.begin(); it != counts.end(); ++it) {
+      sorted.push_back(std::make_pair(it->second, it->first));
+    }
+    std::sort(sorted.rbegin(), sorted.rend());
+    printf("pid %d, %d s\n", (int) options.pid, options.seconds);
+    printf("  %-20s %12s%s\n", "syscall", "calls", options.requests ? "   per request" : "");
+    for (std::size_t i = 0; i < sorted.size(); ++i) {
+      printCount(syscallName(sorted[i].second), sorted[i].first, options.requests);
+    }
+    printCount("total", total, options.requests);
+  }
+
+ private:
+  static void printCount(const std::string &name, unsigned long calls, unsigned long requests) {
+    if (requests == 0) {
+      printf("  %-20s %12lu\n", name.c_str(), calls);
+    } else {
+      printf("  %-20s %12lu %14.2f\n", name.c_str(), calls, (double) calls / requests);
+    }
+  }
+
+  void handleStop(pid_t tid, int status) {
+    int signal = WIFSTOPPED(status) ? WSTOPSIG(status) : 0;
+    int event = status >> 16;
+    int deliver = 0;
+    if (signal == (SIGTRAP | 0x80)) {
+      countSyscall(tid);
+    } else if (event == 0 && signal != SIGTRAP) {
+      deliver = signal; // a signal sent to the process: handed on
+    }
+    if (timeIsUp) {
+      ptrace(PTRACE_DETACH, tid, NULL, (void *) (long) deliver);
+      traced.erase(tid);
+      return;
+    }
+    ptrace(PTRACE_SYSCALL, tid, NULL, (void *) (long) deliver);
+  }
+
+  void countSyscall(pid_t tid) {
+    struct __ptrace_syscall_info info;
+    long size = ptrace(PTRACE_GET_SYSCALL_INFO, tid, (void *) sizeof(info), &info);
+    if (size > 0 && info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+      ++counts[(long) info.entry.nr];
+      ++total;
+    }
+  }
+
+  // each thread stops once more and is detached there
+  void interruptAll() {
+    for (std::set<pid_t>::iterator it = traced.begin(); it != traced.end(); ++it) {
+      ptrace(PTRACE_INTERRUPT, *it, NULL, NULL);
+    }
+  }
+};
+
+} // namespace
+
+int main(int argc, char **argv) {
+  SyscountOptions options = parseOptions(argc, argv);
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = onAlarm; // no SA_RESTART: the alarm breaks waitpid
+  sigaction(SIGALRM, &action, NULL);
+  SyscallCounter counter;
+  if (!counter.attach(options.pid)) {
+    return 1;
+  }
+  alarm(options.seconds);
+  counter.run();
+  counter.print(options);
+  return 0;
+}
@@ -0,0 +1,394 @@
+#pragma once
+#include "BufferedLogFile.h"
+#include "RequestTiming.h"
+#include "HttpMethod.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <cctype>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+// What the access log needs to know about one finished request. Pointers are borrowed from the
+// client for the duration of AccessLog::log().
+struct AccessLogEntry {
+  const struct sockaddr_storage *remoteAddr;
+  HttpMethod method;
+  const std::string *path;
+  int status;
+  unsigned long bytesSent;
+  unsigned long requestLength;
+  long long requestMicros;
+  long long upstreamMicros; // -1 when no CGI ran
+  int serverPort;
+  const std::string *serverName;
+  const RequestTiming *timing;
+
+  AccessLogEntry() : remoteAddr(NULL), method(UNKNOWN_METHOD), path(NULL), status(0), bytesSent(0),
+                     requestLength(0), requestMicros(0), upstreamMicros(-1), serverPort(0), serverName(NULL),
+                     timing(NULL) {}
+};
+
+// `access_log` / `log_format` settings of one server block
+struct AccessLogConfig {
+  std::string path; // empty: access log off
+  std::string format;
+  bool json;
+  std::size_t bufferSize;
+  long flushMillis;
+
+  AccessLogConfig() : format(AccessLogConfig::COMBINED), json(false), bufferSize(64 * 1024), flushMillis(1000) {}
+
+  static const char *COMBINED;
+};
+
+const char *AccessLogConfig::COMBINED =
+    "$remote_addr - [$time_local] \"$request_method $request_uri\" $status $bytes_sent $request_time $upstream_response_time";
+
+// nginx-style access log. The format is compiled once into a list of literals and variables; each
+// request is rendered straight into the BufferedLogFile, so the steady-state cost is a few memcpy
+// per request. Logs of different formats on one path share the file and its buffer, the last one
+// closes it.
+class AccessLog {
+ public:
+  static const std::size_t VALUE_WIDTH = 48;
+
+  enum Variable {
+    LITERAL,
+    REMOTE_ADDR,
+    TIME_LOCAL,
+    TIME_ISO8601,
+    REQUEST_METHOD,
+    REQUEST_URI,
+    STATUS,
+    BYTES_SENT,
+    REQUEST_LENGTH,
+    REQUEST_TIME,
+    UPSTREAM_RESPONSE_TIME,
+    SERVER_NAME,
+    SERVER_PORT,
+    // request phases, see RequestTiming
+    FIRST_BYTE_WAIT_TIME,
+    HEADER_TIME,
+    BODY_TIME,
+    HANDLER_TIME,
+    TTFB,
+    SEND_TIME
+  };
+
+ private:
+  struct Token {
+    Variable variable;
+    std::string text; // literal text, or the variable name for json keys
+  };
+
+  BufferedLogFile &out;
+  int *fileUsers; // access logs writing into `out`
+  std::string format;
+  bool json;
+  bool phases;
+  std::vector<Token> tokens;
+  std::size_t lineWidth; // bytes of a line but for its paths and names, at most
+  time_t cachedSecond;
+  char cachedLocal[40];
+  char cachedIso[40];
+
+ public:
+  AccessLog(const AccessLogConfig &config)
+      : out(*new BufferedLogFile(config.path, config.bufferSize, config.flushMillis)), fileUsers(new int(1)),
+        format(config.format), json(config.json), phases(false), lineWidth(0), cachedSecond(-1) {
+    compileFormat();
+  }
+
+  // another format written into the file of `shared`; its buffer and flush settings stay
+  AccessLog(const AccessLogConfig &config, AccessLog &shared)
+      : out(shared.out), fileUsers(shared.fileUsers), format(config.format), json(config.json), phases(false),
+        lineWidth(0), cachedSecond(-1) {
+    ++*fileUsers;
+    compileFormat();
+  }
+
+  virtual ~AccessLog() {
+    releaseFile();
+  }
+
+ private:
+  AccessLog(const AccessLog &);
+  AccessLog &operator=(const AccessLog &);
+
+ public:
+  BufferedLogFile &getFile() {
+    return out;
+  }
+
+  // true when lines for `config` are rendered the same way by this log
+  bool hasFormat(const AccessLogConfig &config) const {
+    return format == config.format && json == config.json;
+  }
+
+  // true when the format prints phase timings, so clients must take every RequestTiming mark
+  bool needsPhases() const {
+    return phases;
+  }
+
+  void log(const AccessLogEntry &entry) {
+    // a line never exceeds the reserve except for absurd paths, which are cut
+    std::size_t names = entry.serverName ? entry.serverName->length() * 2 : 0;
+    out.reserve(lineWidth + names + (entry.path ? entry.path->length() * 2 : 0));
+    if (json) {
+      renderJson(entry);
+    } else {
+      renderText(entry);
+    }
+    out.endRecord();
+  }
+
+ private:
+  void compileFormat() {
+    try {
+      compile(format);
+    } catch (...) {
+      releaseFile();
+      throw;
+    }
+  }
+
+  void releaseFile() {
+    if (--*fileUsers == 0) {
+      delete &out;
+      delete fileUsers;
+    }
+  }
+
+  void compile(const std::string &format) {
+    std::size_t i = 0;
+    std::string literal;
+    while (i < format.length()) {
+      if (format[i] != '$') {
+        literal += format[i++];
+        continue;
+      }
+      std::size_t end = i + 1;
+      while (end < format.length() && (isalnum(format[end]) || format[end] == '_')) {
+        ++end;
+      }
+      std::string name = format.substr(i + 1, end - i - 1);
+      Variable variable = lookup(name);
+      if (variable == LITERAL) {
+        throw std::runtime_error("Config file error: unknown log_format variable $" + name + ". Exiting...");
+      }
+      if (variable >= FIRST_BYTE_WAIT_TIME) {
+        phases = true;
+      }
+      if (!literal.empty()) {
+        addToken(LITERAL, literal);
+        literal.clear();
+      }
+      addToken(variable, name);
+      i = end;
+    }
+    if (!literal.empty()) {
+      addToken(LITERAL, literal);
+    }
+  }
+
+  void addToken(Variable variable, const std::string &text) {
+    // a number or address is under VALUE_WIDTH; json adds the key, quotes and separators
+    lineWidth += variable == LITERAL ? (json ? 0 : text.length()) : VALUE_WIDTH + (json ? text.length() + 8 : 0);
+    Token token;
+    token.variable = variable;
+    token.text = text;
+    tokens.push_back(token);
+  }
+
+  static Variable lookup(const std::string &name) {
+    if (name == "remote_addr") return REMOTE_ADDR;
+    if (name == "time_local") return TIME_LOCAL;
+    if (name == "time_iso8601") return TIME_ISO8601;
+    if (name == "request_method") return REQUEST_METHOD;
+    if (name == "request_uri") return REQUEST_URI;
+    if (name == "status") return STATUS;
+    if (name == "bytes_sent") return BYTES_SENT;
+    if (name == "request_length") return REQUEST_LENGTH;
+    if (name == "request_time") return REQUEST_TIME;
+    if (name == "upstream_response_time") return UPSTREAM_RESPONSE_TIME;
+    if (name == "server_name") return SERVER_NAME;
+    if (name == "server_port") return SERVER_PORT;
+    if (name == "first_byte_wait_time") return FIRST_BYTE_WAIT_TIME;
+    if (name == "header_time") return HEADER_TIME;
+    if (name == "body_time") return BODY_TIME;
+    if (name == "handler_time") return HANDLER_TIME;
+    if (name == "ttfb") return TTFB;
+    if (name == "send_time") return SEND_TIME;
+    return LITERAL;
+  }
+
+  void renderText(const AccessLogEntry &entry) {
+    for (std::vector<Token>::const_iterator it = tokens.begin(); it != tokens.end(); ++it) {
+      if (it->variable == LITERAL) {
+        out.put(it->text.data(), it->text.length());
+      } else {
+        renderVariable(it->variable, entry, false);
+      }
+    }
+  }
+
+  void renderJson(const AccessLogEntry &entry) {
+    out.put('{');
+    bool first = true;
+    for (std::vector<Token>::const_iterator it = tokens.begin(); it != tokens.end(); ++it) {
+      if (it->variable == LITERAL) {
+        continue;
+      }
+      if (!first) {
+        out.put(',');
+      }
+      first = false;
+      out.put('"');
+      out.put(it->text.data(), it->text.length());
+      out.put("\":", 2);
+      renderVariable(it->variable, entry, true);
+    }
+    out.put('}');
+  }
+
+  void renderVariable(Variable variable, const AccessLogEntry &entry, bool quoted) {
+    switch (variable) {
+      case REMOTE_ADDR: {
+        char address[INET6_ADDRSTRLEN] = "-";
+        if (entry.remoteAddr != NULL) {
+          formatAddress(*entry.remoteAddr, address, sizeof(address));
+        }
+        putString(address, strlen(address), quoted);
+        break;
+      }
+      case TIME_LOCAL:
+        refreshTime();
+        putString(cachedLocal, strlen(cachedLocal), quoted);
+        break;
+      case TIME_ISO8601:
+        refreshTime();
+        putString(cachedIso, strlen(cachedIso), quoted);
+        break;
+      case REQUEST_METHOD: {
+        const char *name = methodName(entry.method);
+        putString(name, strlen(name), quoted);
+        break;
+      }
+      case REQUEST_URI:
+        if (entry.path != NULL) {
+          putString(entry.path->data(), entry.path->length(), quoted);
+        } else {
+          putString("-", 1, quoted);
+        }
+        break;
+      case STATUS:
+        out.putSigned(entry.status);
+        break;
+      case BYTES_SENT:
+        out.putUnsigned(entry.bytesSent);
+        break;
+      case REQUEST_LENGTH:
+        out.putUnsigned(entry.requestLength);
+        break;
+      case REQUEST_TIME:
+        out.putSeconds(entry.requestMicros);
+        break;
+      case UPSTREAM_RESPONSE_TIME:
+        putOptionalSeconds(entry.upstreamMicros, quoted, false);
+        break;
+      case SERVER_NAME:
+        if (entry.serverName != NULL) {
+          putString(entry.serverName->data(), entry.serverName->length(), quoted);
+        } else {
+          putString("-", 1, quoted);
+        }
+        break;
+      case SERVER_PORT:
+        out.putSigned(entry.serverPort);
+        break;
+      case FIRST_BYTE_WAIT_TIME:
+        putPhase(entry, RequestTiming::ACCEPTED, RequestTiming::FIRST_BYTE, quoted);
+        break;
+      case HEADER_TIME:
+        putPhase(entry, RequestTiming::FIRST_BYTE, RequestTiming::HEADERS_PARSED, quoted);
+        break;
+      case BODY_TIME:
+        putPhase(entry, RequestTiming::HEADERS_PARSED, RequestTiming::HANDLER_START, quoted);
+        break;
+      case HANDLER_TIME:
+        putPhase(entry, RequestTiming::HANDLER_START, RequestTiming::HANDLER_END, quoted);
+        break;
+      case TTFB:
+        putPhase(entry, RequestTiming::ACCEPTED, RequestTiming::FIRST_BYTE_SENT, quoted);
+        break;
+      case SEND_TIME:
+        putPhase(entry, RequestTiming::FIRST_BYTE_SENT, RequestTiming::LAST_BYTE_SENT, quoted);
+        break;
+      case LITERAL:
+        break;
+    }
+  }
+
+  void putPhase(const AccessLogEntry &entry, RequestTiming::Phase from, RequestTiming::Phase to, bool quoted) {
+    putOptionalSeconds(entry.timing != NULL ? entry.timing->between(from, to) : -1, quoted, true);
+  }
+
+  void putOptionalSeconds(long long micros, bool quoted, bool precise) {
+    if (micros < 0) {
+      quoted ? out.put("null", 4) : out.put('-');
+    } else if (precise) {
+      out.putSecondsPrecise(micros);
+    } else {
+      out.putSeconds(micros);
+    }
+  }
+
+  void putString(const char *data, std::size_t count, bool quoted) {
+    if (quoted) {
+      out.putJsonString(data, count);
+    } else {
+      out.put(data, count);
+    }
+  }
+
+  void refreshTime() {
+    time_t now = time(NULL);
+    if (now == cachedSecond) {
+      return;
+    }
+    struct tm parts;
+    localtime_r(&now, &parts);
+    strftime(cachedLocal, sizeof(cachedLocal), "%d/%b/%Y:%H:%M:%S %z", &parts);
+    strftime(cachedIso, sizeof(cachedIso), "%Y-%m-%dT%H:%M:%S%z", &parts);
+    cachedSecond = now;
+  }
+
+  static void formatAddress(const struct sockaddr_storage &address, char *out, std::size_t size) {
+    if (address.ss_family == AF_INET) {
+      // inet_ntop is several times slower than this for the common case
+      const unsigned char *octets = (const unsigned char *) &((const struct sockaddr_in &) address).sin_addr;
+      for (int i = 0; i < 4; ++i) {
+        out += BufferedLogFile::formatUnsigned(out, octets[i]);
+        *out++ = i < 3 ? '.' : 0;
+      }
+    } else if (address.ss_family == AF_INET6) {
+      inet_ntop(AF_INET6, &((const struct sockaddr_in6 &) address).sin6_addr, out, size);
+    } else if (address.ss_family == AF_UNIX) {
+      strncpy(out, "unix:", size);
+    }
+  }
+
+  static const char *methodName(HttpMethod method) {
+    switch (method) {
+      case GET: return "GET";
+      case POST: return "POST";
+      case DELETE: return "DELETE";
+      default: return "-";
+    }
+  }
+};
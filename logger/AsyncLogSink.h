@@ -0,0 +1,228 @@
+#pragma once
+#include "LogRing.h"
+
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <stdexcept>
+
+// Process-wide log destination. Producers copy a formatted line into the LogRing and return;
+// a background thread drains the ring and writes whole batches with one write(2) each, so the
+// event loop never blocks on (or flushes) the log file. Only an error line that finds the ring
+// full is written by the producer itself.
+class AsyncLogSink {
+ public:
+  static const std::size_t BATCH_SIZE = 64 * 1024;
+  static const long MIN_IDLE_SLEEP_NS = 1000000;   // 1 ms
+  static const long MAX_IDLE_SLEEP_NS = 32000000;  // 32 ms
+  static const char *SPRING_GREEN_SET;
+  static const char *RESET;
+
+ private:
+  LogRing ring;
+  int fd;
+  bool colored;
+  bool started;
+  bool stopping;
+  bool forked;
+  pthread_t thread;
+  pthread_mutex_t startMutex;
+  char batch[BATCH_SIZE];
+  std::size_t batchLength;
+  time_t cachedSecond;
+  char cachedStamp[32];
+
+  AsyncLogSink() : fd(STDERR_FILENO), colored(isatty(STDERR_FILENO)), started(false), stopping(false),
+                   forked(false), batchLength(0), cachedSecond(-1) {
+    pthread_mutex_init(&startMutex, NULL);
+    cachedStamp[0] = 0;
+  }
+
+  AsyncLogSink(const AsyncLogSink &);
+  AsyncLogSink &operator=(const AsyncLogSink &);
+
+ public:
+  static AsyncLogSink &instance() {
+    static AsyncLogSink sink;
+    return sink;
+  }
+
+  // redirect output to a file, "stderr" keeps the default
+  void open(const std::string &path) {
+    if (path.empty() || path == "stderr") {
+      return;
+    }
+    int newFd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (newFd == -1) {
+      throw std::runtime_error("Could not open log file: " + path);
+    }
+    fd = newFd;
+    colored = false;
+  }
+
+  void push(int level, const char *message, std::size_t length) {
+    if (forked) {
+      // a CGI child has no drainer thread, so it writes through
+      appendRecord(level, time(NULL), message, length);
+      flushBatch();
+      return;
+    }
+    if (!__atomic_load_n(&started, __ATOMIC_ACQUIRE) && !start()) {
+      // the drainer is gone (exit in progress): keep the line rather than losing it
+      pthread_mutex_lock(&startMutex);
+      appendRecord(level, time(NULL), message, length);
+      flushBatch();
+      pthread_mutex_unlock(&startMutex);
+      return;
+    }
+    if (!ring.push(level, message, length) && level >= LogRing::ERROR_LEVEL) {
+      writeError(message, length);
+    }
+  }
+
+  // drains everything queued so far and stops the drainer; safe to call more than once
+  static void shutdown() {
+    AsyncLogSink &sink = instance();
+    if (sink.forked || !__atomic_load_n(&sink.started, __ATOMIC_ACQUIRE)) {
+      return;
+    }
+    __atomic_store_n(&sink.stopping, true, __ATOMIC_RELEASE);
+    pthread_join(sink.thread, NULL);
+    __atomic_store_n(&sink.started, false, __ATOMIC_RELEASE);
+  }
+
+ private:
+  bool start() {
+    pthread_mutex_lock(&startMutex);
+    if (!started && !__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+      if (pthread_create(&thread, NULL, &AsyncLogSink::drainRoutine, this) == 0) {
+        __atomic_store_n(&started, true, __ATOMIC_RELEASE);
+        pthread_atfork(NULL, NULL, &AsyncLogSink::onForkChild);
+        atexit(&AsyncLogSink::shutdown);
+      }
+    }
+    pthread_mutex_unlock(&startMutex);
+    return started;
+  }
+
+  static void onForkChild() {
+    instance().forked = true;
+    instance().batchLength = 0;
+  }
+
+  static void *drainRoutine(void *arg) {
+    AsyncLogSink *sink = static_cast<AsyncLogSink *>(arg);
+    long idleSleep = MIN_IDLE_SLEEP_NS;
+    while (true) {
+      bool stop = __atomic_load_n(&sink->stopping, __ATOMIC_ACQUIRE);
+      if (sink->drainOnce()) {
+        idleSleep = MIN_IDLE_SLEEP_NS;
+        continue;
+      }
+      if (stop) {
+        break;
+      }
+      struct timespec pause = {0, idleSleep};
+      nanosleep(&pause, NULL);
+      if (idleSleep < MAX_IDLE_SLEEP_NS) {
+        idleSleep *= 2;
+      }
+    }
+    return NULL;
+  }
+
+  bool drainOnce() {
+    bool drained = false;
+    const LogRing::Record *record;
+    while ((record = ring.peek()) != NULL) {
+      appendRecord(record->level, record->time.tv_sec, record->message, record->length);
+      ring.release();
+      drained = true;
+    }
+    unsigned long errors;
+    unsigned long dropped = ring.takeDropped(errors);
+    if (dropped || errors) {
+      char note[96];
+      int length = snprintf(note, sizeof(note), "log ring overflow, dropped %lu lines, %lu errors written directly",
+                            dropped, errors);
+      appendRecord(LogRing::ERROR_LEVEL, time(NULL), note, length);
+    }
+    flushBatch();
+    return drained;
+  }
+
+  // an error the ring had no room for, written from the producer's thread around the drainer's batch
+  void writeError(const char *message, std::size_t length) {
+    char line[64 + LogRing::MESSAGE_MAX];
+    time_t now = time(NULL);
+    struct tm parts;
+    localtime_r(&now, &parts);
+    std::size_t used = strftime(line, 32, "%Y-%m-%d %H:%M:%S ", &parts);
+    memcpy(line + used, "ERROR ", 6);
+    used += 6;
+    if (length > LogRing::MESSAGE_MAX) {
+      length = LogRing::MESSAGE_MAX;
+    }
+    memcpy(line + used, message, length);
+    used += length;
+    line[used++] = '\n';
+    while (write(fd, line, used) < 0 && errno == EINTR) {
+    }
+  }
+
+  void appendRecord(int level, time_t second, const char *message, std::size_t length) {
+    const char *label = level <= 1 ? "DEBUG " : level == 2 ? "INFO  " : "ERROR ";
+    std::size_t needed = 64 + length;
+    if (batchLength + needed > BATCH_SIZE) {
+      flushBatch();
+    }
+    if (needed > BATCH_SIZE) {
+      length = BATCH_SIZE - 64;
+    }
+    if (second != cachedSecond) {
+      struct tm parts;
+      localtime_r(&second, &parts);
+      strftime(cachedStamp, sizeof(cachedStamp), "%Y-%m-%d %H:%M:%S ", &parts);
+      cachedSecond = second;
+    }
+    appendRaw(cachedStamp, strlen(cachedStamp));
+    appendRaw(label, 6);
+    bool paint = colored && level == 2;
+    if (paint) {
+      appendRaw(SPRING_GREEN_SET, strlen(SPRING_GREEN_SET));
+    }
+    appendRaw(message, length);
+    if (paint) {
+      appendRaw(RESET, strlen(RESET));
+    }
+    appendRaw("\n", 1);
+  }
+
+  void appendRaw(const char *data, std::size_t length) {
+    memcpy(batch + batchLength, data, length);
+    batchLength += length;
+  }
+
+  void flushBatch() {
+    std::size_t offset = 0;
+    while (offset < batchLength) {
+      ssize_t written = write(fd, batch + offset, batchLength - offset);
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+      if (written <= 0) {
+        break;
+      }
+      offset += written;
+    }
+    batchLength = 0;
+  }
+};
+
+const char *AsyncLogSink::SPRING_GREEN_SET = "\033[38;2;0;255;127m";
+const char *AsyncLogSink::RESET = "\033[0m";
@@ -0,0 +1,195 @@
+#pragma once
+#include "Clock.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+
+// Append-only file written from the event loop through an in-memory buffer: records are rendered
+// with the put* helpers and the buffer goes out in one write(2) when it fills up or when the flush
+// interval elapses. Shared by the access log and the request trace log.
+class BufferedLogFile {
+ public:
+  // every record must fit in this much headroom, longer ones are cut
+  static const std::size_t RECORD_RESERVE = 1024;
+
+ private:
+  std::string path;
+  int fd;
+  char *buffer;
+  std::size_t capacity;
+  std::size_t length;
+  long flushMillis;
+  long long lastFlush;
+  bool emptyAtOpen;
+
+ public:
+  BufferedLogFile(const std::string &path, std::size_t bufferSize, long flushMillis)
+      : path(path), fd(-1), buffer(NULL), capacity(bufferSize), length(0), flushMillis(flushMillis),
+        lastFlush(Clock::nowMillis()), emptyAtOpen(false) {
+    if (capacity < 4 * RECORD_RESERVE) {
+      capacity = 4 * RECORD_RESERVE;
+    }
+    fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+      throw std::runtime_error("Could not open log file: " + path);
+    }
+    emptyAtOpen = lseek(fd, 0, SEEK_END) == 0;
+    buffer = new char[capacity];
+  }
+
+  virtual ~BufferedLogFile() {
+    flush();
+    close(fd);
+    delete[] buffer;
+  }
+
+ private:
+  BufferedLogFile(const BufferedLogFile &);
+  BufferedLogFile &operator=(const BufferedLogFile &);
+
+ public:
+  const std::string &getPath() const {
+    return path;
+  }
+
+  bool isEmptyAtOpen() const {
+    return emptyAtOpen;
+  }
+
+  bool hasPending() const {
+    return length != 0;
+  }
+
+  long getFlushMillis() const {
+    return flushMillis;
+  }
+
+  // makes room for a record of roughly `extra` variable bytes on top of RECORD_RESERVE
+  void reserve(std::size_t extra) {
+    if (length + RECORD_RESERVE + extra > capacity) {
+      flush();
+    }
+  }
+
+  // writes the buffer if the interval passed; called once per event loop iteration
+  void flushIfDue(long long nowMillis) {
+    if (length != 0 && nowMillis - lastFlush >= flushMillis) {
+      flush();
+    }
+  }
+
+  void flush() {
+    std::size_t offset = 0;
+    while (offset < length) {
+      ssize_t written = write(fd, buffer + offset, length - offset);
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+      if (written <= 0) {
+        break;
+      }
+      offset += written;
+    }
+    length = 0;
+    lastFlush = Clock::nowMillis();
+  }
+
+  // rendering ------------------------------------------------------------------------------------
+
+  void put(char c) {
+    if (length + 64 < capacity) {
+      buffer[length++] = c;
+    }
+  }
+
+  // the newline of a record goes in even when the record was cut: the put* writers stop 64 bytes short
+  void endRecord() {
+    buffer[length++] = '\n';
+  }
+
+  void put(const char *data, std::size_t count) {
+    if (length + 64 >= capacity) {
+      return;
+    }
+    if (count > capacity - length - 64) {
+      count = capacity - length - 64;
+    }
+    memcpy(buffer + length, data, count);
+    length += count;
+  }
+
+  void put(const char *data) {
+    put(data, strlen(data));
+  }
+
+  void putJsonString(const char *data, std::size_t count) {
+    static const char HEX[] = "0123456789abcdef";
+    put('"');
+    for (std::size_t i = 0; i < count && length + 8 < capacity; ++i) {
+      unsigned char c = data[i];
+      if (c == '"' || c == '\\') {
+        put('\\');
+        put(c);
+      } else if (c < 0x20) {
+        put("\\u00", 4);
+        put(HEX[c >> 4]);
+        put(HEX[c & 0xf]);
+      } else {
+        put(c);
+      }
+    }
+    put('"');
+  }
+
+  static std::size_t formatUnsigned(char *out, unsigned long long value) {
+    char digits[24];
+    std::size_t count = 0;
+    do {
+      digits[count++] = (char) ('0' + value % 10);
+      value /= 10;
+    } while (value != 0);
+    for (std::size_t i = 0; i < count; ++i) {
+      out[i] = digits[count - 1 - i];
+    }
+    return count;
+  }
+
+  void putUnsigned(unsigned long long value) {
+    if (length + 64 >= capacity) {
+      return; // a record past its reserve is cut, as by put
+    }
+    length += formatUnsigned(buffer + length, value);
+  }
+
+  void putSigned(long long value) {
+    if (value < 0) {
+      put('-');
+      value = -value;
+    }
+    putUnsigned((unsigned long long) value);
+  }
+
+  // seconds with millisecond resolution, as nginx prints $request_time
+  void putSeconds(long long micros) {
+    putFraction(micros < 0 ? 0 : micros / 1000, 1000, 3);
+  }
+
+  // seconds with microsecond resolution, for phase timings
+  void putSecondsPrecise(long long micros) {
+    putFraction(micros < 0 ? 0 : micros, 1000000, 6);
+  }
+
+ private:
+  void putFraction(long long value, long long unit, int digits) {
+    putUnsigned((unsigned long long) (value / unit));
+    put('.');
+    long long rest = value % unit;
+    for (long long divisor = unit / 10; digits > 0; --digits, divisor /= 10) {
+      put((char) ('0' + rest / divisor % 10));
+    }
+  }
+};
@@ -0,0 +1,16 @@
+#pragma once
+#include <ctime>
+
+class Clock {
+ public:
+  // monotonic microseconds, for durations only
+  static long long nowMicros() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+  }
+
+  static long long nowMillis() {
+    return nowMicros() / 1000;
+  }
+};
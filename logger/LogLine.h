@@ -0,0 +1,75 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+// Stack-only line formatter used by the LOG_* macros: no heap allocation, silently truncates
+// at MAX_LENGTH.
+class LogLine {
+ public:
+  static const std::size_t MAX_LENGTH = 480;
+
+ private:
+  char buffer[MAX_LENGTH];
+  std::size_t length;
+
+ public:
+  LogLine() : length(0) {}
+
+  const char *data() const {
+    return buffer;
+  }
+
+  std::size_t size() const {
+    return length;
+  }
+
+  LogLine &append(const char *data, std::size_t count) {
+    if (count > MAX_LENGTH - length) {
+      count = MAX_LENGTH - length;
+    }
+    memcpy(buffer + length, data, count);
+    length += count;
+    return *this;
+  }
+
+  LogLine &operator<<(const char *value) {
+    return append(value, strlen(value));
+  }
+
+  LogLine &operator<<(const std::string &value) {
+    return append(value.data(), value.length());
+  }
+
+  LogLine &operator<<(char value) {
+    return append(&value, 1);
+  }
+
+  LogLine &operator<<(int value) {
+    return format("%d", value);
+  }
+
+  LogLine &operator<<(unsigned value) {
+    return format("%u", value);
+  }
+
+  LogLine &operator<<(long value) {
+    return format("%ld", value);
+  }
+
+  LogLine &operator<<(unsigned long value) {
+    return format("%lu", value);
+  }
+
+  LogLine &operator<<(double value) {
+    return format("%.3f", value);
+  }
+
+ private:
+  template<class T>
+  LogLine &format(const char *spec, T value) {
+    char digits[32];
+    int count = snprintf(digits, sizeof(digits), spec, value);
+    return append(digits, count > 0 ? count : 0);
+  }
+};
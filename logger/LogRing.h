@@ -0,0 +1,96 @@
+#pragma once
+#include <cstring>
+#include <ctime>
+
+// Bounded lock-free queue of fixed-size log records (Vyukov's sequence-per-slot design).
+// Any thread may push, exactly one thread (the sink drainer) may pop. A full ring drops the
+// record and counts it instead of blocking the event loop; errors are counted apart.
+class LogRing {
+ public:
+  static const unsigned CAPACITY = 4096; // power of two
+  static const unsigned MESSAGE_MAX = 480;
+  static const int ERROR_LEVEL = 3; // Logger::ERROR
+
+  struct Record {
+    unsigned long sequence;
+    int level;
+    struct timespec time;
+    unsigned length;
+    char message[MESSAGE_MAX];
+  };
+
+ private:
+  Record *records;
+  unsigned long tail; // next position for producers
+  unsigned long head; // next position for the consumer
+  unsigned long dropped;       // DEBUG and INFO records
+  unsigned long droppedErrors; // ERROR records, counted apart
+
+ public:
+  LogRing() : records(new Record[CAPACITY]), tail(0), head(0), dropped(0), droppedErrors(0) {
+    for (unsigned long i = 0; i < CAPACITY; ++i) {
+      records[i].sequence = i;
+    }
+  }
+
+  virtual ~LogRing() {
+    delete[] records;
+  }
+
+ private:
+  LogRing(const LogRing &);
+  LogRing &operator=(const LogRing &);
+
+ public:
+  bool push(int level, const char *message, std::size_t length) {
+    unsigned long position = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    Record *record;
+    while (true) {
+      record = &records[position & (CAPACITY - 1)];
+      unsigned long sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+      long diff = (long) sequence - (long) position;
+      if (diff == 0) {
+        if (__atomic_compare_exchange_n(&tail, &position, position + 1, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+          break;
+        }
+      } else if (diff < 0) {
+        __atomic_add_fetch(level >= ERROR_LEVEL ? &droppedErrors : &dropped, 1, __ATOMIC_RELAXED);
+        return false;
+      } else {
+        position = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+      }
+    }
+
+    if (length > MESSAGE_MAX) {
+      length = MESSAGE_MAX;
+    }
+    record->level = level;
+    clock_gettime(CLOCK_REALTIME_COARSE, &record->time);
+    record->length = (unsigned) length;
+    memcpy(record->message, message, length);
+    __atomic_store_n(&record->sequence, position + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // consumer only: returns the oldest committed record or NULL, release() it when done
+  const Record *peek() const {
+    Record *record = &records[head & (CAPACITY - 1)];
+    if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != head + 1) {
+      return NULL;
+    }
+    return record;
+  }
+
+  void release() {
+    Record *record = &records[head & (CAPACITY - 1)];
+    __atomic_store_n(&record->sequence, head + CAPACITY, __ATOMIC_RELEASE);
+    ++head;
+  }
+
+  // records dropped since the last call: DEBUG and INFO ones, and apart in `errors` the ERROR ones
+  unsigned long takeDropped(unsigned long &errors) {
+    errors = __atomic_exchange_n(&droppedErrors, 0, __ATOMIC_RELAXED);
+    return __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+  }
+};
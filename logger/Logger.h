@@ -1,37 +1,76 @@
 #pragma once
+#include "AsyncLogSink.h"
+#include "LogLine.h"
+
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <cstdlib>
+
+// Formats the message only when the level is enabled, so disabled DEBUG/INFO lines cost one branch:
+//   LOG_INFO(LOGGER, "Write to: " << fd);
+#define LOG_AT(logger, lvl, expr) \
+  do { \
+    if ((logger).isEnabled(lvl)) { \
+      LogLine logLine_; \
+      logLine_ << expr; \
+      (logger).write(lvl, logLine_); \
+    } \
+  } while (0)
+
+#define LOG_DEBUG(logger, expr) LOG_AT(logger, Logger::DEBUG, expr)
+#define LOG_INFO(logger, expr) LOG_AT(logger, Logger::INFO, expr)
+#define LOG_ERROR(logger, expr) LOG_AT(logger, Logger::ERROR, expr)
 
 class Logger {
  public:
   static const int DEBUG = 1;
   static const int INFO = 2;
-  static const char *SPRING_GREEN_SET;
-  static const char *RESET;
+  static const int ERROR = 3;
 
  private:
+  static int levelOverride;
   int level;
 
  public:
   Logger(int level = INFO) : level(level) {
   }
 
-  // todo add more data: time, thread
+  // WEBSERV_LOG_LEVEL=debug|info|error applies to every logger, WEBSERV_ERROR_LOG=<path> moves output to a file
+  static void configureFromEnvironment() {
+    const char *levelName = getenv("WEBSERV_LOG_LEVEL");
+    if (levelName != NULL) {
+      std::string name(levelName);
+      levelOverride = name == "debug" ? DEBUG : name == "error" ? ERROR : INFO;
+    }
+    const char *path = getenv("WEBSERV_ERROR_LOG");
+    if (path != NULL) {
+      AsyncLogSink::instance().open(path);
+    }
+  }
+
+  bool isEnabled(int messageLevel) const {
+    return messageLevel >= (levelOverride ? levelOverride : level);
+  }
+
+  void write(int messageLevel, const LogLine &line) const {
+    AsyncLogSink::instance().push(messageLevel, line.data(), line.size());
+  }
+
   void info(std::string const &message) const {
-    if (level <= 2) {
-      std::cerr << SPRING_GREEN_SET << message << RESET << std::endl;
+    if (isEnabled(INFO)) {
+      AsyncLogSink::instance().push(INFO, message.data(), message.length());
     }
   }
 
   void debug(std::string const &message) const {
-    if (level <= 1) {
-      std::cerr << message << std::endl;
+    if (isEnabled(DEBUG)) {
+      AsyncLogSink::instance().push(DEBUG, message.data(), message.length());
     }
   }
 
   void error(std::string const &message) const {
-    std::cerr << message << std::endl;
+    AsyncLogSink::instance().push(ERROR, message.data(), message.length());
   }
 
   template<class T>
@@ -42,5 +81,4 @@ class Logger {
   }
 };
 
-const char *Logger::SPRING_GREEN_SET = "\033[38;2;0;255;127m";
-const char *Logger::RESET = "\033[0m";
+int Logger::levelOverride = 0;
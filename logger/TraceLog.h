@@ -0,0 +1,104 @@
+#pragma once
+#include "BufferedLogFile.h"
+#include "RequestTiming.h"
+#include "HttpMethod.h"
+
+#include <unistd.h>
+#include <string>
+
+// `trace_log` settings of one server block
+struct TraceLogConfig {
+  std::string path; // empty: tracing off
+  unsigned long sampleEvery; // trace one request out of N
+  std::size_t bufferSize;
+  long flushMillis;
+
+  TraceLogConfig() : sampleEvery(100), bufferSize(256 * 1024), flushMillis(1000) {}
+};
+
+// Writes the phases of sampled requests as Chrome trace events (JSON array format, loadable in
+// chrome://tracing or Perfetto). Each request becomes one "request" slice on the row of its
+// connection fd with its phases nested below it.
+class TraceLog {
+ private:
+  BufferedLogFile out;
+  unsigned long sampleEvery;
+  unsigned long counter;
+  int pid;
+
+ public:
+  TraceLog(const TraceLogConfig &config)
+      : out(config.path, config.bufferSize, config.flushMillis),
+        sampleEvery(config.sampleEvery ? config.sampleEvery : 1), counter(0), pid(getpid()) {
+    if (out.isEmptyAtOpen()) {
+      // the array format tolerates a missing closing bracket, so appending stays valid
+      out.put("[\n", 2);
+    }
+  }
+
+  virtual ~TraceLog() {
+  }
+
+ private:
+  TraceLog(const TraceLog &log);
+  TraceLog &operator=(const TraceLog &log);
+
+ public:
+  BufferedLogFile &getFile() {
+    return out;
+  }
+
+  // decided once per connection at accept time
+  bool shouldSample() {
+    return ++counter % sampleEvery == 0;
+  }
+
+  void write(const RequestTiming &timing, int tid, HttpMethod method, const std::string &path, int status) {
+    out.reserve(path.length() * 2);
+    long long start = timing.marks[RequestTiming::ACCEPTED];
+    long long end = timing.marks[RequestTiming::LAST_BYTE_SENT];
+    out.put("{\"name\":\"request\",\"cat\":\"http\",\"ph\":\"X\",\"ts\":");
+    out.putSigned(start);
+    out.put(",\"dur\":");
+    out.putSigned(end > start ? end - start : 0);
+    putIds(tid);
+    out.put(",\"args\":{\"method\":\"");
+    out.put(method == GET ? "GET" : method == POST ? "POST" : method == DELETE ? "DELETE" : "-");
+    out.put("\",\"path\":");
+    out.putJsonString(path.data(), path.length());
+    out.put(",\"status\":");
+    out.putSigned(status);
+    out.put("}},\n");
+
+    putPhase(timing, "first_byte_wait", RequestTiming::ACCEPTED, RequestTiming::FIRST_BYTE, tid);
+    putPhase(timing, "read_headers", RequestTiming::FIRST_BYTE, RequestTiming::HEADERS_PARSED, tid);
+    putPhase(timing, "read_body", RequestTiming::HEADERS_PARSED, RequestTiming::HANDLER_START, tid);
+    putPhase(timing, "handler", RequestTiming::HANDLER_START, RequestTiming::HANDLER_END, tid);
+    putPhase(timing, "write_headers", RequestTiming::HANDLER_END, RequestTiming::FIRST_BYTE_SENT, tid);
+    putPhase(timing, "send", RequestTiming::FIRST_BYTE_SENT, RequestTiming::LAST_BYTE_SENT, tid);
+  }
+
+ private:
+  void putPhase(const RequestTiming &timing, const char *name,
+                RequestTiming::Phase from, RequestTiming::Phase to, int tid) {
+    long long duration = timing.between(from, to);
+    if (duration < 0) {
+      return;
+    }
+    out.put("{\"name\":\"");
+    out.put(name);
+    out.put("\",\"cat\":\"phase\",\"ph\":\"X\",\"ts\":");
+    out.putSigned(timing.marks[from]);
+    out.put(",\"dur\":");
+    out.putSigned(duration);
+    putIds(tid);
+    out.put("},\n");
+  }
+
+  void putIds(int tid) {
+    out.put(",\"pid\":");
+    out.putSigned(pid);
+    out.put(",\"tid\":");
+    out.putSigned(tid);
+  }
+};
@@ -2,9 +2,13 @@
 #include "Logger.h"
 
 #include <iostream>
+#include <csignal>
 
 int main(int ac, char *av[]) {
   try {
+    // a peer closing mid-response must cost one connection, not the process
+    signal(SIGPIPE, SIG_IGN);
+    Logger::configureFromEnvironment();
     WebServer server;
     server.parseConfig(ac, av);
     server.run();
@@ -0,0 +1,100 @@
+#pragma once
+#include <cstring>
+
+// Log-linear latency histogram in the spirit of HdrHistogram: every power of two is split into
+// SUB_BUCKETS equal slices, giving ~25% worst-case relative error over 1 us .. ~70 min with a
+// fixed 128-slot array. Values are microseconds.
+//
+// Written by exactly one thread; readers on other threads see torn-free (possibly slightly stale)
+// values because every slot is updated with a single relaxed store.
+class Histogram {
+ public:
+  static const int SUB_BUCKET_BITS = 2;
+  static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+  static const int BUCKETS = 128;
+
+ private:
+  unsigned long counts[BUCKETS];
+  unsigned long total;
+  unsigned long long sum;
+
+ public:
+  Histogram() : total(0), sum(0) {
+    memset(counts, 0, sizeof(counts));
+  }
+
+  static int bucketOf(unsigned long long value) {
+    if (value < (unsigned long long) SUB_BUCKETS) {
+      return (int) value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    int sub = (int) ((value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+    int bucket = (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+    return bucket < BUCKETS ? bucket : BUCKETS - 1;
+  }
+
+  // largest value that still falls into the bucket
+  static unsigned long long upperBoundOf(int bucket) {
+    if (bucket < SUB_BUCKETS) {
+      return (unsigned long long) bucket;
+    }
+    int exponent = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    unsigned long long sub = (unsigned long long) (bucket % SUB_BUCKETS);
+    unsigned long long width = 1ULL << (exponent - SUB_BUCKET_BITS);
+    return (1ULL << exponent) + (sub + 1) * width - 1;
+  }
+
+  void record(unsigned long long micros) {
+    int bucket = bucketOf(micros);
+    bump(counts[bucket], 1);
+    bump(total, 1);
+    __atomic_store_n(&sum, __atomic_load_n(&sum, __ATOMIC_RELAXED) + micros, __ATOMIC_RELAXED);
+  }
+
+  // adds another (possibly concurrently written) histogram into this one
+  void merge(const Histogram &other) {
+    for (int i = 0; i < BUCKETS; ++i) {
+      counts[i] += __atomic_load_n(&other.counts[i], __ATOMIC_RELAXED);
+    }
+    total += __atomic_load_n(&other.total, __ATOMIC_RELAXED);
+    sum += __atomic_load_n(&other.sum, __ATOMIC_RELAXED);
+  }
+
+  unsigned long getCount(int bucket) const {
+    return counts[bucket];
+  }
+
+  unsigned long getTotal() const {
+    return total;
+  }
+
+  unsigned long long getSum() const {
+    return sum;
+  }
+
+  int highestNonEmpty() const {
+    for (int i = BUCKETS - 1; i >= 0; --i) {
+      if (counts[i] != 0) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  unsigned long long percentile(double fraction) const {
+    unsigned long wanted = (unsigned long) (fraction * total + 0.5);
+    unsigned long seen = 0;
+    for (int i = 0; i < BUCKETS; ++i) {
+      seen += counts[i];
+      if (seen >= wanted && seen != 0) {
+        return upperBoundOf(i);
+      }
+    }
+    return 0;
+  }
+
+ private:
+  static void bump(unsigned long &counter, unsigned long by) {
+    __atomic_store_n(&counter, __atomic_load_n(&counter, __ATOMIC_RELAXED) + by, __ATOMIC_RELAXED);
+  }
+};
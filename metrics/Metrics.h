@@ -0,0 +1,215 @@
+#pragma once
+#include "Histogram.h"
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <map>
+
+// Counters owned by one thread. The owner updates them with plain (non-locked) relaxed stores;
+// Metrics::collect() sums all shards when the status endpoint is scraped.
+struct MetricsShard {
+  static const int MAX_STATUS = 600;
+  static const int MAX_SCOPES = 256;
+
+  unsigned long accepts;
+  unsigned long requests;
+  unsigned long bytesIn;
+  unsigned long bytesOut;
+  unsigned long cgiSpawns;
+  unsigned long cgiCacheHits;   // answered from cgi_cache
+  unsigned long cgiCacheShared; // answered by the run of an identical request
+  unsigned long limitedRequests;    // 429 from limit_req
+  unsigned long limitedConnections; // 503 from limit_conn
+  unsigned long shedConnections;    // 503 on accept, over max_connections
+  unsigned long shedQueued;         // 503 for queueing over shed_target
+  unsigned long tlsHandshakes;
+  unsigned long tlsResumed;         // handshakes that resumed a session, by id or ticket
+  unsigned long tlsKernel;          // connections whose records the kernel encrypts (kTLS)
+  unsigned long http2Connections;   // connections that started HTTP/2, h2c or h2 by ALPN
+  unsigned long http2Streams;       // requests on them
+  unsigned long statuses[MAX_STATUS];
+  Histogram cgiDuration;
+  Histogram *scopeLatency[MAX_SCOPES]; // by scope id, allocated on first use
+
+  MetricsShard() : accepts(0), requests(0), bytesIn(0), bytesOut(0), cgiSpawns(0), cgiCacheHits(0),
+                   cgiCacheShared(0), limitedRequests(0), limitedConnections(0),
+                   shedConnections(0), shedQueued(0), tlsHandshakes(0), tlsResumed(0), tlsKernel(0),
+                   http2Connections(0), http2Streams(0) {
+    memset(statuses, 0, sizeof(statuses));
+    memset(scopeLatency, 0, sizeof(scopeLatency));
+  }
+
+  static void add(unsigned long &counter, unsigned long by) {
+    __atomic_store_n(&counter, __atomic_load_n(&counter, __ATOMIC_RELAXED) + by, __ATOMIC_RELAXED);
+  }
+};
+
+// Process-wide registry of shards and of latency scopes (one per server and per location).
+class Metrics {
+ public:
+  struct Scope {
+    std::string server;
+    std::string location; // empty for the whole server
+  };
+
+ private:
+  static pthread_mutex_t mutex;
+  static std::vector<MetricsShard *> shards;
+  static std::vector<Scope> scopes;
+  static __thread MetricsShard *localShard;
+
+ public:
+  static MetricsShard &local() {
+    if (localShard == NULL) {
+      MetricsShard *shard = new MetricsShard();
+      pthread_mutex_lock(&mutex);
+      shards.push_back(shard);
+      pthread_mutex_unlock(&mutex);
+      localShard = shard;
+    }
+    return *localShard;
+  }
+
+  // returns a stable id for "server[/location]"; registering the same names twice reuses the id,
+  // -1 once MAX_SCOPES are taken (the caller reports it)
+  static int registerScope(const std::string &server, const std::string &location) {
+    pthread_mutex_lock(&mutex);
+    int id = -1;
+    for (std::size_t i = 0; i < scopes.size(); ++i) {
+      if (scopes[i].server == server && scopes[i].location == location) {
+        id = (int) i;
+      }
+    }
+    if (id == -1 && scopes.size() < (std::size_t) MetricsShard::MAX_SCOPES) {
+      Scope scope;
+      scope.server = server;
+      scope.location = location;
+      scopes.push_back(scope);
+      id = (int) scopes.size() - 1;
+    }
+    pthread_mutex_unlock(&mutex);
+    return id;
+  }
+
+  static void countAccept() {
+    MetricsShard::add(local().accepts, 1);
+  }
+
+  static void countBytesIn(unsigned long bytes) {
+    MetricsShard::add(local().bytesIn, bytes);
+  }
+
+  static void countBytesOut(unsigned long bytes) {
+    MetricsShard::add(local().bytesOut, bytes);
+  }
+
+  static void recordCgi(long long micros) {
+    MetricsShard &shard = local();
+    MetricsShard::add(shard.cgiSpawns, 1);
+    shard.cgiDuration.record(micros < 0 ? 0 : micros);
+  }
+
+  static void countCgiCache(bool hit) {
+    MetricsShard &shard = local();
+    MetricsShard::add(hit ? shard.cgiCacheHits : shard.cgiCacheShared, 1);
+  }
+
+  static void countLimited(bool request) {
+    MetricsShard &shard = local();
+    MetricsShard::add(request ? shard.limitedRequests : shard.limitedConnections, 1);
+  }
+
+  static void countShed(bool queued) {
+    MetricsShard &shard = local();
+    MetricsShard::add(queued ? shard.shedQueued : shard.shedConnections, 1);
+  }
+
+  static void countHandshake(bool resumed, bool kernel) {
+    MetricsShard &shard = local();
+    MetricsShard::add(shard.tlsHandshakes, 1);
+    MetricsShard::add(shard.tlsResumed, resumed ? 1 : 0);
+    MetricsShard::add(shard.tlsKernel, kernel ? 1 : 0);
+  }
+
+  static void countHttp2(bool stream) {
+    MetricsShard &shard = local();
+    MetricsShard::add(stream ? shard.http2Streams : shard.http2Connections, 1);
+  }
+
+  static void recordRequest(int status, int serverScope, int locationScope, long long micros) {
+    MetricsShard &shard = local();
+    MetricsShard::add(shard.requests, 1);
+    if (status >= 0 && status < MetricsShard::MAX_STATUS) {
+      MetricsShard::add(shard.statuses[status], 1);
+    }
+    unsigned long long value = micros < 0 ? 0 : micros;
+    latencyOf(shard, serverScope).record(value);
+    if (locationScope >= 0) {
+      latencyOf(shard, locationScope).record(value);
+    }
+  }
+
+  // sums every shard into `total`, whose scope histograms are allocated as needed
+  static void collect(MetricsShard &total, std::vector<Scope> &scopeNames) {
+    pthread_mutex_lock(&mutex);
+    scopeNames = scopes;
+    for (std::vector<MetricsShard *>::const_iterator it = shards.begin(); it != shards.end(); ++it) {
+      const MetricsShard &shard = **it;
+      total.accepts += __atomic_load_n(&shard.accepts, __ATOMIC_RELAXED);
+      total.requests += __atomic_load_n(&shard.requests, __ATOMIC_RELAXED);
+      total.bytesIn += __atomic_load_n(&shard.bytesIn, __ATOMIC_RELAXED);
+      total.bytesOut += __atomic_load_n(&shard.bytesOut, __ATOMIC_RELAXED);
+      total.cgiSpawns += __atomic_load_n(&shard.cgiSpawns, __ATOMIC_RELAXED);
+      total.cgiCacheHits += __atomic_load_n(&shard.cgiCacheHits, __ATOMIC_RELAXED);
+      total.cgiCacheShared += __atomic_load_n(&shard.cgiCacheShared, __ATOMIC_RELAXED);
+      total.limitedRequests += __atomic_load_n(&shard.limitedRequests, __ATOMIC_RELAXED);
+      total.limitedConnections += __atomic_load_n(&shard.limitedConnections, __ATOMIC_RELAXED);
+      total.shedConnections += __atomic_load_n(&shard.shedConnections, __ATOMIC_RELAXED);
+      total.shedQueued += __atomic_load_n(&shard.shedQueued, __ATOMIC_RELAXED);
+      total.tlsHandshakes += __atomic_load_n(&shard.tlsHandshakes, __ATOMIC_RELAXED);
+      total.tlsResumed += __atomic_load_n(&shard.tlsResumed, __ATOMIC_RELAXED);
+      total.tlsKernel += __atomic_load_n(&shard.tlsKernel, __ATOMIC_RELAXED);
+      total.http2Connections += __atomic_load_n(&shard.http2Connections, __ATOMIC_RELAXED);
+      total.http2Streams += __atomic_load_n(&shard.http2Streams, __ATOMIC_RELAXED);
+      for (int i = 0; i < MetricsShard::MAX_STATUS; ++i) {
+        total.statuses[i] += __atomic_load_n(&shard.statuses[i], __ATOMIC_RELAXED);
+      }
+      total.cgiDuration.merge(shard.cgiDuration);
+      for (int i = 0; i < MetricsShard::MAX_SCOPES; ++i) {
+        Histogram *histogram = __atomic_load_n(&shard.scopeLatency[i], __ATOMIC_ACQUIRE);
+        if (histogram != NULL) {
+          if (total.scopeLatency[i] == NULL) {
+            total.scopeLatency[i] = new Histogram();
+          }
+          total.scopeLatency[i]->merge(*histogram);
+        }
+      }
+    }
+    pthread_mutex_unlock(&mutex);
+  }
+
+  static void release(MetricsShard &total) {
+    for (int i = 0; i < MetricsShard::MAX_SCOPES; ++i) {
+      delete total.scopeLatency[i];
+      total.scopeLatency[i] = NULL;
+    }
+  }
+
+ private:
+  static Histogram &latencyOf(MetricsShard &shard, int scope) {
+    static Histogram discarded;
+    if (scope < 0 || scope >= MetricsShard::MAX_SCOPES) {
+      return discarded;
+    }
+    if (shard.scopeLatency[scope] == NULL) {
+      __atomic_store_n(&shard.scopeLatency[scope], new Histogram(), __ATOMIC_RELEASE);
+    }
+    return *shard.scopeLatency[scope];
+  }
+};
+
+pthread_mutex_t Metrics::mutex = PTHREAD_MUTEX_INITIALIZER;
+std::vector<MetricsShard *> Metrics::shards;
+std::vector<Metrics::Scope> Metrics::scopes;
+__thread MetricsShard *Metrics::localShard = NULL;
@@ -0,0 +1,135 @@
+#pragma once
+#include "Metrics.h"
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Connections by ClientStatus, counted by the event loop at scrape time
+struct ConnectionGauges {
+  unsigned long active;
+  unsigned long reading;
+  unsigned long waitingBody;
+  unsigned long writing;
+
+  ConnectionGauges() : active(0), reading(0), waitingBody(0), writing(0) {}
+};
+
+// Renders the `stub_status` location: nginx's plain text page or the Prometheus text format.
+class StatusPage {
+ public:
+  static const int OFF = 0;
+  static const int STUB = 1;
+  static const int PROMETHEUS = 2;
+
+  static const char *PROMETHEUS_CONTENT_TYPE;
+
+  static std::string render(int format, const ConnectionGauges &connections) {
+    MetricsShard total;
+    std::vector<Metrics::Scope> scopes;
+    Metrics::collect(total, scopes);
+    std::string page = format == PROMETHEUS
+                       ? renderPrometheus(total, scopes, connections)
+                       : renderStub(total, connections);
+    Metrics::release(total);
+    return page;
+  }
+
+ private:
+  static std::string renderStub(const MetricsShard &total, const ConnectionGauges &connections) {
+    std::stringstream ss;
+    ss << "Active connections: " << connections.active << " \n"
+       << "server accepts handled requests\n"
+       << " " << total.accepts << " " << total.accepts << " " << total.requests << " \n"
+       << "Reading: " << connections.reading
+       << " Writing: " << connections.writing
+       << " Waiting: " << connections.waitingBody << " \n";
+    return ss.str();
+  }
+
+  static std::string renderPrometheus(const MetricsShard &total,
+                                      const std::vector<Metrics::Scope> &scopes,
+                                      const ConnectionGauges &connections) {
+    std::stringstream ss;
+    ss << "# HELP webserv_connections Open client connections by state.\n"
+       << "# TYPE webserv_connections gauge\n"
+       << "webserv_connections{state=\"reading\"} " << connections.reading << "\n"
+       << "webserv_connections{state=\"waiting_body\"} " << connections.waitingBody << "\n"
+       << "webserv_connections{state=\"writing\"} " << connections.writing << "\n"
+       << "# TYPE webserv_accepts_total counter\n"
+       << "webserv_accepts_total " << total.accepts << "\n"
+       << "# TYPE webserv_requests_total counter\n";
+    for (int status = 0; status < MetricsShard::MAX_STATUS; ++status) {
+      if (total.statuses[status] != 0) {
+        ss << "webserv_requests_total{status=\"" << status << "\"} " << total.statuses[status] << "\n";
+      }
+    }
+    ss << "# TYPE webserv_received_bytes_total counter\n"
+       << "webserv_received_bytes_total " << total.bytesIn << "\n"
+       << "# TYPE webserv_sent_bytes_total counter\n"
+       << "webserv_sent_bytes_total " << total.bytesOut << "\n"
+       << "# TYPE webserv_cgi_spawns_total counter\n"
+       << "webserv_cgi_spawns_total " << total.cgiSpawns << "\n"
+       << "# HELP webserv_cgi_cache_total GETs of CGI scripts answered without running them.\n"
+       << "# TYPE webserv_cgi_cache_total counter\n"
+       << "webserv_cgi_cache_total{result=\"hit\"} " << total.cgiCacheHits << "\n"
+       << "webserv_cgi_cache_total{result=\"shared\"} " << total.cgiCacheShared << "\n"
+       << "# HELP webserv_limited_total Requests and connections rejected by limit_req and limit_conn.\n"
+       << "# TYPE webserv_limited_total counter\n"
+       << "webserv_limited_total{limit=\"req\"} " << total.limitedRequests << "\n"
+       << "webserv_limited_total{limit=\"conn\"} " << total.limitedConnections << "\n"
+       << "# HELP webserv_shed_total Connections and requests answered 503 because the server was overloaded.\n"
+       << "# TYPE webserv_shed_total counter\n"
+       << "webserv_shed_total{reason=\"max_connections\"} " << total.shedConnections << "\n"
+       << "webserv_shed_total{reason=\"queue_delay\"} " << total.shedQueued << "\n"
+       << "# HELP webserv_tls_handshakes_total Completed TLS handshakes, by whether they resumed a session.\n"
+       << "# TYPE webserv_tls_handshakes_total counter\n"
+       << "webserv_tls_handshakes_total{session=\"new\"} " << total.tlsHandshakes - total.tlsResumed << "\n"
+       << "webserv_tls_handshakes_total{session=\"resumed\"} " << total.tlsResumed << "\n"
+       << "# HELP webserv_tls_ktls_total TLS connections whose records the kernel encrypts.\n"
+       << "# TYPE webserv_tls_ktls_total counter\n"
+       << "webserv_tls_ktls_total " << total.tlsKernel << "\n"
+       << "# HELP webserv_http2_connections_total Connections that spoke HTTP/2.\n"
+       << "# TYPE webserv_http2_connections_total counter\n"
+       << "webserv_http2_connections_total " << total.http2Connections << "\n"
+       << "# HELP webserv_http2_streams_total Requests made on HTTP/2 streams.\n"
+       << "# TYPE webserv_http2_streams_total counter\n"
+       << "webserv_http2_streams_total " << total.http2Streams << "\n"
+       << "# HELP webserv_cgi_duration_seconds Wall time of CGI script runs.\n"
+       << "# TYPE webserv_cgi_duration_seconds histogram\n";
+    renderHistogram(ss, "webserv_cgi_duration_seconds", "", total.cgiDuration);
+
+    ss << "# HELP webserv_request_duration_seconds Time from accept to the last response byte.\n"
+       << "# TYPE webserv_request_duration_seconds histogram\n";
+    for (std::size_t i = 0; i < scopes.size(); ++i) {
+      if (total.scopeLatency[i] == NULL) {
+        continue;
+      }
+      std::string labels = "server=\"" + scopes[i].server + "\"";
+      if (!scopes[i].location.empty()) {
+        labels += ",location=\"" + scopes[i].location + "\"";
+      }
+      renderHistogram(ss, "webserv_request_duration_seconds", labels, *total.scopeLatency[i]);
+    }
+    return ss.str();
+  }
+
+  // cumulative buckets up to the highest populated one, bounds converted from us to seconds
+  static void renderHistogram(std::stringstream &ss, const char *name, const std::string &labels,
+                              const Histogram &histogram) {
+    std::string separator = labels.empty() ? "" : ",";
+    ss.precision(10);
+    unsigned long cumulative = 0;
+    int highest = histogram.highestNonEmpty();
+    for (int bucket = 0; bucket <= highest; ++bucket) {
+      cumulative += histogram.getCount(bucket);
+      ss << name << "_bucket{" << labels << separator << "le=\""
+         << Histogram::upperBoundOf(bucket) / 1e6 << "\"} " << cumulative << "\n";
+    }
+    ss << name << "_bucket{" << labels << separator << "le=\"+Inf\"} " << histogram.getTotal() << "\n"
+       << name << "_sum" << (labels.empty() ? "" : "{" + labels + "}") << " " << histogram.getSum() / 1e6 << "\n"
+       << name << "_count" << (labels.empty() ? "" : "{" + labels + "}") << " " << histogram.getTotal() << "\n";
+  }
+};
+
+const char *StatusPage::PROMETHEUS_CONTENT_TYPE = "text/plain; version=0.0.4";
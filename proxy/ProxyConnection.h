@@ -0,0 +1,598 @@
+#pragma once
+#include "UpstreamPool.h"
+#include "Clock.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <string>
+
+// One proxied request: the connection to the upstream server it went to, the request streamed to
+// it as the client's body arrives, and the response streamed back as it is read. Neither side is
+// buffered whole: reading stops while BUFFER_LIMIT bytes wait for the other side.
+//
+// The event loop polls the upstream socket for upstreamEvents(), calls onUpstream() when it is
+// ready, appends the client's body with appendBody() while wantsClientBody(), and writes output()
+// to the client. A failed attempt (FAILED) is retried on another connection while canRetry().
+class ProxyConnection {
+ public:
+  enum State {
+    CONNECTING, // nonblocking connect in progress
+    ACTIVE,     // request going out, response coming in
+    DONE,       // response complete, the upstream connection is released
+    FAILED      // getStatus() is what to answer when nothing reached the client yet
+  };
+  static const std::size_t BUFFER_LIMIT = 65536; // per direction
+  static const std::size_t HEAD_LIMIT = 16384;   // response status line and headers
+  static const std::size_t READ_CHUNK = 16384;
+
+ private:
+  enum Framing {
+    NO_BODY, // 204, 304
+    LENGTH,
+    CHUNKED,
+    UNTIL_CLOSE
+  };
+  enum ChunkState {
+    CHUNK_SIZE,     // hex size, then extensions up to the end of the line
+    CHUNK_DATA,
+    CHUNK_DATA_END, // CRLF after the data
+    CHUNK_TRAILER,  // trailer lines up to an empty one
+    CHUNKS_DONE
+  };
+
+  UpstreamPool *pool;
+  UpstreamPeer *peer;
+  int fd;
+  bool reused; // the connection came from the idle list: failing before the response means stale
+  State state;
+  int status;  // of the response, or errorStatus once FAILED
+  int attempts;
+  int connections; // started so far, tells a connection from the one before it on the same fd
+  bool retryable;
+
+  // request: head and as much of the body as arrived; the sent part is kept for a retry until
+  // it outgrows BUFFER_LIMIT
+  std::string request;
+  std::size_t requestSent;
+  bool requestTrimmed;
+  long long bodyLeft;
+
+  // response
+  std::string responseHead;
+  bool headDone;
+  bool responseStarted; // bytes of the response reached the output
+  bool anyResponseBytes;
+  Framing framing;
+  long long contentLeft;
+  ChunkState chunkState;
+  long long chunkLeft;
+  bool chunkSizeDone;
+  std::size_t trailerLine;
+  bool keepAlive;
+  std::string toClient;
+
+  long long deadline;
+  long connectTimeoutMillis;
+  long readTimeoutMillis;
+  long long startMicros;
+  long long upstreamMicros;
+
+ public:
+  ProxyConnection(UpstreamPool &pool, const std::string &head, long long bodyLength, long connectTimeoutMillis,
+                  long readTimeoutMillis)
+      : pool(&pool), peer(NULL), fd(-1), reused(false), state(FAILED), status(0), attempts(0), connections(0),
+        retryable(true),
+        request(head), requestSent(0), requestTrimmed(false), bodyLeft(bodyLength),
+        deadline(0), connectTimeoutMillis(connectTimeoutMillis), readTimeoutMillis(readTimeoutMillis),
+        startMicros(Clock::nowMicros()), upstreamMicros(-1) {
+    resetResponse();
+  }
+
+  virtual ~ProxyConnection() {
+    releaseConnection(false);
+  }
+
+ private:
+  ProxyConnection(const ProxyConnection &connection);
+  ProxyConnection &operator=(const ProxyConnection &connection);
+
+ public:
+  // the request line with `uri` and HTTP/1.1, the client's headers without the hop-by-hop ones,
+  // then Host and Connection for the upstream
+  static std::string buildRequestHead(const std::string &clientHead, const std::string &uri, const std::string &host,
+                                      bool keepAlive) {
+    std::string head;
+    std::size_t lineEnd = clientHead.find("\r\n");
+    std::string requestLine = clientHead.substr(0, lineEnd);
+    head.append(requestLine, 0, requestLine.find(' '));
+    head += ' ';
+    head += uri;
+    head += " HTTP/1.1\r\n";
+    std::size_t start = lineEnd == std::string::npos ? clientHead.length() : lineEnd + 2;
+    while (start < clientHead.length()) {
+      std::size_t end = clientHead.find("\r\n", start);
+      if (end == std::string::npos) {
+        end = clientHead.length();
+      }
+      if (end > start && !isHopByHop(clientHead, start, end)) {
+        head.append(clientHead, start, end - start);
+        head += "\r\n";
+      }
+      start = end + 2;
+    }
+    head += "Host: " + host + "\r\n";
+    head += keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    return head;
+  }
+
+  // picks a server and connects to it, or takes an idle connection to it; FAILED with 502 when
+  // every server is marked down or the connection cannot be made
+  void start(long long now) {
+    ++attempts;
+    ++connections;
+    peer = pool->choose(now);
+    if (peer == NULL) {
+      retryable = false;
+      failWith(502, false, now);
+      return;
+    }
+    fd = pool->takeIdle(peer);
+    if (fd != -1) {
+      reused = true;
+      state = ACTIVE;
+      deadline = now + readTimeoutMillis;
+      return;
+    }
+    reused = false;
+    pool->opened(peer);
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+      failWith(502, false, now);
+      return;
+    }
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    const struct sockaddr_in &address = peer->config.address;
+    if (connect(fd, (const struct sockaddr *) &address, sizeof(address)) == 0) {
+      state = ACTIVE;
+      deadline = now + readTimeoutMillis;
+    } else if (errno == EINPROGRESS) {
+      state = CONNECTING;
+      deadline = now + connectTimeoutMillis;
+    } else {
+      failWith(502, true, now);
+    }
+  }
+
+  // another attempt from the start of the request, after a FAILED one that canRetry()
+  void retry(long long now) {
+    requestSent = 0;
+    resetResponse();
+    start(now);
+  }
+
+  bool canRetry() const {
+    return state == FAILED && retryable && !requestTrimmed && !anyResponseBytes
+        && (std::size_t) attempts < pool->size();
+  }
+
+  State getState() const {
+    return state;
+  }
+
+  int getStatus() const {
+    return status;
+  }
+
+  int getFd() const {
+    return fd;
+  }
+
+  int getConnectionNumber() const {
+    return connections;
+  }
+
+  // upstream response time: from the first attempt to the end of the response, -1 before
+  long long getUpstreamMicros() const {
+    return upstreamMicros;
+  }
+
+  bool isResponseStarted() const {
+    return responseStarted;
+  }
+
+  long long getBodyLeft() const {
+    return bodyLeft;
+  }
+
+  // body bytes of the client's request as they arrive; anything past Content-Length is dropped
+  void appendBody(const char *data, std::size_t length, long long now) {
+    std::size_t taken = (long long) length < bodyLeft ? length : (std::size_t) bodyLeft;
+    request.append(data, taken);
+    bodyLeft -= taken;
+    if (state == ACTIVE) {
+      deadline = now + readTimeoutMillis;
+    }
+  }
+
+  bool wantsClientBody() const {
+    return bodyLeft > 0 && (state == CONNECTING || state == ACTIVE) && request.length() - requestSent < BUFFER_LIMIT;
+  }
+
+  short upstreamEvents() const {
+    if (state == CONNECTING) {
+      return POLLOUT;
+    }
+    if (state != ACTIVE) {
+      return 0;
+    }
+    short events = requestSent < request.length() ? POLLOUT : 0;
+    if (toClient.length() < BUFFER_LIMIT) {
+      events |= POLLIN;
+    }
+    return events;
+  }
+
+  // the response bytes waiting for the client; the caller erases what it wrote with sent()
+  std::string &output() {
+    return toClient;
+  }
+
+  // all of the output at once, into a buffer that stays put while the kernel sends it
+  void takeOutput(std::string &into, long long now) {
+    into.clear();
+    into.swap(toClient);
+    if (state == ACTIVE) {
+      deadline = now + readTimeoutMillis;
+    }
+  }
+
+  // a slow client holding the response back does not count against the upstream's read timeout
+  void sent(std::size_t length, long long now) {
+    toClient.erase(0, length);
+    if (state == ACTIVE) {
+      deadline = now + readTimeoutMillis;
+    }
+  }
+
+  bool isFinished() const {
+    return state == DONE && toClient.empty();
+  }
+
+  long long getDeadline() const {
+    return state == CONNECTING || state == ACTIVE ? deadline : 0;
+  }
+
+  bool isExpired(long long now) const {
+    return (state == CONNECTING || state == ACTIVE) && now >= deadline;
+  }
+
+  // 504; a connect that timed out may go to another server, a response that did not come may not
+  void expire(long long now) {
+    if (state == CONNECTING) {
+      failWith(504, true, now);
+    } else {
+      retryable = false;
+      failWith(504, bodyLeft == 0, now);
+    }
+  }
+
+  // moves whatever can move without blocking; `revents` as polled, 0 when the socket may be ready
+  void onUpstream(long long now, short revents) {
+    if (state == CONNECTING) {
+      if ((revents & (POLLOUT | POLLERR | POLLHUP)) == 0) {
+        return;
+      }
+      int error = 0;
+      socklen_t length = sizeof(error);
+      if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0) {
+        failWith(502, true, now);
+        return;
+      }
+      state = ACTIVE;
+      deadline = now + readTimeoutMillis;
+    }
+    if (state == ACTIVE) {
+      writeRequest(now);
+    }
+    if (state == ACTIVE) {
+      readResponse(now);
+    }
+  }
+
+ private:
+  static bool isHopByHop(const std::string &head, std::size_t start, std::size_t end) {
+    static const char *const DROPPED[] = {"Host", "Connection", "Keep-Alive", "Proxy-Connection", "Expect", "TE",
+                                          "Upgrade", "Transfer-Encoding", "Trailer"};
+    std::size_t colon = head.find(':', start);
+    if (colon == std::string::npos || colon > end) {
+      return false;
+    }
+    for (std::size_t i = 0; i < sizeof(DROPPED) / sizeof(DROPPED[0]); ++i) {
+      std::size_t length = strlen(DROPPED[i]);
+      if (colon - start == length && strncasecmp(head.data() + start, DROPPED[i], length) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void resetResponse() {
+    responseHead.clear();
+    headDone = false;
+    responseStarted = false;
+    anyResponseBytes = false;
+    framing = UNTIL_CLOSE;
+    contentLeft = 0;
+    chunkState = CHUNK_SIZE;
+    chunkLeft = 0;
+    chunkSizeDone = false;
+    trailerLine = 0;
+    keepAlive = false;
+    toClient.clear();
+  }
+
+  void writeRequest(long long now) {
+    while (requestSent < request.length()) {
+      ssize_t written = send(fd, request.data() + requestSent, request.length() - requestSent, MSG_NOSIGNAL);
+      if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      }
+      if (written <= 0) {
+        failAttempt(now);
+        return;
+      }
+      requestSent += written;
+      deadline = now + readTimeoutMillis;
+    }
+    if (requestSent > BUFFER_LIMIT) {
+      request.erase(0, requestSent);
+      requestSent = 0;
+      requestTrimmed = true;
+    }
+  }
+
+  void readResponse(long long now) {
+    char buf[READ_CHUNK];
+    while (state == ACTIVE && toClient.length() < BUFFER_LIMIT) {
+      ssize_t received = recv(fd, buf, sizeof(buf), 0);
+      if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+      }
+      if (received <= 0) {
+        endOfStream(now);
+        return;
+      }
+      anyResponseBytes = true;
+      deadline = now + readTimeoutMillis;
+      consume(buf, received, now);
+    }
+  }
+
+  void endOfStream(long long now) {
+    if (headDone && framing == UNTIL_CLOSE) {
+      keepAlive = false;
+      complete();
+      return;
+    }
+    if (anyResponseBytes) {
+      // cut short: only a client that got nothing yet can be told
+      retryable = false;
+    }
+    failAttempt(now);
+  }
+
+  // a kept-alive connection the server closed meanwhile is not the server's fault, and the retry
+  // on a fresh one is not counted
+  void failAttempt(long long now) {
+    if (reused && !anyResponseBytes) {
+      --attempts;
+      failWith(502, false, now);
+    } else {
+      failWith(502, true, now);
+    }
+  }
+
+  void consume(const char *data, std::size_t length, long long now) {
+    if (headDone) {
+      consumeBody(data, length);
+      return;
+    }
+    responseHead.append(data, length);
+    while (!headDone) {
+      std::size_t end = responseHead.find("\r\n\r\n");
+      if (end == std::string::npos) {
+        if (responseHead.length() > HEAD_LIMIT) {
+          retryable = false;
+          failWith(502, false, now);
+        }
+        return;
+      }
+      std::string rest = responseHead.substr(end + 4);
+      responseHead.resize(end + 4);
+      if (!parseHead(now)) {
+        return;
+      }
+      if (status >= 100 && status < 200) {
+        // 1xx: interim, the final response follows
+        responseHead = rest;
+        continue;
+      }
+      headDone = true;
+      responseStarted = true;
+      if (framing == NO_BODY) {
+        keepAlive = keepAlive && rest.empty();
+        complete();
+        return;
+      }
+      consumeBody(rest.data(), rest.length());
+    }
+  }
+
+  // status, framing and keep-alive of the response in responseHead, which is rewritten for the
+  // client in toClient; false when it is no HTTP response
+  bool parseHead(long long now) {
+    if (responseHead.compare(0, 5, "HTTP/") != 0 || responseHead.length() < 12) {
+      retryable = false;
+      failWith(502, false, now);
+      return false;
+    }
+    status = atoi(responseHead.c_str() + 9);
+    keepAlive = responseHead.compare(0, 8, "HTTP/1.0") != 0;
+    framing = status == 204 || status == 304 || (status >= 100 && status < 200) ? NO_BODY : UNTIL_CLOSE;
+    std::string rewritten;
+    std::size_t start = 0;
+    while (start < responseHead.length()) {
+      std::size_t end = responseHead.find("\r\n", start);
+      if (end == start) {
+        break;
+      }
+      if (start != 0 && headerIs(start, end, "Connection")) {
+        std::string value = headerValue(start, end);
+        keepAlive = strcasecmp(value.c_str(), "close") != 0
+            && (keepAlive || strcasecmp(value.c_str(), "keep-alive") == 0);
+        start = end + 2;
+        continue;
+      }
+      if (start != 0 && headerIs(start, end, "Keep-Alive")) {
+        start = end + 2;
+        continue;
+      }
+      if (framing != NO_BODY && headerIs(start, end, "Transfer-Encoding")) {
+        std::string value = headerValue(start, end);
+        framing = value.find("chunked") != std::string::npos ? CHUNKED : framing;
+      } else if (framing == UNTIL_CLOSE && headerIs(start, end, "Content-Length")) {
+        framing = LENGTH;
+        contentLeft = atoll(headerValue(start, end).c_str());
+      }
+      rewritten.append(responseHead, start, end - start + 2);
+      start = end + 2;
+    }
+    if (framing == UNTIL_CLOSE) {
+      keepAlive = false;
+    }
+    if (status >= 200) {
+      toClient += rewritten;
+      toClient += "Connection: close\r\n\r\n";
+    }
+    return true;
+  }
+
+  bool headerIs(std::size_t start, std::size_t end, const char *name) const {
+    std::size_t length = strlen(name);
+    return end - start > length && responseHead[start + length] == ':'
+        && strncasecmp(responseHead.data() + start, name, length) == 0;
+  }
+
+  std::string headerValue(std::size_t start, std::size_t end) const {
+    std::size_t value = responseHead.find(':', start) + 1;
+    while (value < end && (responseHead[value] == ' ' || responseHead[value] == '\t')) {
+      ++value;
+    }
+    std::size_t valueEnd = end;
+    while (valueEnd > value && (responseHead[valueEnd - 1] == ' ' || responseHead[valueEnd - 1] == '\t')) {
+      --valueEnd;
+    }
+    return responseHead.substr(value, valueEnd - value);
+  }
+
+  void consumeBody(const char *data, std::size_t length) {
+    if (framing == UNTIL_CLOSE) {
+      toClient.append(data, length);
+      return;
+    }
+    std::size_t used = length;
+    if (framing == LENGTH) {
+      used = (long long) length < contentLeft ? length : (std::size_t) contentLeft;
+      contentLeft -= used;
+    } else if (framing == CHUNKED) {
+      used = scanChunked(data, length);
+    }
+    toClient.append(data, used);
+    if (used < length) {
+      keepAlive = false; // bytes past the end of the response
+    }
+    if ((framing == LENGTH && contentLeft == 0) || (framing == CHUNKED && chunkState == CHUNKS_DONE)) {
+      complete();
+    }
+  }
+
+  // follows the chunked framing, the bytes are forwarded as they are; returns how many belong to
+  // the response
+  std::size_t scanChunked(const char *data, std::size_t length) {
+    std::size_t i = 0;
+    while (i < length) {
+      char c = data[i];
+      if (chunkState == CHUNK_DATA) {
+        std::size_t take = (long long) (length - i) < chunkLeft ? length - i : (std::size_t) chunkLeft;
+        chunkLeft -= take;
+        i += take;
+        if (chunkLeft == 0) {
+          chunkState = CHUNK_DATA_END;
+        }
+        continue;
+      }
+      ++i;
+      if (chunkState == CHUNK_SIZE) {
+        if (c == '\n') {
+          chunkState = chunkLeft == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+          chunkSizeDone = false;
+          trailerLine = 0;
+        } else if (!chunkSizeDone && isxdigit((unsigned char) c)) {
+          chunkLeft = chunkLeft * 16 + (isdigit((unsigned char) c) ? c - '0' : (tolower(c) - 'a' + 10));
+        } else {
+          chunkSizeDone = true;
+        }
+      } else if (chunkState == CHUNK_DATA_END) {
+        if (c == '\n') {
+          chunkState = CHUNK_SIZE;
+        }
+      } else if (c == '\n') {
+        if (trailerLine == 0) {
+          chunkState = CHUNKS_DONE;
+          return i;
+        }
+        trailerLine = 0;
+      } else if (c != '\r') {
+        ++trailerLine;
+      }
+    }
+    return i;
+  }
+
+  void complete() {
+    state = DONE;
+    upstreamMicros = Clock::nowMicros() - startMicros;
+    pool->succeed(peer);
+    releaseConnection(keepAlive && bodyLeft == 0 && requestSent == request.length());
+  }
+
+  void failWith(int errorStatus, bool blamePeer, long long now) {
+    if (blamePeer && peer != NULL) {
+      pool->fail(peer, now);
+    }
+    releaseConnection(false);
+    state = FAILED;
+    status = errorStatus;
+    upstreamMicros = Clock::nowMicros() - startMicros;
+  }
+
+  void releaseConnection(bool reusable) {
+    if (peer != NULL) {
+      pool->release(peer, fd, reusable);
+    } else if (fd != -1) {
+      close(fd);
+    }
+    peer = NULL;
+    fd = -1;
+  }
+};
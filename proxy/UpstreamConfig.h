@@ -0,0 +1,78 @@
+#pragma once
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// One `server` line of an upstream block, its address resolved when the configuration is read.
+struct UpstreamServerConfig {
+  std::string host;
+  int port;
+  struct sockaddr_in address;
+  int maxFails;           // failed attempts within failTimeoutMillis that take the server out
+  long failTimeoutMillis; // also how long it stays out
+
+  UpstreamServerConfig() : port(80), maxFails(1), failTimeoutMillis(10000) {
+    memset(&address, 0, sizeof(address));
+  }
+
+  std::string authority() const {
+    return port == 80 ? host : host + ":" + toString(port);
+  }
+
+  // false when the host neither is an IPv4 address nor resolves to one
+  bool resolve() {
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &address.sin_addr) == 1) {
+      return true;
+    }
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *found = NULL;
+    if (getaddrinfo(host.c_str(), NULL, &hints, &found) != 0 || found == NULL) {
+      return false;
+    }
+    address.sin_addr = ((struct sockaddr_in *) found->ai_addr)->sin_addr;
+    freeaddrinfo(found);
+    return true;
+  }
+
+  bool sameAddress(const UpstreamServerConfig &other) const {
+    return host == other.host && port == other.port;
+  }
+
+  static std::string toString(int value) {
+    char text[16];
+    snprintf(text, sizeof(text), "%d", value);
+    return text;
+  }
+};
+
+// An `upstream` block, or the single server of a `proxy_pass http://host:port`.
+//
+//   upstream backend {
+//     server 10.0.0.1:8080 max_fails=3 fail_timeout=10s
+//     server 10.0.0.2:8080
+//     least_conn
+//     keepalive 32
+//   }
+struct UpstreamConfig {
+  static const std::size_t DEFAULT_KEEPALIVE = 32;
+
+  std::string name;       // pools are shared by name, across locations and reloads
+  std::string hostHeader; // Host of the proxied requests
+  std::vector<UpstreamServerConfig> servers;
+  bool leastConn;         // otherwise round robin
+  std::size_t keepalive;  // idle connections kept open
+
+  UpstreamConfig() : leastConn(false), keepalive(DEFAULT_KEEPALIVE) {}
+};
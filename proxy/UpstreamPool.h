@@ -0,0 +1,207 @@
+#pragma once
+#include "UpstreamConfig.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <deque>
+#include <vector>
+
+// A server of an upstream as the event loop sees it: connections in use and its recent failures.
+struct UpstreamPeer {
+  UpstreamServerConfig config;
+  int active;            // connections handed out and not released yet
+  int fails;             // failures since failWindowStart
+  long long failWindowStart;
+  long long downUntil;   // passive health: skipped by choose() until then
+  bool removed;          // gone from the configuration, deleted once idle
+
+  explicit UpstreamPeer(const UpstreamServerConfig &config)
+      : config(config), active(0), fails(0), failWindowStart(0), downUntil(0), removed(false) {}
+};
+
+// The servers of one upstream and the keep-alive connections to them. Lives as long as the
+// WebServer: a reload reconfigures it in place, so that health state and open connections survive.
+//
+//   peer = pool.choose(now); fd = pool.takeIdle(peer) or connect(peer->config.address)
+//   ... request, response ...
+//   pool.release(peer, fd, reusable)
+class UpstreamPool {
+  std::string name;
+  std::vector<UpstreamPeer *> peers;
+  std::size_t next; // round robin position
+  bool leastConn;
+  std::size_t keepalive;
+  std::deque<std::pair<UpstreamPeer *, int> > idle; // oldest first
+
+ public:
+  explicit UpstreamPool(const std::string &name) : name(name), next(0), leastConn(false), keepalive(0) {}
+
+  virtual ~UpstreamPool() {
+    closeIdle();
+    for (std::vector<UpstreamPeer *>::iterator it = peers.begin(); it != peers.end(); ++it) {
+      delete *it;
+    }
+  }
+
+ private:
+  UpstreamPool(const UpstreamPool &pool);
+  UpstreamPool &operator=(const UpstreamPool &pool);
+
+ public:
+  const std::string &getName() const {
+    return name;
+  }
+
+  // servers present before keep their state; removed ones stay until their connections are back
+  void configure(const UpstreamConfig &config) {
+    leastConn = config.leastConn;
+    keepalive = config.keepalive;
+    for (std::vector<UpstreamPeer *>::iterator it = peers.begin(); it != peers.end(); ++it) {
+      (*it)->removed = true;
+    }
+    for (std::vector<UpstreamServerConfig>::const_iterator server = config.servers.begin();
+         server != config.servers.end(); ++server) {
+      UpstreamPeer *peer = find(*server);
+      if (peer == NULL) {
+        peers.push_back(new UpstreamPeer(*server));
+        continue;
+      }
+      peer->config = *server;
+      peer->removed = false;
+    }
+    closeIdleWhere(true);
+    deleteRemovedPeers();
+  }
+
+  // the next server by round robin or fewest active connections, skipping those marked down;
+  // NULL when all of them are
+  UpstreamPeer *choose(long long now) {
+    UpstreamPeer *chosen = NULL;
+    for (std::size_t i = 0; i < peers.size(); ++i) {
+      UpstreamPeer *peer = peers[(next + i) % peers.size()];
+      if (peer->removed || peer->downUntil > now) {
+        continue;
+      }
+      if (!leastConn) {
+        next = (next + i + 1) % peers.size();
+        return peer;
+      }
+      if (chosen == NULL || peer->active < chosen->active) {
+        chosen = peer;
+      }
+    }
+    if (chosen != NULL) {
+      next = (next + 1) % peers.size();
+    }
+    return chosen;
+  }
+
+  // an idle connection to the peer that the server did not close meanwhile, -1 when there is none
+  int takeIdle(UpstreamPeer *peer) {
+    for (std::size_t i = idle.size(); i > 0; --i) {
+      if (idle[i - 1].first != peer) {
+        continue;
+      }
+      int fd = idle[i - 1].second;
+      idle.erase(idle.begin() + (i - 1));
+      char byte;
+      ssize_t peeked = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+      if (peeked == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        ++peer->active;
+        return fd;
+      }
+      // closed by the server, or unexpected bytes on it
+      close(fd);
+    }
+    return -1;
+  }
+
+  // counts a new connection that the caller opened
+  void opened(UpstreamPeer *peer) {
+    ++peer->active;
+  }
+
+  // the connection goes back to the idle list when it can carry another request, else it is closed
+  void release(UpstreamPeer *peer, int fd, bool reusable) {
+    --peer->active;
+    if (reusable && !peer->removed && keepalive > 0) {
+      if (idle.size() >= keepalive) {
+        close(idle.front().second);
+        idle.pop_front();
+      }
+      idle.push_back(std::make_pair(peer, fd));
+    } else if (fd != -1) {
+      close(fd);
+    }
+    if (peer->removed) {
+      deleteRemovedPeers();
+    }
+  }
+
+  // max_fails failures within fail_timeout take the peer out for fail_timeout
+  void fail(UpstreamPeer *peer, long long now) {
+    if (now - peer->failWindowStart > peer->config.failTimeoutMillis) {
+      peer->failWindowStart = now;
+      peer->fails = 0;
+    }
+    if (++peer->fails >= peer->config.maxFails && peer->config.maxFails > 0) {
+      peer->downUntil = now + peer->config.failTimeoutMillis;
+      peer->fails = 0;
+    }
+  }
+
+  void succeed(UpstreamPeer *peer) {
+    peer->fails = 0;
+  }
+
+  std::size_t size() const {
+    return peers.size();
+  }
+
+  std::size_t getIdleCount() const {
+    return idle.size();
+  }
+
+  void closeIdle() {
+    closeIdleWhere(false);
+  }
+
+ private:
+  UpstreamPeer *find(const UpstreamServerConfig &server) {
+    for (std::vector<UpstreamPeer *>::iterator it = peers.begin(); it != peers.end(); ++it) {
+      if ((*it)->config.sameAddress(server)) {
+        return *it;
+      }
+    }
+    return NULL;
+  }
+
+  // all idle connections, or only those to removed peers
+  void closeIdleWhere(bool removedOnly) {
+    std::deque<std::pair<UpstreamPeer *, int> >::iterator it = idle.begin();
+    while (it != idle.end()) {
+      if (removedOnly && !it->first->removed) {
+        ++it;
+        continue;
+      }
+      close(it->second);
+      it = idle.erase(it);
+    }
+  }
+
+  void deleteRemovedPeers() {
+    std::vector<UpstreamPeer *>::iterator it = peers.begin();
+    while (it != peers.end()) {
+      if ((*it)->removed && (*it)->active == 0) {
+        delete *it;
+        it = peers.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    if (next >= peers.size()) {
+      next = 0;
+    }
+  }
+};
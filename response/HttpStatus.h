@@ -4,9 +4,9 @@ enum HttpStatus {
   // 200x
   OK = 200, CREATED = 201, NO_CONTENT = 204,
   // 300x
-  MOVED_PERMANENTLY = 301,
+  MOVED_PERMANENTLY = 301, NOT_MODIFIED = 304,
   // 400x
-  BAD_REQUEST = 400, NOT_FOUND = 404, NOT_ALLOWED = 405,
+  BAD_REQUEST = 400, NOT_FOUND = 404, NOT_ALLOWED = 405, PAYLOAD_TOO_LARGE = 413, TOO_MANY_REQUESTS = 429,
   // 500x
-  INTERNAL_SERVER_ERROR = 500
+  INTERNAL_SERVER_ERROR = 500, BAD_GATEWAY = 502, SERVICE_UNAVAILABLE = 503, GATEWAY_TIMEOUT = 504
 };
@@ -0,0 +1,141 @@
+#pragma once
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <sstream>
+
+// One `listen` of a server block, or its `port`: the address the listening socket binds and how it
+// is tuned. The address is resolved when the configuration is read, the Server opens the socket.
+//
+//   listen [<address>:]<port> [ssl] [backlog=<n>] [deferred[=<seconds>]] [fastopen=<n>] [nodelay]
+//          [rcvbuf=<size>] [sndbuf=<size>] [ipv6only=on|off]
+//   listen unix:<path> [ssl] [backlog=<n>] [mode=<octal>] [cleanup=on|off] [rcvbuf=<size>] [sndbuf=<size>]
+//
+// The address is an IPv4 address, `[<IPv6 address>]`, `*` for every IPv4 address or a host name, its
+// IPv4 address first; the IPv6 wildcard `[::]` also takes IPv4 connections unless `ipv6only=on`.
+// A Unix domain socket is made with the permissions of `mode`, so that only the proxy in front can
+// connect; with `cleanup` (on by default) a stale socket file nobody listens on is replaced, and
+// the file is removed with the listener, unless a new binary took it over.
+struct Listener {
+  static const int DEFAULT_BACKLOG = 511;
+
+  std::string host;       // as configured, empty for every IPv4 address
+  int port;
+  std::string path;       // of a Unix domain socket, empty for TCP
+  bool ssl;
+  int backlog;
+  int deferAcceptSeconds; // TCP_DEFER_ACCEPT: the connection is accepted once data came, 0: off
+  int fastOpenQueue;      // TCP_FASTOPEN: SYNs carrying data not yet accepted, 0: off
+  bool noDelay;           // TCP_NODELAY, inherited by the accepted connections
+  int receiveBuffer;      // SO_RCVBUF, inherited by the accepted connections, 0: the system's default
+  int sendBuffer;         // SO_SNDBUF, the same
+  bool ipv6Only;
+  int mode;               // permissions of the socket file, -1: as the umask leaves them
+  bool cleanup;
+  struct sockaddr_storage address;
+  socklen_t addressLength;
+  int fd;                 // -1 until the Server opens it or it is inherited
+
+  Listener()
+      : port(0), ssl(false), backlog(DEFAULT_BACKLOG), deferAcceptSeconds(0), fastOpenQueue(0), noDelay(false),
+        receiveBuffer(0), sendBuffer(0), ipv6Only(false), mode(-1), cleanup(true), addressLength(0), fd(-1) {
+    memset(&address, 0, sizeof(address));
+  }
+
+  bool isUnix() const {
+    return !path.empty();
+  }
+
+  // false when the host is no address and does not resolve to one, or the path is too long
+  bool resolve() {
+    memset(&address, 0, sizeof(address));
+    struct sockaddr_in &ipv4 = (struct sockaddr_in &) address;
+    struct sockaddr_in6 &ipv6 = (struct sockaddr_in6 &) address;
+    if (isUnix()) {
+      struct sockaddr_un &local = (struct sockaddr_un &) address;
+      if (path.length() >= sizeof(local.sun_path)) {
+        return false;
+      }
+      local.sun_family = AF_UNIX;
+      memcpy(local.sun_path, path.c_str(), path.length() + 1);
+      addressLength = (socklen_t) (offsetof(struct sockaddr_un, sun_path) + path.length() + 1);
+      return true;
+    }
+    if (host.empty() || host == "*") {
+      ipv4.sin_family = AF_INET;
+      ipv4.sin_addr.s_addr = htonl(INADDR_ANY);
+    } else if (inet_pton(AF_INET, host.c_str(), &ipv4.sin_addr) == 1) {
+      ipv4.sin_family = AF_INET;
+    } else if (inet_pton(AF_INET6, host.c_str(), &ipv6.sin6_addr) == 1) {
+      ipv6.sin6_family = AF_INET6;
+    } else if (!lookUp(AF_INET) && !lookUp(AF_INET6)) {
+      return false;
+    }
+    if (address.ss_family == AF_INET6) {
+      ipv6.sin6_port = htons(port);
+      addressLength = sizeof(struct sockaddr_in6);
+    } else {
+      ipv4.sin_port = htons(port);
+      addressLength = sizeof(struct sockaddr_in);
+    }
+    return true;
+  }
+
+  // the first address of the host name in `family`; `localhost` binds 127.0.0.1 rather than ::1
+  bool lookUp(int family) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *found = NULL;
+    if (getaddrinfo(host.c_str(), NULL, &hints, &found) != 0 || found == NULL) {
+      return false;
+    }
+    memcpy(&address, found->ai_addr, found->ai_addrlen);
+    freeaddrinfo(found);
+    return true;
+  }
+
+  // the bound address, `0.0.0.0:8080`, `[::1]:8080` or `unix:/run/webserv.sock`: listeners are
+  // matched by it across reloads and binary upgrades
+  std::string key() const {
+    return keyOf(address);
+  }
+
+  static std::string keyOf(const struct sockaddr_storage &address) {
+    char text[INET6_ADDRSTRLEN] = "";
+    std::ostringstream key;
+    if (address.ss_family == AF_UNIX) {
+      key << "unix:" << ((const struct sockaddr_un &) address).sun_path;
+    } else if (address.ss_family == AF_INET6) {
+      const struct sockaddr_in6 &ipv6 = (const struct sockaddr_in6 &) address;
+      inet_ntop(AF_INET6, &ipv6.sin6_addr, text, sizeof(text));
+      key << '[' << text << "]:" << ntohs(ipv6.sin6_port);
+    } else {
+      const struct sockaddr_in &ipv4 = (const struct sockaddr_in &) address;
+      inet_ntop(AF_INET, &ipv4.sin_addr, text, sizeof(text));
+      key << text << ':' << ntohs(ipv4.sin_port);
+    }
+    return key.str();
+  }
+
+  // a peer's address as CGI's REMOTE_ADDR has it: `127.0.0.1`, `::1`, or `unix:` for a client of a
+  // Unix domain socket, which has no address of its own
+  static std::string peerText(const struct sockaddr_storage &peer) {
+    char text[INET6_ADDRSTRLEN] = "";
+    if (peer.ss_family == AF_INET6) {
+      inet_ntop(AF_INET6, &((const struct sockaddr_in6 &) peer).sin6_addr, text, sizeof(text));
+    } else if (peer.ss_family == AF_INET) {
+      inet_ntop(AF_INET, &((const struct sockaddr_in &) peer).sin_addr, text, sizeof(text));
+    } else if (peer.ss_family == AF_UNIX) {
+      return "unix:";
+    }
+    return text;
+  }
+};
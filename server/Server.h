@@ -2,7 +2,16 @@
 #include "Logger.h"
 #include "Client.h"
 #include "Location.h"
+#include "LocationRuntime.h"
 #include "StringBuilder.h"
+#include "AccessLog.h"
+#include "TraceLog.h"
+#include "TrafficCapture.h"
+#include "RateLimiter.h"
+#include "TlsContext.h"
+#include "Http2Connection.h"
+#include "Listener.h"
+#include "PreloadedSite.h"
 
 #include "PollException.h"
 #include "BadListenerFdException.h"
@@ -16,9 +25,14 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <vector>
 #include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/select.h>
 #include <sys/fcntl.h>
 #include <poll.h>
@@ -32,15 +46,25 @@ class Server {
   static Logger LOGGER;
   // constants
   static const int TCP = 0;
-  static const int BACKLOG = 128;
   // vars
-  int port;
+  int port; // of the first listener: names the server in metrics, logs and CGI
   std::string hostName;
   std::string serverName;
   std::string errorPage;
   int maxBodySize;
   std::vector<Location> locations;
-  int listenerFd;
+  std::vector<LocationRuntime> routes; // locations compiled for request handling, same order
+  std::vector<Listener> listeners;
+  AccessLogConfig accessLog;
+  TraceLogConfig traceLog;
+  CaptureConfig capture;
+  RateLimitConfig limits;
+  TlsConfig tls;
+  Http2Config http2;
+  int metricsScope;
+  RateLimiter *limiter;    // bound by the event loop when limits are set, NULL until then
+  TlsContext *tlsContext;  // bound by the event loop for an ssl server, NULL until then or when it failed
+  std::vector<PreloadedSite *> preloadedSites; // of its `preload` locations, owned; not copied with it
 
  public:
   Server(int port = 8080,
@@ -56,8 +80,16 @@ class Server {
       errorPage(errorPage),
       maxBodySize(maxBodySize),
       locations(locations),
-      listenerFd(-1) {
+      metricsScope(-1),
+      limiter(NULL),
+      tlsContext(NULL) {
 
+    if (port != 0) {
+      Listener listener;
+      listener.port = port;
+      listener.resolve();
+      listeners.push_back(listener);
+    }
     if (locations.empty()) {
       Location loc = Location(1);
       this->locations.push_back(loc);
@@ -65,6 +97,9 @@ class Server {
   }
 
   virtual ~Server() {
+    for (std::vector<PreloadedSite *>::iterator it = preloadedSites.begin(); it != preloadedSites.end(); ++it) {
+      delete *it;
+    }
   }
 
   Server(const Server &server) {
@@ -73,12 +108,22 @@ class Server {
 
   Server &operator=(const Server &server) {
     this->maxBodySize = server.maxBodySize;
-    this->listenerFd = server.listenerFd;
+    this->listeners = server.listeners;
     this->port = server.port;
     this->hostName = server.hostName;
     this->serverName = server.serverName;
     this->errorPage = server.errorPage;
     this->locations = server.locations;
+    this->routes = server.routes;
+    this->accessLog = server.accessLog;
+    this->traceLog = server.traceLog;
+    this->capture = server.capture;
+    this->limits = server.limits;
+    this->tls = server.tls;
+    this->http2 = server.http2;
+    this->metricsScope = server.metricsScope;
+    this->limiter = server.limiter;
+    this->tlsContext = server.tlsContext;
     return *this;
   }
 
@@ -93,51 +138,153 @@ class Server {
     }
   }
 
-  void createSocket() {
-    listenerFd = socket(AF_INET, SOCK_STREAM, TCP);
-    if (listenerFd == -1) {
+  static void setOption(int fd, int level, int option, int value, const char *name, const Listener &listener) {
+    if (setsockopt(fd, level, option, &value, sizeof(value)) != 0) {
+      LOG_ERROR(LOGGER, "Listener " << listener.key() << ": " << name << " not set: " << strerror(errno));
+    }
+  }
+
+  // options of the listening socket that its connections inherit or that the kernel applies before
+  // accept(); set again on a socket kept across a reload, where the configuration may have changed
+  static void tune(const Listener &listener) {
+    if (listener.deferAcceptSeconds != 0) {
+      setOption(listener.fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, listener.deferAcceptSeconds, "TCP_DEFER_ACCEPT",
+                listener);
+    }
+    if (listener.fastOpenQueue != 0) {
+      setOption(listener.fd, IPPROTO_TCP, TCP_FASTOPEN, listener.fastOpenQueue, "TCP_FASTOPEN", listener);
+    }
+    if (listener.noDelay) {
+      setOption(listener.fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY", listener);
+    }
+    // on a new socket these come before listen(): the window scale of a connection is fixed by its SYN
+    if (listener.receiveBuffer != 0) {
+      setOption(listener.fd, SOL_SOCKET, SO_RCVBUF, listener.receiveBuffer, "SO_RCVBUF", listener);
+    }
+    if (listener.sendBuffer != 0) {
+      setOption(listener.fd, SOL_SOCKET, SO_SNDBUF, listener.sendBuffer, "SO_SNDBUF", listener);
+    }
+  }
+
+  // the file a server that is gone left behind is removed; a socket someone accepts on is left for
+  // bind() to refuse
+  static void removeStaleSocket(const Listener &listener) {
+    struct stat file;
+    if (lstat(listener.path.c_str(), &file) != 0 || !S_ISSOCK(file.st_mode)) {
+      return;
+    }
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe == -1) {
+      return;
+    }
+    if (connect(probe, (const struct sockaddr *) &listener.address, listener.addressLength) != 0
+        && errno == ECONNREFUSED) {
+      LOG_INFO(LOGGER, "Listener " << listener.key() << ": removing stale socket file");
+      unlink(listener.path.c_str());
+    }
+    close(probe);
+  }
+
+  // bind() made the file of a Unix domain socket, it goes with the socket
+  static std::string failureAfterBind(Listener &listener, const char *call) {
+    std::string reason = failure(listener, call);
+    if (listener.isUnix()) {
+      unlink(listener.path.c_str());
+    }
+    return reason;
+  }
+
+  // closes the socket of a listener that could not be opened, for the exception to say why
+  static std::string failure(Listener &listener, const char *call) {
+    std::string reason = std::string(call) + " " + listener.key() + ": " + strerror(errno);
+    close(listener.fd);
+    listener.fd = -1;
+    return reason;
+  }
+
+ public:
+  // binds and listens on the listener's address, FatalWebServException when it cannot
+  static void open(Listener &listener) {
+    listener.fd = socket(listener.address.ss_family, SOCK_STREAM, TCP);
+    if (listener.fd == -1) {
       throw BadListenerFdException();
     }
     try {
-      setNonBlock(listenerFd);
+      setNonBlock(listener.fd);
     } catch (const NonBlockException &e) {
+      close(listener.fd);
+      listener.fd = -1;
       throw FatalWebServException("Non block exception failure on listener fd");
     }
+    if (listener.isUnix()) {
+      if (listener.cleanup) {
+        removeStaleSocket(listener);
+      }
+    } else {
+      // make port not busy for the next use
+      setOption(listener.fd, SOL_SOCKET, SO_REUSEADDR, 1, "SO_REUSEADDR", listener);
+    }
+    if (listener.address.ss_family == AF_INET6) {
+      setOption(listener.fd, IPPROTO_IPV6, IPV6_V6ONLY, listener.ipv6Only, "IPV6_V6ONLY", listener);
+    }
+    tune(listener);
+    if (0 != bind(listener.fd, (struct sockaddr *) &listener.address, listener.addressLength)) {
+      throw BindException(failure(listener, "bind"));
+    }
+    // before listen(): nobody connects to the socket before it has its permissions
+    if (listener.isUnix() && listener.mode != -1 && chmod(listener.path.c_str(), (mode_t) listener.mode) != 0) {
+      throw BindException(failureAfterBind(listener, "chmod"));
+    }
+    // check that port is listening:
+    // netstat -a -n | grep LISTEN
+    if (-1 == listen(listener.fd, listener.backlog)) {
+      throw ListenException(failureAfterBind(listener, "listen"));
+    }
   }
 
-  void bindAddress() const {
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = INADDR_ANY;
-    if (0 != bind(listenerFd, (struct sockaddr *) &addr, sizeof(addr))) {
-      throw BindException();
+  // a listening socket kept from an earlier configuration, or inherited, takes this one's tuning
+  static void retune(const Listener &listener) {
+    tune(listener);
+    if (-1 == listen(listener.fd, listener.backlog)) {
+      LOG_ERROR(LOGGER, "Listener " << listener.key() << ": backlog not changed: " << strerror(errno));
     }
   }
 
-  void startListening() {
-    if (-1 == listen(listenerFd, BACKLOG)) {
-      throw ListenException();
+  // opens the listeners not inherited yet; those opened before the one that fails stay open
+  void run() {
+    for (std::vector<Listener>::iterator it = listeners.begin(); it != listeners.end(); ++it) {
+      if (it->fd == -1) {
+        open(*it);
+      }
     }
   }
 
- public:
-  void run() {
-    // 1. create listenerFd
-    createSocket();
-    // 2. make port not busy for the next use
-    int YES = 1;
-    setsockopt(listenerFd, SOL_SOCKET, SO_REUSEADDR, &YES, sizeof(int));
-    // 3. bind
-    bindAddress();
-    // 4. listen
-    // check that port is listening:
-    // netstat -a -n | grep LISTEN
-    startListening();
+  // closes the socket, and removes the file of a Unix domain socket unless another process took the
+  // socket over and still listens on it
+  static void closeListener(const Listener &listener, bool handedOver) {
+    close(listener.fd);
+    if (listener.isUnix() && listener.cleanup && !handedOver) {
+      unlink(listener.path.c_str());
+    }
+  }
+
+  // closes the listeners it opened or was given
+  void closeListeners() {
+    for (std::vector<Listener>::iterator it = listeners.begin(); it != listeners.end(); ++it) {
+      if (it->fd != -1) {
+        closeListener(*it, false);
+        it->fd = -1;
+      }
+    }
   }
 
-  int getListenerFd() const {
-    return listenerFd;
+  const Listener *listenerFor(int fd) const {
+    for (std::vector<Listener>::const_iterator it = listeners.begin(); it != listeners.end(); ++it) {
+      if (it->fd == fd) {
+        return &*it;
+      }
+    }
+    return NULL;
   }
 
   int getPort() const {
@@ -160,9 +307,31 @@ class Server {
     return this->maxBodySize;
   }
 
+  // limit_size of the server or of its most permissive location: a body bigger than this is refused
+  // wherever it goes, e.g. by an HTTP/2 stream before its request is routed
+  long largestBodySize() const {
+    long largest = this->maxBodySize;
+    for (std::vector<LocationRuntime>::const_iterator it = routes.begin(); it != routes.end(); ++it) {
+      largest = it->maxBodySize > largest ? it->maxBodySize : largest;
+    }
+    return largest;
+  }
+
+  const AccessLogConfig &getAccessLog() const {
+    return this->accessLog;
+  }
+
+  const TraceLogConfig &getTraceLog() const {
+    return this->traceLog;
+  }
+
+  const CaptureConfig &getCapture() const {
+    return this->capture;
+  }
+
   std::vector<Location> &getLocations() {
     return this->locations;
   }
 };
 
-Logger Server::LOGGER(Logger::DEBUG);
+Logger Server::LOGGER(Logger::INFO);
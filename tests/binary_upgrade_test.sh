@@ -0,0 +1,82 @@
+#!/usr/bin/env bash
+# binary_upgrade: SIGUSR2 starts a new webserv on the inherited listeners, which tells the old one to
+# drain with SIGQUIT, while load runs, keep-alive and one request per connection. No connect may be
+# refused and no connection reset or dropped, and every request is answered 200.
+# usage: binary_upgrade_test.sh <webserv binary> <webserv_loadgen binary> [port]
+set -u
+
+WEBSERV=$1
+LOADGEN=$2
+PORT=${3:-18097}
+DIR=$(mktemp -d)
+SERVER=
+trap 'kill -QUIT $SERVER 2>/dev/null; wait 2>/dev/null; rm -rf "$DIR"' EXIT
+
+fail() {
+  echo "FAIL: $*"
+  [ -f "$DIR/server.log" ] && tail -n 50 "$DIR/server.log"
+  exit 1
+}
+
+mkdir "$DIR/www"
+for i in $(seq 8); do
+  head -c $((i * 1000)) /dev/urandom | base64 > "$DIR/www/file$i.txt"
+done
+echo ok > "$DIR/www/index.html"
+cat > "$DIR/webserv.conf" <<CONF
+server {
+  port $PORT
+  host 127.0.0.1
+  location / {
+    root $DIR/www/
+    allow_method GET
+    index index.html
+  }
+}
+CONF
+
+"$WEBSERV" "$DIR/webserv.conf" > "$DIR/server.log" 2>&1 &
+SERVER=$!
+for _ in $(seq 50); do
+  (exec 3<> "/dev/tcp/127.0.0.1/$PORT") 2> /dev/null && break
+  sleep 0.1
+done
+kill -0 $SERVER 2> /dev/null || fail "the server did not start"
+
+for mode in keepalive close; do
+  "$LOADGEN" --port "$PORT" --root "$DIR/www" -c 32 -d 3 --warmup 0.5 --json \
+      $([ $mode = close ] && echo --close) > "$DIR/report.json" &
+  LOAD=$!
+  sleep 1.5
+  OLD=$SERVER
+  kill -USR2 $OLD
+  # the old process exits once the new one took over and it drained
+  for _ in $(seq 100); do
+    kill -0 $OLD 2> /dev/null || break
+    sleep 0.05
+  done
+  kill -0 $OLD 2> /dev/null && fail "$mode: the old process $OLD did not drain"
+  SERVER=$(sed -n 's/.*Started new binary, pid \([0-9]*\).*/\1/p' "$DIR/server.log" | tail -n 1)
+  [ -n "$SERVER" ] && [ "$SERVER" != "$OLD" ] && kill -0 $SERVER 2> /dev/null || fail "$mode: no new process"
+  wait $LOAD || fail "$mode: loadgen failed"
+  REPORT=$(cat "$DIR/report.json")
+  case "$REPORT" in
+    *'"errors":{}'*) ;;
+    *) fail "$mode: requests failed across the upgrade: $REPORT" ;;
+  esac
+  STATUSES=$(echo "$REPORT" | sed 's/.*"statuses":{\([^}]*\)}.*/\1/')
+  case "$STATUSES" in
+    '"200":'[0-9]*) [ "${STATUSES#*,}" = "$STATUSES" ] || fail "$mode: not only 200s: $STATUSES" ;;
+    *) fail "$mode: no 200s: $REPORT" ;;
+  esac
+  echo "$mode: ${STATUSES#*:} requests answered 200, $OLD handed over to $SERVER"
+done
+
+kill -QUIT $SERVER
+for _ in $(seq 100); do
+  kill -0 $SERVER 2> /dev/null || break
+  sleep 0.05
+done
+kill -0 $SERVER 2> /dev/null && fail "the last process did not drain"
+SERVER=
+echo "ok: two upgrades under load without an error"
@@ -0,0 +1,58 @@
+#!/usr/bin/env bash
+# limit_size: a request whose Content-Length is over the limit is answered 413 as soon as its headers
+# are in, and none of its body is read: the access log's $request_length is the length of the head.
+# usage: limit_size_test.sh <webserv binary> [port]
+set -u
+
+WEBSERV=$1
+PORT=${2:-18095}
+DIR=$(mktemp -d)
+trap 'kill $SERVER 2>/dev/null; wait $SERVER 2>/dev/null; rm -rf "$DIR"' EXIT
+
+fail() {
+  echo "FAIL: $*"
+  [ -f "$DIR/server.log" ] && cat "$DIR/server.log"
+  exit 1
+}
+
+mkdir "$DIR/www"
+echo ok > "$DIR/www/index.html"
+cat > "$DIR/webserv.conf" <<CONF
+server {
+  port $PORT
+  host 127.0.0.1
+  limit_size 1000
+  access_log $DIR/access.log
+  log_format '\$status \$request_length'
+  location / {
+    root $DIR/www/
+    allow_method GET POST
+    index index.html
+  }
+}
+CONF
+
+"$WEBSERV" "$DIR/webserv.conf" > "$DIR/server.log" 2>&1 &
+SERVER=$!
+for _ in $(seq 50); do
+  (exec 3<> "/dev/tcp/127.0.0.1/$PORT") 2> /dev/null && break
+  sleep 0.1
+done
+
+HEAD=$'POST /upload HTTP/1.1\r\nHost: localhost\r\nContent-Length: 1000000000\r\n\r\n'
+exec 3<> "/dev/tcp/127.0.0.1/$PORT" || fail "the server does not listen on $PORT"
+printf '%s' "$HEAD" >&3
+read -r -t 5 STATUS_LINE <&3 || fail "no response to the head"
+case "$STATUS_LINE" in
+  "HTTP/1.1 413 "*) ;;
+  *) fail "expected a 413, got '$STATUS_LINE'" ;;
+esac
+# the body the client sends regardless is drained, not counted
+head -c 65536 /dev/zero >&3 2> /dev/null
+exec 3>&-
+
+kill -QUIT $SERVER
+wait $SERVER 2>/dev/null
+LINE=$(tail -n 1 "$DIR/access.log" 2> /dev/null)
+[ "$LINE" = "413 ${#HEAD}" ] || fail "expected access log line '413 ${#HEAD}', got '$LINE'"
+echo "ok: 413 after ${#HEAD} bytes of head"
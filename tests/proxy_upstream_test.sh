@@ -0,0 +1,85 @@
+#!/usr/bin/env bash
+# proxy_upstream: against tests/upstream_stub.py, requests of different clients go over one pooled
+# upstream connection; a pooled connection the upstream closed is replaced without the client seeing
+# an error; an upstream nothing listens on is answered 502.
+# usage: proxy_upstream_test.sh <webserv binary> [port]
+set -u
+
+WEBSERV=$1
+PORT=${2:-18098}
+UPSTREAM=$((PORT + 1))
+UNREACHABLE=$((PORT + 2))
+DIR=$(mktemp -d)
+SERVER=
+STUB=
+trap 'kill $SERVER $STUB 2>/dev/null; wait 2>/dev/null; rm -rf "$DIR"' EXIT
+
+fail() {
+  echo "FAIL: $*"
+  [ -f "$DIR/server.log" ] && tail -n 50 "$DIR/server.log"
+  exit 1
+}
+
+# waits for a listener on port $1
+await() {
+  for _ in $(seq 50); do
+    (exec 3<> "/dev/tcp/127.0.0.1/$1") 2> /dev/null && return 0
+    sleep 0.1
+  done
+  return 1
+}
+
+# GET $1 on a connection of its own; sets STATUS and BODY
+get() {
+  exec 3<> "/dev/tcp/127.0.0.1/$PORT" || fail "the server does not listen on $PORT"
+  printf '%s' "GET $1 HTTP/1.1"$'\r\nHost: localhost\r\nConnection: close\r\n\r\n' >&3
+  local response
+  response=$(timeout 5 cat <&3)
+  exec 3<&-
+  STATUS=$(echo "$response" | head -n 1 | cut -d ' ' -f 2)
+  BODY=$(echo "$response" | tail -n 1)
+}
+
+cat > "$DIR/webserv.conf" <<CONF
+upstream backend {
+  server 127.0.0.1:$UPSTREAM
+  keepalive 4
+}
+server {
+  port $PORT
+  host 127.0.0.1
+  location / { proxy_pass http://backend; allow_method GET }
+  location /down { proxy_pass http://127.0.0.1:$UNREACHABLE; proxy_connect_timeout 2s; allow_method GET }
+}
+CONF
+
+python3 "$(dirname "$0")/upstream_stub.py" "$UPSTREAM" &
+STUB=$!
+await "$UPSTREAM" || fail "the upstream stub did not start"
+"$WEBSERV" "$DIR/webserv.conf" > "$DIR/server.log" 2>&1 &
+SERVER=$!
+await "$PORT" || fail "the server did not start"
+
+get /first
+[ "$STATUS" = 200 ] && [ "$BODY" = "connection 1" ] || fail "first request: $STATUS '$BODY'"
+get /second
+[ "$STATUS" = 200 ] || fail "second request: $STATUS"
+[ "$BODY" = "connection 1" ] || fail "the pooled connection was not reused: '$BODY'"
+echo "ok: keep-alive reuse"
+
+get /stale
+[ "$STATUS" = 200 ] && [ "$BODY" = "connection 1" ] || fail "stale request: $STATUS '$BODY'"
+sleep 0.2
+get /after
+[ "$STATUS" = 200 ] || fail "request after the upstream closed its connection: $STATUS"
+[ "$BODY" = "connection 2" ] || fail "expected a new upstream connection, got '$BODY'"
+echo "ok: a closed pooled connection is replaced"
+
+get /down
+[ "$STATUS" = 502 ] || fail "unreachable upstream: expected 502, got $STATUS"
+echo "ok: 502 from an unreachable upstream"
+
+kill -0 $SERVER 2> /dev/null || fail "the server exited"
+kill -QUIT $SERVER
+wait $SERVER 2> /dev/null
+SERVER=
@@ -0,0 +1,90 @@
+#!/usr/bin/env bash
+# reload_under_load: SIGHUP reloads, one every 50 ms, between two configurations while load runs,
+# keep-alive and one request per connection. Not a request may fail or find its connection dropped,
+# and every one of them is answered 200.
+# usage: reload_under_load_test.sh <webserv binary> <webserv_loadgen binary> [port]
+set -u
+
+WEBSERV=$1
+LOADGEN=$2
+PORT=${3:-18096}
+DIR=$(mktemp -d)
+RELOADER=
+trap 'kill $RELOADER $SERVER 2>/dev/null; wait 2>/dev/null; rm -rf "$DIR"' EXIT
+
+fail() {
+  echo "FAIL: $*"
+  [ -f "$DIR/server.log" ] && tail -n 50 "$DIR/server.log"
+  exit 1
+}
+
+# writes the configuration, with the extra location when $1 is set
+configure() {
+  local extra=
+  [ -n "$1" ] && extra="location /extra { root $DIR/www/; allow_method GET }"
+  cat > "$DIR/webserv.conf.new" <<CONF
+server {
+  port $PORT
+  host 127.0.0.1
+  server_name reload$1
+  location / {
+    root $DIR/www/
+    allow_method GET
+    index index.html
+  }
+  $extra
+}
+CONF
+  mv "$DIR/webserv.conf.new" "$DIR/webserv.conf"
+}
+
+mkdir "$DIR/www"
+for i in $(seq 8); do
+  head -c $((i * 1000)) /dev/urandom | base64 > "$DIR/www/file$i.txt"
+done
+echo ok > "$DIR/www/index.html"
+configure ""
+
+"$WEBSERV" "$DIR/webserv.conf" > "$DIR/server.log" 2>&1 &
+SERVER=$!
+for _ in $(seq 50); do
+  (exec 3<> "/dev/tcp/127.0.0.1/$PORT") 2> /dev/null && break
+  sleep 0.1
+done
+kill -0 $SERVER 2> /dev/null || fail "the server did not start"
+
+(
+  flip=""
+  while kill -0 $SERVER 2> /dev/null; do
+    [ -n "$flip" ] && flip= || flip=x
+    configure "$flip"
+    kill -HUP $SERVER
+    sleep 0.05
+  done
+) &
+RELOADER=$!
+
+for mode in keepalive close; do
+  REPORT=$("$LOADGEN" --port "$PORT" --root "$DIR/www" -c 32 -d 3 --warmup 0.5 --json \
+      $([ $mode = close ] && echo --close)) || fail "$mode: loadgen failed"
+  case "$REPORT" in
+    *'"errors":{}'*) ;;
+    *) fail "$mode: requests failed: $REPORT" ;;
+  esac
+  STATUSES=$(echo "$REPORT" | sed 's/.*"statuses":{\([^}]*\)}.*/\1/')
+  case "$STATUSES" in
+    '"200":'[0-9]*) [ "${STATUSES#*,}" = "$STATUSES" ] || fail "$mode: not only 200s: $STATUSES" ;;
+    *) fail "$mode: no 200s: $REPORT" ;;
+  esac
+  echo "$mode: ${STATUSES#*:} requests answered 200"
+done
+
+kill $RELOADER 2> /dev/null
+wait $RELOADER 2> /dev/null
+RELOADS=$(grep -c "Configuration reloaded" "$DIR/server.log")
+[ "$RELOADS" -ge 50 ] || fail "only $RELOADS reloads applied"
+grep -q "Reload failed" "$DIR/server.log" && fail "a reload failed"
+kill -0 $SERVER 2> /dev/null || fail "the server exited"
+kill -QUIT $SERVER
+wait $SERVER 2> /dev/null
+echo "ok: $RELOADS reloads under load without an error"
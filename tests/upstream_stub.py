@@ -0,0 +1,34 @@
+#!/usr/bin/env python3
+# A keep-alive upstream for the proxy test. Every response names the connection it went over, counted
+# from 1 by their first requests, so that probes of the port do not count; /stale closes the connection after its response without saying so, the way
+# an upstream drops an idle connection.
+# usage: upstream_stub.py <port>
+import sys
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+accepted = [0]
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def setup(self):
+        super().setup()
+        self.connection_number = 0
+
+    def log_message(self, *args):
+        pass
+
+    def do_GET(self):
+        if self.connection_number == 0:
+            accepted[0] += 1
+            self.connection_number = accepted[0]
+        body = ('connection %d\n' % self.connection_number).encode()
+        self.send_response(200)
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+        self.close_connection = self.path.endswith('/stale')
+
+
+ThreadingHTTPServer(('127.0.0.1', int(sys.argv[1])), Handler).serve_forever()
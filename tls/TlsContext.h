@@ -0,0 +1,165 @@
+#pragma once
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include <cstring>
+#include <string>
+
+// `port <n> ssl` and the ssl_* directives of a server block
+struct TlsConfig {
+  static const long DEFAULT_SESSION_CACHE = 20480;  // sessions, OpenSSL's default
+  static const long DEFAULT_SESSION_TIMEOUT = 300;  // seconds
+
+  bool enabled;
+  std::string certificate;    // PEM: the server's certificate, then its chain
+  std::string certificateKey; // PEM private key of the certificate
+  long sessionCache;          // sessions kept for resumption by id, 0: none
+  long sessionTimeout;        // seconds a session or a ticket can be resumed for
+  bool sessionTickets;
+  bool ktls;                  // the kernel takes over the record layer where it can
+
+  TlsConfig()
+      : enabled(false), sessionCache(DEFAULT_SESSION_CACHE), sessionTimeout(DEFAULT_SESSION_TIMEOUT),
+        sessionTickets(true), ktls(true) {}
+};
+
+// The SSL_CTX of an ssl server. Like the rate limiters it is kept by the event loop across reloads:
+// its session cache and its ticket keys are what resumption needs, so a reload loads the certificate
+// into the same context rather than starting a new one.
+class TlsContext {
+  SSL_CTX *ctx;
+
+ public:
+  TlsContext() : ctx(NULL) {}
+
+  ~TlsContext() {
+    SSL_CTX_free(ctx);
+  }
+
+ private:
+  TlsContext(const TlsContext &context);
+  TlsContext &operator=(const TlsContext &context);
+
+ public:
+  // false with the reason when the certificate and its key do not load, the context is left as it was;
+  // `http2` offers h2 in ALPN before http/1.1
+  bool configure(const TlsConfig &config, bool http2, std::string &error) {
+    SSL_CTX *target = ctx != NULL ? ctx : SSL_CTX_new(TLS_server_method());
+    if (target == NULL) {
+      error = lastError("SSL_CTX_new");
+      return false;
+    }
+    if (!loadCertificate(target, config, error)) {
+      if (target != ctx) {
+        SSL_CTX_free(target);
+      }
+      return false;
+    }
+    ctx = target;
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    // a write that took part of the buffer is retried from where it stopped, not with the same pointer
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    static const unsigned char sessionContext[] = "webserv";
+    SSL_CTX_set_session_id_context(ctx, sessionContext, sizeof(sessionContext) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, config.sessionCache > 0 ? SSL_SESS_CACHE_SERVER : SSL_SESS_CACHE_OFF);
+    SSL_CTX_sess_set_cache_size(ctx, config.sessionCache);
+    SSL_CTX_set_timeout(ctx, config.sessionTimeout);
+    if (config.sessionTickets) {
+      SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+    } else {
+      SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    }
+#ifdef SSL_OP_ENABLE_KTLS
+    if (config.ktls) {
+      SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    } else {
+      SSL_CTX_clear_options(ctx, SSL_OP_ENABLE_KTLS);
+    }
+#endif
+    SSL_CTX_set_alpn_select_cb(ctx, selectProtocol, (void *) (http2 ? PROTOCOLS_H2 : PROTOCOLS_HTTP1));
+    return true;
+  }
+
+  // server side of a TLS connection on the accepted socket, NULL when OpenSSL cannot make one
+  SSL *accept(int fd) const {
+    SSL *ssl = ctx != NULL ? SSL_new(ctx) : NULL;
+    if (ssl != NULL && SSL_set_fd(ssl, fd) != 1) {
+      SSL_free(ssl);
+      return NULL;
+    }
+    if (ssl != NULL) {
+      SSL_set_accept_state(ssl);
+    }
+    return ssl;
+  }
+
+  static std::string lastError(const std::string &call) {
+    char reason[256];
+    unsigned long code = ERR_get_error();
+    ERR_clear_error();
+    if (code == 0) {
+      return call + " failed";
+    }
+    ERR_error_string_n(code, reason, sizeof(reason));
+    return call + ": " + reason;
+  }
+
+ private:
+  static const unsigned char PROTOCOLS_H2[];    // ALPN wire format: length-prefixed names, ours first
+  static const unsigned char PROTOCOLS_HTTP1[];
+
+  // the first of our protocols the client offers; a client offering none of them gets no ALPN answer
+  // and speaks HTTP/1.1 all the same
+  static int selectProtocol(SSL *ssl, const unsigned char **out, unsigned char *outLength, const unsigned char *in,
+                            unsigned inLength, void *arg) {
+    (void) ssl;
+    const unsigned char *protocols = (const unsigned char *) arg;
+    unsigned char *selected;
+    if (SSL_select_next_proto(&selected, outLength, protocols, (unsigned) strlen((const char *) protocols), in,
+                              inLength) != OPENSSL_NPN_NEGOTIATED) {
+      return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+  }
+
+  // the files are read once and applied together: a key that does not match keeps the old pair
+  static bool loadCertificate(SSL_CTX *target, const TlsConfig &config, std::string &error) {
+    X509 *certificate = NULL;
+    STACK_OF(X509) *chain = sk_X509_new_null();
+    EVP_PKEY *key = NULL;
+    BIO *file = BIO_new_file(config.certificate.c_str(), "r");
+    if (file != NULL) {
+      certificate = PEM_read_bio_X509_AUX(file, NULL, NULL, NULL);
+      X509 *link;
+      while (certificate != NULL && (link = PEM_read_bio_X509(file, NULL, NULL, NULL)) != NULL) {
+        sk_X509_push(chain, link);
+      }
+      ERR_clear_error(); // the end of the chain reads as an error
+      BIO_free(file);
+    }
+    file = certificate != NULL ? BIO_new_file(config.certificateKey.c_str(), "r") : NULL;
+    if (file != NULL) {
+      key = PEM_read_bio_PrivateKey(file, NULL, NULL, NULL);
+      BIO_free(file);
+    }
+    bool loaded = certificate != NULL && key != NULL
+        && SSL_CTX_use_cert_and_key(target, certificate, key, chain, 1) == 1;
+    if (!loaded) {
+      error = lastError(certificate == NULL ? "ssl_certificate " + config.certificate
+                        : key == NULL ? "ssl_certificate_key " + config.certificateKey
+                        : "ssl_certificate_key does not match ssl_certificate");
+    }
+    X509_free(certificate);
+    EVP_PKEY_free(key);
+    sk_X509_pop_free(chain, X509_free);
+    return loaded;
+  }
+};
+
+const unsigned char TlsContext::PROTOCOLS_H2[] = "\x02h2\x08http/1.1";
+const unsigned char TlsContext::PROTOCOLS_HTTP1[] = "\x08http/1.1";
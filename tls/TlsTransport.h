@@ -0,0 +1,118 @@
+#pragma once
+#include "Transport.h"
+#include "Metrics.h"
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <climits>
+#include <cerrno>
+
+// TLS over an accepted socket. The handshake runs within the first reads, as the client's messages
+// come in; OpenSSL wanting to read or write comes out as EAGAIN, like a socket that is not ready.
+// A record is decrypted whole, so what a read did not take stays with OpenSSL: hasBuffered() has the
+// loop come back for it without waiting on the socket. When the kernel took over the record layer
+// (kTLS), a file is sent with SSL_sendfile(), i.e. sendfile(2) on the socket, encrypted by the kernel.
+class TlsTransport : public Transport {
+ private:
+  int fd;
+  SSL *ssl;
+  bool closed;
+  bool established; // handshake done
+  bool kernelSends; // kTLS on the sending side
+
+ public:
+  TlsTransport(int fd, SSL *ssl) : fd(fd), ssl(ssl), closed(false), established(false), kernelSends(false) {
+  }
+
+  virtual ~TlsTransport() {
+    close();
+    SSL_free(ssl);
+  }
+
+ private:
+  TlsTransport(const TlsTransport &transport);
+  TlsTransport &operator=(const TlsTransport &transport);
+
+ public:
+  virtual ssize_t read(char *buf, size_t length) {
+    ERR_clear_error();
+    int got = SSL_read(ssl, buf, length > INT_MAX ? INT_MAX : (int) length);
+    return got > 0 ? progress(got) : failure(got);
+  }
+
+  virtual ssize_t write(const char *buf, size_t length) {
+    ERR_clear_error();
+    int written = SSL_write(ssl, buf, length > INT_MAX ? INT_MAX : (int) length);
+    return written > 0 ? progress(written) : failure(written);
+  }
+
+  virtual bool sendsFiles() const {
+    return kernelSends;
+  }
+
+  virtual ssize_t sendFile(int file, off_t offset, size_t length) {
+#ifndef OPENSSL_NO_KTLS
+    ERR_clear_error();
+    ossl_ssize_t sent = SSL_sendfile(ssl, file, offset, length, 0);
+    return sent > 0 ? sent : failure((int) sent);
+#else
+    return Transport::sendFile(file, offset, length);
+#endif
+  }
+
+  virtual bool hasBuffered() const {
+    return SSL_pending(ssl) > 0;
+  }
+
+  // close_notify when the handshake was done, without waiting for the peer's
+  virtual void close() {
+    if (closed) {
+      return;
+    }
+    if (established && !SSL_in_init(ssl)) {
+      ERR_clear_error();
+      SSL_shutdown(ssl);
+    }
+    ::close(fd);
+    closed = true;
+  }
+
+  virtual int getFd() const {
+    return fd;
+  }
+
+ private:
+  ssize_t progress(int moved) {
+    if (!established) {
+      handshakeDone();
+    }
+    return moved;
+  }
+
+  ssize_t failure(int result) {
+    int error = SSL_get_error(ssl, result);
+    if (!established && SSL_is_init_finished(ssl)) {
+      handshakeDone();
+    }
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+      errno = EAGAIN;
+      return -1;
+    }
+    if (error == SSL_ERROR_ZERO_RETURN || (error == SSL_ERROR_SYSCALL && errno == 0)) {
+      return 0; // close_notify, or the peer closed without one
+    }
+    if (error != SSL_ERROR_SYSCALL) {
+      errno = EPROTO; // a failed handshake or a bad record
+    }
+    ERR_clear_error();
+    return -1;
+  }
+
+  void handshakeDone() {
+    established = true;
+    kernelSends = BIO_get_ktls_send(SSL_get_wbio(ssl)) != 0;
+    Metrics::countHandshake(SSL_session_reused(ssl) == 1, kernelSends);
+  }
+};
@@ -0,0 +1,99 @@
+#pragma once
+#include "Transport.h"
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+// In-process connection: request bytes are fed by the caller, response bytes collect in memory.
+// Lets benchmarks and stress tests run the whole pipeline deterministically without sockets.
+class MemoryTransport : public Transport {
+ private:
+  std::string input;
+  std::size_t inputOffset;
+  bool inputEnded;
+  std::string output;
+  bool keepOutput;
+  unsigned long long outputBytes;
+  bool closed;
+
+ public:
+  // keepOutput false only counts response bytes, for runs that would otherwise grow without bound
+  MemoryTransport(bool keepOutput = true)
+      : inputOffset(0), inputEnded(false), keepOutput(keepOutput), outputBytes(0), closed(false) {
+  }
+
+  virtual ~MemoryTransport() {
+  }
+
+ private:
+  MemoryTransport(const MemoryTransport &transport);
+  MemoryTransport &operator=(const MemoryTransport &transport);
+
+ public:
+  void feed(const char *data, std::size_t length) {
+    if (inputOffset == input.length()) {
+      input.clear();
+      inputOffset = 0;
+    }
+    input.append(data, length);
+  }
+
+  void feed(const std::string &data) {
+    feed(data.data(), data.length());
+  }
+
+  // the peer closed its side: read returns 0 once the fed bytes are consumed
+  void endInput() {
+    inputEnded = true;
+  }
+
+  const std::string &getOutput() const {
+    return output;
+  }
+
+  unsigned long long getOutputBytes() const {
+    return outputBytes;
+  }
+
+  bool isClosed() const {
+    return closed;
+  }
+
+  virtual ssize_t read(char *buf, size_t length) {
+    std::size_t available = input.length() - inputOffset;
+    if (available == 0) {
+      if (inputEnded || closed) {
+        return 0;
+      }
+      errno = EAGAIN;
+      return -1;
+    }
+    if (length > available) {
+      length = available;
+    }
+    memcpy(buf, input.data() + inputOffset, length);
+    inputOffset += length;
+    return (ssize_t) length;
+  }
+
+  virtual ssize_t write(const char *buf, size_t length) {
+    if (closed) {
+      errno = EPIPE;
+      return -1;
+    }
+    if (keepOutput) {
+      output.append(buf, length);
+    }
+    outputBytes += length;
+    return (ssize_t) length;
+  }
+
+  virtual void close() {
+    closed = true;
+  }
+
+  virtual bool isReadable() const {
+    return inputOffset < input.length() || inputEnded;
+  }
+};
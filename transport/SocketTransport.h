@@ -0,0 +1,53 @@
+#pragma once
+#include "Transport.h"
+
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+// A connected stream socket: accepted TCP connections, or one end of a socketpair(2)
+class SocketTransport : public Transport {
+ private:
+  int fd;
+  bool closed;
+
+ public:
+  SocketTransport(int fd) : fd(fd), closed(false) {
+  }
+
+  virtual ~SocketTransport() {
+    close();
+  }
+
+ private:
+  SocketTransport(const SocketTransport &transport);
+  SocketTransport &operator=(const SocketTransport &transport);
+
+ public:
+  virtual ssize_t read(char *buf, size_t length) {
+    return recv(fd, buf, length, 0);
+  }
+
+  virtual ssize_t write(const char *buf, size_t length) {
+    return send(fd, buf, length, MSG_NOSIGNAL);
+  }
+
+  virtual bool sendsFiles() const {
+    return true;
+  }
+
+  virtual ssize_t sendFile(int file, off_t offset, size_t length) {
+    return sendfile(fd, file, &offset, length);
+  }
+
+  virtual void close() {
+    if (!closed && fd >= 0) {
+      ::close(fd);
+    }
+    closed = true;
+  }
+
+  virtual int getFd() const {
+    return fd;
+  }
+};
@@ -0,0 +1,48 @@
+#pragma once
+#include <sys/types.h>
+#include <cerrno>
+
+// Byte stream of one client connection beneath the event loop. read and write follow recv(2) and
+// send(2): the number of bytes moved, 0 from read at the end of the stream, -1 with errno set
+// (EAGAIN when the stream is not ready). Transports with a file descriptor are polled; the others
+// report readiness themselves so the loop can serve them without the kernel. A response body that is
+// a file goes through sendFile() when the transport sendsFiles(), read into memory and written otherwise.
+class Transport {
+ public:
+  virtual ~Transport() {
+  }
+
+  virtual ssize_t read(char *buf, size_t length) = 0;
+
+  virtual ssize_t write(const char *buf, size_t length) = 0;
+
+  virtual void close() = 0;
+
+  // descriptor to poll, -1 for in-process transports
+  virtual int getFd() const {
+    return -1;
+  }
+
+  // readiness of in-process transports, only asked when getFd() is -1
+  virtual bool isReadable() const {
+    return false;
+  }
+
+  // bytes read from the descriptor already, which polling it does not report
+  virtual bool hasBuffered() const {
+    return false;
+  }
+
+  virtual bool sendsFiles() const {
+    return false;
+  }
+
+  // like write, from `length` bytes of `file` at `offset`
+  virtual ssize_t sendFile(int file, off_t offset, size_t length) {
+    (void) file;
+    (void) offset;
+    (void) length;
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+};
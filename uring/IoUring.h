@@ -0,0 +1,342 @@
+#pragma once
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/utsname.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+
+// A submission/completion queue pair of io_uring(7), driven through the raw system calls: the ring
+// memory is mapped here, entries are filled in by the caller and handed to the kernel in batches by
+// submitAndWait(). Also holds one ring of provided buffers that multishot receives pick from.
+//
+//   io_uring_sqe *sqe = ring.getSqe(); sqe->opcode = IORING_OP_RECV; ...
+//   ring.submitAndWait(timeout);
+//   while ((cqe = ring.peek()) != NULL) { ...; ring.advance(); }
+class IoUring {
+ public:
+  static const unsigned short BUFFER_GROUP = 0;
+
+ private:
+  int fd;
+  unsigned features;
+  void *sqRing;
+  std::size_t sqRingSize;
+  void *cqRing;
+  std::size_t cqRingSize;
+  struct io_uring_sqe *sqes;
+  std::size_t sqesSize;
+  unsigned *sqHead;
+  unsigned *sqTail;
+  unsigned sqMask;
+  unsigned sqEntries;
+  unsigned *sqArray;
+  unsigned sqLocalTail; // entries handed out by getSqe, published to the kernel on submit
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned cqMask;
+  struct io_uring_cqe *cqes;
+
+  struct io_uring_buf_ring *bufferRing;
+  std::size_t bufferRingSize;
+  char *buffers;
+  unsigned bufferCount;
+  unsigned bufferSize;
+  unsigned bufferStride;
+  unsigned short bufferTail;
+
+ public:
+  IoUring()
+      : fd(-1), features(0), sqRing(MAP_FAILED), sqRingSize(0), cqRing(MAP_FAILED), cqRingSize(0),
+        sqes((struct io_uring_sqe *) MAP_FAILED), sqesSize(0), sqHead(NULL), sqTail(NULL), sqMask(0), sqEntries(0),
+        sqArray(NULL), sqLocalTail(0), cqHead(NULL), cqTail(NULL), cqMask(0), cqes(NULL),
+        bufferRing((struct io_uring_buf_ring *) MAP_FAILED), bufferRingSize(0), buffers(NULL), bufferCount(0),
+        bufferSize(0), bufferStride(0), bufferTail(0) {}
+
+  virtual ~IoUring() {
+    if (bufferRing != MAP_FAILED) {
+      munmap(bufferRing, bufferRingSize);
+    }
+    delete[] buffers;
+    if (sqes != MAP_FAILED) {
+      munmap(sqes, sqesSize);
+    }
+    if (cqRing != MAP_FAILED && cqRing != sqRing) {
+      munmap(cqRing, cqRingSize);
+    }
+    if (sqRing != MAP_FAILED) {
+      munmap(sqRing, sqRingSize);
+    }
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+
+ private:
+  IoUring(const IoUring &ring);
+  IoUring &operator=(const IoUring &ring);
+
+ public:
+  // false with the reason when this kernel lacks something the server relies on
+  bool setup(unsigned entries, std::string &error) {
+    if (!kernelAtLeast(6, 0)) {
+      error = "multishot receive needs Linux 6.0";
+      return false;
+    }
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (fd == -1) {
+      error = std::string("io_uring_setup: ") + strerror(errno);
+      return false;
+    }
+    features = params.features;
+    if (!(features & IORING_FEAT_EXT_ARG) || !(features & IORING_FEAT_NODROP)) {
+      error = "io_uring lacks timed waits or overflow protection";
+      return false;
+    }
+    if (!mapRings(params, error) || !supportsOperations(error)) {
+      return false;
+    }
+    return true;
+  }
+
+  // `count` buffers of `size` bytes for IOSQE_BUFFER_SELECT in BUFFER_GROUP, each followed by one
+  // spare byte that is never handed to the kernel. They go into a registered buffer ring when the
+  // kernel takes buffers from it, otherwise they are handed over one IORING_OP_PROVIDE_BUFFERS at a
+  // time; those completions carry a user_data of 0.
+  bool setupBuffers(unsigned count, unsigned size, std::string &error) {
+    bufferCount = count;
+    bufferSize = size;
+    bufferStride = size + 1;
+    buffers = new char[(std::size_t) count * bufferStride];
+    if (!registerBufferRing(error)) {
+      return false;
+    }
+    for (unsigned short id = 0; id < count; ++id) {
+      recycleBuffer(id);
+    }
+    if (!bufferRingWorks()) {
+      unregisterBufferRing();
+      for (unsigned short id = 0; id < count; ++id) {
+        recycleBuffer(id);
+      }
+    }
+    return true;
+  }
+
+  char *buffer(unsigned short id) {
+    return buffers + (std::size_t) id * bufferStride;
+  }
+
+  // gives a buffer back to the kernel once its bytes are consumed
+  void recycleBuffer(unsigned short id) {
+    if (bufferRing == MAP_FAILED) {
+      struct io_uring_sqe *sqe = getSqe();
+      sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+      sqe->fd = 1;
+      sqe->addr = (unsigned long) buffer(id);
+      sqe->len = bufferSize;
+      sqe->off = id;
+      sqe->buf_group = BUFFER_GROUP;
+      return;
+    }
+    struct io_uring_buf *entry = &bufferRing->bufs[bufferTail & (bufferCount - 1)];
+    entry->addr = (unsigned long) buffer(id);
+    entry->len = bufferSize;
+    entry->bid = id;
+    ++bufferTail;
+    __atomic_store_n(&bufferRing->tail, bufferTail, __ATOMIC_RELEASE);
+  }
+
+  // a zeroed entry, submitted with the next submitAndWait(); flushes the queue first when it is full
+  struct io_uring_sqe *getSqe() {
+    if (sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+      enter(0, NULL);
+    }
+    struct io_uring_sqe *sqe = &sqes[sqLocalTail & sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray[sqLocalTail & sqMask] = sqLocalTail & sqMask;
+    ++sqLocalTail;
+    return sqe;
+  }
+
+  // submits the queued entries and waits until a completion is there or the timeout passed;
+  // 0 or -errno (-ETIME: nothing completed in time, -EINTR: a signal arrived)
+  int submitAndWait(int timeoutMillis) {
+    if (peek() != NULL) {
+      timeoutMillis = 0;
+    }
+    struct __kernel_timespec timeout = {timeoutMillis / 1000, (long long) (timeoutMillis % 1000) * 1000000};
+    return enter(1, &timeout);
+  }
+
+  struct io_uring_cqe *peek() {
+    unsigned head = *cqHead;
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+      return NULL;
+    }
+    return &cqes[head & cqMask];
+  }
+
+  void advance() {
+    __atomic_store_n(cqHead, *cqHead + 1, __ATOMIC_RELEASE);
+  }
+
+ private:
+  int enter(unsigned waitFor, struct __kernel_timespec *timeout) {
+    unsigned toSubmit = sqLocalTail - *sqTail;
+    __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (unsigned long) timeout;
+    unsigned flags = waitFor > 0 ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+    long ret = syscall(__NR_io_uring_enter, fd, toSubmit, waitFor, flags, waitFor > 0 ? &arg : NULL,
+                       waitFor > 0 ? sizeof(arg) : 0);
+    return ret < 0 ? -errno : 0;
+  }
+
+  bool registerBufferRing(std::string &error) {
+    bufferRingSize = bufferCount * sizeof(struct io_uring_buf);
+    bufferRing = (struct io_uring_buf_ring *) mmap(NULL, bufferRingSize, PROT_READ | PROT_WRITE,
+                                                   MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (bufferRing == MAP_FAILED) {
+      error = std::string("buffer ring: ") + strerror(errno);
+      return false;
+    }
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (unsigned long) bufferRing;
+    registration.ring_entries = bufferCount;
+    registration.bgid = BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &registration, 1) == -1) {
+      munmap(bufferRing, bufferRingSize);
+      bufferRing = (struct io_uring_buf_ring *) MAP_FAILED;
+    }
+    return true;
+  }
+
+  void unregisterBufferRing() {
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.bgid = BUFFER_GROUP;
+    syscall(__NR_io_uring_register, fd, IORING_UNREGISTER_PBUF_RING, &registration, 1);
+    munmap(bufferRing, bufferRingSize);
+    bufferRing = (struct io_uring_buf_ring *) MAP_FAILED;
+  }
+
+  // some kernels accept the registration of a buffer ring and then never pick from it: one byte
+  // read through a pipe tells, before anything else is queued on the ring
+  bool bufferRingWorks() {
+    if (bufferRing == MAP_FAILED) {
+      return false;
+    }
+    int probe[2];
+    if (pipe2(probe, O_CLOEXEC) != 0) {
+      return true;
+    }
+    bool works = true;
+    if (write(probe[1], "", 1) == 1) {
+      struct io_uring_sqe *sqe = getSqe();
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = probe[0];
+      sqe->len = 1;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = BUFFER_GROUP;
+      sqe->user_data = 1;
+      struct io_uring_cqe *cqe = NULL;
+      while (cqe == NULL && enter(1, NULL) == 0) {
+        cqe = peek();
+      }
+      if (cqe != NULL) {
+        works = cqe->res != -ENOBUFS;
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+          recycleBuffer((unsigned short) (cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+        }
+        advance();
+      }
+    }
+    close(probe[0]);
+    close(probe[1]);
+    return works;
+  }
+
+  bool mapRings(const struct io_uring_params &params, std::string &error) {
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = (features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) {
+      sqRingSize = cqRingSize = sqRingSize > cqRingSize ? sqRingSize : cqRingSize;
+    }
+    sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) {
+      error = std::string("mmap of the submission ring: ") + strerror(errno);
+      return false;
+    }
+    cqRing = single ? sqRing : mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                    IORING_OFF_CQ_RING);
+    if (cqRing == MAP_FAILED) {
+      error = std::string("mmap of the completion ring: ") + strerror(errno);
+      return false;
+    }
+    sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe *) mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                        IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+      error = std::string("mmap of the submission entries: ") + strerror(errno);
+      return false;
+    }
+    char *sq = (char *) sqRing;
+    char *cq = (char *) cqRing;
+    sqHead = (unsigned *) (sq + params.sq_off.head);
+    sqTail = (unsigned *) (sq + params.sq_off.tail);
+    sqMask = *(unsigned *) (sq + params.sq_off.ring_mask);
+    sqEntries = params.sq_entries;
+    sqArray = (unsigned *) (sq + params.sq_off.array);
+    sqLocalTail = *sqTail;
+    cqHead = (unsigned *) (cq + params.cq_off.head);
+    cqTail = (unsigned *) (cq + params.cq_off.tail);
+    cqMask = *(unsigned *) (cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return true;
+  }
+
+  bool supportsOperations(std::string &error) {
+    static const unsigned char needed[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ,
+                                           IORING_OP_SPLICE, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL};
+    static const unsigned OPS = 256;
+    std::size_t size = sizeof(struct io_uring_probe) + OPS * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *) calloc(1, size);
+    bool probed = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, OPS) == 0;
+    for (std::size_t i = 0; probed && i < sizeof(needed); ++i) {
+      if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+        char message[64];
+        snprintf(message, sizeof(message), "io_uring operation %u not supported", (unsigned) needed[i]);
+        error = message;
+        probed = false;
+      }
+    }
+    if (error.empty() && !probed) {
+      error = std::string("io_uring probe: ") + strerror(errno);
+    }
+    free(probe);
+    return probed;
+  }
+
+  static bool kernelAtLeast(int major, int minor) {
+    struct utsname name;
+    int runningMajor = 0;
+    int runningMinor = 0;
+    if (uname(&name) != 0 || sscanf(name.release, "%d.%d", &runningMajor, &runningMinor) != 2) {
+      return false;
+    }
+    return runningMajor > major || (runningMajor == major && runningMinor >= minor);
+  }
+};
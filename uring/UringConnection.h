@@ -0,0 +1,72 @@
+#pragma once
+#include <sys/types.h>
+#include <unistd.h>
+#include <cstddef>
+
+// A listening socket with a multishot accept armed, told apart from a later socket reusing its fd.
+struct UringListener {
+  int fd;
+  ino_t inode;
+  bool cancelled;
+};
+
+// What the io_uring backend keeps per connection: the operations the kernel still holds, which keep
+// the client allocated after it is closed, and the file a response body is read or spliced from.
+struct UringConnection {
+  // one counter per operation kind, indexed like the tags of the backend's user_data
+  static const int KINDS = 12;
+
+  unsigned short inFlight[KINDS];
+  bool receiving;        // a multishot receive is armed
+  bool sending;          // the response is submitted
+  bool cancelled;        // the connection was closed and its operations cancelled
+  int file;              // body source, owned
+  std::size_t fileOffset;
+  std::size_t fileLeft;  // not spliced into the pipe yet
+  std::size_t piped;     // in the pipe, not sent yet
+  std::size_t chunk;     // length of the last splice into the pipe
+  int pipe[2];
+  bool pausing;          // receive cancelled while a proxied request takes no more body
+  int upstream;          // proxy connection the upstream polls are armed for
+  bool upstreamStale[2]; // the next POLLIN, POLLOUT completion is of a cancelled poll
+  short upstreamEvents;  // readiness of the upstream socket, not handed to the proxy yet
+
+  UringConnection()
+      : receiving(false), sending(false), cancelled(false), file(-1), fileOffset(0), fileLeft(0), piped(0), chunk(0),
+        pausing(false), upstream(0), upstreamEvents(0) {
+    for (int i = 0; i < KINDS; ++i) {
+      inFlight[i] = 0;
+    }
+    pipe[0] = pipe[1] = -1;
+    upstreamStale[0] = upstreamStale[1] = false;
+  }
+
+  ~UringConnection() {
+    closeFile();
+    if (pipe[0] != -1) {
+      close(pipe[0]);
+      close(pipe[1]);
+    }
+  }
+
+ private:
+  UringConnection(const UringConnection &connection);
+  UringConnection &operator=(const UringConnection &connection);
+
+ public:
+  bool isBusy() const {
+    for (int i = 0; i < KINDS; ++i) {
+      if (inFlight[i] != 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void closeFile() {
+    if (file != -1) {
+      close(file);
+      file = -1;
+    }
+  }
+};
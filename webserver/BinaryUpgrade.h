@@ -0,0 +1,205 @@
+#pragma once
+#include "Logger.h"
+#include "Listener.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+extern char **environ;
+
+// Hands the listening sockets over to a freshly exec'd webserv (SIGUSR2). The sockets are inherited
+// across fork/exec and their numbers passed in the environment:
+//   WEBSERV_LISTENERS=0.0.0.0:8080=5;[::1]:9001=6
+//                                     address=fd of every listener
+//   WEBSERV_UPGRADE_FROM=1234         pid of the old process, told to drain (SIGQUIT) once the
+//                                     new one listens
+// Both processes accept from the same sockets meanwhile, so no connection is refused.
+class BinaryUpgrade {
+ public:
+  static const char *LISTENERS_ENV;
+  static const char *PARENT_ENV;
+  static const char *DRAIN_TIMEOUT_ENV;
+
+  // starts `commandLine` with the listeners inherited; returns its pid, -1 on failure
+  static pid_t spawn(const std::vector<std::string> &commandLine, const std::map<std::string, int> &listeners) {
+    if (commandLine.empty()) {
+      return -1;
+    }
+    // everything is prepared before fork: the child runs exec only
+    std::string listenersVar = std::string(LISTENERS_ENV) + "=";
+    for (std::map<std::string, int>::const_iterator it = listeners.begin(); it != listeners.end(); ++it) {
+      if (it != listeners.begin()) {
+        listenersVar += ";";
+      }
+      listenersVar += it->first + "=" + Logger::toString(it->second);
+    }
+    std::string parentVar = std::string(PARENT_ENV) + "=" + Logger::toString(getpid());
+
+    std::string path = resolve(commandLine[0]);
+    std::vector<char *> argv;
+    for (std::vector<std::string>::const_iterator it = commandLine.begin(); it != commandLine.end(); ++it) {
+      argv.push_back(const_cast<char *>(it->c_str()));
+    }
+    argv.push_back(NULL);
+    std::vector<char *> envp;
+    for (char **var = environ; *var != NULL; ++var) {
+      if (!hasName(*var, LISTENERS_ENV) && !hasName(*var, PARENT_ENV)) {
+        envp.push_back(*var);
+      }
+    }
+    envp.push_back(const_cast<char *>(listenersVar.c_str()));
+    envp.push_back(const_cast<char *>(parentVar.c_str()));
+    envp.push_back(NULL);
+
+    std::vector<int> kept;
+    std::vector<int> closed;
+    listDescriptors(listeners, kept, closed);
+    pid_t pid = fork();
+    if (pid == 0) {
+      markInherited(kept, closed);
+      execve(path.c_str(), &argv[0], &envp[0]);
+      _exit(127);
+    }
+    return pid;
+  }
+
+  // listeners passed by the previous process, by address; the variables are consumed
+  static std::map<std::string, int> inheritedListeners() {
+    std::map<std::string, int> listeners;
+    const char *value = getenv(LISTENERS_ENV);
+    if (value == NULL) {
+      return listeners;
+    }
+    std::string list(value);
+    std::size_t start = 0;
+    while (start < list.length()) {
+      std::size_t end = list.find(';', start);
+      if (end == std::string::npos) {
+        end = list.length();
+      }
+      std::string entry = list.substr(start, end - start);
+      // port:fd from a binary that bound every IPv4 address only
+      std::size_t equals = entry.rfind('=');
+      std::size_t separator = equals != std::string::npos ? equals : entry.find(':');
+      if (separator != std::string::npos) {
+        std::string address = entry.substr(0, separator);
+        if (equals == std::string::npos) {
+          address = "0.0.0.0:" + address;
+        }
+        int fd = std::atoi(entry.substr(separator + 1).c_str());
+        if (isListeningOn(fd, address)) {
+          listeners[address] = fd;
+        }
+      }
+      start = end + 1;
+    }
+    unsetenv(LISTENERS_ENV);
+    return listeners;
+  }
+
+  static pid_t parentToDrain() {
+    const char *value = getenv(PARENT_ENV);
+    pid_t pid = value == NULL ? 0 : (pid_t) std::atol(value);
+    unsetenv(PARENT_ENV);
+    return pid == getppid() ? pid : 0;
+  }
+
+  static long drainTimeoutMillis() {
+    const char *value = getenv(DRAIN_TIMEOUT_ENV);
+    long seconds = value == NULL ? 0 : std::atol(value);
+    return (seconds > 0 ? seconds : 30) * 1000L;
+  }
+
+ private:
+  // execve does not search PATH
+  static std::string resolve(const std::string &program) {
+    const char *path = getenv("PATH");
+    if (program.find('/') != std::string::npos || path == NULL) {
+      return program;
+    }
+    std::string dirs(path);
+    std::size_t start = 0;
+    while (start <= dirs.length()) {
+      std::size_t end = dirs.find(':', start);
+      if (end == std::string::npos) {
+        end = dirs.length();
+      }
+      std::string candidate = (end == start ? std::string(".") : dirs.substr(start, end - start)) + "/" + program;
+      if (access(candidate.c_str(), X_OK) == 0) {
+        return candidate;
+      }
+      start = end + 1;
+    }
+    return program;
+  }
+
+  static bool hasName(const char *var, const char *name) {
+    std::size_t length = strlen(name);
+    return strncmp(var, name, length) == 0 && var[length] == '=';
+  }
+
+  // only the listeners survive exec: client sockets, logs and pipes would otherwise be held open by
+  // the new process. The descriptors are listed before fork, the child changes its own flags only
+  static void listDescriptors(const std::map<std::string, int> &listeners, std::vector<int> &kept,
+                              std::vector<int> &closed) {
+    std::map<int, bool> keep;
+    for (std::map<std::string, int>::const_iterator it = listeners.begin(); it != listeners.end(); ++it) {
+      keep[it->second] = true;
+    }
+    DIR *dir = opendir("/proc/self/fd");
+    if (dir == NULL) {
+      return;
+    }
+    int dirFd = dirfd(dir);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      int fd = std::atoi(entry->d_name);
+      if (entry->d_name[0] == '.' || fd <= STDERR_FILENO || fd == dirFd) {
+        continue;
+      }
+      (keep.count(fd) ? kept : closed).push_back(fd);
+    }
+    closedir(dir);
+  }
+
+  // between fork and exec: fcntl only, the parent's descriptors keep their flags
+  static void markInherited(const std::vector<int> &kept, const std::vector<int> &closed) {
+    for (std::size_t i = 0; i < kept.size(); ++i) {
+      int flags = fcntl(kept[i], F_GETFD);
+      if (flags != -1) {
+        fcntl(kept[i], F_SETFD, flags & ~FD_CLOEXEC);
+      }
+    }
+    for (std::size_t i = 0; i < closed.size(); ++i) {
+      int flags = fcntl(closed[i], F_GETFD);
+      if (flags != -1) {
+        fcntl(closed[i], F_SETFD, flags | FD_CLOEXEC);
+      }
+    }
+  }
+
+  static bool isListeningOn(int fd, const std::string &address) {
+    struct sockaddr_storage addr;
+    socklen_t length = sizeof(addr);
+    int listening = 0;
+    socklen_t optionLength = sizeof(listening);
+    return fd > STDERR_FILENO
+        && getsockname(fd, (struct sockaddr *) &addr, &length) == 0
+        && Listener::keyOf(addr) == address
+        && getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &optionLength) == 0 && listening;
+  }
+};
+
+const char *BinaryUpgrade::LISTENERS_ENV = "WEBSERV_LISTENERS";
+const char *BinaryUpgrade::PARENT_ENV = "WEBSERV_UPGRADE_FROM";
+const char *BinaryUpgrade::DRAIN_TIMEOUT_ENV = "WEBSERV_DRAIN_TIMEOUT";
@@ -0,0 +1,22 @@
+#pragma once
+#include "Server.h"
+#include "AdmissionControl.h"
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+// A configuration load running off the event loop after SIGHUP. The loop only looks at the result
+// once `done` is set, so the fields need no further synchronisation.
+struct ReloadJob {
+  pthread_t thread;
+  bool running;
+  bool pending; // another SIGHUP arrived while loading, load again afterwards
+  std::string path;
+  std::vector<Server *> servers;
+  AdmissionConfig admission;
+  std::string error;
+  int done;
+
+  ReloadJob() : thread(), running(false), pending(false), done(0) {}
+};
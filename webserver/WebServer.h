@@ -18,6 +18,11 @@
 #include <netinet/in.h>
 #include <sys/select.h>
 #include <sys/fcntl.h>
+#include <poll.h>
+#include <cerrno>
+#include <csignal>
+#include <set>
+#include <algorithm>
 
 #include <sstream>
 
@@ -27,6 +32,25 @@
 #include "StringBuilder.h"
 #include "HttpStatusWrapper.h"
 #include "CgiHandler.h"
+#include "CgiCache.h"
+#include "AccessLog.h"
+#include "TraceLog.h"
+#include "TrafficCapture.h"
+#include "Clock.h"
+#include "Metrics.h"
+#include "StatusPage.h"
+#include "ReloadJob.h"
+#include "BinaryUpgrade.h"
+#include "FileWorkerPool.h"
+#include "IoUring.h"
+#include "UringConnection.h"
+#include "UpstreamPool.h"
+#include "ProxyConnection.h"
+#include "RateLimiter.h"
+#include "AdmissionControl.h"
+#include "TlsContext.h"
+#include "TlsTransport.h"
+#include "Http2Connection.h"
 
 #include "FatalWebServException.h"
 #include "FileNotFoundException.h"
@@ -48,18 +72,59 @@
 class WebServer {
  public:
   static const int BUF_SIZE = 1024;
+  static const int ACCEPT_BATCH = 64; // connections accepted per turn of a listener
   static const int PORT_DEFAULT = 8080;
   static const int SERVER_TIMEOUT = 22000;
   static const int SEND_CHUNK_SIZE = 100000;
-  static const int POLL_FD_ARR_SIZE = 50;
+  static const int HTTP2_READ_CHUNK = 16384; // a frame of the default size per read
+  static const int DRAIN_LIMIT = 65536; // bytes of a refused peer's input read before closing it
 
  private:
   static Logger LOGGER;
   std::vector<Server *> servers;
+  // configurations replaced by a reload, deleted once their last connection is gone
+  std::vector<std::vector<Server *> > retiredServers;
+  std::string configPath;
+  std::vector<std::string> commandLine;
+  ReloadJob reload;
+  pid_t upgradePid; // new binary started by SIGUSR2, until it takes over or fails
+  bool draining;
+  long long drainDeadline;
+  FileWorkerPool filePool; // blocking filesystem calls of the handlers, when started
+  IoUring *uring;          // the loop's backend when started, NULL: poll(2)
+  std::map<int, UringListener *> uringListeners; // multishot accepts by listener fd
+  std::vector<Client *> uringTouched; // clients with completions in the current step
+  std::map<std::string, UpstreamPool *> upstreamPools; // by upstream name, kept across reloads
+  std::set<Client *> proxyingClients;
+  CgiCache cgiCache;
+  std::map<std::string, RateLimiter *> limiters; // by "server_name:port", kept across reloads
+  std::map<std::string, TlsContext *> tlsContexts; // the same
+  AdmissionControl admission;
+  std::set<Client *> multiplexedClients; // HTTP/2 connections
+  std::size_t http2Streams;              // clients that serve a stream of one, not connections of their own
+
+  // self-pipe: signal handlers and the reload thread wake the event loop through it
+  static int wakePipe[2];
+  static volatile sig_atomic_t reloadRequested;
+  static volatile sig_atomic_t upgradeRequested;
+  static volatile sig_atomic_t drainRequested;
 
  public:
-  WebServer() : STATUSES(initHttpStatuses()), MIME(initMimeTypes()), MAX_FILESIZE(10485760) {}
-  virtual ~WebServer() {}
+  WebServer() : upgradePid(0), draining(false), drainDeadline(0), uring(NULL), http2Streams(0),
+                STATUSES(initHttpStatuses()), MIME(initMimeTypes()), MAX_FILESIZE(10485760), requestLocation(NULL),
+                responseFile(-1), responseFileSize(0), responsePreloaded(NULL), responsePreloadedLength(0) {}
+  virtual ~WebServer() {
+    delete uring;
+    for (std::map<std::string, UpstreamPool *>::iterator it = upstreamPools.begin(); it != upstreamPools.end(); ++it) {
+      delete it->second;
+    }
+    for (std::map<std::string, RateLimiter *>::iterator it = limiters.begin(); it != limiters.end(); ++it) {
+      delete it->second;
+    }
+    for (std::map<std::string, TlsContext *>::iterator it = tlsContexts.begin(); it != tlsContexts.end(); ++it) {
+      delete it->second;
+    }
+  }
 
  private:
   void setNonBlock(int fd) {
@@ -74,170 +139,334 @@ class WebServer {
 
   void eraseServer(Server &server) {
     for (std::vector<Server *>::iterator serverIt = servers.begin(); serverIt != servers.end(); ++serverIt) {
-      if ((*serverIt)->getListenerFd() == server.getListenerFd()) {
+      if (*serverIt == &server) {
         servers.erase(serverIt);
         break;
       }
     }
   }
 
-  void fillPollFds(struct pollfd *fds,
-                   const std::map<int, Server *> &listenerFdsMap,
-                   const std::map<int, Client *> &clientFdsMap) {
-    int j = 0;
-    for (std::map<int, Client *>::const_iterator fd = clientFdsMap.begin(); fd != clientFdsMap.end(); ++fd, ++j) {
-      fds[j].fd = fd->first;
-      fds[j].events |= POLLIN;
-      if (fd->second->getClientStatus() == WRITE) {
-        fds[j].fd = fd->first;
-        fds[j].events |= POLLOUT;
+  std::map<Client *, Server *> clientsToServersMap;
+  std::map<int, Server *> serverFdsMap;
+  // rebuilt on every loop iteration: listeners first, then the clients with a descriptor
+  std::vector<struct pollfd> pollFds;
+  std::vector<Client *> polledClients;
+  std::vector<Client *> polledUpstreams; // after the clients in pollFds
+
+  // access and trace logs are shared by servers writing to the same path
+  std::map<const Server *, AccessLog *> accessLogs;
+  std::map<const Server *, TraceLog *> traceLogs;
+  std::map<const Server *, TrafficCapture *> captures;
+  std::vector<BufferedLogFile *> logFiles;
+  long long lastActivityMillis;
+
+  // runs the handler once and keeps the response on the client until the transport took all of it
+  void prepareResponse(Client &client, Server &server) {
+    client.timing.mark(RequestTiming::HANDLER_START);
+    if (admission.checksQueueDelay() && !admitQueued(client)) {
+      return;
+    }
+    FileTask *task;
+    if (!filePool.isRunning()) {
+      task = routeRequest(client, server, inlineTask);
+    } else {
+      if (client.fileTask == NULL) {
+        client.fileTask = new FileTask();
+      }
+      task = routeRequest(client, server, *client.fileTask);
+    }
+    if (task != NULL && shareCgiRun(client, *task)) {
+      if (client.getClientStatus() == WAITING_FILE) {
+        requestLocation = NULL;
+        return;
       }
+      task = NULL;
     }
+    if (task != NULL && filePool.isRunning() && task->route->aioThreads && filePool.submit(task)) {
+      client.fileTaskRunning = true;
+      client.clientStatus = WAITING_FILE;
+      requestLocation = NULL;
+      return;
+    }
+    if (task != NULL) {
+      // local files, no pool, or the pool is saturated: this one runs on the loop
+      task->run();
+      finishFileTask(*task, client);
+    }
+    completeResponse(client);
   }
 
-  std::map<Client *, Server *> clientsToServersMap;
-  std::map<int, Client *> clientFdsMap;
-  std::map<int, Server *> serverFdsMap;
-  struct pollfd *fds;
-  int currentFd;
-
-  void writeToClientSocket(Client &client, std::map<Client *, Server *>::iterator &clientIt) {
-
-    generateResponse(client, *(clientIt->second));
-
-    std::size_t bytesWritten = 0;
-
-    // if was error status, send error response
-    if (isErrorStatus()) {
-      const std::string &errorResponse = requestLocation->errorPage[responseStatus];
-      if ((bytesWritten = send(currentFd, errorResponse.c_str(), errorResponse.length(), 0)) == -1) {
-        return;
+  // headers of the response generated for the client's request, ready to send
+  void completeResponse(Client &client) {
+    client.timing.mark(RequestTiming::HANDLER_END);
+
+    client.responseStatus = responseStatus;
+    client.locationScope = requestLocation != NULL ? requestLocation->metricsScope : -1;
+    if (responsePreloaded != NULL) {
+      client.responsePreloaded = responsePreloaded;
+      client.responsePreloadedLength = responsePreloadedLength;
+      responsePreloaded = NULL;
+    } else if (isErrorStatus()) {
+      if (requestLocation != NULL) {
+        client.responseHead = requestLocation->errorResponse(responseStatus);
+      }
+      if (client.responseHead.empty()) {
+        client.responseHead = STATUSES[responseStatus] + "Content-Length: 0\r\nConnection: close\r\n\r\n";
       }
     } else {
-      // generate headers
-      std::stringstream ss;
-      ss << STATUSES[responseStatus];
-
-      // Content-Length
-      std::size_t responseBodyLength = responseBody.length();
-      if (!responseBody.empty()) {
-        ss << "Content-Length: " << responseBodyLength << "\r\n";
-      }
-
-      // Content-Type
-      unsigned long pos;
-      ss << "Content-Type: ";
-      if ((pos = client.path.find_last_of('.')) != std::string::npos) {
-        MimeTypes::const_iterator it;
-        if ((it = MIME.find(client.path.substr(pos))) != MIME.end()) {
-          ss << it->second;
-        } else {
-          ss << MIME[".html"];
-        }
-      } else {
-        ss << MIME[".html"];
+      client.responseHead = serializeHeaders(client);
+      client.responseBody.swap(responseBody);
+      if (responseFile != -1 && client.uring != NULL) {
+        client.uring->file = responseFile;
+        client.uring->fileOffset = 0;
+        client.uring->fileLeft = responseFileSize;
+      } else if (responseFile != -1) {
+        client.responseFile = responseFile;
+        client.responseFileOffset = 0;
+        client.responseFileLeft = responseFileSize;
       }
-      ss << "\r\n";
-
-      // Connection
-      ss << "Connection: close";
-
-      // end of response headers
-      ss << "\r\n\r\n";
-
-      const std::string &headersString = ss.str();
+      responseFile = -1;
+    }
+    responseBody.clear();
+    responseContentType.clear();
+    requestLocation = NULL;
+    client.responseOffset = 0;
+    client.clientStatus = SENDING;
+  }
 
-      if ((bytesWritten = send(currentFd, headersString.c_str(), headersString.length(), 0)) == -1) {
-        return;
-      } else if (bytesWritten == 0) {
-        return;
+  // returns true once the response is fully written or the peer is gone; a file body goes last,
+  // straight from the file to the transport
+  bool sendResponse(Client &client) {
+    const char *head = client.responseHead.data();
+    std::size_t headLength = client.responseHead.length();
+    if (client.responsePreloaded != NULL) {
+      head = client.responsePreloaded;
+      headLength = client.responsePreloadedLength;
+    }
+    std::size_t total = headLength + client.responseBody.length();
+    while (client.responseOffset < total) {
+      bool inHead = client.responseOffset < headLength;
+      const char *part = inHead ? head + client.responseOffset
+                                : client.responseBody.data() + (client.responseOffset - headLength);
+      ssize_t bytesWritten = client.transport->write(part, (inHead ? headLength : total) - client.responseOffset);
+      if (bytesWritten < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return false;
       }
+      if (bytesWritten <= 0) {
+        return true;
+      }
+      if (client.responseOffset == 0) {
+        client.timing.mark(RequestTiming::FIRST_BYTE_SENT);
+      }
+      client.responseOffset += bytesWritten;
+      client.bytesSent += bytesWritten;
+    }
+    while (client.responseFileLeft > 0) {
+      ssize_t bytesWritten = client.transport->sendFile(client.responseFile, client.responseFileOffset,
+                                                        client.responseFileLeft);
+      if (bytesWritten < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return false;
+      }
+      if (bytesWritten <= 0) {
+        return true;
+      }
+      client.responseFileOffset += bytesWritten;
+      client.responseFileLeft -= bytesWritten;
+      client.bytesSent += bytesWritten;
+    }
+    return true;
+  }
 
-      std::size_t countWrittenBytes = 0;
-      std::size_t CHUNK_SIZE = 100000;
-      // if body exists — send body
-      if (!responseBody.empty()) {
-
-        std::size_t chunkSize;
-
-        while (countWrittenBytes < responseBodyLength) {
-          if (responseBodyLength > CHUNK_SIZE) {
-            chunkSize = CHUNK_SIZE;
-          } else {
-            chunkSize = responseBodyLength;
-          }
+  void writeToClient(Client &client, Server &server) {
+    if (client.getClientStatus() == WRITE) {
+      prepareResponse(client, server);
+    }
+    if (client.getClientStatus() == WAITING_FILE) {
+      return;
+    }
+    if (sendResponse(client)) {
+      client.timing.markAlways(RequestTiming::LAST_BYTE_SENT);
+      finishRequest(client, server);
+      client.closeClient();
+    }
+  }
 
-          if ((bytesWritten = send(currentFd, responseBody.c_str() + countWrittenBytes, chunkSize, 0)) == -1) {
-            return;
-          } else if (bytesWritten == 0) {
-            return;
-          }
+ public:
+  // status line and headers of a successful response, for the current responseStatus/responseBody
+  std::string serializeHeaders(const Client &client) {
+    std::stringstream ss;
+    ss << STATUSES[responseStatus];
+
+    // Content-Length
+    std::size_t bodyLength = responseFile != -1 ? responseFileSize : responseBody.length();
+    if (bodyLength != 0) {
+      ss << "Content-Length: " << bodyLength << "\r\n";
+    }
 
-          countWrittenBytes += bytesWritten;
-        }
+    // Content-Type
+    unsigned long pos;
+    ss << "Content-Type: ";
+    if (!responseContentType.empty()) {
+      ss << responseContentType;
+    } else if ((pos = client.path.find_last_of('.')) != std::string::npos) {
+      MimeTypes::const_iterator it;
+      if ((it = MIME.find(client.path.substr(pos))) != MIME.end()) {
+        ss << it->second;
+      } else {
+        ss << MIME[".html"];
       }
+    } else {
+      ss << MIME[".html"];
     }
+    ss << "\r\n";
+
+    // Connection
+    ss << "Connection: close";
+
+    // end of response headers
+    ss << "\r\n\r\n";
+    return ss.str();
   }
 
+ private:
   void readRequestChunk(Client &client) {
     long bytesRead;
     char buf[BUF_SIZE + 1];
-    int fd = client.getFd();
 
-    if ((bytesRead = recv(fd, buf, BUF_SIZE, 0)) == -1) {
-      client.closeClient();
+    if ((bytesRead = client.transport->read(buf, BUF_SIZE)) == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        client.closeClient();
+      }
       return;
     }
     if (bytesRead == 0) {
       client.closeClient();
       return;
     }
+    receiveBytes(client, buf, bytesRead);
+  }
+
+  void receiveBytes(Client &client, char *buf, long bytesRead) {
+    if (client.captureId != 0) {
+      captures[clientsToServersMap[&client]]->data(client.captureId, buf, bytesRead);
+    }
+    consumeRequestBytes(client, buf, bytesRead);
+  }
+
+ public:
+  // h2c with prior knowledge: the decision waits for PREFACE_DECISION bytes, which may come in more
+  // than one read; until then they are kept as the start of an HTTP/1 request
+  bool opensHttp2(const Client &client, const char *buf, long bytesRead) const {
+    if (client.getClientStatus() != READ || client.uring != NULL || client.http2Stream
+        || client.fullRequestBody.length() >= Http2Connection::PREFACE_DECISION) {
+      return false;
+    }
+    std::string opening = client.fullRequestBody;
+    opening.append(buf, std::min((std::size_t) bytesRead, Http2Frame::PREFACE_LENGTH));
+    return Http2Connection::startsWithPreface(opening.data(), opening.length());
+  }
+
+  // request bytes as read from the connection, `buf` has room for a terminating zero
+  void consumeRequestBytes(Client &client, char *buf, long bytesRead) {
     buf[bytesRead] = 0;
+    bool firstBytes = client.bytesReceived == 0;
+    if (firstBytes) {
+      client.timing.mark(RequestTiming::FIRST_BYTE);
+    }
+    client.bytesReceived += bytesRead;
+    if (!client.http2Stream) {
+      Metrics::countBytesIn(bytesRead); // a stream's request was counted as the frames it came in
+    }
+    if (opensHttp2(client, buf, bytesRead)) {
+      startHttp2(client);
+      if (client.getClientStatus() == MULTIPLEXED) {
+        // the start of the preface may have come in an earlier read
+        client.http2->receive(client.fullRequestBody.data(), client.fullRequestBody.length());
+        std::string().swap(client.fullRequestBody);
+      }
+    }
+    if (client.getClientStatus() == MULTIPLEXED) {
+      client.http2->receive(buf, bytesRead);
+      return;
+    }
     if (client.getClientStatus() == READ) {
       client.appendToRequestBody(buf);
     } else if (client.getClientStatus() == WAITING_BODY) {
       client.appendToBody(buf);
+    } else if (client.getClientStatus() == PROXYING) {
+      client.proxy->appendBody(buf, bytesRead, Clock::nowMillis());
     }
 
-    LOGGER.debug(std::string(buf));
-  }
-
-  void processReading(Client &client) {
-    readRequestChunk(client);
+    LOG_DEBUG(LOGGER, buf);
     if (client.getClientStatus() == READ && client.isContainsRequestEnd()) {
       client.parseRequest();
+      client.timing.mark(RequestTiming::HEADERS_PARSED);
+      bool parsed = client.getClientStatus() == WRITE || client.getClientStatus() == WAITING_BODY;
+      if (parsed && (!admitRequest(client) || !admitBody(client))) {
+        return;
+      }
+      if (client.getClientStatus() == WAITING_BODY) {
+        continueBody(client);
+      }
+      if (parsed && !upstreamPools.empty()) {
+        routeToProxy(client);
+      }
     }
   }
 
+ private:
   void readFromClientSocket(Client &client) {
     try {
-      processReading(client);
+      readRequestChunk(client);
     } catch (const RuntimeWebServException &e) {
       LOGGER.error(e.what());
     }
   }
 
-  void handleNewConnection() {
-    Server *server = serverFdsMap[fds[currentFd].fd];
+  // accepts what the listener has queued, up to ACCEPT_BATCH: connections left in the backlog wait
+  // where their queue delay is not seen and where they cannot be shed
+  void handleNewConnection(int listenerFd, Server *server) {
     try {
-      struct sockaddr addr;
-      socklen_t socklen = sizeof(addr);
-      int newClientFd;
+      for (int i = 0; i < ACCEPT_BATCH; ++i) {
+        struct sockaddr_storage addr;
+        socklen_t socklen = sizeof(addr);
+        int newClientFd;
+
+        if ((newClientFd = accept(listenerFd, (struct sockaddr *) &addr, &socklen)) == -1) {
+          if (i == 0) {
+            throw AcceptException();
+          }
+          return;
+        }
+        if (!admitConnection(newClientFd, *server)) {
+          continue;
+        }
+        if (server->limiter != NULL && !server->limiter->admitConnection(addr, Clock::nowMillis())) {
+          rejectConnection(newClientFd, *server);
+          Metrics::countLimited(false);
+          continue;
+        }
+        // set nonblock
+        setNonBlock(newClientFd);
+        Transport *transport = NULL;
+        const Listener *listener = server->listenerFor(listenerFd);
+        if (listener != NULL && listener->ssl) {
+          SSL *ssl = server->tlsContext != NULL ? server->tlsContext->accept(newClientFd) : NULL;
+          if (ssl == NULL) {
+            close(newClientFd); // never served in plain text
+            continue;
+          }
+          transport = new TlsTransport(newClientFd, ssl);
+        }
+        Client *newClient = new Client(newClientFd, transport);
+        newClient->remoteAddr = addr;
+        if (server->limiter != NULL && server->limiter->limitsConnections()) {
+          newClient->connectionLimiter = server->limiter;
+        }
+        addConnection(newClient, *server);
 
-      // if no connection, accept is blocking process and start waiting
-      if ((newClientFd = accept(server->getListenerFd(), (struct sockaddr *) &addr, &socklen)) == -1) {
-        throw AcceptException();
+        LOG_INFO(LOGGER, "Client connected, fd: " << newClientFd);
       }
-      // set nonblock
-      setNonBlock(newClientFd);
-      Client *newClient = new Client(newClientFd); //todo malloc free
-      clientsToServersMap[newClient] = server;
-      clientFdsMap[newClientFd] = newClient;
-
-      fds[newClientFd].fd = newClientFd;
-      fds[newClientFd].events |= POLLIN;
-
-      LOGGER.info("Client connected, fd: " + std::to_string(newClientFd));
     } catch (const RuntimeWebServException &e) {
       LOGGER.error(e.what());
     } catch (const FatalWebServException &e) {
@@ -245,111 +474,454 @@ class WebServer {
     }
   }
 
+  // a client the pool or the kernel still works for is only closed: it goes when they are done
+  void removeClient(std::map<Client *, Server *>::iterator clientIt) {
+    Client &client = *clientIt->first;
+    if (client.proxy != NULL) {
+      endProxy(client);
+    }
+    if (!client.cgiKey.empty()) {
+      cgiCache.leave(client.cgiKey, &client);
+    }
+    if (client.isBusy()) {
+      client.closeClient();
+      if (client.uring != NULL) {
+        cancelUringOperations(client);
+      }
+      return;
+    }
+    captureClose(*clientIt->first, *clientIt->second);
+    if (client.connectionLimiter != NULL) {
+      client.connectionLimiter->releaseConnection(client.remoteAddr);
+    }
+    if (client.http2 != NULL) {
+      multiplexedClients.erase(&client); // its streams' clients read the end of their requests and close
+    }
+    http2Streams -= client.http2Stream ? 1 : 0;
+    delete clientIt->first;
+    clientsToServersMap.erase(clientIt);
+  }
+
   void clearAllClients() {
     std::map<Client *, Server *>::iterator clientIt = clientsToServersMap.begin();
-    std::map<Client *, Server *>::iterator clientIte = clientsToServersMap.end();
-    while (clientIt != clientIte) {
-      int fdOfClient = clientIt->first->getFd();
+    while (clientIt != clientsToServersMap.end()) {
+      clientIt->first->closeClient();
+      removeClient(clientIt++);
+    }
+  }
 
-      fds[fdOfClient].fd = 0;
-      fds[fdOfClient].events = 0;
-      fds[fdOfClient].revents = 0;
-      clientFdsMap.erase(fdOfClient);
+  // one client turn: read while a request is coming in, write once it is complete
+  void serveClient(Client &client, Server &server, short revents) {
+    if (client.getClientStatus() == MULTIPLEXED) {
+      serveMultiplexed(client, server, revents);
+      return;
+    }
+    if (client.getClientStatus() == PROXYING) {
+      serveProxyClient(client, revents);
+    } else if (revents & POLLOUT) {
+      LOG_INFO(LOGGER, "Write to: " << client.getFd());
+      writeToClient(client, server);
+    } else if (revents & (POLLIN | POLLHUP | POLLERR)) {
+      LOG_INFO(LOGGER, "Read from: " << client.getFd());
+      readFromClientSocket(client);
+    }
+    if (client.getClientStatus() == PROXYING) {
+      pumpProxy(client, server, 0);
+    } else if (client.getClientStatus() == MULTIPLEXED) {
+      pumpMultiplexed(client, server); // it just started HTTP/2
+    }
+  }
 
-      delete clientIt->first;
-      std::map<Client *, Server *>::iterator tmp = clientIt;
-      ++clientIt;
-      clientsToServersMap.erase(tmp);
+  void serveInProcessClients() {
+    std::map<Client *, Server *>::iterator clientIt = clientsToServersMap.begin();
+    while (clientIt != clientsToServersMap.end()) {
+      Client &client = *clientIt->first;
+      if (client.fileTaskRunning) {
+        ++clientIt;
+        continue;
+      }
+      if (client.transport->getFd() < 0) {
+        bool writing = client.getClientStatus() == WRITE || client.getClientStatus() == SENDING;
+        if (writing || client.transport->isReadable()) {
+          serveClient(client, *clientIt->second, writing ? POLLOUT : POLLIN);
+        }
+      }
+      if (client.getClientStatus() == CLOSED) {
+        removeClient(clientIt++);
+      } else {
+        ++clientIt;
+      }
     }
+  }
 
+  // responses of the requests whose file task finished; clients closed meanwhile are let go
+  void completeFileTasks() {
+    FileTask *task = filePool.takeCompleted();
+    while (task != NULL) {
+      FileTask *next = task->next;
+      std::map<Client *, Server *>::iterator clientIt = clientsToServersMap.find(task->client);
+      Client &client = *clientIt->first;
+      client.fileTaskRunning = false;
+      if (client.getClientStatus() == CLOSED) {
+        if (!client.cgiKey.empty()) {
+          // the requests waiting for the same script get its output all the same
+          requestLocation = task->route;
+          finishFileTask(*task, client);
+          responseBody.clear();
+          requestLocation = NULL;
+        }
+        if (task->file != -1) {
+          close(task->file);
+          task->file = -1;
+        }
+        removeClient(clientIt);
+      } else {
+        requestLocation = task->route;
+        finishFileTask(*task, client);
+        completeResponse(client);
+        if (uring != NULL) {
+          uringTouched.push_back(&client);
+        }
+      }
+      task = next;
+    }
   }
 
   void routine() {
-    while (true) {
-      try {
-        int ret = poll(fds, POLL_FD_ARR_SIZE, SERVER_TIMEOUT);
-        if (ret == -1) {
-          LOGGER.error(WebServException::POLL_ERROR);
-          int i;
-          throw PollException();
-        } else if (ret == 0) {
+    lastActivityMillis = Clock::nowMillis();
+    while (!isDrained()) {
+      step(pollTimeout());
+    }
+    for (std::vector<BufferedLogFile *>::iterator it = logFiles.begin(); it != logFiles.end(); ++it) {
+      (*it)->flush();
+    }
+  }
+
+ public:
+  // takes ownership of a connection created outside the listeners, e.g. on a socketpair or an
+  // in-memory transport, and serves it from the next step() on
+  void addConnection(Client *client, Server &server) {
+    setupTiming(*client, server);
+    setupCapture(*client, server);
+    Metrics::countAccept();
+    clientsToServersMap[client] = &server;
+  }
+
+  std::size_t getConnectionCount() const {
+    return clientsToServersMap.size() - http2Streams;
+  }
+
+  // one iteration of the event loop; in-process transports that are ready make it not block
+  void step(int timeoutMillis) {
+    if (uring != NULL) {
+      stepUring(timeoutMillis);
+      return;
+    }
+    try {
+      if (reload.running && __atomic_load_n(&reload.done, __ATOMIC_ACQUIRE)) {
+        finishReload();
+      }
+      if (!multiplexedClients.empty()) {
+        serveMultiplexedClients();
+      }
+      pollFds.clear();
+      polledClients.clear();
+      polledUpstreams.clear();
+      // the wake-up pipe and the file pool's eventfd come first, each when there is one
+      bool pollsWakePipe = wakePipe[0] != -1;
+      if (pollsWakePipe) {
+        struct pollfd wake = {wakePipe[0], POLLIN, 0};
+        pollFds.push_back(wake);
+      }
+      std::size_t filePoolIndex = pollFds.size();
+      if (filePool.isRunning()) {
+        struct pollfd files = {filePool.getEventFd(), POLLIN, 0};
+        pollFds.push_back(files);
+      }
+      std::size_t firstListener = pollFds.size();
+      for (std::map<int, Server *>::iterator serverIt = serverFdsMap.begin(); serverIt != serverFdsMap.end();
+           ++serverIt) {
+        struct pollfd listener = {serverIt->first, POLLIN, 0};
+        pollFds.push_back(listener);
+      }
+      bool inProcessReady = false;
+      bool buffered = false; // a client's transport holds bytes its descriptor no longer shows
+      for (std::map<Client *, Server *>::iterator clientIt = clientsToServersMap.begin();
+           clientIt != clientsToServersMap.end(); ++clientIt) {
+        Client &client = *clientIt->first;
+        if (client.fileTaskRunning) {
+          continue;
+        }
+        int fd = client.transport->getFd();
+        bool writing = client.getClientStatus() == WRITE || client.getClientStatus() == SENDING;
+        short events = client.getClientStatus() == PROXYING ? proxyClientEvents(client)
+            : client.getClientStatus() == MULTIPLEXED ? multiplexedEvents(client) : writing ? POLLOUT : POLLIN;
+        if (fd >= 0) {
+          struct pollfd pfd = {fd, events, 0};
+          pollFds.push_back(pfd);
+          polledClients.push_back(&client);
+          buffered = buffered || ((events & POLLIN) && client.transport->hasBuffered());
+        } else if (writing || client.transport->isReadable()) {
+          inProcessReady = true;
+        }
+      }
+      std::size_t firstUpstream = pollFds.size();
+      for (std::set<Client *>::iterator it = proxyingClients.begin(); it != proxyingClients.end(); ++it) {
+        short events = (*it)->proxy->upstreamEvents();
+        if (events != 0) {
+          struct pollfd upstream = {(*it)->proxy->getFd(), events, 0};
+          pollFds.push_back(upstream);
+          polledUpstreams.push_back(*it);
+        }
+      }
+
+      int ret = pollFds.empty() ? 0 : poll(&pollFds[0], pollFds.size(),
+                                           inProcessReady || buffered ? 0 : timeoutMillis);
+      long long now = Clock::nowMillis();
+      flushLogFiles(now);
+      if (ret == -1) {
+        if (errno == EINTR) {
+          return;
+        }
+        LOGGER.error(WebServException::POLL_ERROR);
+        throw PollException();
+      }
+      if (ret == 0 && !inProcessReady && !buffered) {
+        expireProxies(now);
+        if (now - lastActivityMillis >= SERVER_TIMEOUT) {
           clearAllClients();
           LOGGER.info("Timeout reached. Close all connections");
-        } else {
-          bool establishedNewConnection = false;
-          // new connection ------------------------------------------------------------------------------------------
-          for (std::map<int, Server *>::iterator serverIt = serverFdsMap.begin();
-               serverIt != serverFdsMap.end(); ++serverIt) {
-
-            currentFd = serverIt->first;
-
-            if (fds[currentFd].revents == 0) {
-              continue;
-            }
-
-            if (fds[currentFd].revents & POLLIN) {
-              LOGGER.info("New Connection: " + std::to_string(currentFd));
-              handleNewConnection();
-              establishedNewConnection = true;
-              break;
-            }
-          }
+          lastActivityMillis = now;
+        }
+        return;
+      }
+      lastActivityMillis = now;
+
+      // new connections ---------------------------------------------------------------------------------------------
+      std::size_t firstClient = firstListener + serverFdsMap.size();
+      for (std::size_t i = firstListener; i < firstClient; ++i) {
+        if (pollFds[i].revents & POLLIN) {
+          LOG_INFO(LOGGER, "New Connection: " << pollFds[i].fd);
+          handleNewConnection(pollFds[i].fd, serverFdsMap[pollFds[i].fd]);
+        }
+      }
 
-          if (!establishedNewConnection) {
-            std::map<Client *, Server *>::iterator clientIt = clientsToServersMap.begin();
-            std::map<Client *, Server *>::iterator clientIte = clientsToServersMap.end();
-            while (clientIt != clientIte) {
-              currentFd = clientIt->first->getFd();
-
-              if (fds[currentFd].revents == 0) {
-                ++clientIt;
-                continue;
-              }
-
-              Client &client = *(clientIt->first);
-
-              // write ------------------------------------------------------------------------------------------------
-              if (fds[currentFd].revents & POLLOUT) {
-                LOGGER.info("Write to: " + std::to_string(currentFd));
-
-                writeToClientSocket(client, clientIt);
-                client.closeClient();
-                requestLocation = NULL;
-                // todo maybe set more
-              }
-                // read ------------------------------------------------------------------------------------------------
-              else if (fds[currentFd].revents & POLLIN) {
-                LOGGER.info("Read from: " + std::to_string(currentFd));
-
-                readFromClientSocket(client);
-                if (client.getClientStatus() == WRITE) {
-                  fds[currentFd].events |= POLLOUT;
-                }
-              }
-
-              if (client.getClientStatus() == CLOSED) {
-                fds[currentFd].fd = 0;
-                fds[currentFd].events = 0;
-                fds[currentFd].revents = 0;
-                clientFdsMap.erase(currentFd);
-                delete clientIt->first;
-                std::map<Client *, Server *>::iterator tmp = clientIt;
-                ++clientIt;
-                clientsToServersMap.erase(tmp);
-              } else {
-                fds[currentFd].revents = 0;
-                ++clientIt;
-              }
-            }
-          }
+      // clients -----------------------------------------------------------------------------------------------------
+      for (std::size_t i = firstClient; i < firstUpstream; ++i) {
+        short revents = pollFds[i].revents;
+        if (revents == 0 && buffered && (pollFds[i].events & POLLIN)
+            && polledClients[i - firstClient]->transport->hasBuffered()) {
+          revents = POLLIN;
         }
-      } catch (const RuntimeWebServException &e) {
-        LOGGER.error(e.what());
-        continue;
+        if (revents == 0) {
+          continue;
+        }
+        std::map<Client *, Server *>::iterator clientIt = clientsToServersMap.find(polledClients[i - firstClient]);
+        serveClient(*clientIt->first, *clientIt->second, revents);
+        if (clientIt->first->getClientStatus() == CLOSED) {
+          removeClient(clientIt);
+        }
+      }
+
+      // upstream connections of proxied requests --------------------------------------------------------------------
+      for (std::size_t i = firstUpstream; i < pollFds.size(); ++i) {
+        if (pollFds[i].revents == 0) {
+          continue;
+        }
+        std::map<Client *, Server *>::iterator clientIt = clientsToServersMap.find(polledUpstreams[i - firstUpstream]);
+        Client *client = clientIt == clientsToServersMap.end() ? NULL : clientIt->first;
+        if (client == NULL || client->proxy == NULL || client->proxy->getFd() != pollFds[i].fd) {
+          continue; // closed, finished or moved to another connection while serving the clients
+        }
+        pumpProxy(*client, *clientIt->second, pollFds[i].revents);
+        if (client->getClientStatus() == CLOSED) {
+          removeClient(clientIt);
+        }
+      }
+      expireProxies(now);
+      if (inProcessReady) {
+        serveInProcessClients();
+      }
+      if (filePoolIndex < firstListener && pollFds[filePoolIndex].revents != 0) {
+        completeFileTasks();
+      }
+      if (!retiredServers.empty()) {
+        releaseRetiredServers();
       }
+      // last: signals may swap or close the listeners indexed above
+      if (pollsWakePipe && pollFds[0].revents != 0) {
+        handleWakeUp();
+      }
+    } catch (const RuntimeWebServException &e) {
+      LOGGER.error(e.what());
     }
   }
+
  private:
+  // poll wakes up early while log lines wait for their flush interval
+  int pollTimeout() const {
+    int timeout = SERVER_TIMEOUT;
+    if (draining) {
+      long long left = drainDeadline - Clock::nowMillis();
+      timeout = left < 0 ? 0 : left < timeout ? (int) left : timeout;
+    }
+    for (std::vector<BufferedLogFile *>::const_iterator it = logFiles.begin(); it != logFiles.end(); ++it) {
+      if ((*it)->hasPending() && (*it)->getFlushMillis() < timeout) {
+        timeout = (int) (*it)->getFlushMillis();
+      }
+    }
+    if (!proxyingClients.empty()) {
+      long long now = Clock::nowMillis();
+      for (std::set<Client *>::const_iterator it = proxyingClients.begin(); it != proxyingClients.end(); ++it) {
+        long long deadline = (*it)->proxy->getDeadline();
+        if (deadline != 0 && deadline - now < timeout) {
+          timeout = deadline < now ? 0 : (int) (deadline - now);
+        }
+      }
+    }
+    return timeout;
+  }
+
+  void flushLogFiles(long long now) {
+    for (std::vector<BufferedLogFile *>::iterator it = logFiles.begin(); it != logFiles.end(); ++it) {
+      (*it)->flushIfDue(now);
+    }
+  }
+
+  template<class Log>
+  Log *findOpenedLog(const std::map<const Server *, Log *> &logs, const std::string &path) {
+    for (typename std::map<const Server *, Log *>::const_iterator it = logs.begin(); it != logs.end(); ++it) {
+      if (it->second->getFile().getPath() == path) {
+        return it->second;
+      }
+    }
+    return NULL;
+  }
+
+  // servers with the same path and format share a log; another format on that path writes into the
+  // same file through its own AccessLog
+  AccessLog *openAccessLog(const AccessLogConfig &config) {
+    AccessLog *samePath = NULL;
+    for (std::map<const Server *, AccessLog *>::iterator it = accessLogs.begin(); it != accessLogs.end(); ++it) {
+      if (it->second->getFile().getPath() == config.path) {
+        if (it->second->hasFormat(config)) {
+          return it->second;
+        }
+        samePath = it->second;
+      }
+    }
+    if (samePath != NULL) {
+      return new AccessLog(config, *samePath);
+    }
+    AccessLog *log = new AccessLog(config);
+    logFiles.push_back(&log->getFile());
+    return log;
+  }
+
+  void openLogs() {
+    for (std::vector<Server *>::iterator server = servers.begin(); server != servers.end(); ++server) {
+      const AccessLogConfig &accessConfig = (*server)->getAccessLog();
+      if (!accessConfig.path.empty()) {
+        AccessLog *accessLog = openAccessLog(accessConfig);
+        accessLogs[*server] = accessLog;
+      }
+      const TraceLogConfig &traceConfig = (*server)->getTraceLog();
+      if (!traceConfig.path.empty()) {
+        TraceLog *traceLog = findOpenedLog(traceLogs, traceConfig.path);
+        if (traceLog == NULL) {
+          traceLog = new TraceLog(traceConfig);
+          logFiles.push_back(&traceLog->getFile());
+        }
+        traceLogs[*server] = traceLog;
+      }
+      const CaptureConfig &captureConfig = (*server)->getCapture();
+      if (!captureConfig.path.empty()) {
+        TrafficCapture *capture = findOpenedLog(captures, captureConfig.path);
+        if (capture == NULL) {
+          capture = new TrafficCapture(captureConfig);
+          logFiles.push_back(&capture->getFile());
+        }
+        captures[*server] = capture;
+      }
+    }
+  }
+
+  void setupCapture(Client &client, const Server &server) {
+    std::map<const Server *, TrafficCapture *>::iterator capture = captures.find(&server);
+    if (capture != captures.end()) {
+      client.captureId = capture->second->open(server.port);
+    }
+  }
+
+  void captureClose(const Client &client, const Server &server) {
+    if (client.captureId != 0) {
+      captures[&server]->close(client.captureId);
+    }
+  }
+
+  // phase marks are only taken for sampled requests or when the access log prints them
+  void setupTiming(Client &client, const Server &server) {
+    std::map<const Server *, TraceLog *>::iterator trace = traceLogs.find(&server);
+    if (trace != traceLogs.end() && trace->second->shouldSample()) {
+      client.timing.sampled = true;
+      client.timing.detailed = true;
+    }
+    std::map<const Server *, AccessLog *>::iterator access = accessLogs.find(&server);
+    if (access != accessLogs.end() && access->second->needsPhases()) {
+      client.timing.detailed = true;
+    }
+  }
+
+  // bookkeeping once the response went out: metrics, access log line and sampled trace events
+  void finishRequest(const Client &client, const Server &server) {
+    long long requestMicros = client.timing.between(RequestTiming::ACCEPTED, RequestTiming::LAST_BYTE_SENT);
+    Metrics::countBytesOut(client.bytesSent);
+    Metrics::recordRequest(client.responseStatus, server.metricsScope, client.locationScope, requestMicros);
+    logAccess(client, server, requestMicros);
+    if (client.timing.sampled) {
+      traceLogs[&server]->write(client.timing, client.getFd(), client.method, client.path, client.responseStatus);
+    }
+    if (client.bodyRefused && client.getFd() >= 0) {
+      // the rest of the body resets the connection once it is closed, maybe before the client read the
+      // response: a FIN ends the response first, and what came in by now is read so the close is clean
+      shutdown(client.getFd(), SHUT_WR);
+      drainInput(client.getFd());
+    }
+  }
+
+  // reads what the peer sent by now without waiting for more, at most DRAIN_LIMIT bytes: a peer still
+  // sending past that has its connection reset on close all the same, but does not hold up the loop
+  static void drainInput(int fd) {
+    char drain[BUF_SIZE];
+    for (int drained = 0; drained < DRAIN_LIMIT;) {
+      ssize_t received = recv(fd, drain, sizeof(drain), MSG_DONTWAIT);
+      if (received <= 0) {
+        return;
+      }
+      drained += (int) received;
+    }
+  }
+
+  void logAccess(const Client &client, const Server &server, long long requestMicros) {
+    std::map<const Server *, AccessLog *>::iterator it = accessLogs.find(&server);
+    if (it == accessLogs.end()) {
+      return;
+    }
+    AccessLogEntry entry;
+    entry.remoteAddr = &client.remoteAddr;
+    entry.method = client.method;
+    entry.path = &client.path;
+    entry.status = client.responseStatus;
+    entry.bytesSent = client.bytesSent;
+    entry.requestLength = client.bytesReceived;
+    entry.requestMicros = requestMicros;
+    entry.upstreamMicros = client.upstreamMicros;
+    entry.serverPort = server.port;
+    entry.serverName = &server.serverName;
+    entry.timing = &client.timing;
+    it->second->log(entry);
+  }
+
   std::string convertStatus(const HttpStatus &status) {
     if (status == NOT_FOUND)
       return "404 Not Found";
@@ -360,6 +932,29 @@ class WebServer {
     return "400 Bad Request";
   }
 
+  // runs on the reload thread too: reads STATUSES, never inserts into it
+  LocationRuntime compileLocation(const Location &location, const Server &server) const {
+    std::string errorResponses[LocationRuntime::ERROR_SLOTS];
+    for (int slot = 0; slot < LocationRuntime::ERROR_SLOTS; ++slot) {
+      HttpStatus status = LocationRuntime::slotStatus(slot);
+      std::map<HttpStatus, std::string>::const_iterator page = location.errorPage.find(status);
+      if (page != location.errorPage.end() && !page->second.empty()) {
+        errorResponses[slot] = page->second;
+      } else {
+        errorResponses[slot] = STATUSES.find(status)->second + "Content-Length: 0\r\nConnection: close\r\n\r\n";
+      }
+    }
+    LocationRuntime runtime = LocationRuntime::compile(location, errorResponses);
+    if (runtime.maxBodySize < 0) {
+      runtime.maxBodySize = server.getBodySize();
+    }
+    if (runtime.hasCgi) {
+      runtime.cgiEnvironment = CgiHandler::constantEnvironment(runtime.cgiInterpreter, server.getServerName(),
+                                                               server.getPort());
+    }
+    return runtime;
+  }
+
   void loadErrorPages(std::map<HttpStatus, std::string> &ep, const std::string &root) {
     for (std::map<HttpStatus, std::string>::iterator it = ep.begin(); it != ep.end(); ++it) {
       std::ifstream f((root + '/' + it->second).c_str());
@@ -376,270 +971,1580 @@ class WebServer {
 
  public:
   void parseConfig(int ac, char *av[]) {
+    configPath = ac == 1 ? "" : av[1];
+    commandLine.assign(av, av + ac);
+    AdmissionConfig limits;
+    std::vector<Server *> loaded = loadServers(configPath, true, limits);
+    admission.configure(limits);
+    servers.insert(servers.end(), loaded.begin(), loaded.end());
+  }
+
+  // builds the Server tables of a configuration file, the built-in default one for an empty path, and
+  // reads its process-wide limits into `limits`. Touches no event loop state, so that a reload can
+  // run it on its own thread.
+  std::vector<Server *> loadServers(const std::string &path, bool print, AdmissionConfig &limits) {
     std::vector<Server> vector;
-    if (ac == 1) {
+    if (path.empty()) {
       ConfigReader conf;
-      conf.printData();
+      if (print) {
+        conf.printData();
+      }
       vector = conf.getServers();
+      limits = conf.getAdmission();
     } else {
-      ConfigReader conf(av[1]);
+      ConfigReader conf(path);
       conf.readConfig();
-      conf.printData();
+      if (print) {
+        conf.printData();
+      }
       vector = conf.getServers();
+      limits = conf.getAdmission();
     }
+    std::vector<Server *> loaded;
+    int unscoped = 0;
     std::vector<Server>::iterator srv = vector.begin();
     while (srv != vector.end()) {
-      for (std::vector<Location>::iterator it = srv->getLocations().begin(); it != srv->getLocations().end(); it++)
+      std::string scopeName = srv->getServerName() + ":" + Logger::toString(srv->getPort());
+      srv->metricsScope = Metrics::registerScope(scopeName, "");
+      unscoped += srv->metricsScope < 0;
+      for (std::vector<Location>::iterator it = srv->getLocations().begin(); it != srv->getLocations().end(); it++) {
         loadErrorPages(it->getErrorPageByRef(), it->getRoot());
-      servers.push_back(new Server(*srv));
+        it->metricsScope = Metrics::registerScope(scopeName, it->getUrl());
+        unscoped += it->metricsScope < 0;
+        srv->routes.push_back(compileLocation(*it, *srv));
+      }
+      loaded.push_back(new Server(*srv));
+      try {
+        preloadSites(*loaded.back());
+      } catch (...) {
+        deleteServers(loaded);
+        throw;
+      }
       ++srv;
     }
+    if (unscoped > 0) {
+      LOG_ERROR(LOGGER, unscoped << " servers and locations are over the " << MetricsShard::MAX_SCOPES
+          << " latency scopes and get no histogram");
+    }
+    return loaded;
+  }
+
+  // reads the files of the `preload` locations into memory; on the reload thread the current
+  // configuration serves meanwhile
+  void preloadSites(Server &server) const {
+    for (std::size_t i = 0; i < server.routes.size(); ++i) {
+      LocationRuntime &route = server.routes[i];
+      if (!server.locations[i].preload || route.isProxy()) {
+        continue;
+      }
+      long long start = Clock::nowMicros();
+      PreloadedSite *site = PreloadedSite::load(route, MIME, MAX_FILESIZE);
+      server.preloadedSites.push_back(site);
+      route.preload = site;
+      LOG_INFO(LOGGER, "Preloaded " << route.root << ": " << site->fileCount() << " files, "
+          << site->fileBytes() << " bytes in " << site->mappedBytes() << " mapped, "
+          << (long) ((Clock::nowMicros() - start) / 1000) << " ms");
+    }
+  }
+
+  const std::vector<Server *> &getServers() const {
+    return servers;
   }
 
   void run() {
+    std::map<std::string, int> inherited = BinaryUpgrade::inheritedListeners();
     std::vector<Server *>::iterator server = servers.begin();
 
-    fds = new struct pollfd[POLL_FD_ARR_SIZE];
-    memset(fds, 0, sizeof(struct pollfd) * POLL_FD_ARR_SIZE);
-
     while (server != servers.end()) {
+      std::vector<Listener> &listeners = (*server)->listeners;
       try {
+        for (std::vector<Listener>::iterator it = listeners.begin(); it != listeners.end(); ++it) {
+          std::map<std::string, int>::iterator listener = inherited.find(it->key());
+          if (listener != inherited.end()) {
+            it->fd = listener->second;
+            inherited.erase(listener);
+            Server::retune(*it);
+          }
+        }
         (*server)->run();
-        serverFdsMap[(*server)->getListenerFd()] = *server;
-        fds[(*server)->getListenerFd()].fd = (*server)->getListenerFd();
-        fds[(*server)->getListenerFd()].events |= POLLIN;
+        for (std::vector<Listener>::iterator it = listeners.begin(); it != listeners.end(); ++it) {
+          serverFdsMap[it->fd] = *server;
+        }
         ++server;
       } catch (const FatalWebServException &e) {
         LOGGER.error(e.what());
-
+        (*server)->closeListeners();
         server = servers.erase(server);
       }
     }
 
-    if (!servers.empty()) {
+    for (std::map<std::string, int>::iterator it = inherited.begin(); it != inherited.end(); ++it) {
+      close(it->second);
+    }
+
+    if (!servers.empty()) {
+      openLogs();
+      bindUpstreams();
+      bindLimiters();
+      bindTlsContexts();
+      installSignalHandlers();
+      FileTask::configureFromEnvironment();
+      int fileThreads = FileWorkerPool::threadsFromEnvironment();
+      if (fileThreads > 0 && !filePool.start(fileThreads)) {
+        LOGGER.error("Could not start the file worker pool, filesystem calls stay on the event loop");
+      }
+      startUring();
+      pid_t previous = BinaryUpgrade::parentToDrain();
+      if (previous != 0) {
+        LOG_INFO(LOGGER, "Listening, telling the previous process " << previous << " to drain");
+        kill(previous, SIGQUIT);
+      }
       routine();
     }
   }
 
-// RESPONSE GENERATION ----------------------------------------------------------------------------------------------------
+// CONFIGURATION RELOAD ---------------------------------------------------------------------------------------------------
 
- public:
-  typedef std::map<std::string, std::string> MimeTypes;
-  typedef std::map<std::string, std::string> Headers;
+ private:
+  void installSignalHandlers() {
+    if (pipe(wakePipe) == -1) {
+      LOGGER.error("Could not create the wake-up pipe, SIGHUP reload disabled");
+      return;
+    }
+    for (int i = 0; i < 2; ++i) {
+      fcntl(wakePipe[i], F_SETFL, O_NONBLOCK);
+      fcntl(wakePipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &onSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGHUP, &action, NULL);
+    sigaction(SIGUSR2, &action, NULL);
+    sigaction(SIGQUIT, &action, NULL);
+    sigaction(SIGCHLD, &action, NULL);
+  }
 
-  std::map<HttpStatus, std::string> STATUSES;
-  MimeTypes MIME;
-  const int MAX_FILESIZE; // 10mb
+  // SIGHUP: reload the configuration, SIGUSR2: start a new binary on the same listeners,
+  // SIGQUIT: stop accepting and exit once the open connections are done, SIGCHLD: reap that binary
+  static void onSignal(int signal) {
+    if (signal == SIGHUP) {
+      reloadRequested = 1;
+    } else if (signal == SIGUSR2) {
+      upgradeRequested = 1;
+    } else if (signal == SIGQUIT) {
+      drainRequested = 1;
+    }
+    wake();
+  }
 
-  std::string responseBody;
-  HttpStatus responseStatus;
-  Location *requestLocation;
+  static void wake() {
+    int savedErrno = errno;
+    char byte = 0;
+    if (write(wakePipe[1], &byte, 1) == -1) {
+      // the pipe is full: a wake-up is pending anyway
+    }
+    errno = savedErrno;
+  }
 
-  typedef std::map<std::string, std::string>::iterator iterator;
+  void handleWakeUp() {
+    char drain[64];
+    while (read(wakePipe[0], drain, sizeof(drain)) > 0) {
+    }
+    if (upgradePid > 0) {
+      reapUpgrade();
+    }
+    if (drainRequested) {
+      drainRequested = 0;
+      startDrain();
+    }
+    if (upgradeRequested) {
+      upgradeRequested = 0;
+      startUpgrade();
+    }
+    if (reloadRequested) {
+      reloadRequested = 0;
+      startReload();
+    }
+  }
 
- private:
-  bool isDirectory(const char *path) {
-    struct stat path_stat;
-    stat(path, &path_stat);
-    return S_ISDIR(path_stat.st_mode);
+  // SIGHUP: the new configuration is parsed and validated off the loop, which keeps serving meanwhile
+  void startReload() {
+    if (draining) {
+      return;
+    }
+    if (reload.running) {
+      reload.pending = true;
+      return;
+    }
+    LOGGER.info("Reloading configuration");
+    reload.path = configPath;
+    reload.servers.clear();
+    reload.error.clear();
+    reload.pending = false;
+    __atomic_store_n(&reload.done, 0, __ATOMIC_RELAXED);
+    reload.running = pthread_create(&reload.thread, NULL, &loadInBackground, this) == 0;
+    if (!reload.running) {
+      LOGGER.error("Could not start the reload thread, keeping the current configuration");
+    }
   }
 
-  bool isErrorStatus() {
-    return responseStatus != OK && responseStatus != CREATED && responseStatus != NO_CONTENT;
+  static void *loadInBackground(void *arg) {
+    WebServer *webServer = static_cast<WebServer *>(arg);
+    ReloadJob &job = webServer->reload;
+    try {
+      job.servers = webServer->loadServers(job.path, false, job.admission);
+      if (job.servers.empty()) {
+        job.error = "no server blocks";
+      }
+    } catch (const std::exception &e) {
+      job.error = e.what();
+    }
+    __atomic_store_n(&job.done, 1, __ATOMIC_RELEASE);
+    wake();
+    return NULL;
   }
 
-  void generateAutoIndex(Client &client, Server &server, const std::string &path) {
-    DIR *dir = opendir(path.c_str());
-    if (dir != NULL) {
-      // generate host address
-      std::stringstream serverAddr;
-      serverAddr << "http://" << server.hostName + ":" << server.port;
-      const std::string &serverAddress = serverAddr.str();
-
-      std::stringstream ss;
-      ss << "<!doctype html><html lang=\"en\"><head><meta charset=\"UTF-8\"><title>" << path << "</title></head><body>";
-
-      struct dirent *ent;
-      while ((ent = readdir(dir)) != NULL) {
-        std::string fileName = (ent->d_name);
-        if (!(fileName == "." || fileName == "..")) {
-          ss << "<li><a href=\"" << serverAddress << client.path;
-          if (client.path[client.path.length() - 1] != '/') {
-            ss << "/";
+  void finishReload() {
+    pthread_join(reload.thread, NULL);
+    reload.running = false;
+    if (!reload.error.empty()) {
+      LOG_ERROR(LOGGER, "Reload failed, keeping the current configuration: " << reload.error);
+      deleteServers(reload.servers);
+    } else {
+      applyReload(reload.servers, reload.admission);
+    }
+    reload.servers.clear();
+    if (reload.pending) {
+      startReload();
+    }
+  }
+
+  // listeners of addresses present in both configurations move to the new Server objects and take
+  // their new tuning, addresses that are new get bound first: when one of them fails the old
+  // configuration stays in place
+  void applyReload(std::vector<Server *> &loaded, const AdmissionConfig &limits) {
+    if (draining) {
+      deleteServers(loaded);
+      return;
+    }
+    std::map<std::string, const Listener *> oldListeners;
+    for (std::map<int, Server *>::iterator it = serverFdsMap.begin(); it != serverFdsMap.end(); ++it) {
+      const Listener *listener = it->second->listenerFor(it->first);
+      oldListeners[listener->key()] = listener;
+    }
+    std::vector<Listener *> kept;
+    std::vector<Listener *> bound;
+    for (std::vector<Server *>::iterator it = loaded.begin(); it != loaded.end(); ++it) {
+      std::vector<Listener> &listeners = (*it)->listeners;
+      for (std::vector<Listener>::iterator listener = listeners.begin(); listener != listeners.end(); ++listener) {
+        std::map<std::string, const Listener *>::iterator old = oldListeners.find(listener->key());
+        if (old != oldListeners.end()) {
+          listener->fd = old->second->fd;
+          oldListeners.erase(old);
+          kept.push_back(&*listener);
+          continue;
+        }
+        try {
+          Server::open(*listener);
+          bound.push_back(&*listener);
+        } catch (const FatalWebServException &e) {
+          LOG_ERROR(LOGGER, "Reload failed, keeping the current configuration: " << e.what());
+          for (std::vector<Listener *>::iterator it = bound.begin(); it != bound.end(); ++it) {
+            Server::closeListener(**it, false);
           }
-          ss << ent->d_name << "\">" << ent->d_name << "</a></li>" << std::endl;
+          deleteServers(loaded);
+          return;
         }
       }
-      closedir(dir);
-
-      ss << "</body></html>";
+    }
+    for (std::map<std::string, const Listener *>::iterator it = oldListeners.begin(); it != oldListeners.end(); ++it) {
+      Server::closeListener(*it->second, false);
+    }
+    for (std::vector<Listener *>::iterator it = kept.begin(); it != kept.end(); ++it) {
+      Server::retune(**it);
+    }
 
-      responseBody = ss.str();
-      responseStatus = OK;
+    serverFdsMap.clear();
+    for (std::vector<Server *>::iterator it = loaded.begin(); it != loaded.end(); ++it) {
+      for (std::vector<Listener>::iterator listener = (*it)->listeners.begin(); listener != (*it)->listeners.end();
+           ++listener) {
+        serverFdsMap[listener->fd] = *it;
+      }
     }
+    retiredServers.push_back(servers);
+    servers = loaded;
+    openLogs();
+    bindUpstreams();
+    bindLimiters();
+    bindTlsContexts();
+    admission.configure(limits);
+    LOG_INFO(LOGGER, "Configuration reloaded: " << servers.size() << " servers, " << bound.size()
+        << " new listeners");
+  }
 
-    responseStatus = INTERNAL_SERVER_ERROR;
+  static void deleteServers(std::vector<Server *> &toDelete) {
+    for (std::vector<Server *>::iterator it = toDelete.begin(); it != toDelete.end(); ++it) {
+      delete *it;
+    }
+    toDelete.clear();
   }
 
-  bool fileSizeIsBiggerThanLimit(const std::string &path) {
-    struct stat fileStat;
-    stat(path.c_str(), &fileStat);
-    return fileStat.st_size > MAX_FILESIZE;
+  // a retired configuration goes away with the last connection that was accepted under it
+  void releaseRetiredServers() {
+    std::set<const Server *> inUse;
+    for (std::map<Client *, Server *>::iterator it = clientsToServersMap.begin(); it != clientsToServersMap.end(); ++it) {
+      inUse.insert(it->second);
+    }
+    std::vector<std::vector<Server *> >::iterator generation = retiredServers.begin();
+    while (generation != retiredServers.end()) {
+      bool busy = false;
+      for (std::vector<Server *>::iterator it = generation->begin(); it != generation->end() && !busy; ++it) {
+        busy = inUse.count(*it) != 0;
+      }
+      if (busy) {
+        ++generation;
+        continue;
+      }
+      for (std::vector<Server *>::iterator it = generation->begin(); it != generation->end(); ++it) {
+        releaseLog(accessLogs, *it);
+        releaseLog(traceLogs, *it);
+        releaseLog(captures, *it);
+      }
+      deleteServers(*generation);
+      generation = retiredServers.erase(generation);
+    }
   }
 
-  std::string getDocumentContent(std::ifstream &fileStream) {
-    fileStream.seekg(0, std::ios::end);
-    std::streampos length = fileStream.tellg();
-    fileStream.seekg(0, std::ios::beg);
-    std::vector<char> buffer(length);
-    fileStream.read(&buffer[0], length);
-    return std::string(buffer.begin(), buffer.end());
+  // drops the log of a retired server, and closes it unless a current server writes there too; its file
+  // stays flushed while a log of another format writes into it, e.g. after a reload changed log_format
+  template<class Log>
+  void releaseLog(std::map<const Server *, Log *> &logs, const Server *server) {
+    typename std::map<const Server *, Log *>::iterator entry = logs.find(server);
+    if (entry == logs.end()) {
+      return;
+    }
+    Log *log = entry->second;
+    logs.erase(entry);
+    bool fileShared = false;
+    for (entry = logs.begin(); entry != logs.end(); ++entry) {
+      if (entry->second == log) {
+        return;
+      }
+      fileShared = fileShared || &entry->second->getFile() == &log->getFile();
+    }
+    if (!fileShared) {
+      logFiles.erase(std::find(logFiles.begin(), logFiles.end(), &log->getFile()));
+    }
+    delete log;
   }
 
-  void getDocumentContentInside(std::ifstream &fileStream) {
-    fileStream.seekg(0, std::ios::end);
-    std::streampos length = fileStream.tellg();
-    fileStream.seekg(0, std::ios::beg);
-    std::vector<char> buffer(length);
-    fileStream.read(&buffer[0], length);
+// BINARY UPGRADE ---------------------------------------------------------------------------------------------------------
 
-    responseBody = std::string(buffer.begin(), buffer.end());
+  void startUpgrade() {
+    if (draining || upgradePid > 0) {
+      LOGGER.error("Upgrade already in progress, SIGUSR2 ignored");
+      return;
+    }
+    std::map<std::string, int> listeners;
+    for (std::map<int, Server *>::iterator it = serverFdsMap.begin(); it != serverFdsMap.end(); ++it) {
+      listeners[it->second->listenerFor(it->first)->key()] = it->first;
+    }
+    upgradePid = BinaryUpgrade::spawn(commandLine, listeners);
+    if (upgradePid == -1) {
+      upgradePid = 0;
+      LOGGER.error("Could not start the new binary, still serving");
+      return;
+    }
+    LOG_INFO(LOGGER, "Started new binary, pid " << upgradePid << ", handing over " << listeners.size()
+        << " listeners");
   }
 
-  void doGet(Client &client, Server &server) {
-    const std::string &path = requestLocation->substitutePath(client.path);
+  // the new binary exiting before it told us to drain means it failed to start: keep serving
+  void reapUpgrade() {
+    int status;
+    if (waitpid(upgradePid, &status, WNOHANG) != upgradePid) {
+      return;
+    }
+    if (!draining) {
+      LOG_ERROR(LOGGER, "New binary " << upgradePid << " exited with status " << WEXITSTATUS(status)
+          << ", still serving");
+    }
+    upgradePid = 0;
+  }
 
-    std::ifstream fileStream(path.c_str());
-    if (fileStream.fail()) {
-      responseStatus = NOT_FOUND;
+  // the listeners stay open in the process that took over: closing our copies refuses nothing. Without
+  // one the socket files of Unix domain listeners go with them
+  void startDrain() {
+    if (draining) {
       return;
     }
-    if (fileSizeIsBiggerThanLimit(path)) {
-      responseStatus = BAD_REQUEST;
+    for (std::map<int, Server *>::iterator it = serverFdsMap.begin(); it != serverFdsMap.end(); ++it) {
+      Server::closeListener(*it->second->listenerFor(it->first), upgradePid > 0);
+    }
+    serverFdsMap.clear();
+    for (std::set<Client *>::iterator it = multiplexedClients.begin(); it != multiplexedClients.end(); ++it) {
+      (*it)->http2->goAway();
+    }
+    draining = true;
+    drainDeadline = Clock::nowMillis() + BinaryUpgrade::drainTimeoutMillis();
+    LOG_INFO(LOGGER, "Stopped accepting, draining " << getConnectionCount() << " connections");
+  }
+
+  bool isDrained() {
+    if (!draining) {
+      return false;
+    }
+    if (!clientsToServersMap.empty() && Clock::nowMillis() < drainDeadline) {
+      return false;
+    }
+    if (!clientsToServersMap.empty()) {
+      LOG_ERROR(LOGGER, "Drain deadline passed, closing " << getConnectionCount() << " connections");
+      clearAllClients();
+    }
+    LOGGER.info("Drained, exiting");
+    return true;
+  }
+
+// HTTP/2 -----------------------------------------------------------------------------------------------------------------
+
+  // a connection of an http2 server that opened with the preface, in clear (h2c with prior knowledge)
+  // or after ALPN chose h2; from here on its bytes go to its Http2Connection
+  void startHttp2(Client &client) {
+    const Server &server = *clientsToServersMap[&client];
+    if (!server.http2.enabled) {
       return;
     }
+    client.http2 = new Http2Connection(server.http2, (std::size_t) server.largestBodySize());
+    client.clientStatus = MULTIPLEXED;
+    multiplexedClients.insert(&client);
+    if (draining) {
+      client.http2->goAway();
+    }
+    Metrics::countHttp2(false);
+    LOG_INFO(LOGGER, "HTTP/2 on fd: " << client.getFd());
+  }
 
-    if (!isDirectory(path.c_str())) {
-      getDocumentContentInside(fileStream);
-    } else {
-      if (requestLocation->isAutoIndex()) {
-        generateAutoIndex(client, server, path);
+  static short multiplexedEvents(const Client &client) {
+    return (short) (POLLIN | (client.http2->hasOutput() ? POLLOUT : 0));
+  }
+
+  void serveMultiplexed(Client &client, Server &server, short revents) {
+    if (revents & (POLLIN | POLLHUP | POLLERR)) {
+      char buf[HTTP2_READ_CHUNK + 1];
+      ssize_t bytesRead = client.transport->read(buf, HTTP2_READ_CHUNK);
+      if (bytesRead > 0) {
+        receiveBytes(client, buf, bytesRead);
+      } else if (bytesRead == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        client.closeClient();
+        return;
+      }
+    }
+    pumpMultiplexed(client, server);
+  }
+
+  // streams whose request came in become clients of their own, served in process like any other; the
+  // responses they wrote go out as frames, as far as the socket takes them
+  void pumpMultiplexed(Client &client, Server &server) {
+    Http2Connection &connection = *client.http2;
+    unsigned id;
+    while (connection.takeReady(id)) {
+      Client *stream = new Client(-1, new Http2StreamTransport(connection, id));
+      stream->http2Stream = true;
+      stream->remoteAddr = client.remoteAddr;
+      setupTiming(*stream, server);
+      clientsToServersMap[stream] = &server;
+      ++http2Streams;
+      Metrics::countHttp2(true);
+    }
+    connection.produce();
+    while (connection.hasOutput()) {
+      ssize_t written = client.transport->write(connection.outputData(), connection.outputLength());
+      if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      }
+      if (written <= 0) {
+        client.closeClient();
+        return;
+      }
+      connection.sent(written);
+      connection.produce();
+    }
+    if (connection.isDone()) {
+      client.closeClient();
+    }
+  }
+
+  // before the poll: the responses written by streams served since the last one
+  void serveMultiplexedClients() {
+    std::set<Client *>::iterator it = multiplexedClients.begin();
+    while (it != multiplexedClients.end()) {
+      std::map<Client *, Server *>::iterator clientIt = clientsToServersMap.find(*it++);
+      pumpMultiplexed(*clientIt->first, *clientIt->second);
+      if (clientIt->first->getClientStatus() == CLOSED) {
+        removeClient(clientIt);
+      }
+    }
+  }
+
+// RATE LIMITS ------------------------------------------------------------------------------------------------------------
+
+  // servers with limit_req or limit_conn get the limiter of their name and port; limiters stay for the
+  // life of the process, so that a reload keeps the counts of the addresses
+  void bindLimiters() {
+    for (std::vector<Server *>::iterator it = servers.begin(); it != servers.end(); ++it) {
+      Server &server = **it;
+      server.limiter = NULL;
+      if (!server.limits.isEnabled()) {
+        continue;
+      }
+      std::stringstream key;
+      key << server.serverName << ':' << server.port;
+      RateLimiter *&limiter = limiters[key.str()];
+      if (limiter == NULL) {
+        limiter = new RateLimiter(server.limits);
       } else {
-        std::ifstream indexFileStream((path + requestLocation->getFirstExistingIndex(path)).c_str());
-        if (!indexFileStream.fail()) {
-          getDocumentContentInside(indexFileStream);
-        } else {
-          responseBody.clear();
-          responseStatus = NOT_FOUND;
-          return;
+        limiter->configure(server.limits);
+      }
+      server.limiter = limiter;
+    }
+  }
+
+  // ssl servers: a certificate that does not load is logged and leaves the server without a context,
+  // or with the one it had before the reload
+  void bindTlsContexts() {
+    for (std::vector<Server *>::iterator it = servers.begin(); it != servers.end(); ++it) {
+      Server &server = **it;
+      server.tlsContext = NULL;
+      if (!server.tls.enabled) {
+        continue;
+      }
+      std::stringstream key;
+      key << server.serverName << ':' << server.port;
+      TlsContext *&context = tlsContexts[key.str()];
+      bool created = context == NULL;
+      if (created) {
+        context = new TlsContext();
+      }
+      std::string error;
+      if (context->configure(server.tls, server.http2.enabled, error)) {
+        server.tlsContext = context;
+      } else if (created) {
+        LOG_ERROR(LOGGER, key.str() << ": " << error << ", its connections are closed");
+        delete context;
+        tlsContexts.erase(key.str());
+      } else {
+        LOG_ERROR(LOGGER, key.str() << ": " << error << ", the previous certificate stays");
+        server.tlsContext = context;
+      }
+    }
+  }
+
+  // limit_conn and overload: the connection gets a 503 and is closed before it is a client; what the
+  // peer sent already is read first, so that the close does not reset the connection before the 503.
+  // A TLS client could not read the 503, it is only closed.
+  void rejectConnection(int fd, const Server &server) {
+    static const char response[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                   "Content-Length: 0\r\nConnection: close\r\n\r\n";
+    if (server.tls.enabled) {
+      close(fd);
+      return;
+    }
+    drainInput(fd);
+    send(fd, response, sizeof(response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+  }
+
+  // limit_req: a request over the rate of its address is answered 429 as soon as its headers are in,
+  // before it is routed; false when it was
+  bool admitRequest(Client &client) {
+    static const std::string response = "HTTP/1.1 429 Too Many Requests\r\n"
+                                        "Content-Length: 0\r\nConnection: close\r\n\r\n";
+    std::map<Client *, Server *>::iterator it = clientsToServersMap.find(&client);
+    if (it == clientsToServersMap.end() || it->second->limiter == NULL
+        || it->second->limiter->admitRequest(client.remoteAddr, Clock::nowMillis())) {
+      return true;
+    }
+    Metrics::countLimited(true);
+    respondEarly(client, TOO_MANY_REQUESTS, response);
+    return false;
+  }
+
+  // limit_size of the location, or of the server: a request announcing a larger body is answered 413
+  // as soon as its headers are in, and the body is not read; false when it was
+  bool admitBody(Client &client) {
+    static const std::string response = "HTTP/1.1 413 Payload Too Large\r\n"
+                                        "Content-Length: 0\r\nConnection: close\r\n\r\n";
+    std::map<Client *, Server *>::iterator it = clientsToServersMap.find(&client);
+    if (client.length == 0 || it == clientsToServersMap.end()) {
+      return true;
+    }
+    const LocationRuntime *route = findLocation(*it->second, client.path);
+    if (client.length <= (route != NULL ? route->maxBodySize : it->second->getBodySize())) {
+      return true;
+    }
+    client.bodyRefused = client.body.length() < (std::size_t) client.length;
+    respondEarly(client, PAYLOAD_TOO_LARGE, response);
+    return false;
+  }
+
+  // Expect: 100-continue, the client waits for the go-ahead before it sends the body
+  void continueBody(Client &client) {
+    static const char response[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    if (!client.body.empty() || strcasecmp(client.getHeader("Expect").c_str(), "100-continue") != 0) {
+      return;
+    }
+    ssize_t sent = client.transport->write(response, sizeof(response) - 1);
+    if (sent > 0) {
+      client.bytesSent += sent;
+    }
+  }
+
+  // max_connections: the new connection is answered 503 without a look at its request; false
+  // when it was
+  bool admitConnection(int fd, const Server &server) {
+    if (admission.admitConnection(getConnectionCount())) {
+      return true;
+    }
+    rejectConnection(fd, server);
+    Metrics::countShed(false);
+    return false;
+  }
+
+  // shed_target: a request that queued too long is answered 503 instead of handled; false
+  // when it was
+  bool admitQueued(Client &client) {
+    static const std::string response = "HTTP/1.1 503 Service Unavailable\r\n"
+                                        "Content-Length: 0\r\nConnection: close\r\n\r\n";
+    long long now = Clock::nowMicros();
+    if (admission.admitQueued(now - client.timing.marks[RequestTiming::ACCEPTED], now)) {
+      return true;
+    }
+    Metrics::countShed(true);
+    respondEarly(client, SERVICE_UNAVAILABLE, response);
+    return false;
+  }
+
+  // a canned response instead of the handlers'
+  void respondEarly(Client &client, HttpStatus status, const std::string &head) {
+    client.timing.mark(RequestTiming::HANDLER_END);
+    client.responseStatus = status;
+    client.locationScope = -1;
+    client.responseHead = head;
+    client.responseBody.clear();
+    client.responseOffset = 0;
+    client.clientStatus = SENDING;
+  }
+
+// REVERSE PROXY ----------------------------------------------------------------------------------------------------------
+
+  // every proxy_pass location gets the pool of its upstream; pools stay for the life of the process,
+  // so that a reload keeps their open connections and the health of their servers
+  void bindUpstreams() {
+    std::set<UpstreamPool *> bound;
+    for (std::vector<Server *>::iterator server = servers.begin(); server != servers.end(); ++server) {
+      std::vector<LocationRuntime> &routes = (*server)->routes;
+      for (std::vector<LocationRuntime>::iterator route = routes.begin(); route != routes.end(); ++route) {
+        if (!route->isProxy()) {
+          continue;
         }
+        UpstreamPool *&pool = upstreamPools[route->upstream.name];
+        if (pool == NULL) {
+          pool = new UpstreamPool(route->upstream.name);
+        }
+        if (bound.insert(pool).second) {
+          pool->configure(route->upstream);
+        }
+        route->proxyPool = pool;
+      }
+    }
+    for (std::map<std::string, UpstreamPool *>::iterator it = upstreamPools.begin(); it != upstreamPools.end(); ++it) {
+      if (bound.count(it->second) == 0) {
+        it->second->closeIdle();
       }
     }
-    responseStatus = OK;
   }
 
-  void postFile(const std::string &path, Client &client) {
-    std::fstream nf(path.c_str(), std::fstream::in | std::fstream::out | std::fstream::trunc);
-    if (!nf.fail()) {
-      nf << client.body;
-      responseStatus = CREATED;
-      responseBody = "<html>\n"
-                     "  <body>\n"
-                     "    <h1>File Created.</h1>\n"
-                     "  </body>\n"
-                     "</html>";
-    } else {
-      responseStatus = INTERNAL_SERVER_ERROR;
-      responseBody = "";
+  // a request to a proxy_pass location goes upstream as soon as its headers are in, its body
+  // follows as it arrives
+  void routeToProxy(Client &client) {
+    const LocationRuntime *route = findLocation(*clientsToServersMap.find(&client)->second, client.path);
+    if (route == NULL || route->proxyPool == NULL || !route->allows(client.method)) {
+      return;
+    }
+    long long now = Clock::nowMillis();
+    std::string head = client.fullRequestBody.substr(0, client.fullRequestBody.find(client.REQUEST_END));
+    head = ProxyConnection::buildRequestHead(head, route->proxiedPath(client.path), route->upstream.hostHeader,
+                                             route->upstream.keepalive > 0);
+    client.proxy = new ProxyConnection(*route->proxyPool, head, client.length, route->proxyConnectTimeoutMillis,
+                                       route->proxyReadTimeoutMillis);
+    client.proxy->appendBody(client.body.data(), client.body.length(), now);
+    client.body.clear();
+    client.locationScope = route->metricsScope;
+    client.timing.mark(RequestTiming::HANDLER_START);
+    client.clientStatus = PROXYING;
+    proxyingClients.insert(&client);
+    client.proxy->start(now);
+  }
+
+  // the client socket is polled for the response waiting for it and for body the upstream can take
+  static short proxyClientEvents(const Client &client) {
+    return (short) ((client.proxy->output().empty() ? 0 : POLLOUT) | (client.proxy->wantsClientBody() ? POLLIN : 0));
+  }
+
+  void serveProxyClient(Client &client, short revents) {
+    if (revents & POLLOUT) {
+      writeProxyOutput(client);
+    }
+    if (client.getClientStatus() == PROXYING && (revents & (POLLIN | POLLHUP | POLLERR))) {
+      readFromClientSocket(client);
+    }
+  }
+
+  void writeProxyOutput(Client &client) {
+    std::string &output = client.proxy->output();
+    ssize_t written = client.transport->write(output.data(), output.length());
+    if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (written <= 0) {
+      client.closeClient();
+      return;
     }
+    if (client.bytesSent == 0) {
+      client.timing.mark(RequestTiming::FIRST_BYTE_SENT);
+    }
+    client.bytesSent += written;
+    client.proxy->sent(written, Clock::nowMillis());
   }
 
-  void doPost(Client &client, Server &server) {
-    std::string path = requestLocation->substitutePath(client.path);
-    std::string interpreter = requestLocation->getFullCgiPath(requestLocation->getCgiPath());
-    std::string queryString = extractQueryString(path);
-    std::ifstream fileStream(path.c_str());
-    std::string directory = path.substr(0, path.rfind('/'));
-    if (fileStream.fail()) {
-      if (!isDirectory(directory.c_str())) {
-        responseStatus = NOT_FOUND;
+  // moves the request and the response as far as the sockets let them; on poll the response goes
+  // on to the client right away, on io_uring syncUringProxy submits it
+  void pumpProxy(Client &client, Server &server, short upstreamEvents) {
+    client.proxy->onUpstream(Clock::nowMillis(), upstreamEvents);
+    if (client.uring == NULL && !client.proxy->output().empty()) {
+      writeProxyOutput(client);
+    }
+    if (client.getClientStatus() == PROXYING) {
+      advanceProxy(client, server);
+    }
+  }
+
+  // a failed attempt is retried while nothing of the response came; otherwise the client gets 502
+  // or 504, or is cut off when part of the response is out already
+  void advanceProxy(Client &client, Server &server) {
+    if (client.getClientStatus() != PROXYING) {
+      return;
+    }
+    ProxyConnection &proxy = *client.proxy;
+    long long now = Clock::nowMillis();
+    while (proxy.canRetry()) {
+      LOG_INFO(LOGGER, "Upstream attempt failed, retrying, fd: " << client.getFd());
+      proxy.retry(now);
+      proxy.onUpstream(now, 0);
+    }
+    if (proxy.getState() == ProxyConnection::FAILED) {
+      LOG_ERROR(LOGGER, "Upstream failed with " << proxy.getStatus() << ", fd: " << client.getFd());
+      client.upstreamMicros = proxy.getUpstreamMicros();
+      bool started = proxy.isResponseStarted();
+      int scope = client.locationScope;
+      responseStatus = (HttpStatus) proxy.getStatus();
+      endProxy(client);
+      if (started) {
+        client.closeClient();
         return;
       }
-      postFile(path, client);
-      responseStatus = CREATED;
+      requestLocation = NULL;
+      completeResponse(client);
+      client.locationScope = scope;
+    } else if (proxy.isFinished() && client.responseBody.empty()) {
+      client.responseStatus = proxy.getStatus();
+      client.upstreamMicros = proxy.getUpstreamMicros();
+      endProxy(client);
+      client.timing.mark(RequestTiming::HANDLER_END);
+      client.timing.markAlways(RequestTiming::LAST_BYTE_SENT);
+      finishRequest(client, server);
+      client.closeClient();
+    }
+  }
+
+  // 504 for the proxies whose upstream did not answer in time
+  void expireProxies(long long now) {
+    std::vector<Client *> expired;
+    for (std::set<Client *>::iterator it = proxyingClients.begin(); it != proxyingClients.end(); ++it) {
+      if ((*it)->getClientStatus() == PROXYING && (*it)->proxy->isExpired(now)) {
+        expired.push_back(*it);
+      }
+    }
+    for (std::vector<Client *>::iterator it = expired.begin(); it != expired.end(); ++it) {
+      std::map<Client *, Server *>::iterator clientIt = clientsToServersMap.find(*it);
+      Client &client = *clientIt->first;
+      client.proxy->expire(now);
+      advanceProxy(client, *clientIt->second);
+      if (client.uring != NULL) {
+        uringTouched.push_back(&client);
+      } else if (client.getClientStatus() == CLOSED) {
+        removeClient(clientIt);
+      }
+    }
+  }
+
+  void endProxy(Client &client) {
+    if (client.uring != NULL) {
+      cancelUringUpstream(client);
+    }
+    delete client.proxy;
+    client.proxy = NULL;
+    proxyingClients.erase(&client);
+  }
+
+// IO_URING BACKEND -------------------------------------------------------------------------------------------------------
+
+ private:
+  // the low bits of a submission's user_data: what it does, the rest points to its object
+  enum UringOperation {
+    URING_NONE, // cancellations and buffer hand-overs, their completions are not looked at
+    URING_ACCEPT,
+    URING_RECV,
+    URING_SEND,
+    URING_READ,
+    URING_SPLICE_IN,
+    URING_SPLICE_OUT,
+    URING_WAKE,
+    URING_FILES,
+    URING_UPSTREAM_IN,  // one-shot polls of a proxied request's upstream socket
+    URING_UPSTREAM_OUT,
+    URING_PROXY_SEND    // the upstream's response on to the client
+  };
+  static const unsigned long long URING_OPERATION_MASK = 0xF;
+  static const unsigned URING_ENTRIES = 1024;
+  static const unsigned URING_BUFFERS = 512;         // a power of two
+  static const std::size_t SPLICE_MIN_SIZE = 65536; // smaller files are read into memory and sent
+  static const std::size_t SPLICE_CHUNK = 65536;    // default pipe capacity
+
+  // WEBSERV_IO=uring: the loop runs on io_uring when the kernel has what it needs, on poll otherwise
+  void startUring() {
+    const char *backend = getenv("WEBSERV_IO");
+    if (backend == NULL || strcmp(backend, "uring") != 0) {
       return;
     }
-    if (!isDirectory(path.c_str())) {
-      if (requestLocation->getCgiPath().empty() || requestLocation->getCgiExt().empty()) {
-        responseStatus = BAD_REQUEST;
+    for (std::vector<Server *>::const_iterator it = servers.begin(); it != servers.end(); ++it) {
+      if ((*it)->tls.enabled || (*it)->http2.enabled) {
+        LOGGER.error("io_uring does not serve ssl or http2 servers, the event loop uses poll");
         return;
       }
-      std::string extension = findExtension(path);
-      bool extensionMatches = false;
-      std::vector<std::string> extensions = requestLocation->getCgiExt();
-      for (std::vector<std::string>::iterator it = extensions.begin(); it != extensions.end(); ++it) {
-        if (*it == extension) {
-          extensionMatches = true;
-          break;
+    }
+    IoUring *ring = new IoUring();
+    std::string error;
+    if (!ring->setup(URING_ENTRIES, error) || !ring->setupBuffers(URING_BUFFERS, BUF_SIZE, error)) {
+      LOG_ERROR(LOGGER, "io_uring unavailable (" << error << "), the event loop uses poll");
+      delete ring;
+      return;
+    }
+    uring = ring;
+    if (wakePipe[0] != -1) {
+      armUringPoll(wakePipe[0], URING_WAKE);
+    }
+    if (filePool.isRunning()) {
+      armUringPoll(filePool.getEventFd(), URING_FILES);
+    }
+    syncUringListeners();
+    LOGGER.info("Event loop on io_uring");
+  }
+
+  // one iteration on io_uring: submit what the last one queued, wait, handle the completions
+  void stepUring(int timeoutMillis) {
+    try {
+      if (reload.running && __atomic_load_n(&reload.done, __ATOMIC_ACQUIRE)) {
+        finishReload();
+        syncUringListeners();
+      }
+      int ret = uring->submitAndWait(timeoutMillis);
+      long long now = Clock::nowMillis();
+      flushLogFiles(now);
+      if (ret < 0 && ret != -ETIME && ret != -EINTR) {
+        LOGGER.error(WebServException::POLL_ERROR);
+        throw PollException();
+      }
+      bool wake = false;
+      bool files = false;
+      bool completed = false;
+      struct io_uring_cqe *cqe;
+      while ((cqe = uring->peek()) != NULL) {
+        struct io_uring_cqe completion = *cqe;
+        uring->advance();
+        handleUringCompletion(completion, wake, files);
+        completed = true;
+      }
+      expireProxies(now);
+      if (!completed && uringTouched.empty()) {
+        if (ret == -ETIME && now - lastActivityMillis >= SERVER_TIMEOUT) {
+          clearAllClients();
+          LOGGER.info("Timeout reached. Close all connections");
+          lastActivityMillis = now;
         }
+        return;
       }
-      if (!extensionMatches) {
-        postFile(path, client);
-      } else {
-        CgiHandler cgi(client, server, queryString, path, interpreter);
-        responseBody = cgi.runScript(path, interpreter, responseStatus);
+      lastActivityMillis = now;
+      if (files) {
+        completeFileTasks();
+      }
+      advanceUringClients();
+      if (!retiredServers.empty()) {
+        releaseRetiredServers();
+      }
+      if (wake) {
+        handleWakeUp();
+        syncUringListeners();
+      }
+    } catch (const RuntimeWebServException &e) {
+      LOGGER.error(e.what());
+    }
+  }
+
+  static unsigned long long uringData(const void *object, UringOperation operation) {
+    return (unsigned long long) (unsigned long) object | operation;
+  }
+
+  struct io_uring_sqe *uringSqe(Client &client, UringOperation operation) {
+    struct io_uring_sqe *sqe = uring->getSqe();
+    sqe->user_data = uringData(&client, operation);
+    ++client.uring->inFlight[operation];
+    return sqe;
+  }
+
+  void armUringPoll(int fd, UringOperation operation) {
+    struct io_uring_sqe *sqe = uring->getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = uringData(NULL, operation);
+  }
+
+  void armUringAccept(UringListener &listener) {
+    struct io_uring_sqe *sqe = uring->getSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener.fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC; // blocking: only the kernel reads and writes these sockets
+    sqe->user_data = uringData(&listener, URING_ACCEPT);
+  }
+
+  void armUringRecv(Client &client) {
+    struct io_uring_sqe *sqe = uringSqe(client, URING_RECV);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client.getFd();
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = IoUring::BUFFER_GROUP;
+    client.uring->receiving = true;
+  }
+
+  void cancelUring(unsigned long long userData) {
+    struct io_uring_sqe *sqe = uring->getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = userData;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = uringData(NULL, URING_NONE);
+  }
+
+  // a closed client's operations end with -ECANCELED; it is deleted after the last of them
+  void cancelUringOperations(Client &client) {
+    if (client.uring->cancelled) {
+      return;
+    }
+    client.uring->cancelled = true;
+    for (int operation = 0; operation < UringConnection::KINDS; ++operation) {
+      if (client.uring->inFlight[operation] != 0) {
+        cancelUring(uringData(&client, (UringOperation) operation));
+      }
+    }
+  }
+
+  // arms an accept on listeners that appeared (run, reload) and cancels it on those that went
+  // away (reload, drain)
+  void syncUringListeners() {
+    std::map<int, UringListener *> armed;
+    for (std::map<int, Server *>::iterator it = serverFdsMap.begin(); it != serverFdsMap.end(); ++it) {
+      struct stat socketStat;
+      if (fstat(it->first, &socketStat) != 0) {
+        continue;
+      }
+      std::map<int, UringListener *>::iterator listener = uringListeners.find(it->first);
+      if (listener != uringListeners.end() && listener->second->inode == socketStat.st_ino) {
+        armed[it->first] = listener->second;
+        uringListeners.erase(listener);
+        continue;
+      }
+      UringListener *added = new UringListener();
+      added->fd = it->first;
+      added->inode = socketStat.st_ino;
+      added->cancelled = false;
+      armUringAccept(*added);
+      armed[it->first] = added;
+    }
+    for (std::map<int, UringListener *>::iterator it = uringListeners.begin(); it != uringListeners.end(); ++it) {
+      it->second->cancelled = true;
+      cancelUring(uringData(it->second, URING_ACCEPT));
+    }
+    uringListeners.swap(armed);
+  }
+
+  void handleUringCompletion(const struct io_uring_cqe &cqe, bool &wake, bool &files) {
+    UringOperation operation = (UringOperation) (cqe.user_data & URING_OPERATION_MASK);
+    void *object = (void *) (unsigned long) (cqe.user_data & ~URING_OPERATION_MASK);
+    bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+    if (operation == URING_NONE) {
+      return;
+    }
+    if (operation == URING_WAKE || operation == URING_FILES) {
+      (operation == URING_WAKE ? wake : files) = true;
+      if (!more) {
+        armUringPoll(operation == URING_WAKE ? wakePipe[0] : filePool.getEventFd(), operation);
+      }
+      return;
+    }
+    if (operation == URING_ACCEPT) {
+      acceptUring(static_cast<UringListener *>(object), cqe.res, more);
+      return;
+    }
+    Client &client = *static_cast<Client *>(object);
+    if (!more) {
+      --client.uring->inFlight[operation];
+    }
+    if (operation == URING_RECV) {
+      receiveUring(client, cqe, more);
+    } else if (operation == URING_UPSTREAM_IN || operation == URING_UPSTREAM_OUT) {
+      bool &stale = client.uring->upstreamStale[operation == URING_UPSTREAM_OUT];
+      if (!stale && cqe.res > 0) {
+        client.uring->upstreamEvents |= (short) cqe.res;
       }
+      stale = false;
+    } else if (operation == URING_PROXY_SEND) {
+      proxySentUring(client, cqe.res);
     } else {
-      responseStatus = NOT_FOUND;
+      sendUring(client, operation, cqe.res);
     }
+    uringTouched.push_back(&client);
   }
 
-  void doDelete(Client &client, Server &server) {
-    std::string path = requestLocation->substitutePath(client.path);
-    std::ifstream infile(path.c_str());
-    if (infile.good() && (remove(path.c_str())) == 0) {
-      responseBody = "HTTP/1.1 200 OK\n"
-                     "<html>\n"
-                     "  <body>\n"
-                     "    <h1>File deleted.</h1>\n"
-                     "  </body>\n"
-                     "</html>";
-      responseStatus = OK;
+  void acceptUring(UringListener *listener, int fd, bool more) {
+    std::map<int, Server *>::iterator server = serverFdsMap.find(listener->fd);
+    if (fd >= 0 && (listener->cancelled || server == serverFdsMap.end() || server->second->tls.enabled)) {
+      close(fd); // an ssl server added by a reload: TLS is served on poll only
+    } else if (fd >= 0 && admitConnection(fd, *server->second)) {
+      struct sockaddr_storage address;
+      memset(&address, 0, sizeof(address));
+      RateLimiter *limiter = server->second->limiter;
+      if (limiter != NULL || accessLogs.find(server->second) != accessLogs.end()) {
+        // multishot accepts do not return addresses: only asked for when it is limited or logged
+        socklen_t length = sizeof(address);
+        getpeername(fd, (struct sockaddr *) &address, &length);
+      }
+      if (limiter != NULL && !limiter->admitConnection(address, Clock::nowMillis())) {
+        rejectConnection(fd, *server->second);
+        Metrics::countLimited(false);
+      } else {
+        Client *client = new Client(fd);
+        client->uring = new UringConnection();
+        client->remoteAddr = address;
+        if (limiter != NULL && limiter->limitsConnections()) {
+          client->connectionLimiter = limiter;
+        }
+        addConnection(client, *server->second);
+        armUringRecv(*client);
+        LOG_INFO(LOGGER, "Client connected, fd: " << fd);
+      }
+    } else if (fd < 0 && fd != -ECANCELED) {
+      LOG_ERROR(LOGGER, WebServException::ACCEPT_ERROR << ": " << strerror(-fd));
+    }
+    if (!more) {
+      if (listener->cancelled) {
+        delete listener;
+      } else {
+        armUringAccept(*listener);
+      }
+    }
+  }
+
+  void receiveUring(Client &client, const struct io_uring_cqe &cqe, bool more) {
+    bool reading = client.getClientStatus() == READ || client.getClientStatus() == WAITING_BODY
+        || (client.getClientStatus() == PROXYING && client.proxy->getBodyLeft() > 0);
+    if (!more) {
+      client.uring->receiving = false;
+      client.uring->pausing = false;
+    }
+    if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+      unsigned short id = (unsigned short) (cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+      if (client.getClientStatus() != CLOSED) {
+        receiveBytes(client, uring->buffer(id), cqe.res);
+      }
+      uring->recycleBuffer(id);
+    } else if (cqe.res != -ECANCELED && cqe.res != -ENOBUFS) {
+      // end of stream or an error; once the request is in, the response is sent regardless
+      if (reading) {
+        client.closeClient();
+      }
+      return;
+    }
+    reading = client.getClientStatus() == READ || client.getClientStatus() == WAITING_BODY
+        || (client.getClientStatus() == PROXYING && client.proxy->wantsClientBody());
+    if (!more && reading && cqe.res != -ECANCELED) {
+      armUringRecv(client);
+    } else if (more && client.bodyRefused && !client.uring->pausing) {
+      // the refused body stays in the socket
+      client.uring->pausing = true;
+      cancelUring(uringData(&client, URING_RECV));
+    }
+  }
+
+  // the response on the wire: head and in-memory body linked, a small file read in front of
+  // them, a large one spliced through a pipe after the head, one pipe's worth at a time
+  void submitUringResponse(Client &client) {
+    UringConnection &state = *client.uring;
+    state.sending = true;
+    if (client.responsePreloaded != NULL) {
+      submitUringSend(client, client.responsePreloaded, client.responsePreloadedLength, false);
+      return;
+    }
+    bool spliced = state.file != -1 && state.fileLeft >= SPLICE_MIN_SIZE && openUringPipe(state);
+    if (state.file != -1 && !spliced) {
+      client.responseBody.resize(state.fileLeft);
+      state.chunk = state.fileLeft;
+      state.fileLeft = 0;
+      if (state.chunk == 0) {
+        state.closeFile();
+      } else {
+        struct io_uring_sqe *sqe = uringSqe(client, URING_READ);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = state.file;
+        sqe->addr = (unsigned long) &client.responseBody[0];
+        sqe->len = state.chunk;
+        sqe->off = 0;
+        sqe->flags = IOSQE_IO_LINK;
+      }
+    }
+    bool bodyInMemory = !spliced && !client.responseBody.empty();
+    submitUringSend(client, client.responseHead.data(), client.responseHead.length(), spliced || bodyInMemory);
+    if (bodyInMemory) {
+      submitUringSend(client, client.responseBody.data(), client.responseBody.length(), false);
+    }
+    if (spliced) {
+      submitUringSplice(client);
+    }
+  }
+
+  void submitUringSend(Client &client, const char *data, std::size_t length, bool linked) {
+    struct io_uring_sqe *sqe = uringSqe(client, URING_SEND);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = client.getFd();
+    sqe->addr = (unsigned long) data;
+    sqe->len = length;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->flags = linked ? IOSQE_IO_LINK : 0;
+  }
+
+  bool openUringPipe(UringConnection &state) {
+    return state.pipe[0] != -1 || pipe2(state.pipe, O_CLOEXEC) == 0;
+  }
+
+  // file -> pipe linked to pipe -> socket; a short first half breaks the link, sendUring then
+  // sends what made it into the pipe on its own
+  void submitUringSplice(Client &client) {
+    UringConnection &state = *client.uring;
+    state.chunk = state.fileLeft < SPLICE_CHUNK ? state.fileLeft : SPLICE_CHUNK;
+    struct io_uring_sqe *in = uringSqe(client, URING_SPLICE_IN);
+    in->opcode = IORING_OP_SPLICE;
+    in->fd = state.pipe[1];
+    in->off = (unsigned long long) -1;
+    in->splice_fd_in = state.file;
+    in->splice_off_in = state.fileOffset;
+    in->len = state.chunk;
+    in->flags = IOSQE_IO_LINK;
+    submitUringSpliceOut(client, state.chunk);
+  }
+
+  void submitUringSpliceOut(Client &client, std::size_t length) {
+    struct io_uring_sqe *out = uringSqe(client, URING_SPLICE_OUT);
+    out->opcode = IORING_OP_SPLICE;
+    out->fd = client.getFd();
+    out->off = (unsigned long long) -1;
+    out->splice_fd_in = client.uring->pipe[0];
+    out->splice_off_in = (unsigned long long) -1;
+    out->len = length;
+  }
+
+  void sendUring(Client &client, UringOperation operation, int result) {
+    UringConnection &state = *client.uring;
+    if (client.getClientStatus() == CLOSED) {
+      return;
+    }
+    if (operation == URING_SPLICE_OUT && result == -ECANCELED && state.piped > 0) {
+      submitUringSpliceOut(client, state.piped);
+      return;
+    }
+    if (result < 0 || (result == 0 && operation != URING_SEND)
+        || (operation == URING_READ && (std::size_t) result != state.chunk)) {
+      client.closeClient();
+      return;
+    }
+    if (operation == URING_READ) {
+      state.closeFile();
+    } else if (operation == URING_SPLICE_IN) {
+      state.fileOffset += result;
+      state.fileLeft -= result;
+      state.piped += result;
     } else {
-      responseStatus = NOT_FOUND;
+      if (client.responseOffset == 0 && result > 0) {
+        client.timing.mark(RequestTiming::FIRST_BYTE_SENT);
+      }
+      client.responseOffset += result;
+      client.bytesSent += result;
+      if (operation == URING_SPLICE_OUT) {
+        state.piped -= result;
+        if (state.piped > 0) {
+          submitUringSpliceOut(client, state.piped);
+        } else if (state.fileLeft > 0) {
+          submitUringSplice(client);
+        }
+      }
+    }
+    bool sending = state.inFlight[URING_SEND] || state.inFlight[URING_READ] || state.inFlight[URING_SPLICE_IN]
+        || state.inFlight[URING_SPLICE_OUT];
+    if (!sending && state.fileLeft == 0 && state.piped == 0) {
+      client.timing.markAlways(RequestTiming::LAST_BYTE_SENT);
+      finishRequest(client, *clientsToServersMap.find(&client)->second);
+      client.closeClient();
     }
   }
 
+  // the kernel's side of a proxied request: polls of the upstream socket, the response sent on to the
+  // client, and the client's body received only while the proxy takes it
+  void syncUringProxy(Client &client) {
+    UringConnection &state = *client.uring;
+    ProxyConnection &proxy = *client.proxy;
+    if (state.upstream != proxy.getConnectionNumber()) {
+      cancelUringUpstream(client);
+      state.upstream = proxy.getConnectionNumber();
+    }
+    short events = proxy.upstreamEvents();
+    if ((events & POLLIN) && state.inFlight[URING_UPSTREAM_IN] == 0) {
+      armUringUpstream(client, URING_UPSTREAM_IN, POLLIN);
+    }
+    if ((events & POLLOUT) && state.inFlight[URING_UPSTREAM_OUT] == 0) {
+      armUringUpstream(client, URING_UPSTREAM_OUT, POLLOUT);
+    }
+    if (state.inFlight[URING_PROXY_SEND] == 0) {
+      if (client.responseBody.empty()) {
+        proxy.takeOutput(client.responseBody, Clock::nowMillis());
+      }
+      if (!client.responseBody.empty()) {
+        struct io_uring_sqe *sqe = uringSqe(client, URING_PROXY_SEND);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = client.getFd();
+        sqe->addr = (unsigned long) client.responseBody.data();
+        sqe->len = client.responseBody.length();
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+      }
+    }
+    bool wantsBody = proxy.wantsClientBody();
+    if (wantsBody && !state.receiving) {
+      armUringRecv(client);
+    } else if (!wantsBody && state.receiving && !state.pausing && proxy.getBodyLeft() > 0) {
+      // the request buffer is full: the rest of the body waits in the socket
+      state.pausing = true;
+      cancelUring(uringData(&client, URING_RECV));
+    }
+  }
+
+  void armUringUpstream(Client &client, UringOperation operation, short events) {
+    struct io_uring_sqe *sqe = uringSqe(client, operation);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = client.proxy->getFd();
+    sqe->poll32_events = events;
+  }
+
+  // polls armed for a connection the proxy is done with; their completions are not looked at
+  void cancelUringUpstream(Client &client) {
+    for (int i = 0; i < 2; ++i) {
+      UringOperation operation = i == 0 ? URING_UPSTREAM_IN : URING_UPSTREAM_OUT;
+      if (client.uring->inFlight[operation] != 0 && !client.uring->upstreamStale[i]) {
+        client.uring->upstreamStale[i] = true;
+        cancelUring(uringData(&client, operation));
+      }
+    }
+    client.uring->upstreamEvents = 0;
+  }
+
+  void proxySentUring(Client &client, int result) {
+    if (client.getClientStatus() == CLOSED) {
+      return;
+    }
+    if (result <= 0) {
+      client.closeClient();
+      return;
+    }
+    if (client.bytesSent == 0) {
+      client.timing.mark(RequestTiming::FIRST_BYTE_SENT);
+    }
+    client.bytesSent += result;
+    client.responseBody.erase(0, result);
+  }
+
+  // clients that had completions this turn: responses to build and send, closed ones to let go
+  void advanceUringClients() {
+    for (std::size_t i = 0; i < uringTouched.size(); ++i) {
+      std::map<Client *, Server *>::iterator clientIt = clientsToServersMap.find(uringTouched[i]);
+      if (clientIt == clientsToServersMap.end()) {
+        continue; // listed twice and removed the first time
+      }
+      Client &client = *clientIt->first;
+      if (client.getClientStatus() == PROXYING) {
+        short upstreamEvents = client.uring->upstreamEvents;
+        client.uring->upstreamEvents = 0;
+        pumpProxy(client, *clientIt->second, upstreamEvents);
+      }
+      if (client.getClientStatus() == PROXYING) {
+        syncUringProxy(client);
+      }
+      if (client.getClientStatus() == WRITE) {
+        prepareResponse(client, *clientIt->second);
+      }
+      if (client.getClientStatus() == SENDING && !client.uring->sending) {
+        submitUringResponse(client);
+      }
+      if (client.getClientStatus() == CLOSED) {
+        removeClient(clientIt);
+      }
+    }
+    uringTouched.clear();
+  }
+
+// RESPONSE GENERATION ----------------------------------------------------------------------------------------------------
+
  public:
-  void generateResponse(Client &client, Server &server) {
-    std::vector<Location> &locations = server.getLocations();
-    try {
-      for (std::vector<Location>::iterator location = locations.begin();
-           location != locations.end();
-           ++location) {
-
-        if (location->matches(client.path)) {
-          requestLocation = &(*location);
-          if (location->getUrl() != "/") {
-            break;
-          }
+  typedef std::map<std::string, std::string> MimeTypes;
+  typedef std::map<std::string, std::string> Headers;
+
+  std::map<HttpStatus, std::string> STATUSES;
+  MimeTypes MIME;
+  const int MAX_FILESIZE; // 10mb
+
+  std::string responseBody;
+  std::string responseContentType; // overrides the extension based MIME type when set
+  HttpStatus responseStatus;
+  const LocationRuntime *requestLocation;
+  FileTask inlineTask; // filesystem work of requests handled on the loop, keeps its buffers between requests
+  int responseFile;    // body left in a file for the transport or io_uring to send, -1: responseBody
+  std::size_t responseFileSize;
+  const char *responsePreloaded; // the whole response, in the blob of a `preload` location
+  std::size_t responsePreloadedLength;
+  std::string preloadPath;       // the request path mapped under the root, keeps its capacity
+
+  typedef std::map<std::string, std::string>::iterator iterator;
+
+ private:
+  bool isErrorStatus() {
+    return responseStatus != OK && responseStatus != CREATED && responseStatus != NO_CONTENT;
+  }
+
+  std::string getDocumentContent(std::ifstream &fileStream) {
+    fileStream.seekg(0, std::ios::end);
+    std::streampos length = fileStream.tellg();
+    fileStream.seekg(0, std::ios::beg);
+    std::vector<char> buffer(length);
+    fileStream.read(&buffer[0], length);
+    return std::string(buffer.begin(), buffer.end());
+  }
+
+  void doStubStatus() {
+    ConnectionGauges connections;
+    for (std::map<Client *, Server *>::const_iterator it = clientsToServersMap.begin();
+         it != clientsToServersMap.end(); ++it) {
+      ++connections.active;
+      ClientStatus status = it->first->getClientStatus();
+      if (status == READ) {
+        ++connections.reading;
+      } else if (status == WAITING_BODY) {
+        ++connections.waitingBody;
+      } else if (status == WRITE || status == WAITING_FILE || status == SENDING || status == PROXYING) {
+        ++connections.writing;
+      }
+    }
+    responseBody = StatusPage::render(requestLocation->stubStatus, connections);
+    responseContentType = requestLocation->stubStatus == StatusPage::PROMETHEUS
+                          ? StatusPage::PROMETHEUS_CONTENT_TYPE : "text/plain";
+    responseStatus = OK;
+  }
+
+  // GET, POST and DELETE end in a FileTask: the file the request maps to and what to do with it
+  FileTask *prepareFileTask(Client &client, Server &server, FileTask &task) {
+    if (!requestLocation->mapPath(client.path, task.path)) {
+      responseStatus = BAD_REQUEST;
+      return NULL;
+    }
+    task.operation = client.method == GET ? FileTask::READ : client.method == POST ? FileTask::WRITE : FileTask::REMOVE;
+    task.route = requestLocation;
+    task.requestPath = &client.path;
+    task.requestBody = &client.body;
+    task.maxFileSize = MAX_FILESIZE;
+    task.keepOpen = client.uring != NULL || client.transport->sendsFiles();
+    task.client = &client;
+    task.queryString = extractQueryString(task.path);
+    if (requestLocation->hasCgi) {
+      task.remoteAddress = Listener::peerText(client.remoteAddr);
+    }
+    if (requestLocation->autoIndex) {
+      std::stringstream serverAddress;
+      serverAddress << "http://" << server.hostName << ":" << server.port;
+      task.serverAddress = serverAddress.str();
+    }
+    return &task;
+  }
+
+  // a file of a `preload` location is answered from memory, with a 304 when If-None-Match names its
+  // ETag; false when it is not there and the request goes to the disk
+  bool findPreloaded(Client &client) {
+    const PreloadedSite &site = *requestLocation->preload;
+    if (!requestLocation->mapPath(client.path, preloadPath)) {
+      return false;
+    }
+    std::size_t start = requestLocation->root.length();
+    std::size_t end = preloadPath.find('?', start);
+    if (end == std::string::npos) {
+      end = preloadPath.length();
+    }
+    const PreloadedSite::File *file = site.find(preloadPath.data() + start, end - start);
+    if (file == NULL) {
+      return false;
+    }
+    if (site.isNotModified(*file, client.getHeader("If-None-Match"))) {
+      responseStatus = NOT_MODIFIED;
+      responsePreloaded = site.data(file->notModified);
+      responsePreloadedLength = file->notModifiedLength;
+    } else {
+      responseStatus = OK;
+      responsePreloaded = site.data(file->response);
+      responsePreloadedLength = file->responseLength;
+    }
+    return true;
+  }
+
+  // takes the results of a task that ran
+  void finishFileTask(FileTask &task, Client &client) {
+    responseStatus = task.status;
+    responseBody.swap(task.body);
+    task.body.clear();
+    responseFile = task.file;
+    responseFileSize = task.fileSize;
+    task.file = -1;
+    if (task.cgiMicros >= 0) {
+      client.upstreamMicros = task.cgiMicros;
+      Metrics::recordCgi(task.cgiMicros);
+    }
+    if (!client.cgiKey.empty()) {
+      finishCgiRun(client, *task.route);
+    }
+  }
+
+  // a GET of a cgi_cache location is answered from the cache, or waits for an identical request
+  // that runs the script already (WAITING_FILE); false when this request has to run it
+  bool shareCgiRun(Client &client, const FileTask &task) {
+    const LocationRuntime &route = *task.route;
+    if (task.operation != FileTask::READ || route.cgiCacheMillis < 0 || !route.hasCgi
+        || !route.isCgiScript(task.path)) {
+      return false;
+    }
+    std::string key = task.path + '?' + task.queryString;
+    for (std::vector<std::string>::const_iterator name = route.cgiCacheVary.begin();
+         name != route.cgiCacheVary.end(); ++name) {
+      key += '\n';
+      key += client.getHeader(*name);
+    }
+    if (cgiCache.lookup(key, Clock::nowMillis(), responseStatus, responseBody)) {
+      Metrics::countCgiCache(true);
+      return true;
+    }
+    client.cgiKey = key;
+    if (cgiCache.join(key, &client)) {
+      client.clientStatus = WAITING_FILE;
+      return true;
+    }
+    return false;
+  }
+
+  // the output of a shared run answers the requests that waited for it and stays for the ttl
+  void finishCgiRun(Client &client, const LocationRuntime &route) {
+    std::vector<Client *> waiting = cgiCache.finish(client.cgiKey, responseStatus, responseBody, Clock::nowMillis(),
+                                                    route.cgiCacheMillis);
+    client.cgiKey.clear();
+    if (waiting.empty()) {
+      return;
+    }
+    HttpStatus status = responseStatus;
+    std::string body(responseBody);
+    for (std::vector<Client *>::iterator it = waiting.begin(); it != waiting.end(); ++it) {
+      Client &waiter = **it;
+      waiter.cgiKey.clear();
+      requestLocation = &route;
+      responseStatus = status;
+      responseBody = body;
+      completeResponse(waiter);
+      Metrics::countCgiCache(false);
+      if (uring != NULL) {
+        uringTouched.push_back(&waiter);
+      }
+    }
+    requestLocation = &route;
+    responseStatus = status;
+    responseBody.swap(body);
+  }
+
+  // the first location whose url the path starts with, unless it is "/": a longer one may follow
+  static const LocationRuntime *findLocation(const Server &server, const std::string &path) {
+    const LocationRuntime *found = NULL;
+    for (std::vector<LocationRuntime>::const_iterator route = server.routes.begin(); route != server.routes.end();
+         ++route) {
+      if (route->matches(path)) {
+        found = &(*route);
+        if (!route->isRoot()) {
+          break;
         }
       }
+    }
+    return found;
+  }
+
+  // routes the request and answers what needs no filesystem access; otherwise returns `task`
+  // ready to run, and the response is completed by finishFileTask
+  FileTask *routeRequest(Client &client, Server &server, FileTask &task) {
+    responseContentType.clear();
+    requestLocation = NULL;
+    try {
+      requestLocation = findLocation(server, client.path);
       if (requestLocation == NULL) {
         responseStatus = BAD_REQUEST;
-        return;
+        return NULL;
       }
-      if (!requestLocation->isMethodAllowed(client.method)) {
+      if (!requestLocation->allows(client.method)) {
         responseStatus = NOT_ALLOWED;
-        return;
+        return NULL;
+      }
+      if (requestLocation->preload != NULL && client.method == GET && findPreloaded(client)) {
+        return NULL;
+      }
+      if (requestLocation->isProxy()) {
+        // proxied requests leave before they get here, unless no event loop bound the upstreams
+        responseStatus = BAD_GATEWAY;
+        return NULL;
       }
 
-      if (client.method == GET) {
-        doGet(client, server);
-      } else if (client.method == POST) {
-        doPost(client, server);
-      } else if (client.method == DELETE) {
-        doDelete(client, server);
+      if (requestLocation->stubStatus != StatusPage::OFF && client.method == GET) {
+        doStubStatus();
+      } else if (client.method == GET || client.method == POST || client.method == DELETE) {
+        return prepareFileTask(client, server, task);
       } else {
         responseStatus = BAD_REQUEST;
       }
@@ -647,6 +2552,17 @@ class WebServer {
       LOGGER.error("Exception thrown");
       responseStatus = BAD_REQUEST;
     }
+    return NULL;
+  }
+
+ public:
+  // the whole handler on the calling thread, filesystem calls included
+  void generateResponse(Client &client, Server &server) {
+    FileTask *task = routeRequest(client, server, inlineTask);
+    if (task != NULL) {
+      task->run();
+      finishFileTask(*task, client);
+    }
   }
 
   std::vector<std::string> convertHeadersToStringVector(const Headers &headersToConvert) {
@@ -667,7 +2583,13 @@ class WebServer {
     statuses.insert(std::make_pair(NOT_FOUND, "HTTP/1.1 404 Not Found\r\n"));
     statuses.insert(std::make_pair(BAD_REQUEST, "HTTP/1.1 400 Bad Request\r\n"));
     statuses.insert(std::make_pair(MOVED_PERMANENTLY, "HTTP/1.1 301 Moved Permanently\r\n"));
+    statuses.insert(std::make_pair(NOT_MODIFIED, "HTTP/1.1 304 Not Modified\r\n"));
     statuses.insert(std::make_pair(INTERNAL_SERVER_ERROR, "HTTP/1.1 500 Internal Server Error\r\n"));
+    statuses.insert(std::make_pair(PAYLOAD_TOO_LARGE, "HTTP/1.1 413 Payload Too Large\r\n"));
+    statuses.insert(std::make_pair(TOO_MANY_REQUESTS, "HTTP/1.1 429 Too Many Requests\r\n"));
+    statuses.insert(std::make_pair(BAD_GATEWAY, "HTTP/1.1 502 Bad Gateway\r\n"));
+    statuses.insert(std::make_pair(SERVICE_UNAVAILABLE, "HTTP/1.1 503 Service Unavailable\r\n"));
+    statuses.insert(std::make_pair(GATEWAY_TIMEOUT, "HTTP/1.1 504 Gateway Timeout\r\n"));
 
     return statuses;
   }
@@ -686,4 +2608,8 @@ class WebServer {
   }
 };
 
-Logger WebServer::LOGGER(Logger::DEBUG);
+Logger WebServer::LOGGER(Logger::INFO);
+int WebServer::wakePipe[2] = {-1, -1};
+volatile sig_atomic_t WebServer::reloadRequested = 0;
+volatile sig_atomic_t WebServer::upgradeRequested = 0;
+volatile sig_atomic_t WebServer::drainRequested = 0;